@@ -16,7 +16,9 @@
 #include "fileformats/IAGeometryReaderBinaryStl.h"
 #include "opengl/IAFramebuffer.h"
 #include "toolpath/IAToolpath.h"
+#include "toolpath/IAGcodeEncoder.h"
 #include "printer/IAPrinter.h"
+#include "printer/IAFDMPrinter.h"
 
 
 #include <FL/fl_ask.H>
@@ -102,7 +104,7 @@ void IAIota::userMenuFileOpen()
 {
     Fl_Native_File_Chooser fc(Fl_Native_File_Chooser::BROWSE_FILE);
     fc.title("Open mesh file");
-    fc.filter("*.{stl,STL}");
+    fc.filter("*.{stl,STL,gcode,gco,g}");
     // fc.directory(gPreferences.pLastLoadFilename); pRecentFile[]...
     switch (fc.show()) {
         case -1: // error
@@ -264,7 +266,10 @@ void IAIota::userMainSelectPrinter()
 {
     Fl_Menu_Item const* m = wPrinterChoice->mvalue();
     if (m) {
-        Iota.pCurrentPrinter = (IAPrinter*)m->user_data();
+        IAPrinter *printer = (IAPrinter*)m->user_data();
+        if (Iota.pCurrentPrinter && Iota.pCurrentPrinter!=printer)
+            Iota.pCurrentPrinter->purgeSlicesAndCaches();
+        Iota.pCurrentPrinter = printer;
         Iota.pCurrentPrinter->buildSessionSettings(wSessionSettings);
     }
 }
@@ -394,7 +399,7 @@ void IAIota::userDialogSettingPrinterRemove()
  *
  * \param list one or more filenames, separated by \n
  *
- * \todo At this point, we only know how to read STL files.
+ * \todo At this point, we only know how to read STL and GCode files.
  * \todo Currently, we only support one mesh, which will be replaced by
  *       whatever we read.
  */
@@ -413,6 +418,10 @@ void IAIota::loadAnyFile(const char *list)
             const char *ext = fl_filename_ext(filename);
             if (fl_utf_strcasecmp(ext, ".stl")==0) {
                 Iota.addGeometry(filename);
+            } else if (   fl_utf_strcasecmp(ext, ".gcode")==0
+                       || fl_utf_strcasecmp(ext, ".gco")==0
+                       || fl_utf_strcasecmp(ext, ".g")==0) {
+                Iota.importGCode(filename);
             } else {
                 Error.set("Load Any File", IAError::UnknownFileType_STR, filename);
             }
@@ -471,10 +480,11 @@ bool IAIota::addGeometry(const char *filename)
  *       mesh to the scene.
  *
  * \param read a file reader previously generated by other addGeometry calls
+ *
+ * \return true if a mesh was loaded
  */
 bool IAIota::addGeometry(std::shared_ptr<IAGeometryReader> reader)
 {
-    bool ret = false;
     delete Iota.pMesh; Iota.pMesh = nullptr;
     if (pCurrentPrinter)
         pCurrentPrinter->purgeSlicesAndCaches();
@@ -485,7 +495,23 @@ bool IAIota::addGeometry(std::shared_ptr<IAGeometryReader> reader)
         pMesh->projectTexture(3, 1, IA_PROJECTION_CYLINDRICAL);
         pMesh->centerOnPrintbed(pCurrentPrinter);
     }
-    return ret;
+    return (pMesh!=nullptr);
+}
+
+
+/**
+ * Read a GCode file and show its toolpaths in the preview.
+ *
+ * \param filename a GCode file from any slicer
+ */
+bool IAIota::importGCode(const char *filename)
+{
+    IAFDMPrinter *printer = dynamic_cast<IAFDMPrinter*>(pCurrentPrinter);
+    if (!printer) {
+        Error.set("Import GCode", IAError::UnknownFileType_STR, filename);
+        return false;
+    }
+    return printer->importGCode(filename);
 }
 
 
@@ -502,6 +528,39 @@ void IAIota::loadDemoFiles()
 }
 
 
+/**
+ * Slice a model and write GCode without opening any window.
+ *
+ * All framebuffers are rendered on the CPU, so this works on machines that
+ * have neither a display nor an OpenGL driver. The current printer and its
+ * settings are taken from the user preferences.
+ *
+ * \param modelFile an STL file
+ * \param gcodeFile write the GCode to this file, or print directly with
+ *        "serial:/dev/ttyACM0@115200"; "serial:loopback" prints to a
+ *        simulated printer for testing
+ *
+ * \return 0 on success, 1 if an error occured
+ */
+int IAIota::sliceHeadless(const char *modelFile, const char *gcodeFile)
+{
+    IAFDMPrinter *printer = dynamic_cast<IAFDMPrinter*>(pCurrentPrinter);
+    if (!printer) {
+        fprintf(stderr, "Iota: the current printer does not generate GCode.\n");
+        return 1;
+    }
+    if (!addGeometry(modelFile)) {
+        fprintf(stderr, "Iota: can't read model \"%s\".\n", modelFile);
+        return 1;
+    }
+    if (!printer->saveToolpath(gcodeFile)) {
+        fprintf(stderr, "Iota: can't write \"%s\".\n", gcodeFile);
+        return 1;
+    }
+    return 0;
+}
+
+
 #ifdef __APPLE__
 #pragma mark -
 #endif
@@ -513,10 +572,62 @@ void IAIota::loadDemoFiles()
  *
  * \todo The whole user interface must be in its own class.
  */
+static bool gHeadless = false;
+static bool gDecode = false;
+
+
+/**
+ * Handle command line arguments that are not handled by FLTK.
+ *
+ * -headless : slice without user interface, followed by the name of the STL
+ *             file and the name of the GCode output file.
+ * -decode : verify a MeatPack or block encoded GCode file and write it as
+ *           plain text, followed by the name of the encoded file and the
+ *           name of the text file.
+ */
+static int argsHandler(int argc, char **argv, int &i)
+{
+    if (strcmp(argv[i], "-headless")==0) {
+        gHeadless = true;
+        i++;
+        return 1;
+    }
+    if (strcmp(argv[i], "-decode")==0) {
+        gDecode = true;
+        i++;
+        return 1;
+    }
+    return 0;
+}
+
+
 int main (int argc, char **argv)
 {
+    int i = 1;
+    if (!Fl::args(argc, argv, i, argsHandler) || ((gHeadless || gDecode) && argc-i!=2)) {
+        fprintf(stderr, "Usage: %s [-headless model.stl output.gcode]\n"
+                "       %s [-headless model.stl serial:device[@baud]]\n"
+                "       %s [-decode encoded.gcode output.gcode]\n%s\n",
+                argv[0], argv[0], argv[0], Fl::help);
+        return 1;
+    }
+
+    if (gDecode) {
+        if (!IAGcodeDecoder::decodeFile(argv[i], argv[i+1])) {
+            fprintf(stderr, "Iota: can't decode \"%s\".\n", argv[i]);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (gHeadless) {
+        IAFramebuffer::pSoftwareRendering = true;
+        Iota.pPrinterPrototypeList.generatePrototypes();
+        Iota.pCustomPrinterList.loadCustomPrinters(Iota.pCurrentPrinter);
+        return Iota.sliceHeadless(argv[i], argv[i+1]);
+    }
+
     Fl::scheme("gtk+");
-	Fl::args(argc, argv);
     Fl::set_color(FL_BACKGROUND_COLOR, 0xeeeeee00);
     Fl::use_high_res_GL(1);
     Fl_Tooltip::size(12);
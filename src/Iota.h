@@ -115,6 +115,7 @@ public:
     // --------
     void loadDemoFiles();
     void loadAnyFile(const char *list);
+    int sliceHeadless(const char *modelFile, const char *gcodeFile);
 
     /** Set, clear, and show error messages. */
     IAError Error;
@@ -124,6 +125,7 @@ private:
     bool addGeometry(const char *name, uint8_t *data, size_t size);
     bool addGeometry(const char *filename);
     bool addGeometry(std::shared_ptr<IAGeometryReader> reader);
+    bool importGCode(const char *filename);
 
 public:
     /// the main UI window
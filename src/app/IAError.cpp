@@ -52,6 +52,10 @@ const char *IAError::kErrorMessage[] =
     HDR"There seems to be an error inside this file:\n\"%s\"",
     // OpenGLFeatureNotSupported_STR
     HDR"Required OpenGL graphics feature not suported:\n\"%s\"",
+    // CantWriteFile_STR_BSD
+    HDR"Can't write file \"%s\":\n%s",
+    // PrinterCommunication_STR
+    HDR"Lost communication with the printer:\n%s",
 };
 
 
@@ -26,6 +26,8 @@ public:
         UnknownFileType_STR,
         FileContentCorrupt_STR,
         OpenGLFeatureNotSupported_STR,
+        CantWriteFile_STR_BSD,
+        PrinterCommunication_STR,
     } Error;
 
     static void clear();
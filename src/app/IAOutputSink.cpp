@@ -0,0 +1,253 @@
+//
+//  IAOutputSink.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAOutputSink.h"
+
+#include "Iota.h"
+
+#include <FL/fl_utf8.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+
+/**
+ * Create a sink that is not connected to any file yet.
+ *
+ * \param pageSize size of each of the two pages in bytes
+ */
+IAOutputSink::IAOutputSink(size_t pageSize)
+:   pPageSize( pageSize ? pageSize : kDefaultPageSize )
+{
+}
+
+
+/**
+ * Write all pending data and close the file.
+ */
+IAOutputSink::~IAOutputSink()
+{
+    if (pFile)
+        close();
+}
+
+
+/**
+ * Create a file and start the I/O thread.
+ *
+ * \param filename path and name of the new file
+ * \param policy when to force the data to the disk
+ *
+ * \return false if the file could not be created
+ */
+bool IAOutputSink::open(const char *filename, SyncPolicy policy)
+{
+    if (pFile)
+        close();
+    pErrno = 0;
+    pFile = fl_fopen(filename, "wb");
+    if (!pFile) {
+        pErrno = errno;
+        return false;
+    }
+    pFilename = strdup(filename);
+    pPolicy = policy;
+    for (auto &p: pPage)
+        p.resize(pPageSize);
+    pFillPage = 0;
+    pFillSize = 0;
+    pWriteSize = 0;
+    pQuit = false;
+    pThread = std::thread(&IAOutputSink::ioLoop, this);
+    return true;
+}
+
+
+/**
+ * Add data to the file.
+ *
+ * The data is copied, so the caller can reuse the memory right away.
+ */
+void IAOutputSink::write(const void *data, size_t size)
+{
+    if (!pFile) return;
+    const char *src = (const char*)data;
+    while (size>0) {
+        size_t n = pPageSize - pFillSize;
+        if (n>size) n = size;
+        memcpy(pPage[pFillPage].data()+pFillSize, src, n);
+        pFillSize += n;
+        src += n;
+        size -= n;
+        if (pFillSize==pPageSize)
+            submitPage();
+    }
+}
+
+
+/**
+ * Add a text to the file.
+ */
+void IAOutputSink::writeText(const char *text)
+{
+    write(text, strlen(text));
+}
+
+
+/**
+ * Add text in printf() formatting to the file.
+ */
+void IAOutputSink::print(const char *format, ...)
+{
+    char buf[1024];
+    va_list va, va2;
+    va_start(va, format);
+    va_copy(va2, va);
+    int n = vsnprintf(buf, sizeof(buf), format, va);
+    if (n>=0 && (size_t)n<sizeof(buf)) {
+        write(buf, n);
+    } else if (n>=0) {
+        std::vector<char> text(n+1);
+        vsnprintf(text.data(), n+1, format, va2);
+        write(text.data(), n);
+    }
+    va_end(va2);
+    va_end(va);
+}
+
+
+/**
+ * Hand the filled page to the I/O thread and continue with the other page.
+ *
+ * Waits until the I/O thread has finished the previous page.
+ */
+void IAOutputSink::submitPage()
+{
+    std::unique_lock<std::mutex> lock(pMutex);
+    pWakeCaller.wait(lock, [this]{ return pWriteSize==0; });
+    pWriteSize = pFillSize;
+    pFillPage ^= 1;
+    pFillSize = 0;
+    pWakeIO.notify_one();
+}
+
+
+/**
+ * Write pages to the file as they are submitted, until the file is closed.
+ */
+void IAOutputSink::ioLoop()
+{
+    std::unique_lock<std::mutex> lock(pMutex);
+    for (;;) {
+        pWakeIO.wait(lock, [this]{ return pWriteSize>0 || pQuit; });
+        if (pWriteSize==0)
+            break;
+        // the caller fills the other page meanwhile
+        const char *data = pPage[pFillPage^1].data();
+        size_t size = pWriteSize;
+        bool failed = (pErrno!=0);
+        lock.unlock();
+        int err = 0;
+        if (!failed) {
+            if (fwrite(data, 1, size, pFile)!=size)
+                err = errno ? errno : EIO;
+            else if (pPolicy==SYNC_EVERY_PAGE) {
+                if (fflush(pFile)!=0)
+                    err = errno;
+#ifdef _WIN32
+                else if (_commit(_fileno(pFile))!=0)
+#else
+                else if (fsync(fileno(pFile))!=0)
+#endif
+                    err = errno;
+            }
+        }
+        lock.lock();
+        if (err && !pErrno)
+            pErrno = err;
+        pWriteSize = 0;
+        pWakeCaller.notify_one();
+    }
+}
+
+
+/**
+ * Write all remaining data, stop the I/O thread, and close the file.
+ *
+ * If anything went wrong while writing, errno is set, and the error is
+ * reported to the user through IAError.
+ *
+ * \param reportError set this to false when closing files outside of the
+ *        main thread; IAError is not thread safe, so the caller must report
+ *        the error later, using errno
+ *
+ * \return true if all data was written successfully
+ */
+bool IAOutputSink::close(bool reportError)
+{
+    if (!pFile)
+        return false;
+    if (pFillSize>0)
+        submitPage();
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        pQuit = true;
+    }
+    pWakeIO.notify_one();
+    pThread.join();
+
+    if (!pErrno && fflush(pFile)!=0)
+        pErrno = errno;
+    if (!pErrno && pPolicy!=SYNC_NEVER) {
+#ifdef _WIN32
+        if (_commit(_fileno(pFile))!=0)
+#else
+        if (fsync(fileno(pFile))!=0)
+#endif
+            pErrno = errno;
+    }
+    if (fclose(pFile)!=0 && !pErrno)
+        pErrno = errno;
+    pFile = nullptr;
+    for (auto &p: pPage) {
+        p.clear();
+        p.shrink_to_fit();
+    }
+
+    bool ok = (pErrno==0);
+    if (!ok) {
+        errno = pErrno;
+        if (reportError)
+            Iota.Error.set("Writing file", IAError::CantWriteFile_STR_BSD, pFilename);
+    }
+    ::free((void*)pFilename);
+    pFilename = nullptr;
+    return ok;
+}
+
+
+/**
+ * Return true if writing failed since the file was opened.
+ *
+ * Errors are detected in the I/O thread, so they may show up a little
+ * later than the write() call that caused them.
+ */
+bool IAOutputSink::hadError()
+{
+    std::lock_guard<std::mutex> lock(pMutex);
+    return pErrno!=0;
+}
+
+
@@ -0,0 +1,88 @@
+//
+//  IAOutputSink.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_OUTPUT_SINK_H
+#define IA_OUTPUT_SINK_H
+
+
+#include <stdio.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Write a file in a background thread.
+ *
+ * The caller fills one page of memory while an I/O thread writes the other
+ * page to disk. The caller only waits if it fills a page faster than the
+ * disk can take it. This keeps slow or network-mounted drives from stalling
+ * the slicer.
+ *
+ * Errors in the I/O thread are remembered and returned by close(), which
+ * also reports them to the user through IAError.
+ */
+class IAOutputSink
+{
+public:
+    /**
+     * When the data is forced to the disk with fsync().
+     */
+    typedef enum {
+        SYNC_NEVER = 0,
+        SYNC_ON_CLOSE,
+        SYNC_EVERY_PAGE
+    } SyncPolicy;
+
+    IAOutputSink(size_t pageSize=kDefaultPageSize);
+    ~IAOutputSink();
+
+    bool open(const char *filename, SyncPolicy policy=SYNC_NEVER);
+    void write(const void *data, size_t size);
+    void writeText(const char *text);
+    void print(const char *format, ...);
+    bool close(bool reportError=true);
+
+    /** Return true if a file is open for writing. */
+    bool isOpen() { return pFile!=nullptr; }
+    bool hadError();
+
+    /// default size of each of the two pages
+    static const size_t kDefaultPageSize = 1024*1024;
+
+private:
+    void submitPage();
+    void ioLoop();
+
+    FILE *pFile = nullptr;
+    char *pFilename = nullptr;
+    SyncPolicy pPolicy = SYNC_NEVER;
+    size_t pPageSize;
+    /// one page is filled by the caller, the other one is written to disk
+    std::vector<char> pPage[2];
+    /// index of the page that is filled by the caller
+    int pFillPage = 0;
+    /// number of bytes in the page that is filled by the caller
+    size_t pFillSize = 0;
+    /// number of bytes in the page that is written, or 0 if the I/O thread is idle
+    size_t pWriteSize = 0;
+    /// errno of the first failed operation, 0 if all went well
+    int pErrno = 0;
+    bool pQuit = false;
+    std::thread pThread;
+    std::mutex pMutex;
+    /// wake the I/O thread when a page is ready or the file is closed
+    std::condition_variable pWakeIO;
+    /// wake the caller when the I/O thread finished a page
+    std::condition_variable pWakeCaller;
+};
+
+
+#endif /* IA_OUTPUT_SINK_H */
+
+
@@ -0,0 +1,149 @@
+//
+//  IAThreadPool.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAThreadPool.h"
+
+
+IAThreadPool gThreadPool;
+
+
+/**
+ * Create a thread pool.
+ *
+ * Threads are not started until the pool is used for the first time.
+ */
+IAThreadPool::IAThreadPool()
+{
+}
+
+
+/**
+ * Stop all threads and wait for them to finish.
+ */
+IAThreadPool::~IAThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        pQuit = true;
+    }
+    pWakeWorker.notify_all();
+    for (auto &t: pThreadList)
+        t.join();
+}
+
+
+/**
+ * Return the number of worker threads, not including the calling thread.
+ */
+int IAThreadPool::numThreads()
+{
+    std::lock_guard<std::mutex> lock(pMutex);
+    startThreads();
+    return (int)pThreadList.size();
+}
+
+
+/**
+ * Launch one worker thread less than we have cores, so that the calling
+ * thread can work as well.
+ *
+ * Must be called while pMutex is locked.
+ */
+void IAThreadPool::startThreads()
+{
+    if (!pThreadList.empty()) return;
+    int n = (int)std::thread::hardware_concurrency() - 1;
+    for (int i=0; i<n; i++)
+        pThreadList.push_back(std::thread([this]{ workerLoop(); }));
+}
+
+
+/**
+ * Run tasks until the pool is destroyed.
+ */
+void IAThreadPool::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(pMutex);
+    for (;;) {
+        pWakeWorker.wait(lock, [this]{ return pQuit || !pTaskList.empty(); });
+        if (pQuit) return;
+        runOneTask(lock);
+    }
+}
+
+
+/**
+ * Take a task from the list and run it with pMutex unlocked.
+ *
+ * \param lock a lock on pMutex; it is locked again when this call returns
+ *
+ * \return false, if there was no task to run
+ */
+bool IAThreadPool::runOneTask(std::unique_lock<std::mutex> &lock)
+{
+    if (pTaskList.empty())
+        return false;
+    auto task = std::move(pTaskList.front());
+    pTaskList.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+    return true;
+}
+
+
+/**
+ * Split a range into bands and call a function for every band in parallel.
+ *
+ * Ranges that are too small to be split are run in the calling thread.
+ * The call returns when all bands are done.
+ *
+ * \param begin, end the range [begin, end), for example the rows of a bitmap
+ * \param minRange the minimum number of elements in a band
+ * \param func will be called as func(bandBegin, bandEnd), must be thread safe
+ */
+void IAThreadPool::parallelFor(int begin, int end, int minRange,
+                               const std::function<void(int, int)> &func)
+{
+    if (minRange<1) minRange = 1;
+    int n = end - begin;
+    int nBands = n / minRange;
+    if (nBands>1) {
+        int nThreads = numThreads() + 1;
+        if (nBands>nThreads) nBands = nThreads;
+    }
+    if (nBands<2) {
+        if (n>0) func(begin, end);
+        return;
+    }
+
+    std::atomic<int> pending(nBands);
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        for (int i=0; i<nBands; i++) {
+            int b0 = begin + (int)((long long)n*i/nBands);
+            int b1 = begin + (int)((long long)n*(i+1)/nBands);
+            pTaskList.push_back([this, &func, &pending, b0, b1]{
+                func(b0, b1);
+                if (--pending==0) {
+                    std::lock_guard<std::mutex> lock(pMutex);
+                    pWakeCaller.notify_all();
+                }
+            });
+        }
+    }
+    pWakeWorker.notify_all();
+
+    // help out until all of our bands are done
+    std::unique_lock<std::mutex> lock(pMutex);
+    while (pending>0) {
+        if (!runOneTask(lock))
+            pWakeCaller.wait(lock, [this, &pending]{ return pending==0 || !pTaskList.empty(); });
+    }
+}
+
+
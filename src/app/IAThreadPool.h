@@ -0,0 +1,64 @@
+//
+//  IAThreadPool.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_THREAD_POOL_H
+#define IA_THREAD_POOL_H
+
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * A set of worker threads that share the work of a loop.
+ *
+ * The threads are started the first time they are needed. The calling thread
+ * works on the loop as well, so parallelFor() can be called from inside
+ * another parallelFor() without blocking the pool.
+ */
+class IAThreadPool
+{
+public:
+    IAThreadPool();
+    ~IAThreadPool();
+
+    void parallelFor(int begin, int end, int minRange,
+                     const std::function<void(int, int)> &func);
+
+    int numThreads();
+
+private:
+    void startThreads();
+    void workerLoop();
+    bool runOneTask(std::unique_lock<std::mutex> &lock);
+
+    /// all worker threads
+    std::vector<std::thread> pThreadList;
+    /// tasks waiting for a thread
+    std::deque<std::function<void()>> pTaskList;
+    /// lock access to the task list
+    std::mutex pMutex;
+    /// wake up a worker when a task was added
+    std::condition_variable pWakeWorker;
+    /// wake up a caller of parallelFor when a task was finished or added
+    std::condition_variable pWakeCaller;
+    /// set when the pool is destroyed
+    bool pQuit = false;
+};
+
+
+/// the thread pool that is shared by all parts of the app
+extern IAThreadPool gThreadPool;
+
+
+#endif /* IA_THREAD_POOL_H */
+
+
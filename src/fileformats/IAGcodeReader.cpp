@@ -0,0 +1,444 @@
+//
+//  IAGcodeReader.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAGcodeReader.h"
+
+#include "Iota.h"
+#include "app/IAThreadPool.h"
+#include "toolpath/IAToolpath.h"
+#include "toolpath/IAGcodeEncoder.h"
+#include "toolpath/IAMotionPlanner.h"
+
+#include <FL/fl_utf8.h>
+
+#include <math.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+
+
+/** Arcs are split into segments of about this length for drawing, in mm. */
+static const double kArcSegmentLength = 0.5;
+
+
+/**
+ * Map a GCode file into memory.
+ *
+ * If the file can't be opened, the Iota error system will be used to
+ * produce an error message. Files in MeatPack or block encoding are decoded.
+ *
+ * \param filename read this file
+ */
+IAGcodeReader::IAGcodeReader(const char *filename)
+{
+    int fd = fl_open(filename, O_RDONLY, 0);
+    if (fd==-1) {
+        Iota.Error.set("GCode reader", IAError::CantOpenFile_STR_BSD, filename);
+        return;
+    }
+    struct stat st; fstat(fd, &st);
+    size_t len = st.st_size;
+    if (len==0) {
+        ::close(fd);
+        pDecoded.clear();
+        pData = pDecoded.data();
+        return;
+    }
+
+#ifdef _WIN32
+    pDecoded.resize(len);
+    len = read(fd, &pDecoded[0], (unsigned)len);
+    pDecoded.resize(len);
+    pData = pDecoded.data();
+#else
+    void *data = mmap(nullptr, len, PROT_READ, MAP_PRIVATE|MAP_FILE, fd, 0);
+    if (data==MAP_FAILED) {
+        Iota.Error.set("GCode reader", IAError::CantOpenFile_STR_BSD, filename);
+        ::close(fd);
+        return;
+    }
+    pData = (const char*)data;
+    pMustUnmap = true;
+#endif
+    pSize = len;
+    ::close(fd);
+
+    if (IAGcodeDecoder::detectFormat((const uint8_t*)pData, pSize)!=IAGcodeEncoder::PLAIN) {
+        std::string text;
+        if (!IAGcodeDecoder::decode((const uint8_t*)pData, pSize, text)) {
+            // the decoder set the error; use what we got so far
+        }
+#ifndef _WIN32
+        munmap((void*)pData, pSize);
+        pMustUnmap = false;
+#endif
+        pDecoded.swap(text);
+        pData = pDecoded.data();
+        pSize = pDecoded.size();
+    }
+}
+
+
+/**
+ * Release the file.
+ */
+IAGcodeReader::~IAGcodeReader()
+{
+#ifndef _WIN32
+    if (pMustUnmap)
+        munmap((void*)pData, pSize);
+#endif
+}
+
+
+/**
+ * Read a number, as used in GCode.
+ *
+ * This is much faster than strtod(), because it does not care about locales
+ * and exponents.
+ */
+double IAGcodeReader::number(const char *&p, const char *end)
+{
+    while (p<end && (*p==' ' || *p=='\t')) p++;
+    bool neg = false;
+    if (p<end && (*p=='-' || *p=='+')) { neg = (*p=='-'); p++; }
+    double v = 0.0;
+    while (p<end && *p>='0' && *p<='9') v = v*10.0 + (*p++ - '0');
+    if (p<end && *p=='.') {
+        p++;
+        double f = 0.1;
+        while (p<end && *p>='0' && *p<='9') { v += (*p++ - '0')*f; f *= 0.1; }
+    }
+    return neg ? -v : v;
+}
+
+
+/**
+ * Interpret the commands in a part of the file.
+ *
+ * Only commands that change the position or the modes are interpreted.
+ * For every move or dwell, the callback receives the move and the machine
+ * state before the move.
+ *
+ * \param start, end byte range in the file
+ * \param s the machine state; it is updated by every command
+ * \param callback called as callback(const Move&, const State&)
+ */
+template<class Callback>
+void IAGcodeReader::parse(size_t start, size_t end, State &s, Callback callback)
+{
+    const char *p = pData+start, *e = pData+end;
+    while (p<e) {
+        const char *line = p;
+        const char *eol = (const char*)memchr(p, '\n', e-p);
+        if (!eol) eol = e;
+        p = eol+1;
+        const char *c = (const char*)memchr(line, ';', eol-line);
+        if (!c) c = eol;
+
+        const char *q = line;
+        while (q<c && (*q==' ' || *q=='\t')) q++;
+        if (q<c && (*q=='N' || *q=='n')) { q++; number(q, c); while (q<c && *q==' ') q++; }
+        if (q>=c) continue;
+        char cmd = *q++;
+        if (cmd>='a') cmd -= 32;
+        if (cmd!='G' && cmd!='M' && cmd!='T') continue;
+        double full = number(q, c);
+        int code = (int)full;
+        // commands with a subcode, like G92.1 or G29.1, do something else
+        // than the main command, so leave them alone
+        if (full-code>0.001) continue;
+        if (cmd=='T') {
+            s.pTool = code;
+            continue;
+        }
+        if (cmd=='M') {
+            if (code==82) s.pRelativeE = false;
+            else if (code==83) s.pRelativeE = true;
+            continue;
+        }
+
+        // read the parameters of a G command
+        unsigned int has = 0;
+        double val[26];
+        while (q<c) {
+            char l = *q++;
+            if (l>='a' && l<='z') l -= 32;
+            if (l<'A' || l>'Z') continue;
+            val[l-'A'] = number(q, c);
+            has |= 1u<<(l-'A');
+        }
+#define HAS(l) (has & (1u<<((l)-'A')))
+#define VAL(l) (val[(l)-'A'])
+
+        switch (code) {
+            case 0: case 1: case 2: case 3: {
+                Move m;
+                m.pG = code;
+                m.pLine = line-pData;
+                double u = s.pUnit;
+                m.pX = HAS('X') ? (s.pRelative ? s.pX+VAL('X')*u : VAL('X')*u) : s.pX;
+                m.pY = HAS('Y') ? (s.pRelative ? s.pY+VAL('Y')*u : VAL('Y')*u) : s.pY;
+                m.pZ = HAS('Z') ? (s.pRelative ? s.pZ+VAL('Z')*u : VAL('Z')*u) : s.pZ;
+                double newE = s.pE;
+                if (HAS('E'))
+                    newE = s.pRelativeE ? s.pE+VAL('E')*u : VAL('E')*u;
+                m.pE = newE - s.pE;
+                if (code>=2) {
+                    m.pI = HAS('I') ? VAL('I')*u : 0.0;
+                    m.pJ = HAS('J') ? VAL('J')*u : 0.0;
+                }
+                if (HAS('F')) s.pFeedrate = VAL('F')*u;
+                callback(m, s);
+                s.pX = m.pX; s.pY = m.pY; s.pZ = m.pZ; s.pE = newE;
+                break; }
+            case 4: {
+                Move m;
+                m.pG = 4;
+                m.pLine = line-pData;
+                m.pX = s.pX; m.pY = s.pY; m.pZ = s.pZ; m.pE = 0.0;
+                m.pDwell = HAS('S') ? VAL('S') : (HAS('P') ? VAL('P')/1000.0 : 0.0);
+                callback(m, s);
+                break; }
+            case 20: s.pUnit = 25.4; break;
+            case 21: s.pUnit = 1.0; break;
+            case 28:
+                if (!HAS('X') && !HAS('Y') && !HAS('Z')) {
+                    s.pX = s.pY = s.pZ = 0.0;
+                } else {
+                    if (HAS('X')) s.pX = 0.0;
+                    if (HAS('Y')) s.pY = 0.0;
+                    if (HAS('Z')) s.pZ = 0.0;
+                }
+                break;
+            case 90: s.pRelative = false; s.pRelativeE = false; break;
+            case 91: s.pRelative = true; s.pRelativeE = true; break;
+            case 92:
+                if (HAS('X')) s.pX = VAL('X')*s.pUnit;
+                if (HAS('Y')) s.pY = VAL('Y')*s.pUnit;
+                if (HAS('Z')) s.pZ = VAL('Z')*s.pUnit;
+                if (HAS('E')) s.pE = VAL('E')*s.pUnit;
+                break;
+        }
+#undef HAS
+#undef VAL
+    }
+}
+
+
+/**
+ * Find the start of every layer.
+ */
+void IAGcodeReader::buildIndex()
+{
+    if (pHasIndex) return;
+    pHasIndex = true;
+    pLayerList.clear();
+    if (!pData) return;
+
+    State s;
+    bool inLayer = false;
+    double layerZ = 0.0;
+    parse(0, pSize, s, [&](const Move &m, const State &b) {
+        if (m.pG>3 || m.pE<=0.0) return;
+        if (m.pG<2 && m.pX==b.pX && m.pY==b.pY) return; // priming, not printing
+        if (inLayer && fabs(m.pZ-layerZ)<1e-4) return;
+        if (!pLayerList.empty())
+            pLayerList.back().pEnd = m.pLine;
+        Layer l;
+        l.pStart = m.pLine;
+        l.pEnd = pSize;
+        l.pZ = m.pZ;
+        l.pState = b;
+        pLayerList.push_back(l);
+        layerZ = m.pZ;
+        inLayer = true;
+    });
+}
+
+
+/**
+ * Return the number of layers in the file.
+ *
+ * The first call scans the entire file.
+ */
+size_t IAGcodeReader::layerCount()
+{
+    buildIndex();
+    return pLayerList.size();
+}
+
+
+/**
+ * Return the height of a layer in mm.
+ */
+double IAGcodeReader::layerZ(size_t i)
+{
+    buildIndex();
+    return (i<pLayerList.size()) ? pLayerList[i].pZ : 0.0;
+}
+
+
+/**
+ * Create the toolpaths for one layer.
+ *
+ * Every run of extruding moves becomes one toolpath. Arcs are split into
+ * short lines.
+ *
+ * \param i layer index
+ *
+ * \return a new toolpath list, or nullptr if there is no such layer
+ */
+IAToolpathList *IAGcodeReader::loadLayer(size_t i)
+{
+    buildIndex();
+    if (i>=pLayerList.size()) return nullptr;
+    const Layer &l = pLayerList[i];
+    double z = l.pZ;
+    State s = l.pState;
+    IAToolpathList *list = new IAToolpathList(z);
+    IAToolpath *tp = nullptr;
+    int tool = 0;
+
+    auto finish = [&]() {
+        if (!tp) return;
+        if (tp->pVertexList.size()>2)
+            list->add(tp, tool, 0, 0);
+        else
+            delete tp;
+        tp = nullptr;
+    };
+
+    parse(l.pStart, l.pEnd, s, [&](const Move &m, const State &b) {
+        if (m.pG>3) return;
+        if (m.pE<=0.0) {
+            if (m.pE<0.0 || m.pX!=b.pX || m.pY!=b.pY)
+                finish();
+            return;
+        }
+        if (tp && b.pTool!=tool)
+            finish();
+        if (!tp) {
+            tp = new IAToolpathLine(z);
+            tp->tPrev = IAVector3d(b.pX, b.pY, z);
+            tp->startPath(b.pX, b.pY);
+            tool = b.pTool;
+        }
+        if (m.pG<2) {
+            tp->continuePath(m.pX, m.pY);
+            return;
+        }
+        double cx = b.pX+m.pI, cy = b.pY+m.pJ;
+        double r = sqrt(m.pI*m.pI + m.pJ*m.pJ);
+        double a0 = atan2(b.pY-cy, b.pX-cx), a1 = atan2(m.pY-cy, m.pX-cx);
+        bool ccw = (m.pG==3);
+        double sweep = ccw ? a1-a0 : a0-a1;
+        if (sweep<=1e-9) sweep += 2.0*M_PI;
+        int n = std::max(1, std::min(720, (int)ceil(r*sweep/kArcSegmentLength)));
+        for (int k=1; k<n; k++) {
+            double a = a0 + (ccw ? 1.0 : -1.0) * sweep*k/n;
+            tp->continuePath(cx + r*cos(a), cy + r*sin(a));
+        }
+        tp->continuePath(m.pX, m.pY);
+    });
+    finish();
+    return list;
+}
+
+
+/**
+ * Create the toolpaths for all layers.
+ *
+ * Layers are parsed in parallel. Layers at the same height are merged.
+ *
+ * \param machine receives the layers
+ */
+void IAGcodeReader::load(IAMachineToolpath &machine)
+{
+    size_t n = layerCount();
+    std::vector<IAToolpathList*> layerList(n, nullptr);
+    gThreadPool.parallelFor(0, (int)n, 4, [&](int i0, int i1) {
+        for (int i=i0; i<i1; i++)
+            layerList[i] = loadLayer(i);
+    });
+    for (size_t i=0; i<n; i++) {
+        IAToolpathList *dst = machine.createLayer(pLayerList[i].pZ);
+        dst->move(layerList[i]);
+        delete layerList[i];
+    }
+}
+
+
+/**
+ * Estimate the time to print one layer.
+ *
+ * \param i layer index
+ * \param planner a planner set up for the target printer
+ *
+ * \return time in seconds
+ */
+double IAGcodeReader::estimateLayerTime(size_t i, IAMotionPlanner &planner)
+{
+    buildIndex();
+    if (i>=pLayerList.size()) return 0.0;
+    const Layer &l = pLayerList[i];
+    State s = l.pState;
+    planner.flush();
+    double t0 = planner.time();
+    parse(l.pStart, l.pEnd, s, [&](const Move &m, const State &b) {
+        IAVector3d from(b.pX, b.pY, b.pZ), to(m.pX, m.pY, m.pZ);
+        if (m.pG==4)
+            planner.addDelay(m.pDwell);
+        else if (m.pG<2)
+            planner.addMove(from, to, m.pE, b.pFeedrate);
+        else
+            planner.addArc(from, to, IAVector3d(b.pX+m.pI, b.pY+m.pJ, b.pZ),
+                           m.pG==3, m.pE, b.pFeedrate);
+    });
+    planner.flush();
+    return planner.time() - t0;
+}
+
+
+/**
+ * Estimate the time to print the entire file.
+ *
+ * This includes everything before the first and after the last layer, but
+ * not the time to heat up.
+ *
+ * \param planner a planner set up for the target printer
+ *
+ * \return time in seconds
+ */
+double IAGcodeReader::estimateTime(IAMotionPlanner &planner)
+{
+    if (!pData) return 0.0;
+    State s;
+    planner.reset();
+    parse(0, pSize, s, [&](const Move &m, const State &b) {
+        IAVector3d from(b.pX, b.pY, b.pZ), to(m.pX, m.pY, m.pZ);
+        if (m.pG==4)
+            planner.addDelay(m.pDwell);
+        else if (m.pG<2)
+            planner.addMove(from, to, m.pE, b.pFeedrate);
+        else
+            planner.addArc(from, to, IAVector3d(b.pX+m.pI, b.pY+m.pJ, b.pZ),
+                           m.pG==3, m.pE, b.pFeedrate);
+    });
+    planner.flush();
+    return planner.time();
+}
+
+
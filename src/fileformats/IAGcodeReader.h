@@ -0,0 +1,108 @@
+//
+//  IAGcodeReader.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_GCODE_READER_H
+#define IA_GCODE_READER_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+class IAToolpathList;
+class IAMachineToolpath;
+class IAMotionPlanner;
+
+
+/**
+ * Read GCode files from any slicer and rebuild their toolpaths.
+ *
+ * The file is mapped into memory and never copied, unless it was written in
+ * one of our compact encodings, which are decoded first.
+ *
+ * The reader finds the layers lazily. The first call that needs them scans
+ * the whole file once, only tracking the position and extrusion, and
+ * remembers where every layer starts and the machine state at that point.
+ * A new layer starts whenever the head extrudes at a new height, so z-hops
+ * during travel don't create layers. Afterwards, every layer can be turned
+ * into toolpaths or timed on its own, without parsing the rest of the file.
+ */
+class IAGcodeReader
+{
+public:
+    IAGcodeReader(const char *filename);
+    ~IAGcodeReader();
+
+    /** Return true if the file could be read. */
+    bool isOpen() { return pData!=nullptr; }
+
+    size_t layerCount();
+    double layerZ(size_t i);
+    IAToolpathList *loadLayer(size_t i);
+    void load(IAMachineToolpath &machine);
+    double estimateLayerTime(size_t i, IAMotionPlanner &planner);
+    double estimateTime(IAMotionPlanner &planner);
+
+private:
+    /**
+     * The machine state between two commands.
+     */
+    class State {
+    public:
+        double pX = 0.0, pY = 0.0, pZ = 0.0, pE = 0.0;
+        double pFeedrate = 1000.0;  ///< mm/min
+        double pUnit = 1.0;         ///< 25.4 if the file uses inches
+        bool pRelative = false;     ///< G91
+        bool pRelativeE = false;    ///< M83
+        int pTool = 0;
+    };
+
+    /**
+     * A move command, with the state before the move.
+     */
+    class Move {
+    public:
+        int pG = 0;                 ///< 0 to 3
+        double pX, pY, pZ;          ///< target position
+        double pE;                  ///< filament length, relative
+        double pI = 0.0, pJ = 0.0;  ///< arc center, relative to the start
+        double pDwell = 0.0;        ///< G4 time in seconds
+        size_t pLine = 0;           ///< offset of the command in the file
+    };
+
+    /**
+     * Where a layer starts in the file.
+     */
+    class Layer {
+    public:
+        size_t pStart, pEnd;
+        double pZ;
+        State pState;
+    };
+
+    void buildIndex();
+    template<class Callback>
+    void parse(size_t start, size_t end, State &s, Callback callback);
+    static double number(const char *&p, const char *end);
+
+    /// the file data, mapped or decoded
+    const char *pData = nullptr;
+    size_t pSize = 0;
+    /// if set, pData must be unmapped
+    bool pMustUnmap = false;
+    /// holds the decoded text of encoded files
+    std::string pDecoded;
+    /// start of every layer, built on demand
+    std::vector<Layer> pLayerList;
+    bool pHasIndex = false;
+};
+
+
+#endif /* IA_GCODE_READER_H */
+
+
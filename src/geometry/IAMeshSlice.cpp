@@ -435,7 +435,7 @@ void IAMeshSlice::tesselateLidFromRim()
 void IAMeshSlice::tesselateAndDrawLid(IAFramebuffer *fb)
 {
     fb->bindForRendering(); // make sure we have a square in the buffer
-    if (fb->buffers()==IAFramebuffer::BITMAP) {
+    if (fb->rendersToBitmap()) {
         fb->drawLid(pRim);
     } else {
         tesselateLidFromRim();
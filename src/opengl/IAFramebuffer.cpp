@@ -6,15 +6,21 @@
 
 
 #include "IAFramebuffer.h"
+#include "IAFramebufferPool.h"
+#include "app/IAThreadPool.h"
+#include "app/IAOutputSink.h"
 
 #include "view/IAGUIMain.h"
 #include "toolpath/IAToolpath.h"
 #include "potrace/IAPotrace.h"
+#include "toolpath/IAContourTracer.h"
 #include "potrace/bitmap.h"
 #include "printer/IAPrinter.h"
+#include "geometry/IAMesh.h"
 
 #include <stdio.h>
 #include <math.h>
+#include <algorithm>
 #include <libjpeg/jpeglib.h>
 #include <libpng/png.h>
 
@@ -54,6 +60,12 @@ PFNGLBLITFRAMEBUFFEREXTPROC glBlitFramebufferEXT;
 #endif
 
 
+bool IAFramebuffer::pSoftwareRendering = false;
+
+/** Bitmap operations are split into bands of at least this many rows. */
+static const int kMinRowsPerBand = 128;
+
+
 int isExtensionSupported(const char *extension)
 {
     const GLubyte *extensions = NULL;
@@ -135,9 +147,12 @@ if (!a##EXT) { Iota.Error.set("Initializing OpenGL", IAError::OpenGLFeatureNotSu
  *
  * \param printer used for scaling GL to build volume
  * \param buffers request a certain type of buffers
+ * \param width, height size of the buffer in pixels
  */
-IAFramebuffer::IAFramebuffer(IAPrinter *printer, Buffers buffers)
-:   pBuffers( buffers ),
+IAFramebuffer::IAFramebuffer(IAPrinter *printer, Buffers buffers, int width, int height)
+:   pWidth( width ),
+    pHeight( height ),
+    pBuffers( buffers ),
     pPrinter( printer )
 {
     // variables are initialized inline
@@ -150,15 +165,23 @@ IAFramebuffer::IAFramebuffer(IAPrinter *printer, Buffers buffers)
  * \param src copy the parameters and content from this buffer
  */
 IAFramebuffer::IAFramebuffer(IAFramebuffer *src)
-:   pBuffers( src->pBuffers ),
+:   pWidth( src->pWidth ),
+    pHeight( src->pHeight ),
+    pBuffers( src->pBuffers ),
     pPrinter( src->pPrinter )
 {
     if (src->hasFBO()) {
-        bindForRendering();
-        if (pBuffers==BITMAP) {
-            /** \bug assuming that all framebuffers have the same resolution */
-            pBitmap = bm_dup(src->pBitmap);
+        if (pBuffers==COVERAGE) {
+            createFBO(false);
+            memcpy(pCoverage, src->pCoverage, pWidth*pHeight);
+        } else if (rendersToBitmap()) {
+            // no need to clear the buffer, we overwrite it right away
+            createFBO(false);
+            bm_copy(pBitmap, src->pBitmap);
+            if (pDepthBuffer && src->pDepthBuffer)
+                memcpy(pDepthBuffer, src->pDepthBuffer, pWidth*pHeight*sizeof(float));
         } else {
+            bindForRendering();
             glBindFramebufferEXT(GL_READ_FRAMEBUFFER, src->pFramebuffer);
             IA_HANDLE_GL_ERRORS();
             glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, pFramebuffer);
@@ -167,8 +190,8 @@ IAFramebuffer::IAFramebuffer(IAFramebuffer *src)
                                  0, 0, pWidth, pHeight,
                                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
             IA_HANDLE_GL_ERRORS();
+            unbindFromRendering();
         }
-        unbindFromRendering();
     }
 }
 
@@ -183,21 +206,30 @@ void IAFramebuffer::logicAndNot(IAFramebuffer *src)
 {
     if (src && src->hasFBO()) {
         bindForRendering();
-        if (pBuffers==BITMAP) {
+        if (pBuffers==COVERAGE) {
+            // the coverage that is in this buffer, but not in src
+            gThreadPool.parallelFor(0, pHeight, kMinRowsPerBand, [=](int y0, int y1) {
+                uint8_t *pSrc = src->pCoverage + y0*pWidth;
+                uint8_t *pDst = pCoverage + y0*pWidth;
+                for (int i=0, n=(y1-y0)*pWidth; i<n; i++) {
+                    uint8_t inv = 255 - pSrc[i];
+                    if (pDst[i] > inv) pDst[i] = inv;
+                }
+            });
+        } else if (rendersToBitmap()) {
             int dy = pBitmap->dy;
-            int y;
-            int i;
-            potrace_word *pSrc, *pDst;
             if (dy < 0) {
                 dy = -dy;
             }
-            for (y=0; y < pBitmap->h; y++) {
-                pSrc = bm_scanline(src->pBitmap, y);
-                pDst = bm_scanline(pBitmap, y);
-                for (i=0; i < dy; i++) {
-                    pDst[i] = pDst[i] & ~pSrc[i];
+            gThreadPool.parallelFor(0, pBitmap->h, kMinRowsPerBand, [=](int y0, int y1) {
+                for (int y=y0; y < y1; y++) {
+                    potrace_word *pSrc = bm_scanline(src->pBitmap, y);
+                    potrace_word *pDst = bm_scanline(pBitmap, y);
+                    for (int i=0; i < dy; i++) {
+                        pDst[i] = pDst[i] & ~pSrc[i];
+                    }
                 }
-            }
+            });
         } else {
             glBindFramebufferEXT(GL_READ_FRAMEBUFFER, src->pFramebuffer);
             IA_HANDLE_GL_ERRORS();
@@ -253,21 +285,29 @@ void IAFramebuffer::logicAnd(IAFramebuffer *src)
 {
     if (src && src->hasFBO()) {
         bindForRendering();
-        if (pBuffers==BITMAP) {
+        if (pBuffers==COVERAGE) {
+            // the coverage that is in both buffers
+            gThreadPool.parallelFor(0, pHeight, kMinRowsPerBand, [=](int y0, int y1) {
+                uint8_t *pSrc = src->pCoverage + y0*pWidth;
+                uint8_t *pDst = pCoverage + y0*pWidth;
+                for (int i=0, n=(y1-y0)*pWidth; i<n; i++) {
+                    if (pDst[i] > pSrc[i]) pDst[i] = pSrc[i];
+                }
+            });
+        } else if (rendersToBitmap()) {
             int dy = pBitmap->dy;
-            int y;
-            int i;
-            potrace_word *pSrc, *pDst;
             if (dy < 0) {
                 dy = -dy;
             }
-            for (y=0; y < pBitmap->h; y++) {
-                pSrc = bm_scanline(src->pBitmap, y);
-                pDst = bm_scanline(pBitmap, y);
-                for (i=0; i < dy; i++) {
-                    pDst[i] = pDst[i] & pSrc[i];
+            gThreadPool.parallelFor(0, pBitmap->h, kMinRowsPerBand, [=](int y0, int y1) {
+                for (int y=y0; y < y1; y++) {
+                    potrace_word *pSrc = bm_scanline(src->pBitmap, y);
+                    potrace_word *pDst = bm_scanline(pBitmap, y);
+                    for (int i=0; i < dy; i++) {
+                        pDst[i] = pDst[i] & pSrc[i];
+                    }
                 }
-            }
+            });
         } else {
             glBindFramebufferEXT(GL_READ_FRAMEBUFFER, src->pFramebuffer);
             IA_HANDLE_GL_ERRORS();
@@ -315,21 +355,47 @@ void IAFramebuffer::logicAnd(IAFramebuffer *src)
 
 
 /**
- * Delete the framebuffer, if we ever created one.
+ * Return the framebuffer to the pool, if we ever created one.
  */
 IAFramebuffer::~IAFramebuffer()
 {
+    if (hasFBO()) {
+        deleteFBO();
+    }
     if (pBitmap) {
         bm_free(pBitmap);
         pBitmap = nullptr;
     }
-    if (hasFBO()) {
-        deleteFBO();
-        pFramebufferCreated = false;
+    if (pCoverage) {
+        ::free((void*)pCoverage);
+        pCoverage = nullptr;
     }
 }
 
 
+/**
+ * Return the number of bytes used by the buffers of this framebuffer.
+ *
+ * OpenGL buffers are estimated at four bytes per pixel and buffer.
+ */
+size_t IAFramebuffer::memorySize()
+{
+    if (!hasFBO())
+        return 0;
+    size_t nPixels = (size_t)pWidth * (size_t)pHeight;
+    size_t size = 0;
+    if (pBitmap)
+        size += bm_size(pBitmap);
+    if (pCoverage)
+        size += nPixels;
+    if (pDepthBuffer)
+        size += nPixels*sizeof(float);
+    if (!rendersToBitmap())
+        size += nPixels * ((pBuffers==RGBAZ) ? 8 : 4);
+    return size;
+}
+
+
 /**
  * Draw a black framebuffer with a depth of 0.
  *
@@ -339,15 +405,21 @@ void IAFramebuffer::fill(int color)
 {
     if (hasFBO()) {
         bindForRendering();
-        if (pBuffers==RGBA) {
+        if (pBuffers==COVERAGE) {
+            memset(pCoverage, color ? 255 : 0, pWidth*pHeight);
+        } else if (rendersToBitmap()) {
+            bm_clear(pBitmap, color);
+            if (pDepthBuffer) {
+                for (int i=0, n=pWidth*pHeight; i<n; i++)
+                    pDepthBuffer[i] = 1.0f;
+            }
+        } else if (pBuffers==RGBA) {
             glClearColor(0.0, 0.0, 0.0, 0.0);
             glClear(GL_COLOR_BUFFER_BIT);
         } else if (pBuffers==RGBAZ) {
             glClearColor(0.0, 0.0, 0.0, 0.0);
             glClearDepth(1.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        } else if (pBuffers==BITMAP) {
-            bm_clear(pBitmap, color);
         }
         unbindFromRendering();
     }
@@ -361,7 +433,7 @@ void IAFramebuffer::bindForRendering()
 {
     activateFBO();
 
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         // nothing to do
     } else {
         // set matrices, lighting, etc. for this FBO
@@ -394,7 +466,7 @@ void IAFramebuffer::bindForRendering()
  */
 void IAFramebuffer::unbindFromRendering()
 {
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         // nothing to do
     } else {
         // deactivate the FBO and set render target to FL_BACKBUFFER
@@ -416,11 +488,15 @@ uint8_t *IAFramebuffer::getRawImageRGB()
 {
     size_t size = pWidth*pHeight*3;
     uint8_t *data = (uint8_t*)calloc(size, 1);
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         uint8_t *dst = data;
         for (int y=0; y<pHeight; y++) {
             for (int x=0; x<pWidth; x++) {
-                uint8_t lum = BM_UGET(pBitmap, x, y) ? 255 : 0;
+                uint8_t lum;
+                if (pCoverage)
+                    lum = pCoverage[y*pWidth+x];
+                else
+                    lum = BM_UGET(pBitmap, x, y) ? 255 : 0;
                 *dst++ = lum;
                 *dst++ = lum;
                 *dst++ = lum;
@@ -448,14 +524,19 @@ uint8_t *IAFramebuffer::getRawImageRGBA()
 {
     size_t size = pWidth*pHeight*4;
     uint8_t *data = (uint8_t*)calloc(size, 1);
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         uint8_t *dst = data;
         for (int y=0; y<pHeight; y++) {
             for (int x=0; x<pWidth; x++) {
-                uint8_t lum = BM_UGET(pBitmap, x, y) ? 255 : 0;
+                uint8_t lum;
+                if (pCoverage)
+                    lum = pCoverage[y*pWidth+x];
+                else
+                    lum = BM_UGET(pBitmap, x, y) ? 255 : 0;
                 *dst++ = lum;
                 *dst++ = lum;
                 *dst++ = lum;
+                *dst++ = 255;
             }
         }
     } else {
@@ -476,18 +557,63 @@ uint8_t *IAFramebuffer::getRawImageRGBA()
  *
  * \param toolpath add outline segments to this toolpath
  * \param z give all segments in the toolpath a z position
+ * \param method trace with potrace or with marching squares
+ * \param tolerance marching squares removes points that are closer than
+ *        this to the outline, in millimeters
  *
  * \return returns 0 on success
  */
-int IAFramebuffer::traceOutline(IAToolpathList *toolpathList, double z)
+int IAFramebuffer::traceOutline(IAToolpathList *toolpathList, double z,
+                                TraceMethod method, double tolerance)
 {
     toolpathList->purge();
     toolpathList->setZ(z);
-    potrace(this, toolpathList, z);
+    if (pBuffers==COVERAGE || method==MARCHING_SQUARES) {
+        IAContourTracer tracer(this);
+        tracer.trace(toolpathList, z, tolerance);
+    } else {
+        potrace(this, toolpathList, z);
+    }
     return 0;
 }
 
 
+/**
+ * A libjpeg destination that hands the compressed data to an output sink.
+ */
+struct IAJpegSinkDestination
+{
+    struct jpeg_destination_mgr pub;
+    IAOutputSink *sink;
+    JOCTET buffer[4096];
+};
+
+
+static void jpegInitDestination(j_compress_ptr cinfo)
+{
+    IAJpegSinkDestination *dest = (IAJpegSinkDestination*)cinfo->dest;
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
+
+
+static boolean jpegEmptyOutputBuffer(j_compress_ptr cinfo)
+{
+    IAJpegSinkDestination *dest = (IAJpegSinkDestination*)cinfo->dest;
+    dest->sink->write(dest->buffer, sizeof(dest->buffer));
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = sizeof(dest->buffer);
+    return TRUE;
+}
+
+
+static void jpegTermDestination(j_compress_ptr cinfo)
+{
+    IAJpegSinkDestination *dest = (IAJpegSinkDestination*)cinfo->dest;
+    dest->sink->write(dest->buffer, sizeof(dest->buffer)-dest->pub.free_in_buffer);
+}
+
+
 /**
  * Write the RGB components of the image buffer into a jpeg file.
  *
@@ -496,10 +622,29 @@ int IAFramebuffer::traceOutline(IAToolpathList *toolpathList, double z)
  *        get and handle the image data.
  *
  * \return 0 on success
+ */
+int IAFramebuffer::saveAsJpeg(const char *filename, GLubyte *imgdata)
+{
+    IAOutputSink sink;
+    if (!sink.open(filename))
+        return -1;
+    saveAsJpeg(sink, imgdata);
+    return sink.close() ? 0 : -1;
+}
+
+
+/**
+ * Write the RGB components of the image buffer as jpeg data into a sink.
+ *
+ * \param sink an open output sink; the sink is not closed
+ * \param imgdata a pointer to an RGB buffer, or nullptr if this call will
+ *        get and handle the image data.
+ *
+ * \return 0 on success
  *
  * \todo no error checking yet
  */
-int IAFramebuffer::saveAsJpeg(const char *filename, GLubyte *imgdata)
+int IAFramebuffer::saveAsJpeg(IAOutputSink &sink, GLubyte *imgdata)
 {
     bool freeImgData = false;
     if (imgdata==nullptr) {
@@ -507,41 +652,42 @@ int IAFramebuffer::saveAsJpeg(const char *filename, GLubyte *imgdata)
         freeImgData = true;
     }
 
-    FILE *ofp;
     struct jpeg_compress_struct cinfo;   /* JPEG compression struct */
     struct jpeg_error_mgr jerr;          /* JPEG error handler */
+    IAJpegSinkDestination dest;          /* JPEG data goes to the sink */
     JSAMPROW row_pointer[1];             /* output row buffer */
     int row_stride;                      /* physical row width in output buf */
 
-    if ((ofp = fl_fopen(filename, "wb"))) {
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
-        jpeg_stdio_dest(&cinfo, ofp);
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    dest.pub.init_destination = jpegInitDestination;
+    dest.pub.empty_output_buffer = jpegEmptyOutputBuffer;
+    dest.pub.term_destination = jpegTermDestination;
+    dest.sink = &sink;
+    cinfo.dest = &dest.pub;
 
-        cinfo.image_width = pWidth;
-        cinfo.image_height = pHeight;
-        cinfo.input_components = 3;
-        cinfo.in_color_space = JCS_RGB;
+    cinfo.image_width = pWidth;
+    cinfo.image_height = pHeight;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
 
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, 95, FALSE);
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 95, FALSE);
 
-        jpeg_start_compress(&cinfo, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
 
-        /* Calculate the size of a row in the image */
-        row_stride = cinfo.image_width * cinfo.input_components;
+    /* Calculate the size of a row in the image */
+    row_stride = cinfo.image_width * cinfo.input_components;
 
-        /* compress the JPEG, one scanline at a time into the buffer */
-        while (cinfo.next_scanline < cinfo.image_height) {
-            row_pointer[0] = &(imgdata[(pHeight - cinfo.next_scanline - 1)*row_stride]);
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
+    /* compress the JPEG, one scanline at a time into the buffer */
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row_pointer[0] = &(imgdata[(pHeight - cinfo.next_scanline - 1)*row_stride]);
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
 
-        jpeg_finish_compress(&cinfo);
-        jpeg_destroy_compress(&cinfo);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
 
-        fclose(ofp);
-    }
     if (freeImgData)
         free(imgdata);
 
@@ -549,6 +695,18 @@ int IAFramebuffer::saveAsJpeg(const char *filename, GLubyte *imgdata)
 }
 
 
+static void pngWriteToSink(png_structp png, png_bytep data, png_size_t length)
+{
+    ((IAOutputSink*)png_get_io_ptr(png))->write(data, length);
+}
+
+
+static void pngFlushSink(png_structp)
+{
+    // the sink writes in the background, there is nothing to flush
+}
+
+
 /**
  * Write framebuffer as PNG image file.
  *
@@ -558,6 +716,26 @@ int IAFramebuffer::saveAsJpeg(const char *filename, GLubyte *imgdata)
  *        get and handle the image data.
  *
  * \return 0 on success
+ */
+int IAFramebuffer::saveAsPng(const char *filename, int components, GLubyte *imgdata)
+{
+    IAOutputSink sink;
+    if (!sink.open(filename))
+        return -1;
+    saveAsPng(sink, components, imgdata);
+    return sink.close() ? 0 : -1;
+}
+
+
+/**
+ * Write framebuffer as PNG data into a sink.
+ *
+ * \param sink an open output sink; the sink is not closed
+ * \param components 3 for RGB, 4 for RGBA
+ * \param imgdata a pointer to an RGB(A) buffer, or nullptr if this call will
+ *        get and handle the image data.
+ *
+ * \return 0 on success
  *
  * \todo no error checking yet
  * \todo can we accelerate PNG writing by changing filters and compression?
@@ -565,7 +743,7 @@ int IAFramebuffer::saveAsJpeg(const char *filename, GLubyte *imgdata)
  * \todo if we want to send data directly to a printhead, we may want to
  *       generate dithered files for color blending.
  */
-int IAFramebuffer::saveAsPng(const char *filename, int components, GLubyte *imgdata)
+int IAFramebuffer::saveAsPng(IAOutputSink &sink, int components, GLubyte *imgdata)
 {
     bool freeImgData = false;
     if (imgdata==nullptr) {
@@ -576,9 +754,6 @@ int IAFramebuffer::saveAsPng(const char *filename, int components, GLubyte *imgd
         freeImgData = true;
     }
 
-    FILE *fp = fopen(filename, "wb");
-    if(!fp) abort();
-
     png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png) abort();
 
@@ -587,7 +762,7 @@ int IAFramebuffer::saveAsPng(const char *filename, int components, GLubyte *imgd
 
     if (setjmp(png_jmpbuf(png))) abort();
 
-    png_init_io(png, fp);
+    png_set_write_fn(png, &sink, pngWriteToSink, pngFlushSink);
 
     int fmt = 0;
     switch (components) {
@@ -612,7 +787,8 @@ int IAFramebuffer::saveAsPng(const char *filename, int components, GLubyte *imgd
     for(int y = 0; y < pHeight; y++) {
         png_write_row( png, imgdata + y*pWidth*components );
     }
-    fclose(fp);
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
 
     if (freeImgData)
         free(imgdata);
@@ -630,7 +806,7 @@ void IAFramebuffer::draw(double z)
 {
     if (!hasFBO()) return;
 
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         /** \bug write this */
     } else {
         // set as texture and render out
@@ -674,7 +850,7 @@ void IAFramebuffer::activateFBO()
     if (!pFramebufferCreated) {
         createFBO();
     }
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         // nothing to do
     } else {
         /** \todo what if there was an error and FBO is still not created */
@@ -688,16 +864,31 @@ void IAFramebuffer::activateFBO()
 /**
  * Create a framebuffer object.
  *
+ * If possible, the buffers are taken from the framebuffer pool.
+ *
+ * \param clear if set, fill the buffer with 0
+ *
  * \see https://www.khronos.org/opengl/wiki/Framebuffer_Object_Extension_Examples#Color_texture.2C_Depth_texture
  *
  * \todo return a potential error code and handle it upstream.
  */
-void IAFramebuffer::createFBO()
+void IAFramebuffer::createFBO(bool clear)
 {
+    // Recycle a previously used framebuffer
+    if (IAFramebufferPool::acquire(this)) {
+        pFramebufferCreated = true;
+        if (clear) fill(0);
+        return;
+    }
+
     // Create this thing
 
-    if (pBuffers==BITMAP) {
+    if (pBuffers==COVERAGE) {
+        pCoverage = (uint8_t*)::malloc(pWidth*pHeight);
+    } else if (rendersToBitmap()) {
         pBitmap = bm_new(pWidth, pHeight);
+        if (pBuffers==RGBAZ)
+            pDepthBuffer = (float*)::malloc(pWidth*pHeight*sizeof(float));
     } else {
         //RGBA8 2D texture, 24 bit depth texture
         IA_HANDLE_GL_ERRORS();
@@ -751,33 +942,16 @@ void IAFramebuffer::createFBO()
         }
     }
     pFramebufferCreated = true;
-    fill(0);
+    if (clear) fill(0);
 }
 
 
 /**
- * Delete the framebuffer object.
+ * Return the buffers to the framebuffer pool.
  */
 void IAFramebuffer::deleteFBO()
 {
-    if (pBuffers==BITMAP) {
-        bm_free(pBitmap);
-    } else {
-        //Bind 0, which means render to back buffer, as a result, fb is unbound
-        IA_HANDLE_GL_ERRORS();
-        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
-        IA_HANDLE_GL_ERRORS();
-        //Delete resources
-        if (pColorbuffer)
-            glDeleteTextures(1, &pColorbuffer);
-        IA_HANDLE_GL_ERRORS();
-        if (pDepthbuffer)
-            glDeleteRenderbuffersEXT(1, &pDepthbuffer);
-        IA_HANDLE_GL_ERRORS();
-        if (pFramebuffer)
-            glDeleteFramebuffersEXT(1, &pFramebuffer);
-        IA_HANDLE_GL_ERRORS();
-    }
+    IAFramebufferPool::release(this);
     pFramebufferCreated = false;
 }
 
@@ -786,17 +960,18 @@ void IAFramebuffer::deleteFBO()
  * Trace the framebuffer and create a toolpath.
  *
  * \param z create a toolptah at this layer
+ * \param method, tolerance see traceOutline()
  *
  * \return nullptr, if tracing generates an empty toolpath
  * \return a new smart_pointer to a toolpath
  */
-IAToolpathListSP IAFramebuffer::toolpathFromLasso(double z)
+IAToolpathListSP IAFramebuffer::toolpathFromLasso(double z, TraceMethod method, double tolerance)
 {
     // use a shared pointer, so we don't have to worry about deallocating
     auto tp0 = std::make_shared<IAToolpathList>(z);
 
     // create an outline for this slice image
-    traceOutline(tp0.get(), z);
+    traceOutline(tp0.get(), z, method, tolerance);
 
     if (tp0->isEmpty())
         return nullptr;
@@ -811,14 +986,16 @@ IAToolpathListSP IAFramebuffer::toolpathFromLasso(double z)
  *
  * \param z create a toolpath at this layer
  * \param r the pattern will be reduced by the amount in r
+ * \param method, tolerance see traceOutline()
  *
  * \return nullptr, if tracing generates an empty toolpath
  * \return a new smart_pointer to a toolpath
  */
-IAToolpathListSP IAFramebuffer::toolpathFromLassoAndContract(double z, double r)
+IAToolpathListSP IAFramebuffer::toolpathFromLassoAndContract(double z, double r,
+                                                             TraceMethod method, double tolerance)
 {
     // use a shared pointer, so we don;t have to worry about deallocating
-    auto tp0 = toolpathFromLasso(z);
+    auto tp0 = toolpathFromLasso(z, method, tolerance);
     subtract(tp0, r);
     return tp0;
 }
@@ -830,14 +1007,16 @@ IAToolpathListSP IAFramebuffer::toolpathFromLassoAndContract(double z, double r)
  *
  * \param z create a toolpath at this layer
  * \param r the pattern will be increased by the amount in r
+ * \param method, tolerance see traceOutline()
  *
  * \return nullptr, if tracing generates an empty toolpath
  * \return a new smart_pointer to a toolpath
  */
-IAToolpathListSP IAFramebuffer::toolpathFromLassoAndExpand(double z, double r)
+IAToolpathListSP IAFramebuffer::toolpathFromLassoAndExpand(double z, double r,
+                                                           TraceMethod method, double tolerance)
 {
     // use a shared pointer, so we don;t have to worry about deallocating
-    auto tp0 = toolpathFromLasso(z);
+    auto tp0 = toolpathFromLasso(z, method, tolerance);
     add(tp0, r);
     return tp0;
 }
@@ -854,7 +1033,7 @@ void IAFramebuffer::subtract(IAToolpathListSP tp, double r)
     if (tp) {
         // draw the outline to contract the image
         bindForRendering();
-        if (pBuffers==BITMAP) {
+        if (rendersToBitmap()) {
             tp->drawFlatToBitmap(this, r*2.0);
         } else {
             glDisable(GL_DEPTH_TEST);
@@ -877,7 +1056,7 @@ void IAFramebuffer::add(IAToolpathListSP tp, double r)
     if (tp) {
         // draw the outline to contract the image
         bindForRendering();
-        if (pBuffers==BITMAP) {
+        if (rendersToBitmap()) {
             tp->drawFlatToBitmap(this, r*2.0, 1);
         } else {
             glDisable(GL_DEPTH_TEST);
@@ -903,23 +1082,26 @@ void IAFramebuffer::overlayLidPattern(int i, double infillWdt)
     /** \todo What if the printer has negative coordintes as well? */
     double wdt = pPrinter->printVolumeMax().x();
     double hgt = pPrinter->printVolumeMax().y();
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         if (i&1) {
             int dx = infillWdt/pPrinter->pPrintVolume.x()*pWidth;
             if (dx<1) dx = 1;
-            for (int x=0; x<pWidth; x+=2*dx) {
-                for (int y=0; y<pHeight; y++) {
-                    bm_hline(pBitmap, x, x+dx, y, 0);
+            gThreadPool.parallelFor(0, pHeight, kMinRowsPerBand, [=](int y0, int y1) {
+                for (int y=y0; y<y1; y++) {
+                    for (int x=0; x<pWidth; x+=2*dx) {
+                        hline(x, x+dx, y, 0);
+                    }
                 }
-            }
+            });
         } else {
             int dy = infillWdt/pPrinter->pPrintVolume.y()*pHeight;
             if (dy<1) dy = 1;
-            for (int y1=0; y1<pHeight; y1+=2*dy) {
-                for (int y2=0; y2<dy; y2++) {
-                    bm_hline(pBitmap, 0, pWidth, y1+y2, 0);
+            gThreadPool.parallelFor(0, pHeight, kMinRowsPerBand, [=](int y0, int y1) {
+                for (int y=y0; y<y1; y++) {
+                    if ((y/dy)&1) continue;
+                    hline(0, pWidth, y, 0);
                 }
-            }
+            });
         }
     } else {
         glDisable(GL_DEPTH_TEST);
@@ -953,40 +1135,35 @@ void IAFramebuffer::overlayLidPattern(int i, double infillWdt)
 void IAFramebuffer::overlayInfillPattern(int i, double infillWdt)
 {
     bindForRendering();
-    if (pBuffers==BITMAP) {
+    if (rendersToBitmap()) {
         infillWdt *= sqrt(2.0); // compensate that we draw at a 45 deg angle
         int dx = infillWdt/pPrinter->pPrintVolume.x()*pWidth;
         if (dx<1) dx = 1;
-        if (dx==10) {
+        if (dx==10 && pBitmap) {
             /// \todo some ultra fast fill function using word sized lookup tables
             // This is a special case for dx=10, just to try the effect
             bm_word m = 0b1111111111000000000011111111110000000000111111111100000000001111;
             bm_word lut[20];
             for (int i=0; i<20; i++) lut[i] = (m>>i) | (m<<(20-i));
-            for (int y=0; y<pHeight; y++) {
-                bm_word *dst = bm_scanline(pBitmap, y);
-                int src = (i&1) ? y%20 : 19-(y%20);
-                for (int x=0; x<pBitmap->dy; x++) {
-                    *dst++ &= lut[src];
-                    src = (src+16)%20;
-                }
-            }
-        } else {
-            if (i&1) {
-                for (int y=0; y<pHeight; y++) {
-                    for (int x=0; x<pWidth; x+=2*dx) {
-                        int xx = x + y%(2*dx);
-                        bm_hline(pBitmap, xx, xx+dx, y, 0);
+            gThreadPool.parallelFor(0, pHeight, kMinRowsPerBand, [&](int y0, int y1) {
+                for (int y=y0; y<y1; y++) {
+                    bm_word *dst = bm_scanline(pBitmap, y);
+                    int src = (i&1) ? y%20 : 19-(y%20);
+                    for (int x=0; x<pBitmap->dy; x++) {
+                        *dst++ &= lut[src];
+                        src = (src+16)%20;
                     }
                 }
-            } else {
-                for (int y=0; y<pHeight; y++) {
+            });
+        } else {
+            gThreadPool.parallelFor(0, pHeight, kMinRowsPerBand, [=](int y0, int y1) {
+                for (int y=y0; y<y1; y++) {
                     for (int x=0; x<pWidth; x+=2*dx) {
-                        int xx = x+2*dx - y%(2*dx);
-                        bm_hline(pBitmap, xx, xx+dx, y, 0);
+                        int xx = (i&1) ? x + y%(2*dx) : x+2*dx - y%(2*dx);
+                        hline(xx, xx+dx, y, 0);
                     }
                 }
-            }
+            });
         }
     } else {
         glDisable(GL_DEPTH_TEST);
@@ -1053,57 +1230,166 @@ void IAFramebuffer::endComplexPolygon(int color)
         if (v->pY > yMax) yMax = v->pY;
     }
     xMax++; yMax++;
+    if (yMin<0) yMin = 0;
+    if (yMax>pHeight) yMax = pHeight;
+
+    if (pBuffers==COVERAGE) {
+        fillComplexPolygonCoverage(yMin, yMax, color);
+        return;
+    }
+
+    // every row is independent, so we can split the work into bands of rows
+    gThreadPool.parallelFor(yMin, yMax, kMinRowsPerBand, [=](int y0, int y1) {
+        int nodes, pixelY, i, j, swap;
+        int *nodeX = (int*)::malloc((end - begin) * sizeof(int));
+
+        //  Loop through the rows of the image.
+        for (pixelY = y0; pixelY < y1; pixelY++) {
+            //  Build a list of nodes.
+            nodes = 0;
+            for (i = begin+1; i < end; i++) {
+                j = i-1;
+                if (pVertex[j].pIsGap)
+                    continue;
+                if (   (pVertex[i].pY < pixelY && pVertex[j].pY >= pixelY)
+                    || (pVertex[j].pY < pixelY && pVertex[i].pY >= pixelY) )
+                {
+                    float dy = pVertex[j].pY - pVertex[i].pY;
+                    if (fabsf(dy)>.0001) {
+                        nodeX[nodes++] = (int)(pVertex[i].pX +
+                                               (pixelY - pVertex[i].pY) / dy
+                                               * (pVertex[j].pX - pVertex[i].pX));
+                    } else {
+                        nodeX[nodes++] = pVertex[i].pX;
+                    }
+                }
+            }
 
-    int nodes, pixelY, i, j, swap;
-	int *nodeX = (int*)::malloc((end - begin) * sizeof(int));
-
-    //  Loop through the rows of the image.
-    for (pixelY = yMin; pixelY < yMax; pixelY++) {
-        //  Build a list of nodes.
-        nodes = 0;
-        for (i = begin+1; i < end; i++) {
-            j = i-1;
-            if (pVertex[j].pIsGap)
-                continue;
-            if (   (pVertex[i].pY < pixelY && pVertex[j].pY >= pixelY)
-                || (pVertex[j].pY < pixelY && pVertex[i].pY >= pixelY) )
-            {
-                float dy = pVertex[j].pY - pVertex[i].pY;
-                if (fabsf(dy)>.0001) {
-                    nodeX[nodes++] = (int)(pVertex[i].pX +
-                                           (pixelY - pVertex[i].pY) / dy
-                                           * (pVertex[j].pX - pVertex[i].pX));
+            //  Sort the nodes, via a simple “Bubble” sort.
+            i = 0;
+            while (i < nodes - 1) {
+                if (nodeX[i] > nodeX[i + 1]) {
+                    swap = nodeX[i];
+                    nodeX[i] = nodeX[i + 1];
+                    nodeX[i + 1] = swap;
+                    if (i) i--;
                 } else {
-                    nodeX[nodes++] = pVertex[i].pX;
+                    i++;
                 }
             }
-        }
-        //Fl_Android_Application::log_e("%d nodes (must be even!)", nodes);
-
-        //  Sort the nodes, via a simple “Bubble” sort.
-        i = 0;
-        while (i < nodes - 1) {
-            if (nodeX[i] > nodeX[i + 1]) {
-                swap = nodeX[i];
-                nodeX[i] = nodeX[i + 1];
-                nodeX[i + 1] = swap;
-                if (i) i--;
-            } else {
-                i++;
+
+            //  Fill the pixels between node pairs.
+            for (i = 0; i < nodes-1; i += 2) {
+                if (nodeX[i] >= xMax) break;
+                if (nodeX[i + 1] > xMin) {
+                    if (nodeX[i] < xMin) nodeX[i] = xMin;
+                    if (nodeX[i + 1] > xMax) nodeX[i + 1] = xMax;
+                    bm_hline(pBitmap, nodeX[i], nodeX[i+1], pixelY, color);
+                }
             }
         }
+        ::free((void*)nodeX);
+    });
+}
 
-        //  Fill the pixels between node pairs.
-        for (i = 0; i < nodes-1; i += 2) {
-            if (nodeX[i] >= xMax) break;
-            if (nodeX[i + 1] > xMin) {
-                if (nodeX[i] < xMin) nodeX[i] = xMin;
-                if (nodeX[i + 1] > xMax) nodeX[i + 1] = xMax;
-                bm_hline(pBitmap, nodeX[i], nodeX[i+1], pixelY, color);
+
+/**
+ * Fill the polygon in the vertex list with anti-aliasing.
+ *
+ * Every pixel row is sampled in four sub-rows. The horizontal coverage in
+ * every sub-row is calculated exactly, which gives a good estimate of the
+ * area of a pixel that is inside the polygon.
+ *
+ * \param yMin, yMax the range of rows that may be touched by the polygon
+ * \param color 1 adds the polygon to the coverage, 0 removes it
+ */
+void IAFramebuffer::fillComplexPolygonCoverage(int yMin, int yMax, int color)
+{
+    const int kSubRows = 4;
+    const float kSubRowWeight = 1.0f/kSubRows;
+    int begin = 0, end = pnVertex;
+
+    gThreadPool.parallelFor(yMin, yMax, kMinRowsPerBand, [=](int y0, int y1) {
+        float *nodeX = (float*)::malloc((end - begin) * sizeof(float));
+        float *acc = (float*)::calloc(pWidth+1, sizeof(float));
+
+        for (int pixelY = y0; pixelY < y1; pixelY++) {
+            int accMin = pWidth, accMax = -1;
+            for (int sub = 0; sub < kSubRows; sub++) {
+                float sy = pixelY + (sub + 0.5f) * kSubRowWeight;
+                //  Build a list of nodes.
+                int nodes = 0;
+                for (int i = begin+1; i < end; i++) {
+                    int j = i-1;
+                    if (pVertex[j].pIsGap)
+                        continue;
+                    const Vertex &vi = pVertex[i], &vj = pVertex[j];
+                    if (   (vi.pY < sy && vj.pY >= sy)
+                        || (vj.pY < sy && vi.pY >= sy) )
+                    {
+                        nodeX[nodes++] = vi.pX + (sy - vi.pY) / (vj.pY - vi.pY) * (vj.pX - vi.pX);
+                    }
+                }
+                std::sort(nodeX, nodeX+nodes);
+
+                //  Accumulate the coverage between node pairs.
+                for (int i = 0; i < nodes-1; i += 2) {
+                    float xa = std::max(0.0f, nodeX[i]);
+                    float xb = std::min((float)pWidth, nodeX[i+1]);
+                    if (xa >= xb) continue;
+                    int ia = (int)xa, ib = (int)xb;
+                    if (ia < accMin) accMin = ia;
+                    if (ib > accMax) accMax = ib;
+                    if (ia == ib) {
+                        acc[ia] += (xb - xa) * kSubRowWeight;
+                    } else {
+                        acc[ia] += (ia + 1 - xa) * kSubRowWeight;
+                        for (int x = ia+1; x < ib; x++)
+                            acc[x] += kSubRowWeight;
+                        acc[ib] += (xb - ib) * kSubRowWeight;
+                    }
+                }
             }
+
+            // combine the polygon with the current coverage
+            if (accMax >= pWidth) accMax = pWidth-1;
+            uint8_t *dst = pCoverage + pixelY*pWidth;
+            for (int x = accMin; x <= accMax; x++) {
+                float a = std::min(1.0f, acc[x]);
+                acc[x] = 0.0f;
+                if (a <= 0.0f) continue;
+                float c = dst[x];
+                if (color)
+                    c = c + a * (255.0f - c);
+                else
+                    c = c * (1.0f - a);
+                dst[x] = (uint8_t)(c + 0.5f);
+            }
+            if (accMax+1 <= pWidth) acc[accMax+1] = 0.0f;
         }
+        ::free((void*)acc);
+        ::free((void*)nodeX);
+    });
+}
+
+
+/**
+ * Set or clear a horizontal line of pixels.
+ *
+ * \param x1, x2 the range of pixels [x1, x2)
+ * \param y the pixel row
+ * \param color 0 or 1
+ */
+void IAFramebuffer::hline(int x1, int x2, int y, int color)
+{
+    if (pCoverage) {
+        if (x1<0) x1 = 0;
+        if (x2>pWidth) x2 = pWidth;
+        if (x1<x2)
+            memset(pCoverage + y*pWidth + x1, color ? 255 : 0, x2-x1);
+    } else {
+        bm_hline(pBitmap, x1, x2, y, color);
     }
-	::free((void*)nodeX);
 }
 
 
@@ -1147,22 +1433,232 @@ void IAFramebuffer::addGap()
 }
 
 
+/**
+ * Clip all rendering above the given z plane.
+ *
+ * \param z everything above this plane will not be rendered
+ */
 void IAFramebuffer::beginClipAboveZ(double z)
 {
-    GLdouble equationUpperHalf[4] = { 0.0, 0.0, -1.0, z };
-    glClipPlane(GL_CLIP_PLANE0, equationUpperHalf);
-    glEnable(GL_CLIP_PLANE0);
+    if (rendersToBitmap()) {
+        pClipMode = 1;
+        pClipZ = z;
+    } else {
+        // the clipping plane is transformed by the current modelview matrix
+        bindForRendering();
+        GLdouble equationUpperHalf[4] = { 0.0, 0.0, -1.0, z };
+        glClipPlane(GL_CLIP_PLANE0, equationUpperHalf);
+        glEnable(GL_CLIP_PLANE0);
+        unbindFromRendering();
+    }
 }
 
+
+/**
+ * Clip all rendering below the given z plane.
+ *
+ * \param z everything below this plane will not be rendered
+ */
 void IAFramebuffer::beginClipBelowZ(double z)
 {
-    GLdouble equationUpperHalf[4] = { 0.0, 0.0, 1.0, -z };
-    glClipPlane(GL_CLIP_PLANE0, equationUpperHalf);
-    glEnable(GL_CLIP_PLANE0);
+    if (rendersToBitmap()) {
+        pClipMode = 2;
+        pClipZ = z;
+    } else {
+        // the clipping plane is transformed by the current modelview matrix
+        bindForRendering();
+        GLdouble equationUpperHalf[4] = { 0.0, 0.0, 1.0, -z };
+        glClipPlane(GL_CLIP_PLANE0, equationUpperHalf);
+        glEnable(GL_CLIP_PLANE0);
+        unbindFromRendering();
+    }
 }
 
+
+/**
+ * Stop clipping.
+ */
 void IAFramebuffer::endClip()
 {
-    glDisable(GL_CLIP_PLANE0);
+    if (rendersToBitmap()) {
+        pClipMode = 0;
+    } else {
+        glDisable(GL_CLIP_PLANE0);
+    }
+}
+
+
+/**
+ * Set all values in the depth buffer.
+ *
+ * \param depth the new depth, 0.0 is the top of the build volume, 1.0 is
+ *        the bottom
+ */
+void IAFramebuffer::clearDepth(double depth)
+{
+    bindForRendering();
+    if (rendersToBitmap()) {
+        if (pDepthBuffer) {
+            for (int i=0, n=pWidth*pHeight; i<n; i++)
+                pDepthBuffer[i] = (float)depth;
+        }
+    } else {
+        glClearDepth(depth);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glClearDepth(1.0);
+    }
+    unbindFromRendering();
+}
+
+
+/**
+ * Set the depth test for all following rendering operations.
+ *
+ * \param func LESS renders the topmost surface, GREATER renders the
+ *        lowest surface
+ */
+void IAFramebuffer::depthFunc(DepthFunc func)
+{
+    pDepthFunc = func;
+    if (!rendersToBitmap()) {
+        glDepthFunc(func==GREATER ? GL_GREATER : GL_LESS);
+    }
 }
 
+
+/**
+ * Render all triangles of a mesh in a single color.
+ *
+ * \param mesh the mesh in local coordinates
+ * \param offset move the mesh by this amount
+ * \param color 0 for black, 1 for white
+ */
+void IAFramebuffer::drawMesh(IAMesh *mesh, const IAVector3d &offset, int color)
+{
+    bindForRendering();
+    if (rendersToBitmap()) {
+        for (auto &t: mesh->triangleList) {
+            fillTriangle(t->vertex(0)->pLocalPosition + offset,
+                         t->vertex(1)->pLocalPosition + offset,
+                         t->vertex(2)->pLocalPosition + offset, color);
+        }
+    } else {
+        float c = color ? 1.0f : 0.0f;
+        glPushMatrix();
+        glTranslated(offset.x(), offset.y(), offset.z());
+        mesh->draw(IAMesh::kMASK, c, c, c);
+        glPopMatrix();
+    }
+    unbindFromRendering();
+}
+
+
+/**
+ * Render all triangles of a mesh in white that face downward by more than
+ * the given angle.
+ *
+ * \param mesh the mesh in global coordinates
+ * \param angle the minimum angle between the face normal and the z axis
+ */
+void IAFramebuffer::drawAngledFaces(IAMesh *mesh, double angle)
+{
+    bindForRendering();
+    if (rendersToBitmap()) {
+        IAVector3d zVec = { 0.0, 0.0, 1.0 };
+        double ref = cos(angle/180.0*M_PI);
+        for (auto &t: mesh->triangleList) {
+            if (t->pNormal.dot(zVec)<ref) {
+                fillTriangle(t->vertex(0)->pGlobalPosition,
+                             t->vertex(1)->pGlobalPosition,
+                             t->vertex(2)->pGlobalPosition, 1);
+            }
+        }
+    } else {
+        mesh->drawAngledFaces(angle);
+    }
+    unbindFromRendering();
+}
+
+
+/**
+ * Render a triangle into the bitmap, using clipping and depth testing.
+ *
+ * Pixels are set if their center is inside the triangle. The depth is
+ * calculated in the same range as the OpenGL version with the projection
+ * set in bindForRendering().
+ *
+ * \param a, b, c the corners of the triangle in world coordinates
+ * \param color 0 for black, 1 for white
+ */
+void IAFramebuffer::fillTriangle(IAVector3d a, IAVector3d b, IAVector3d c, int color)
+{
+    IAVector3d vMin = pPrinter->printVolumeMin();
+    IAVector3d vMax = pPrinter->printVolumeMax();
+    double sx = pWidth/(vMax.x()-vMin.x());
+    double sy = pHeight/(vMax.y()-vMin.y());
+    double vz = pPrinter->pPrintVolume.z();
+
+    // convert x and y into pixel coordinates, z remains in world coordinates
+    IAVector3d *v[3] = { &a, &b, &c };
+    for (auto p: v) {
+        p->set((p->x()-vMin.x())*sx, (p->y()-vMin.y())*sy, p->z());
+    }
+
+    // make sure that the triangle is counter-clockwise
+    double area = (b.x()-a.x())*(c.y()-a.y()) - (c.x()-a.x())*(b.y()-a.y());
+    if (fabs(area)<1e-9) return; // triangles that stand vertically are not rendered
+    if (area<0.0) {
+        IAVector3d t = b; b = c; c = t;
+        area = -area;
+    }
+
+    // z is a plane across the triangle
+    double dzdx = ((b.z()-a.z())*(c.y()-a.y()) - (c.z()-a.z())*(b.y()-a.y())) / area;
+    double dzdy = ((c.z()-a.z())*(b.x()-a.x()) - (b.z()-a.z())*(c.x()-a.x())) / area;
+
+    double yMinF = std::min(a.y(), std::min(b.y(), c.y()));
+    double yMaxF = std::max(a.y(), std::max(b.y(), c.y()));
+    int y0 = std::max(0, (int)ceil(yMinF-0.5));
+    int y1 = std::min(pHeight-1, (int)ceil(yMaxF-0.5)-1);
+
+    bool simple = (pDepthBuffer==nullptr && pClipMode==0);
+    for (int y=y0; y<=y1; y++) {
+        double yc = y + 0.5;
+        // intersect the pixel row with all three edges
+        double xl = -1e9, xr = 1e9;
+        for (int i=0; i<3; i++) {
+            IAVector3d &p = *v[i], &q = *v[(i+1)%3];
+            double dy = q.y()-p.y();
+            double k = (q.x()-p.x())*(yc-p.y()) + dy*p.x();
+            if (dy>0.0) {
+                xr = std::min(xr, k/dy);
+            } else if (dy<0.0) {
+                xl = std::max(xl, k/dy);
+            } else if (k<0.0) {
+                xr = xl; // row is on the outside of a horizontal edge
+            }
+        }
+        int x0 = std::max(0, (int)ceil(xl-0.5));
+        int x1 = std::min(pWidth, (int)ceil(xr-0.5));
+        if (x0>=x1) continue;
+        if (simple) {
+            bm_hline(pBitmap, x0, x1, y, color);
+            continue;
+        }
+        float *depth = pDepthBuffer ? pDepthBuffer + y*pWidth : nullptr;
+        for (int x=x0; x<x1; x++) {
+            double z = a.z() + dzdx*(x+0.5-a.x()) + dzdy*(yc-a.y());
+            if (pClipMode==1 && z>pClipZ) continue;
+            if (pClipMode==2 && z<pClipZ) continue;
+            if (depth) {
+                // same mapping as glOrtho(..., -vz-1, 1) in bindForRendering()
+                float d = (float)((vz+1.0-z)/(vz+2.0));
+                if (pDepthFunc==LESS ? (d>=depth[x]) : (d<=depth[x])) continue;
+                depth[x] = d;
+            }
+            if (color) BM_USET(pBitmap, x, y); else BM_UCLR(pBitmap, x, y);
+        }
+    }
+}
+
+
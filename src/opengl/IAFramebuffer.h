@@ -29,6 +29,8 @@ extern const char *glIAErrorString(int err);
 
 class IAToolpath;
 class IAPrinter;
+class IAMesh;
+class IAOutputSink;
 
 
 /**
@@ -61,9 +63,15 @@ extern bool initializeOpenGL();
  * By repeatedly vectorizing and shrinking the image in the framebuffer, GCode
  * for the outer shell is generated. The remaining graphics in the image can
  * be used to overlay a vectorized fill pattern.
+ *
+ * COVERAGE buffers store how much of every pixel is covered by polygons,
+ * using one byte per pixel. Their outline is traced at sub-pixel accuracy
+ * by IAContourTracer, so a smaller COVERAGE buffer can replace a large
+ * BITMAP buffer.
  */
 class IAFramebuffer
 {
+    friend class IAFramebufferPool;
 public:
     typedef unsigned long bm_word;
 
@@ -74,10 +82,32 @@ public:
         NONE = 0,
         RGBA,
         RGBAZ,
-        BITMAP
+        BITMAP,
+        COVERAGE
     } Buffers;
 
-    IAFramebuffer(IAPrinter*, Buffers type);
+    /**
+     * Depth test functions when rendering into RGBAZ buffers.
+     */
+    typedef enum {
+        LESS = 0,
+        GREATER
+    } DepthFunc;
+
+    /**
+     * How outlines are traced into toolpaths.
+     *
+     * POTRACE fits smooth curves to the outline. MARCHING_SQUARES is much
+     * faster and simplifies the outline within a given tolerance. COVERAGE
+     * buffers are always traced with marching squares.
+     */
+    typedef enum {
+        POTRACE = 0,
+        MARCHING_SQUARES
+    } TraceMethod;
+
+    IAFramebuffer(IAPrinter*, Buffers type,
+                  int width=kFramebufferSize, int height=kFramebufferSize);
     IAFramebuffer(IAFramebuffer*);
     ~IAFramebuffer();
     void fill(int color);
@@ -88,9 +118,12 @@ public:
     void draw(double z);
     uint8_t *getRawImageRGB();
     uint8_t *getRawImageRGBA();
-    int traceOutline(IAToolpathList *toolpathList, double z);
+    int traceOutline(IAToolpathList *toolpathList, double z,
+                     TraceMethod method=POTRACE, double tolerance=0.0);
     int saveAsJpeg(const char *filename, GLubyte *imgdata=nullptr);
+    int saveAsJpeg(IAOutputSink &sink, GLubyte *imgdata=nullptr);
     int saveAsPng(const char *filename, int components, GLubyte *imgdata=nullptr);
+    int saveAsPng(IAOutputSink &sink, int components, GLubyte *imgdata=nullptr);
 
     /** Width in pixels.
      \return the width of the buffer. */
@@ -103,14 +136,23 @@ public:
     /** Buffer type */
     Buffers buffers() { return pBuffers; }
 
+    size_t memorySize();
+
+    /** Return true if all rendering goes into a bitmap in user memory. */
+    bool rendersToBitmap() {
+        return pBuffers==BITMAP || pBuffers==COVERAGE || pSoftwareRendering;
+    }
+
     void logicAndNot(IAFramebuffer*);
     void logicAnd(IAFramebuffer*);
 
     void subtract(IAToolpathListSP, double r);
     void add(IAToolpathListSP, double r);
-    IAToolpathListSP toolpathFromLassoAndContract(double z, double r);
-    IAToolpathListSP toolpathFromLassoAndExpand(double z, double r);
-    IAToolpathListSP toolpathFromLasso(double z);
+    IAToolpathListSP toolpathFromLassoAndContract(double z, double r,
+                                                  TraceMethod method=POTRACE, double tolerance=0.0);
+    IAToolpathListSP toolpathFromLassoAndExpand(double z, double r,
+                                                TraceMethod method=POTRACE, double tolerance=0.0);
+    IAToolpathListSP toolpathFromLasso(double z, TraceMethod method=POTRACE, double tolerance=0.0);
 
     void overlayLidPattern(int i, double w);
     void overlayInfillPattern(int i, double w);
@@ -127,13 +169,24 @@ public:
     void beginClipBelowZ(double z);
     void endClip();
 
+    void clearDepth(double depth);
+    void depthFunc(DepthFunc func);
+    void drawMesh(IAMesh *mesh, const IAVector3d &offset, int color);
+    void drawAngledFaces(IAMesh *mesh, double angle);
+
+    /** Render RGBA and RGBAZ buffers on the CPU instead of using OpenGL. */
+    static bool pSoftwareRendering;
+
 protected:
     bool hasFBO();
     void activateFBO();
-    void createFBO();
+    void createFBO(bool clear=true);
     void deleteFBO();
 
     void addPointRaw(float x, float y, bool gap=false);
+    void hline(int x1, int x2, int y, int color);
+    void fillComplexPolygonCoverage(int yMin, int yMax, int color);
+    void fillTriangle(IAVector3d a, IAVector3d b, IAVector3d c, int color);
 
     class Vertex {
     public:
@@ -170,8 +223,23 @@ protected:
     /** Use this to retrieve the build volume when rendering. */
     IAPrinter *pPrinter = nullptr;
 
+    /** Depth values of an RGBAZ buffer when rendering in software */
+    float *pDepthBuffer = nullptr;
+
+    /** Current depth test when rendering in software */
+    DepthFunc pDepthFunc = LESS;
+
+    /** Software clipping: 0 = off, 1 = clip above pClipZ, 2 = clip below */
+    int pClipMode = 0;
+
+    /** Software clipping plane */
+    double pClipZ = 0.0;
+
 public:
     potrace_bitmap_t *pBitmap = nullptr;
+
+    /** Pixel coverage of a COVERAGE buffer, 0 is empty, 255 is fully covered */
+    uint8_t *pCoverage = nullptr;
 };
 
 
@@ -0,0 +1,150 @@
+//
+//  IAFramebufferPool.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAFramebufferPool.h"
+
+#include "potrace/bitmap.h"
+
+#ifdef __LINUX__
+#include <GL/glext.h>
+#endif
+
+#ifdef _WIN32
+#include <GL/glext.h>
+// these are found at runtime in IAFramebuffer.cpp
+extern PFNGLDELETEFRAMEBUFFERSEXTPROC glDeleteFramebuffersEXT;
+extern PFNGLBINDFRAMEBUFFEREXTPROC glBindFramebufferEXT;
+extern PFNGLDELETERENDERBUFFERSEXTPROC glDeleteRenderbuffersEXT;
+#endif
+
+
+std::mutex IAFramebufferPool::pMutex;
+std::vector<IAFramebufferPool::Entry> IAFramebufferPool::pEntryList;
+
+
+/**
+ * Give the framebuffer the resources of a previously released framebuffer.
+ *
+ * \param fb a framebuffer without resources; type and size must be set
+ *
+ * \return true if matching resources were found and moved into fb
+ * \return false if the caller must create new resources
+ */
+bool IAFramebufferPool::acquire(IAFramebuffer *fb)
+{
+    std::lock_guard<std::mutex> lock(pMutex);
+    bool software = fb->rendersToBitmap();
+    for (auto it = pEntryList.begin(); it!=pEntryList.end(); ++it) {
+        Entry &e = *it;
+        if (   e.pBuffers==fb->pBuffers && e.pSoftware==software
+            && e.pWidth==fb->pWidth && e.pHeight==fb->pHeight)
+        {
+            fb->pBitmap = e.pBitmap;
+            fb->pDepthBuffer = e.pDepthBuffer;
+            fb->pCoverage = e.pCoverage;
+            fb->pFramebuffer = e.pFramebuffer;
+            fb->pColorbuffer = e.pColorbuffer;
+            fb->pDepthbuffer = e.pDepthbuffer;
+            pEntryList.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Take all resources from a framebuffer and keep them for later use.
+ *
+ * If there are already enough buffers of the same kind in the pool, the
+ * resources are freed instead.
+ *
+ * \param fb a framebuffer with resources; the framebuffer will have no
+ *        resources when this call returns
+ */
+void IAFramebufferPool::release(IAFramebuffer *fb)
+{
+    Entry e;
+    e.pBuffers = fb->pBuffers;
+    e.pSoftware = fb->rendersToBitmap();
+    e.pWidth = fb->pWidth;
+    e.pHeight = fb->pHeight;
+    e.pBitmap = fb->pBitmap;
+    e.pDepthBuffer = fb->pDepthBuffer;
+    e.pCoverage = fb->pCoverage;
+    e.pFramebuffer = fb->pFramebuffer;
+    e.pColorbuffer = fb->pColorbuffer;
+    e.pDepthbuffer = fb->pDepthbuffer;
+    fb->pBitmap = nullptr;
+    fb->pDepthBuffer = nullptr;
+    fb->pCoverage = nullptr;
+    fb->pFramebuffer = fb->pColorbuffer = fb->pDepthbuffer = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        int n = 0;
+        for (auto &p: pEntryList) {
+            if (   p.pBuffers==e.pBuffers && p.pSoftware==e.pSoftware
+                && p.pWidth==e.pWidth && p.pHeight==e.pHeight)
+                n++;
+        }
+        if (n<kMaxEntriesPerKind) {
+            pEntryList.push_back(e);
+            return;
+        }
+    }
+    e.destroy();
+}
+
+
+/**
+ * Free all resources in the pool.
+ *
+ * OpenGL objects are deleted, so the OpenGL context that was used to create
+ * them must be current.
+ */
+void IAFramebufferPool::purge()
+{
+    std::lock_guard<std::mutex> lock(pMutex);
+    for (auto &e: pEntryList)
+        e.destroy();
+    pEntryList.clear();
+}
+
+
+/**
+ * Free the bitmaps or delete the OpenGL objects of an entry.
+ */
+void IAFramebufferPool::Entry::destroy()
+{
+    if (pSoftware) {
+        bm_free(pBitmap);
+        pBitmap = nullptr;
+        ::free((void*)pDepthBuffer);
+        pDepthBuffer = nullptr;
+        ::free((void*)pCoverage);
+        pCoverage = nullptr;
+    } else {
+        //Bind 0, which means render to back buffer, as a result, fb is unbound
+        IA_HANDLE_GL_ERRORS();
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+        IA_HANDLE_GL_ERRORS();
+        //Delete resources
+        if (pColorbuffer)
+            glDeleteTextures(1, &pColorbuffer);
+        IA_HANDLE_GL_ERRORS();
+        if (pDepthbuffer)
+            glDeleteRenderbuffersEXT(1, &pDepthbuffer);
+        IA_HANDLE_GL_ERRORS();
+        if (pFramebuffer)
+            glDeleteFramebuffersEXT(1, &pFramebuffer);
+        IA_HANDLE_GL_ERRORS();
+        pFramebuffer = pColorbuffer = pDepthbuffer = 0;
+    }
+}
+
+
@@ -0,0 +1,64 @@
+//
+//  IAFramebufferPool.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_FRAMEBUFFER_POOL_H
+#define IA_FRAMEBUFFER_POOL_H
+
+
+#include "opengl/IAFramebuffer.h"
+
+#include <mutex>
+#include <vector>
+
+
+/**
+ * Recycle the memory and OpenGL objects of framebuffers.
+ *
+ * Slicing creates and destroys several framebuffers for every layer. Instead
+ * of allocating bitmaps and creating OpenGL framebuffer objects every time,
+ * IAFramebuffer returns its buffers to this pool when it is deleted, and
+ * takes them from the pool when it needs buffers again.
+ *
+ * Buffers are matched by type and size. Only a few buffers of every kind are
+ * kept, so that the pool does not grow with the number of layers.
+ *
+ * Buffers in the pool contain undefined data. IAFramebuffer clears them after
+ * acquiring them.
+ */
+class IAFramebufferPool
+{
+public:
+    static bool acquire(IAFramebuffer *fb);
+    static void release(IAFramebuffer *fb);
+    static void purge();
+
+private:
+    /**
+     * The resources of a single framebuffer.
+     */
+    class Entry {
+    public:
+        void destroy();
+        IAFramebuffer::Buffers pBuffers = IAFramebuffer::NONE;
+        bool pSoftware = false;
+        int pWidth = 0, pHeight = 0;
+        potrace_bitmap_t *pBitmap = nullptr;
+        float *pDepthBuffer = nullptr;
+        uint8_t *pCoverage = nullptr;
+        GLuint pFramebuffer = 0, pColorbuffer = 0, pDepthbuffer = 0;
+    };
+
+    /// keep at most this many buffers of the same type and size
+    static const int kMaxEntriesPerKind = 4;
+
+    static std::mutex pMutex;
+    static std::vector<Entry> pEntryList;
+};
+
+
+#endif /* IA_FRAMEBUFFER_POOL_H */
+
+
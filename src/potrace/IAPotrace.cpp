@@ -10,6 +10,7 @@
 #include "toolpath/IAToolpath.h"
 #include "opengl/IAFramebuffer.h"
 #include "printer/IAPrinter.h"
+#include "app/IAThreadPool.h"
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -77,12 +78,75 @@ void bezier(IAToolpath *toolpath,
             double x4, double y4);
 
 
+/** Paths are fitted in bands of at least this many paths. */
+static const int kMinPathsPerBand = 4;
+
+/**
+ * Let potrace fit its paths on our thread pool.
+ */
+static void potraceParallelFor(int n, void (*func)(void *data, int begin, int end), void *data)
+{
+    gThreadPool.parallelFor(0, n, kMinPathsPerBand, [func, data](int begin, int end) {
+        func(data, begin, end);
+    });
+}
+
+// install the hook before main() runs, so that it is never changed while tracing
+static const bool gPotraceIsParallel = (potrace_parallel_for = potraceParallelFor, true);
+
+
+/**
+ * Create a read-only view of the part of a bitmap that contains set pixels.
+ *
+ * The view shares the pixel data with the original bitmap and must not be
+ * freed with bm_free(). The left edge of the view is aligned to a bitmap
+ * word, so that every scanline of the view starts at a word boundary.
+ *
+ * \param bm the original bitmap
+ * \param view fill this bitmap header with the cropped view
+ * \param xOff, yOff position of the view in the original bitmap
+ *
+ * \return false, if the bitmap is empty
+ */
+static bool cropBitmap(const potrace_bitmap_t *bm, potrace_bitmap_t *view, int &xOff, int &yOff)
+{
+    int nWords = (bm->w + BM_WORDBITS - 1) / BM_WORDBITS;
+    int yMin = bm->h, yMax = -1, wMin = nWords, wMax = -1;
+    for (int y=0; y<bm->h; y++) {
+        potrace_word *line = bm_scanline(bm, y);
+        for (int i=0; i<nWords; i++) {
+            if (line[i]) {
+                if (i<wMin) wMin = i;
+                if (i>wMax) wMax = i;
+                if (y<yMin) yMin = y;
+                yMax = y;
+            }
+        }
+    }
+    if (yMax==-1)
+        return false;
+    xOff = wMin * BM_WORDBITS;
+    yOff = yMin;
+    view->w = (wMax + 1) * BM_WORDBITS - xOff;
+    if (xOff + view->w > bm->w)
+        view->w = bm->w - xOff;
+    view->h = yMax - yMin + 1;
+    view->dy = bm->dy;
+    view->map = bm_scanline(bm, yMin) + wMin;
+    return true;
+}
+
+
 /**
  * Trace the given framebuffer and store the result as a toolpath at layer z.
  *
  * \todo It may be useful to choose a component, r, g, b, or a, and a threshold
- * \todo Conversion to bitmap is expensive. Can't we rewrite that to use bytes?
- * \todo Not handling holes, not handling hierarchies of loops
+ * \todo Conversion of OpenGL buffers to bitmap is expensive. Can't we rewrite
+ *       that to use bytes?
+ * Every outline starts a new island, and the holes inside that outline
+ * follow it as part of the same island. Potrace lists islands inside of
+ * holes as new islands after their surrounding island.
+ *
  * \todo don't render noise specs
  *       http://potrace.sourceforge.net/potracelib.pdf
  */
@@ -96,16 +160,20 @@ int potrace(IAFramebuffer *framebuffer, IAToolpathList *toolpath, double z)
     double yScl = printbed.y()/height;
 
     int x, y, i;
-    potrace_bitmap_t *bm;
+    potrace_bitmap_t *bm = nullptr, view;
+    int xOff = 0, yOff = 0;
     potrace_param_t *param;
     potrace_path_t *p;
     potrace_state_t *st;
     int n, *tag;
     potrace_dpoint_t (*c)[3];
 
-    /* create a bitmap */
+    /* Potrace never writes to the bitmap that we give it, so bitmaps are
+       traced in place. Only the occupied part is handed to potrace, so that
+       it copies and scans as little as possible. */
     if (framebuffer->pBitmap) {
-        bm = bm_dup(framebuffer->pBitmap);
+        if (!cropBitmap(framebuffer->pBitmap, &view, xOff, yOff))
+            return 0;
     } else {
         const uint8_t *px = framebuffer->getRawImageRGB();
         bm = bm_new(width, height);
@@ -123,13 +191,14 @@ int potrace(IAFramebuffer *framebuffer, IAToolpathList *toolpath, double z)
             }
         }
         ::free((void*)px);
+        view = *bm;
     }
 
     /* set tracing parameters, starting from defaults */
     param = potrace_param_default();
     if (!param) {
         fprintf(stderr, "Error allocating parameters: %s\n", strerror(errno));
-        bm_free(bm);
+        if (bm) bm_free(bm);
         return 1;
     }
 
@@ -154,20 +223,39 @@ int potrace(IAFramebuffer *framebuffer, IAToolpathList *toolpath, double z)
     /* trace the bitmap */
 //    bm->w = width/2;
 //    bm->map +=32;
-    st = potrace_trace(param, bm);
+    st = potrace_trace(param, &view);
 //    bm->w = width;
 //    bm->map -=32;
+    if (bm) bm_free(bm);
 
     if (!st || st->status != POTRACE_STATUS_OK) {
         fprintf(stderr, "Error tracing bitmap: %s\n", strerror(errno));
+        if (st) potrace_state_free(st);
+        potrace_param_free(param);
         return 1;
     }
-    bm_free(bm);
+
+    /* move the curves of a cropped bitmap back into place */
+    if (xOff || yOff) {
+        for (p = st->plist; p; p = p->next) {
+            for (i=0; i<p->curve.n; i++) {
+                for (int k=0; k<3; k++) {
+                    p->curve.c[i][k].x += xOff;
+                    p->curve.c[i][k].y += yOff;
+                }
+            }
+        }
+    }
 
     IAToolpathLoop *toolpathLoop = nullptr;
+    int island = toolpath->numIslands() - 1;
     /* draw each curve */
     p = st->plist;
     while (p != NULL) {
+        /* potrace lists every positive path followed by its negative
+           children, so a positive path starts a new island */
+        if (p->sign == '+')
+            island++;
         n = p->curve.n;
         tag = p->curve.tag;
         c = p->curve.c;
@@ -202,15 +290,11 @@ int potrace(IAFramebuffer *framebuffer, IAToolpathList *toolpath, double z)
                     printf("potrace: unknown tag %d\n", tag[i]);
             }
         }
-        /* at the end of a group of a positive path and its negative
-         children, fill. */
-        //if (p->next == NULL || p->next->sign == '+') {
-            // NULL-> close path and quit layer?
-            // + -> rapid move to next shape
-            toolpathLoop->closePath();
-            toolpath->add(toolpathLoop, 0, 0, 0);
-            toolpathLoop = nullptr;
-        //}
+        toolpathLoop->closePath();
+        toolpathLoop->pIsland = island;
+        toolpathLoop->pIsHole = (p->sign == '-');
+        toolpath->add(toolpathLoop, 0, 0, 0);
+        toolpathLoop = nullptr;
         p = p->next;
     }
 
@@ -226,6 +226,11 @@ static inline int bm_resize(potrace_bitmap_t *bm, int h) {
 }
 
 
+/* copy the contents of a bitmap into another bitmap of the same size. */
+static inline void bm_copy(potrace_bitmap_t *dst, const potrace_bitmap_t *src) {
+  memcpy(bm_base(dst), bm_base(src), bm_size(src));
+}
+
 static inline void bm_hline(potrace_bitmap_t *bm, int x1, int x2, int y, int color)
 {
     /** \bug this can be optimized a lot! */
@@ -423,31 +423,48 @@ static void pathlist_to_tree(path_t *plist, potrace_bitmap_t *bm) {
   return;
 }
 
+/* return the number of pixels before the first set pixel in a word.
+   The word must not be 0. */
+static inline int word_leading_zeros(potrace_word w) {
+#if defined(__GNUC__)
+  return __builtin_clzl(w);
+#else
+  int n = 0;
+  while (!(w & BM_HIBIT)) {
+    w <<= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
 /* find the next set pixel in a row <= y. Pixels are searched first
    left-to-right, then top-down. In other words, (x,y)<(x',y') if y>y'
    or y=y' and x<x'. If found, return 0 and store pixel in
    (*xp,*yp). Else return 1. Note that this function assumes that
-   excess bytes have been cleared with bm_clearexcess. */
+   excess bytes have been cleared with bm_clearexcess. Words that are
+   0 are skipped, and the first set pixel in a word is found by
+   counting leading zeros instead of testing every pixel. */
 static int findnext(potrace_bitmap_t *bm, int *xp, int *yp) {
-  int x;
   int y;
-  int x0;
+  int i;
+  int i0;
+  int n = (bm->w + BM_WORDBITS - 1) / BM_WORDBITS;
+  potrace_word *line;
 
-  x0 = (*xp) & ~(BM_WORDBITS-1);
+  i0 = (*xp) / BM_WORDBITS;
 
   for (y=*yp; y>=0; y--) {
-    for (x=x0; x<bm->w && x>=0; x+=(unsigned)BM_WORDBITS) {
-      if (*bm_index(bm, x, y)) {
-	while (!BM_GET(bm, x, y)) {
-	  x++;
-	}
+    line = bm_scanline(bm, y);
+    for (i=i0; i<n; i++) {
+      if (line[i]) {
 	/* found */
-	*xp = x;
+	*xp = i * BM_WORDBITS + word_leading_zeros(line[i]);
 	*yp = y;
 	return 0;
       }
     }
-    x0 = 0;
+    i0 = 0;
   }
   /* not found */
   return 1;
@@ -132,6 +132,13 @@ void potrace_state_free(potrace_state_t *st);
    of potracelib */
 const char *potrace_version(void);
 
+/* Optional hook to fit paths in parallel. If set, it must call
+   func(data, begin, end) for bands that cover the range [0, n) exactly
+   once, possibly from several threads, and return when all bands are
+   done. If NULL, all paths are fitted in the calling thread. */
+typedef void (*potrace_parallel_for_t)(int n, void (*func)(void *data, int begin, int end), void *data);
+extern potrace_parallel_for_t potrace_parallel_for;
+
 #ifdef  __cplusplus
 } /* end of extern "C" */
 #endif
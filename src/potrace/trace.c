@@ -28,6 +28,54 @@
 #define SAFE_CALLOC(var, n, typ) \
   if ((var = (typ *)calloc(n, sizeof(typ))) == NULL) goto calloc_error 
 
+/* ---------------------------------------------------------------------- */
+/* scratch buffers */
+
+/* Temporary arrays are taken from a scratch buffer instead of being
+   allocated and freed for every path. Every thread that fits paths
+   has its own scratch buffer. The stages of a path run one after the
+   other, so they can share the same slots. */
+
+#define SCRATCH_SLOTS 8
+
+struct scratch_s {
+  void *buf[SCRATCH_SLOTS];
+  size_t size[SCRATCH_SLOTS];
+};
+typedef struct scratch_s scratch_t;
+
+/* return n zeroed bytes in the given slot, growing the slot if needed.
+   Return NULL with errno set on error. */
+static void *scratch_get(scratch_t *sc, int slot, size_t n) {
+  if (n == 0) {
+    n = 1;
+  }
+  if (sc->size[slot] < n) {
+    void *buf = realloc(sc->buf[slot], n);
+    if (!buf) {
+      return NULL;
+    }
+    sc->buf[slot] = buf;
+    sc->size[slot] = n;
+  }
+  memset(sc->buf[slot], 0, n);
+  return sc->buf[slot];
+}
+
+/* free all buffers in a scratch area */
+static void scratch_free(scratch_t *sc) {
+  int i;
+
+  for (i=0; i<SCRATCH_SLOTS; i++) {
+    free(sc->buf[i]);
+    sc->buf[i] = NULL;
+    sc->size[i] = 0;
+  }
+}
+
+#define SCRATCH_CALLOC(var, slot, n, typ) \
+  if ((var = (typ *)scratch_get(sc, slot, (size_t)(n) * sizeof(typ))) == NULL) goto calloc_error
+
 /* ---------------------------------------------------------------------- */
 /* auxiliary functions */
 
@@ -322,7 +370,7 @@ static int calc_sums(privpath_t *pp) {
    substantial. */
 
 /* returns 0 on success, 1 on error with errno set */
-static int calc_lon(privpath_t *pp) {
+static int calc_lon(privpath_t *pp, scratch_t *sc) {
   point_t *pt = pp->pt;
   int n = pp->len;
   int i, j, k, k1;
@@ -335,8 +383,8 @@ static int calc_lon(privpath_t *pp) {
   point_t dk;  /* direction of k-k1 */
   int a, b, c, d;
 
-  SAFE_CALLOC(pivk, n, int);
-  SAFE_CALLOC(nc, n, int);
+  SCRATCH_CALLOC(pivk, 0, n, int);
+  SCRATCH_CALLOC(nc, 1, n, int);
 
   /* initialize the nc data structure. Point from each point to the
      furthest future point to which it is connected by a vertical or
@@ -458,13 +506,9 @@ static int calc_lon(privpath_t *pp) {
     pp->lon[i] = j;
   }
 
-  free(pivk);
-  free(nc);
   return 0;
 
  calloc_error:
-  free(pivk);
-  free(nc);
   return 1;
 }
 
@@ -527,7 +571,7 @@ static double penalty3(privpath_t *pp, int i, int j) {
 /* find the optimal polygon. Fill in the m and po components. Return 1
    on failure with errno set, else 0. Non-cyclic version: assumes i=0
    is in the polygon. Fixme: implement cyclic version. */
-static int bestpolygon(privpath_t *pp)
+static int bestpolygon(privpath_t *pp, scratch_t *sc)
 {
   int i, j, m, k;     
   int n = pp->len;
@@ -541,12 +585,12 @@ static int bestpolygon(privpath_t *pp)
   double best;
   int c;
 
-  SAFE_CALLOC(pen, n+1, double);
-  SAFE_CALLOC(prev, n+1, int);
-  SAFE_CALLOC(clip0, n, int);
-  SAFE_CALLOC(clip1, n+1, int);
-  SAFE_CALLOC(seg0, n+1, int);
-  SAFE_CALLOC(seg1, n+1, int);
+  SCRATCH_CALLOC(pen, 0, n+1, double);
+  SCRATCH_CALLOC(prev, 1, n+1, int);
+  SCRATCH_CALLOC(clip0, 2, n, int);
+  SCRATCH_CALLOC(clip1, 3, n+1, int);
+  SCRATCH_CALLOC(seg0, 4, n+1, int);
+  SCRATCH_CALLOC(seg1, 5, n+1, int);
 
   /* calculate clipped paths */
   for (i=0; i<n; i++) {
@@ -616,21 +660,9 @@ static int bestpolygon(privpath_t *pp)
     pp->po[j] = i;
   }
 
-  free(pen);
-  free(prev);
-  free(clip0);
-  free(clip1);
-  free(seg0);
-  free(seg1);
   return 0;
   
  calloc_error:
-  free(pen);
-  free(prev);
-  free(clip0);
-  free(clip1);
-  free(seg0);
-  free(seg1);
   return 1;
 }
 
@@ -642,7 +674,7 @@ static int bestpolygon(privpath_t *pp)
    if it lies outside. Return 1 with errno set on error; 0 on
    success. */
 
-static int adjust_vertices(privpath_t *pp) {
+static int adjust_vertices(privpath_t *pp, scratch_t *sc) {
   int m = pp->m;
   int *po = pp->po;
   int n = pp->len;
@@ -659,9 +691,9 @@ static int adjust_vertices(privpath_t *pp) {
   dpoint_t s;
   int r;
 
-  SAFE_CALLOC(ctr, m, dpoint_t);
-  SAFE_CALLOC(dir, m, dpoint_t);
-  SAFE_CALLOC(q, m, quadform_t);
+  SCRATCH_CALLOC(ctr, 0, m, dpoint_t);
+  SCRATCH_CALLOC(dir, 1, m, dpoint_t);
+  SCRATCH_CALLOC(q, 2, m, quadform_t);
 
   r = privcurve_init(&pp->curve, m);
   if (r) {
@@ -826,15 +858,9 @@ static int adjust_vertices(privpath_t *pp) {
     continue;
   }
 
-  free(ctr);
-  free(dir);
-  free(q);
   return 0;
 
  calloc_error:
-  free(ctr);
-  free(dir);
-  free(q);
   return 1;
 }
 
@@ -1060,7 +1086,7 @@ static int opti_penalty(privpath_t *pp, int i, int j, opti_t *res, double opttol
 /* optimize the path p, replacing sequences of Bezier segments by a
    single segment when possible. Return 0 on success, 1 with errno set
    on failure. */
-static int opticurve(privpath_t *pp, double opttolerance) {
+static int opticurve(privpath_t *pp, double opttolerance, scratch_t *sc) {
   int m = pp->curve.n;
   int *pt = NULL;     /* pt[m+1] */
   double *pen = NULL; /* pen[m+1] */
@@ -1079,12 +1105,12 @@ static int opticurve(privpath_t *pp, double opttolerance) {
   int *convc = NULL; /* conv[m]: pre-computed convexities */
   double *areac = NULL; /* cumarea[m+1]: cache for fast area computation */
 
-  SAFE_CALLOC(pt, m+1, int);
-  SAFE_CALLOC(pen, m+1, double);
-  SAFE_CALLOC(len, m+1, int);
-  SAFE_CALLOC(opt, m+1, opti_t);
-  SAFE_CALLOC(convc, m, int);
-  SAFE_CALLOC(areac, m+1, double);
+  SCRATCH_CALLOC(pt, 0, m+1, int);
+  SCRATCH_CALLOC(pen, 1, m+1, double);
+  SCRATCH_CALLOC(len, 2, m+1, int);
+  SCRATCH_CALLOC(opt, 3, m+1, opti_t);
+  SCRATCH_CALLOC(convc, 4, m, int);
+  SCRATCH_CALLOC(areac, 5, m+1, double);
 
   /* pre-calculate convexity: +1 = right turn, -1 = left turn, 0 = corner */
   for (i=0; i<m; i++) {
@@ -1140,8 +1166,8 @@ static int opticurve(privpath_t *pp, double opttolerance) {
   if (r) {
     goto calloc_error;
   }
-  SAFE_CALLOC(s, om, double);
-  SAFE_CALLOC(t, om, double);
+  SCRATCH_CALLOC(s, 6, om, double);
+  SCRATCH_CALLOC(t, 7, om, double);
 
   j = m;
   for (i=om-1; i>=0; i--) {
@@ -1176,25 +1202,9 @@ static int opticurve(privpath_t *pp, double opttolerance) {
   }
   pp->ocurve.alphacurve = 1;
 
-  free(pt);
-  free(pen);
-  free(len);
-  free(opt);
-  free(s);
-  free(t);
-  free(convc);
-  free(areac);
   return 0;
 
  calloc_error:
-  free(pt);
-  free(pen);
-  free(len);
-  free(opt);
-  free(s);
-  free(t);
-  free(convc);
-  free(areac);
   return 1;
 }
 
@@ -1202,48 +1212,125 @@ static int opticurve(privpath_t *pp, double opttolerance) {
 
 #define TRY(x) if (x) goto try_error
 
-/* return 0 on success, 1 on error with errno set. */
+potrace_parallel_for_t potrace_parallel_for = NULL;
+
+/* number of batches in which paths are fitted when progress is reported */
+#define PROGRESS_BATCHES 16
+
+/* the paths of a single trace, fitted by process_band() */
+struct pathjob_s {
+  path_t **paths;                /* all paths, in list order */
+  char *failed;                  /* failed[i] is set if path i failed */
+  int offset;                    /* index of the first path of the current batch */
+  const potrace_param_t *param;
+};
+typedef struct pathjob_s pathjob_t;
+
+/* fit a single path. Return 0 on success, 1 on error with errno set. */
+static int process_one_path(path_t *p, const potrace_param_t *param, scratch_t *sc) {
+  TRY(calc_sums(p->priv));
+  TRY(calc_lon(p->priv, sc));
+  TRY(bestpolygon(p->priv, sc));
+  TRY(adjust_vertices(p->priv, sc));
+  if (p->sign == '-') {   /* reverse orientation of negative paths */
+    reverse(&p->priv->curve);
+  }
+  smooth(&p->priv->curve, param->alphamax);
+  if (param->opticurve) {
+    TRY(opticurve(p->priv, param->opttolerance, sc));
+    p->priv->fcurve = &p->priv->ocurve;
+  } else {
+    p->priv->fcurve = &p->priv->curve;
+  }
+  privcurve_to_curve(p->priv->fcurve, &p->curve);
+  return 0;
+
+ try_error:
+  return 1;
+}
+
+/* fit the paths [begin, end) of the current batch of a job, using a
+   scratch buffer for this band only. Paths are independent, so bands
+   can run in parallel. */
+static void process_band(void *data, int begin, int end) {
+  pathjob_t *job = (pathjob_t *)data;
+  scratch_t sc;
+  int i;
+
+  memset(&sc, 0, sizeof(sc));
+  for (i=begin+job->offset; i<end+job->offset; i++) {
+    job->failed[i] = (char)process_one_path(job->paths[i], job->param, &sc);
+  }
+  scratch_free(&sc);
+}
+
+/* return 0 on success, 1 on error with errno set. Paths are fitted in
+   parallel if potrace_parallel_for is set. If progress is requested,
+   paths are fitted in batches, and progress is reported between
+   batches by the calling thread. The list order, and with it the
+   output, does not change. */
 int process_path(path_t *plist, const potrace_param_t *param, progress_t *progress) {
   path_t *p;
-  double nn = 0, cn = 0;
+  double nn = 0, cn = 0, len;
+  int n, i, end, r;
+  pathjob_t job;
 
-  if (progress->callback) {
-    /* precompute task size for progress estimates */
-    nn = 0;
-    list_forall (p, plist) {
-      nn += p->priv->len;
-    }
-    cn = 0;
+  n = 0;
+  list_forall (p, plist) {
+    n++;
+    nn += p->priv->len;
   }
-  
-  /* call downstream function with each path */
+  if (n == 0) {
+    progress_update(1.0, progress);
+    return 0;
+  }
+
+  job.paths = NULL;
+  job.failed = NULL;
+  job.param = param;
+  SAFE_CALLOC(job.paths, n, path_t *);
+  SAFE_CALLOC(job.failed, n, char);
+  i = 0;
   list_forall (p, plist) {
-    TRY(calc_sums(p->priv));
-    TRY(calc_lon(p->priv));
-    TRY(bestpolygon(p->priv));
-    TRY(adjust_vertices(p->priv));
-    if (p->sign == '-') {   /* reverse orientation of negative paths */
-      reverse(&p->priv->curve);
+    job.paths[i++] = p;
+  }
+
+  for (job.offset = 0; job.offset < n; job.offset = end) {
+    end = n;
+    if (progress->callback) {
+      /* a batch holds about the same share of the total path length */
+      len = 0;
+      for (end = job.offset; end < n && (end == job.offset || len < nn/PROGRESS_BATCHES); end++) {
+        len += job.paths[end]->priv->len;
+      }
     }
-    smooth(&p->priv->curve, param->alphamax);
-    if (param->opticurve) {
-      TRY(opticurve(p->priv, param->opttolerance));
-      p->priv->fcurve = &p->priv->ocurve;
+    if (potrace_parallel_for) {
+      potrace_parallel_for(end-job.offset, process_band, &job);
     } else {
-      p->priv->fcurve = &p->priv->curve;
+      process_band(&job, 0, end-job.offset);
     }
-    privcurve_to_curve(p->priv->fcurve, &p->curve);
-
     if (progress->callback) {
-      cn += p->priv->len;
+      for (i=job.offset; i<end; i++) {
+        cn += job.paths[i]->priv->len;
+      }
       progress_update(cn/nn, progress);
     }
   }
 
+  r = 0;
+  for (i=0; i<n; i++) {
+    r |= job.failed[i];
+  }
+  free(job.paths);
+  free(job.failed);
+  if (r) {
+    return 1;
+  }
   progress_update(1.0, progress);
-
   return 0;
 
- try_error:
+ calloc_error:
+  free(job.paths);
+  free(job.failed);
   return 1;
 }
@@ -11,14 +11,22 @@
 #include "view/IAGUIMain.h"
 #include "view/IAProgressDialog.h"
 #include "toolpath/IAToolpath.h"
+#include "toolpath/IAGcodeEncoder.h"
+#include "toolpath/IAGcodeStream.h"
+#include "toolpath/IAInfillGenerator.h"
+#include "toolpath/IAMotionPlanner.h"
+#include "fileformats/IAGcodeReader.h"
 #include "opengl/IAFramebuffer.h"
 
 
 #include <FL/Fl_Native_File_Chooser.H>
 #include <FL/Fl_Input_Choice.H>
 #include <FL/Fl_Choice.H>
+#include <FL/fl_ask.H>
 #include <FL/filename.H>
 
+#include <algorithm>
+
 
 /*
  How do we find a lid?
@@ -184,21 +192,34 @@ IAFDMPrinter::IAFDMPrinter(IAFDMPrinter const& src)
     presetClass.set( "FDM" );
 
     numExtruders.set( src.numExtruders() );
+    hasArcSupport.set( src.hasArcSupport() );
+    gcodeEncoding.set( src.gcodeEncoding() );
+    outputSync.set( src.outputSync() );
+    maxAcceleration.set( src.maxAcceleration() );
+    extruderAcceleration = src.extruderAcceleration;
+    maxFeedrate.set( src.maxFeedrate() );
+    junctionDeviation = src.junctionDeviation;
+    maxJerk.set( src.maxJerk() );
+    sliceCacheSize.set( src.sliceCacheSize() );
 
     nozzleDiameter = src.nozzleDiameter;
     numShells.set( src.numShells() );
     numLids.set( src.numLids() );
     lidType.set( src.lidType() );
     infillDensity = src.infillDensity;
+    infillPattern.set( src.infillPattern() );
+    sliceResolution.set( src.sliceResolution() );
+    simplifyTolerance = src.simplifyTolerance;
     hasSkirt.set( src.hasSkirt() );
     minimumLayerTime.set( src.minimumLayerTime() );
+    minimumPrintSpeed.set( src.minimumPrintSpeed() );
     /** \bug and all other properties and settings */
 }
 
 
 IAFDMPrinter::~IAFDMPrinter()
 {
-    // nothing to delete
+    delete pImportedToolpath;
 }
 
 
@@ -274,6 +295,74 @@ void IAFDMPrinter::createPropertiesControls()
     s = new IAChoiceController("specs/extruder", "Extruders:", numExtruders,
                                []{}, numExtruderMenu );
     pPropertiesControllerList.push_back(s);
+    static Fl_Menu_Item arcSupportMenu[] = {
+        { "no", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "yes", 0, nullptr, (void*)1, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAChoiceController("specs/arcs", "G2/G3 Arcs:", hasArcSupport,
+                               []{}, arcSupportMenu );
+    s->tooltip("If the printer firmware supports arc moves, round features "
+               "are written as G2 and G3 commands instead of many short lines.");
+    pPropertiesControllerList.push_back(s);
+    static Fl_Menu_Item gcodeEncodingMenu[] = {
+        { "plain text", 0, nullptr, (void*)IAGcodeEncoder::PLAIN, 0, 0, 0, 11 },
+        { "MeatPack", 0, nullptr, (void*)IAGcodeEncoder::MEATPACK, 0, 0, 0, 11 },
+        { "compressed blocks", 0, nullptr, (void*)IAGcodeEncoder::BLOCKS, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAChoiceController("specs/encoding", "GCode Encoding:", gcodeEncoding,
+                               []{}, gcodeEncodingMenu );
+    s->tooltip("MeatPack nearly halves the size of the GCode, if the printer "
+               "firmware supports it. Compressed blocks are smaller still, "
+               "and every block is protected by a checksum.");
+    pPropertiesControllerList.push_back(s);
+    static Fl_Menu_Item outputSyncMenu[] = {
+        { "when the system decides", 0, nullptr, (void*)IAOutputSink::SYNC_NEVER, 0, 0, 0, 11 },
+        { "when the file is closed", 0, nullptr, (void*)IAOutputSink::SYNC_ON_CLOSE, 0, 0, 0, 11 },
+        { "continuously", 0, nullptr, (void*)IAOutputSink::SYNC_EVERY_PAGE, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAChoiceController("specs/sync", "Flush GCode to Disk:", outputSync,
+                               []{}, outputSyncMenu );
+    s->tooltip("Force the GCode onto the disk when the file is closed, so "
+               "that a memory card can be removed right after saving, or "
+               "continuously while writing. Forcing data to disk is slower.");
+    pPropertiesControllerList.push_back(s);
+    s = new IAVectorController("specs/maxAcceleration", "Acceleration:", "", maxAcceleration,
+                               "X:", "mm/s^2",
+                               "Y:", "mm/s^2",
+                               "Z:", "mm/s^2", []{} );
+    s->tooltip("Acceleration limits of the printer, used to estimate the printing time.");
+    pPropertiesControllerList.push_back(s);
+    s = new IAFloatController("specs/extruderAcceleration", "Extruder Acceleration:",
+                              extruderAcceleration, "mm/s^2", []{} );
+    pPropertiesControllerList.push_back(s);
+    s = new IAVectorController("specs/maxFeedrate", "Maximum Speed:", "", maxFeedrate,
+                               "X:", "mm/s",
+                               "Y:", "mm/s",
+                               "Z:", "mm/s", []{} );
+    pPropertiesControllerList.push_back(s);
+    s = new IAFloatController("specs/junctionDeviation", "Junction Deviation:",
+                              junctionDeviation, "mm", []{} );
+    s->tooltip("Limits the speed in corners, as set with M205 J in Marlin. "
+               "Set this to 0 if the firmware uses the classic jerk instead.");
+    pPropertiesControllerList.push_back(s);
+    s = new IAVectorController("specs/maxJerk", "Jerk:", "", maxJerk,
+                               "X:", "mm/s",
+                               "Y:", "mm/s",
+                               "Z:", "mm/s", []{} );
+    pPropertiesControllerList.push_back(s);
+    static Fl_Menu_Item sliceCacheSizeMenu[] = {
+        { "256 MB", 0, nullptr, (void*)256, 0, 0, 0, 11 },
+        { "512 MB", 0, nullptr, (void*)512, 0, 0, 0, 11 },
+        { "1 GB", 0, nullptr, (void*)1024, 0, 0, 0, 11 },
+        { "2 GB", 0, nullptr, (void*)2048, 0, 0, 0, 11 },
+        { "4 GB", 0, nullptr, (void*)4096, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAChoiceController("specs/sliceCache", "Slice Cache:", sliceCacheSize,
+                               []{}, sliceCacheSizeMenu );
+    s->tooltip("Slices are kept in memory for the preview and for saving. If "
+               "they need more memory than this, the least recently used "
+               "slices are removed and sliced again when needed.");
+    pPropertiesControllerList.push_back(s);
 #if 0
     s = new IALabelController("specs/extruder/0", "Extruder 0:");
     pPropertiesControllerList.push_back(s);
@@ -363,6 +452,42 @@ void IAFDMPrinter::initializeSceneSettings()
                                     [this]{purgeSlicesAndCaches();}, infillDensityMenuMenu );
     pSceneSettings.push_back(s);
 
+    static Fl_Menu_Item infillPatternMenu[] = {
+        { "rectilinear", 0, nullptr, (void*)IAInfillGenerator::RECTILINEAR, 0, 0, 0, 11 },
+        { "grid", 0, nullptr, (void*)IAInfillGenerator::GRID, 0, 0, 0, 11 },
+        { "triangles", 0, nullptr, (void*)IAInfillGenerator::TRIANGLES, 0, 0, 0, 11 },
+        { "honeycomb", 0, nullptr, (void*)IAInfillGenerator::HONEYCOMB, 0, 0, 0, 11 },
+        { "gyroid", 0, nullptr, (void*)IAInfillGenerator::GYROID, 0, 0, 0, 11 },
+        { nullptr } };
+
+    s = new IAChoiceController("infillPattern", "infill pattern: ", infillPattern,
+                               [this]{purgeSlicesAndCaches();}, infillPatternMenu );
+    pSceneSettings.push_back(s);
+
+    static Fl_Menu_Item sliceResolutionMenu[] = {
+        { "bitmap 4096", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "anti-aliased 2048", 0, nullptr, (void*)1, 0, 0, 0, 11 },
+        { "anti-aliased 1024", 0, nullptr, (void*)2, 0, 0, 0, 11 },
+        { nullptr } };
+
+    s = new IAChoiceController("sliceResolution", "slice resolution: ", sliceResolution,
+                               [this]{purgeSlicesAndCaches();}, sliceResolutionMenu );
+    pSceneSettings.push_back(s);
+
+    static Fl_Menu_Item simplifyToleranceMenu[] = {
+        { "0.00", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "0.01", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "0.02", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "0.05", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAFloatChoiceController("simplifyTolerance", "simplify paths: ", simplifyTolerance, "mm",
+                                    []{}, simplifyToleranceMenu );
+    s->tooltip("Points that are closer than this to the simplified toolpath are "
+               "removed when saving GCode. This creates fewer and longer moves, "
+               "which the printer firmware can plan much better. Set to 0 to "
+               "keep all points.");
+    pSceneSettings.push_back(s);
+
     static Fl_Menu_Item skirtMenu[] = {
         { "no", 0, nullptr, (void*)0, 0, 0, 0, 11 },
         { "yes", 0, nullptr, (void*)1, 0, 0, 0, 11 },
@@ -384,6 +509,18 @@ void IAFDMPrinter::initializeSceneSettings()
                "before the next layer is added.");
     pSceneSettings.push_back(s);
 
+    static Fl_Menu_Item minSpeedMenu[] = {
+        { "5 mm/s", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "10 mm/s", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "20 mm/s", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAFloatChoiceController("minPrintSpeed", "min. print speed: ", minimumPrintSpeed, "mm/s",
+                                    [this]{purgeSlicesAndCaches();}, minSpeedMenu );
+    s->tooltip("Layers that print faster than the minimum layer time are printed "
+               "slower, but never slower than this. If the layer is still too fast, "
+               "the head moves away and waits.");
+    pSceneSettings.push_back(s);
+
     static Fl_Menu_Item extruderChoiceMenu[] = {
         { "#0 (white)", 0, nullptr, (void*)0, 0, 0, 0, 11 },
         { "#1 (black)", 0, nullptr, (void*)1, 0, 0, 0, 11 },
@@ -511,7 +648,9 @@ void IAFDMPrinter::userSliceSave()
     if (pFirstWrite) {
         userSliceSaveAs();
     } else {
-        saveToolpath();
+        Iota.Error.clear();
+        if (!saveToolpath())
+            Iota.Error.showDialog();
     }
 }
 
@@ -546,17 +685,14 @@ void IAFDMPrinter::addToolpathForSkirt(IAToolpathList *tp, int i)
 {
     double z = sliceIndexToZ(i);
     IAFramebuffer skirt(this, IAFramebuffer::RGBA);
-    skirt.bindForRendering();
-    glPushMatrix();
-    glTranslated(Iota.pMesh->position().x(), Iota.pMesh->position().y(), Iota.pMesh->position().z());
-    Iota.pMesh->draw(IAMesh::kMASK, 1.0, 1.0, 1.0);
-    glPopMatrix();
-    skirt.unbindFromRendering();
-    skirt.toolpathFromLassoAndExpand(z, 3);  // 3mm, should probably be more if the extrusion is 1mm or more
-    IAToolpathListSP tpSkirt1 = skirt.toolpathFromLassoAndContract(z, nozzleDiameter());
-    tp->add(tpSkirt1.get(), modelExtruder(), 5, 0);
-    IAToolpathListSP tpSkirt2 = skirt.toolpathFromLassoAndContract(z, nozzleDiameter());
-    tp->add(tpSkirt2.get(), modelExtruder(), 5, 1);
+    skirt.drawMesh(Iota.pMesh, Iota.pMesh->position(), 1);
+    // the skirt only needs to follow the model roughly, so we trace it fast
+    const IAFramebuffer::TraceMethod fast = IAFramebuffer::MARCHING_SQUARES;
+    skirt.toolpathFromLassoAndExpand(z, 3, fast, traceTolerance());  // 3mm, should probably be more if the extrusion is 1mm or more
+    IAToolpathListSP tpSkirt1 = skirt.toolpathFromLassoAndContract(z, nozzleDiameter(), fast, traceTolerance());
+    tp->move(tpSkirt1.get(), modelExtruder(), 5, 0);
+    IAToolpathListSP tpSkirt2 = skirt.toolpathFromLassoAndContract(z, nozzleDiameter(), fast, traceTolerance());
+    tp->move(tpSkirt2.get(), modelExtruder(), 5, 1);
 }
 
 
@@ -568,13 +704,8 @@ void IAFDMPrinter::addToolpathForSupport(IAToolpathList *tp, int i)
     double z = sliceIndexToZ(i);
     IAFramebuffer support(this, IAFramebuffer::RGBAZ);
 
-    support.bindForRendering();
-
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_GREATER);
-
-    glClearDepth(0.0);
-    glClear(GL_DEPTH_BUFFER_BIT);
+    support.clearDepth(0.0);
+    support.depthFunc(IAFramebuffer::GREATER);
 
     // Draw only what is above the current z plane, but leave a little
     // space between the model and the support to reduce stickyness
@@ -583,32 +714,26 @@ void IAFDMPrinter::addToolpathForSupport(IAToolpathList *tp, int i)
     /** \bug don't do this for every layer! */
     // mark all triangles that need support first, then render only those
     // mark all vertices that need support, then render them here
-    Iota.pMesh->drawAngledFaces(90.0+supportAngle());
+    support.drawAngledFaces(Iota.pMesh, 90.0+supportAngle());
 
-    glPushMatrix();
     // Draw the upper part of the model, so that the support will not
     // protrude through it. Leave a little gap so that the support
-    // Also, remember if we need support at all.
     // sticks less to the model.
-    glTranslated(Iota.pMesh->position().x(),
-                 Iota.pMesh->position().y(),
-                 Iota.pMesh->position().z()
-                 + (supportBottomGap()+supportTopGap())*layerHeight());
-    Iota.pMesh->draw(IAMesh::kMASK, 0.0, 0.0, 0.0);
-    glPopMatrix();
+    IAVector3d offset = Iota.pMesh->position();
+    offset.z( offset.z() + (supportBottomGap()+supportTopGap())*layerHeight() );
+    support.drawMesh(Iota.pMesh, offset, 0);
 
     support.endClip();
+    support.depthFunc(IAFramebuffer::LESS);
 
-    glDepthFunc(GL_LESS);
-    glClearDepth(1.0);
-
-    support.unbindFromRendering();
     /** \bug change to bitmap mode */
 
     // reduce the size of the mask to leave room for the filament, plus
     // a little gap so that the support tower sides do not stick to
     // the model.
-    support.toolpathFromLassoAndContract(z, nozzleDiameter()/2.0 + supportSideGap());
+    const IAFramebuffer::TraceMethod fast = IAFramebuffer::MARCHING_SQUARES;
+    support.toolpathFromLassoAndContract(z, nozzleDiameter()/2.0 + supportSideGap(),
+                                         fast, traceTolerance());
 
     // Fill it.
     if (i==0) {
@@ -618,8 +743,8 @@ void IAFDMPrinter::addToolpathForSupport(IAToolpathList *tp, int i)
         // other layers use the set density
         support.overlayInfillPattern(0, 2*nozzleDiameter() * (100.0 / supportDensity()) - nozzleDiameter());
     }
-    auto supportPath = support.toolpathFromLasso(z);
-    if (supportPath) tp->add(supportPath.get(), supportExtruder(), 60, 0);
+    auto supportPath = support.toolpathFromLasso(z, fast, traceTolerance());
+    if (supportPath) tp->move(supportPath.get(), supportExtruder(), 60, 0);
     /// \todo don't draw anything here which we will draw otherwise later
     /** \bug find icicles and draw support for those */
     /** \bug find and exclude bridges */
@@ -653,9 +778,9 @@ void IAFDMPrinter::createToolpathForShell(int i, IAFramebuffer *fb)
      */
 
     IAToolpathList *tp = new IAToolpathList(z);
-    if (tp3) tp->add(tp3.get(), modelExtruder(), 40, 0);
-    if (tp2) tp->add(tp2.get(), modelExtruder(), 40, 1);
-    if (tp1) tp->add(tp1.get(), modelExtruder(), 40, 2);
+    if (tp3) tp->move(tp3.get(), modelExtruder(), 40, 0);
+    if (tp2) tp->move(tp2.get(), modelExtruder(), 40, 1);
+    if (tp1) tp->move(tp1.get(), modelExtruder(), 40, 2);
     if (pSliceList[i].pShellToolpath) delete pSliceList[i].pShellToolpath;
     pSliceList[i].pShellToolpath = tp;
     pSliceList[i].pCoreBitmap = fb;
@@ -668,8 +793,8 @@ void IAFDMPrinter::addToolpathForLid(IAToolpathList *tp, int i, IAFramebuffer &l
     if (lidType()==0) {
         // ZIGZAG (could do bridging if used in the correct direction!)
         lid.overlayInfillPattern(i, nozzleDiameter());
-        auto lidPath = lid.toolpathFromLasso(z);
-        if (lidPath) tp->add(lidPath.get(), modelExtruder(), 20, 0);
+        auto lidPath = lid.toolpathFromLasso(z, IAFramebuffer::MARCHING_SQUARES, traceTolerance());
+        if (lidPath) tp->move(lidPath.get(), modelExtruder(), 20, 0);
     } else {
         // CONCENTRIC (nicer for lids)
         /** \bug limit this to the width and hight of the build platform divided by the extrusion width */
@@ -677,7 +802,7 @@ void IAFDMPrinter::addToolpathForLid(IAToolpathList *tp, int i, IAFramebuffer &l
         for (k=0;k<300;k++) { /** \bug why 300? */
             auto tp1 = lid.toolpathFromLassoAndContract(z, nozzleDiameter());
             if (!tp1) break;
-            tp->add(tp1.get(), modelExtruder(), 20, k);
+            tp->move(tp1.get(), modelExtruder(), 20, k);
         }
         if (k==300) {
             // assert(0);
@@ -691,9 +816,11 @@ void IAFDMPrinter::addToolpathForInfill(IAToolpathList *tp, int i, IAFramebuffer
     double z = sliceIndexToZ(i);
     /** \todo We are actually filling the areas twice, where the lids and the infill touch! */
     /** \todo remove material that we generated in the lid already */
-    infill.overlayInfillPattern(i, 2*nozzleDiameter() * (100.0 / infillDensity()) - nozzleDiameter());
-    auto infillPath = infill.toolpathFromLasso(z);
-    if (infillPath) tp->add(infillPath.get(), modelExtruder(), 30, 0); /** \bug should be ExtruderDontCare */
+    // clip the infill pattern directly against the core, no tracing required
+    IAInfillGenerator infillGenerator(&infill);
+    auto infillPath = infillGenerator.generate((IAInfillGenerator::Pattern)infillPattern(),
+                                               i, z, nozzleDiameter() * (100.0 / infillDensity()));
+    if (infillPath) tp->move(infillPath.get(), modelExtruder(), 30, 0); /** \bug should be ExtruderDontCare */
 }
 
 
@@ -706,7 +833,18 @@ double IAFDMPrinter::sliceIndexToZ(int i)
 void IAFDMPrinter::acquireCorePattern(int i)
 {
     if (!pSliceList[i].pCoreBitmap) {
-        IAFramebuffer *sliceMap = new IAFramebuffer(this, IAFramebuffer::BITMAP);
+        IAFramebuffer *sliceMap = nullptr;
+        switch (sliceResolution()) {
+            case 1: // anti-aliased outlines are traced at sub-pixel accuracy
+                sliceMap = new IAFramebuffer(this, IAFramebuffer::COVERAGE, 2048, 2048);
+                break;
+            case 2:
+                sliceMap = new IAFramebuffer(this, IAFramebuffer::COVERAGE, 1024, 1024);
+                break;
+            default:
+                sliceMap = new IAFramebuffer(this, IAFramebuffer::BITMAP);
+                break;
+        }
         IAMeshSlice *slc = new IAMeshSlice( this );
         slc->setNewZ(sliceIndexToZ(i));
         slc->generateRim(Iota.pMesh);
@@ -723,8 +861,10 @@ void IAFDMPrinter::sliceLayer(int i)
 
     double z = sliceIndexToZ(i);
     IAFDMSlice &s = pSliceList[i];
+    s.pEvicted = false;
 
-    acquireCorePattern(i);
+    if (!s.pShellToolpath)
+        acquireCorePattern(i);
 
     // skirt around the entire model
     if (i==0 && hasSkirt() && !s.pSkirtToolpath) {
@@ -738,7 +878,11 @@ void IAFDMPrinter::sliceLayer(int i)
         addToolpathForSupport(tp, i);
     }
 
-    if ((!s.pInfillToolpath) || (!s.pLidToolpath)) {
+    // lists that are disabled by the settings are never created
+    bool needsLid = (numLids()>0 && !s.pLidToolpath);
+    bool needsInfill = (infillDensity()>0.0001 && !s.pInfillToolpath);
+    if (needsLid || needsInfill) {
+        acquireCorePattern(i);
         IAFramebuffer infill(pSliceList[i].pCoreBitmap);
 
         // build lids and bottoms
@@ -787,8 +931,13 @@ void IAFDMPrinter::sliceLayer(int i)
 
 /**
  * Slice all meshes and models in the scene.
+ *
+ * \param stream if set, every layer is pushed to this GCode stream as soon
+ *        as it is sliced
+ *
+ * \return false if the user cancelled slicing
  */
-void IAFDMPrinter::sliceAll()
+bool IAFDMPrinter::sliceAll(IAGcodeStream *stream)
 {
 //    pSliceMap.clear();
     double hgt = Iota.pMesh->pMax.z() - Iota.pMesh->pMin.z() + 2.0*layerHeight();
@@ -801,14 +950,26 @@ void IAFDMPrinter::sliceAll()
 
     int i = 0, n = (int)((zMax-zMin)/zLayerHeight) + 2;
 
+    pSliceList.setMemoryBudget((size_t)sliceCacheSize()*1024*1024);
+    bool cancelled = false;
     for (i=0; i<n; ++i)
     {
         double z = sliceIndexToZ(i);
-        if (IAProgressDialog::update(i*100/n, i, n, z, i*100/n)) break;
+        if (IAProgressDialog::update(i*100/n, i, n, z, i*100/n)) {
+            cancelled = true;
+            break;
+        }
         sliceLayer(i);
+        if (stream)
+            stream->push(createLayerToolpath(i));
+        // the core of layer i-2 was needed for the lids up to layer i
+        if (i>=2)
+            pSliceList[i-2].releaseCoreBitmap();
+        pSliceList.trim(i-2, i+2);
     }
 
     IAProgressDialog::hide();
+    if (!gSceneView) return !cancelled; // running headless
     if (zRangeSlider->lowValue()>n-1) {
         int nn = n-2; if (nn<0) nn = 0;
         double d = zRangeSlider->highValue()-zRangeSlider->lowValue();
@@ -817,32 +978,90 @@ void IAFDMPrinter::sliceAll()
     }
     zRangeSlider->do_callback();
     gSceneView->redraw();
+    return !cancelled;
 }
 
 
-void IAFDMPrinter::saveToolpath(const char *filename)
+/**
+ * Slice the scene and write the GCode while slicing.
+ *
+ * \param filename write to this file, or to the most recent upload filename
+ *
+ * \return false if the GCode could not be written completely, or if the
+ *         user cancelled slicing
+ */
+bool IAFDMPrinter::saveToolpath(const char *filename)
 {
     if (!filename)
         filename = recentUpload();
-    sliceAll();
-    double hgt = Iota.pMesh->pMax.z() - Iota.pMesh->pMin.z() + 2.0*layerHeight();
-    double zLayerHeight = layerHeight();
-    double zMax = hgt;
-    IAMachineToolpath machineToolpath(this);
-    int i = 0, n = (int)((zMax)/zLayerHeight) + 2;
-    for (i=0; i<n; ++i)
-    {
-        double z = sliceIndexToZ(i);
-        IAToolpathList *tp = machineToolpath.createLayer(z);
-        IAFDMSlice &s = pSliceList[i];
-        if (s.pShellToolpath) tp->add(s.pShellToolpath);
-        if (s.pLidToolpath) tp->add(s.pLidToolpath);
-        if (s.pInfillToolpath) tp->add(s.pInfillToolpath);
-        if (s.pSkirtToolpath) tp->add(s.pSkirtToolpath);
-        if (s.pSupportToolpath) tp->add(s.pSupportToolpath);
+    if (!filename)
+        return false;
+    unsigned int toolmap = 1<<modelExtruder();
+    if (hasSupport())
+        toolmap |= 1<<supportExtruder();
+    IAGcodeStream stream(this);
+    if (!stream.open(filename, toolmap))
+        return false;
+    if (!sliceAll(&stream)) {
+        stream.abort();
+        return false;
+    }
+    return stream.close();
+}
+
+
+/**
+ * Read a GCode file, no matter which slicer wrote it, for inspection.
+ *
+ * The toolpaths are shown in the preview instead of the slices. The time
+ * estimate uses the motion limits of this printer.
+ *
+ * \param filename a plain or encoded GCode file
+ *
+ * \return false if the file could not be read; the error is set in Iota.Error
+ */
+bool IAFDMPrinter::importGCode(const char *filename)
+{
+    IAGcodeReader reader(filename);
+    if (!reader.isOpen())
+        return false;
+    if (pImportedToolpath)
+        pImportedToolpath->purge();
+    else
+        pImportedToolpath = new IAMachineToolpath(this);
+    reader.load(*pImportedToolpath);
+
+    IAMotionPlanner planner;
+    planner.setup(this);
+    double t = reader.estimateTime(planner);
+    int n = (int)reader.layerCount();
+    if (!gSceneView) { // running headless
+        printf("%s has %d layers, total print time is %.2f minutes\n", filename, n, t/60.0);
+        return true;
     }
-    machineToolpath.optimize();
-    machineToolpath.saveGCode(filename);
+    zRangeSlider->lowValue(0);
+    zRangeSlider->highValue(n>0 ? n-1 : 0);
+    gSceneView->redraw();
+    fl_message("\"%s\" has %d layers.\nThe estimated print time is %d:%02d hours.",
+               fl_filename_name(filename), n, (int)(t/3600.0), ((int)(t/60.0))%60);
+    return true;
+}
+
+
+/**
+ * Create a toolpath list for a layer that shares all toolpaths of the slice.
+ */
+IAToolpathList *IAFDMPrinter::createLayerToolpath(int i)
+{
+    IAFDMSlice &s = pSliceList[i];
+    if (s.pEvicted) sliceLayer(i);
+    IAToolpathList *tp = new IAToolpathList(sliceIndexToZ(i));
+    if (s.pShellToolpath) tp->add(s.pShellToolpath);
+    if (s.pLidToolpath) tp->add(s.pLidToolpath);
+    if (s.pInfillToolpath) tp->add(s.pInfillToolpath);
+    if (s.pSkirtToolpath) tp->add(s.pSkirtToolpath);
+    if (s.pSupportToolpath) tp->add(s.pSupportToolpath);
+    return tp;
 }
 
 
@@ -860,8 +1079,12 @@ void IAFDMPrinter::rangeSliderChanged()
  */
 void IAFDMPrinter::purgeSlicesAndCaches()
 {
+    // a new model or new settings replace an imported GCode file
+    delete pImportedToolpath;
+    pImportedToolpath = nullptr;
     pSliceList.purge();
     super::purgeSlicesAndCaches();
+    if (!gSceneView) return; // running headless
     sliceLayer(zRangeSlider->highValue()); /** \bug very direct access through a view */
     gSceneView->redraw();
 }
@@ -872,15 +1095,23 @@ void IAFDMPrinter::purgeSlicesAndCaches()
  */
 void IAFDMPrinter::drawPreview(double lo, double hi)
 {
+    if (pImportedToolpath) {
+        pImportedToolpath->draw(lo, hi);
+        return;
+    }
     /** \bug trigger building the slices in another thread */
     for (int i=lo; i<=hi; i++) {
         IAFDMSlice &s = pSliceList[i];
+        if (s.pEvicted) sliceLayer(i);
         if (s.pShellToolpath) s.pShellToolpath->draw();
         if (s.pLidToolpath) s.pLidToolpath->draw();
         if (s.pInfillToolpath) s.pInfillToolpath->draw();
         if (s.pSkirtToolpath) s.pSkirtToolpath->draw();
         if (s.pSupportToolpath) s.pSupportToolpath->draw();
     }
+    // layers that were sliced again for the preview must not grow the cache
+    pSliceList.setMemoryBudget((size_t)sliceCacheSize()*1024*1024);
+    pSliceList.trim((int)lo, (int)hi);
 }
 
 
@@ -889,6 +1120,15 @@ void IAFDMPrinter::readProperties(Fl_Preferences &printer)
     super::readProperties(printer);
     Fl_Preferences properties(printer, "properties");
     numExtruders.read(properties);
+    hasArcSupport.read(properties);
+    gcodeEncoding.read(properties);
+    outputSync.read(properties);
+    maxAcceleration.read(properties);
+    extruderAcceleration.read(properties);
+    maxFeedrate.read(properties);
+    junctionDeviation.read(properties);
+    maxJerk.read(properties);
+    sliceCacheSize.read(properties);
 }
 
 
@@ -897,11 +1137,33 @@ void IAFDMPrinter::writeProperties(Fl_Preferences &printer)
     super::writeProperties(printer);
     Fl_Preferences properties(printer, "properties");
     numExtruders.write(properties);
+    hasArcSupport.write(properties);
+    gcodeEncoding.write(properties);
+    outputSync.write(properties);
+    maxAcceleration.write(properties);
+    extruderAcceleration.write(properties);
+    maxFeedrate.write(properties);
+    junctionDeviation.write(properties);
+    maxJerk.write(properties);
+    sliceCacheSize.write(properties);
 }
 
 
 
 
+/**
+ * Return the slice for a layer and mark it as recently used.
+ *
+ * \param i layer index; an empty slice is created if there is none yet
+ */
+IAFDMSlice &IAFDMSliceList::operator[](int i)
+{
+    IAFDMSlice &s = pList[i];
+    s.pLastUse = ++pUseCounter;
+    return s;
+}
+
+
 void IAFDMSliceList::purge()
 {
     for (auto &s: pList) {
@@ -910,6 +1172,45 @@ void IAFDMSliceList::purge()
 }
 
 
+/**
+ * Evict the least recently used slices until the cache fits the budget.
+ *
+ * \param keepLo, keepHi slices in this range of layers are not evicted,
+ *        even if the cache stays over budget
+ */
+void IAFDMSliceList::trim(int keepLo, int keepHi)
+{
+    size_t size = residentSize();
+    if (size<=pMemoryBudget)
+        return;
+    std::vector<std::pair<uint64_t, int>> lruList;
+    for (auto &s: pList) {
+        if (s.first>=keepLo && s.first<=keepHi) continue;
+        if (s.second.memorySize()==0) continue;
+        lruList.push_back(std::make_pair(s.second.pLastUse, s.first));
+    }
+    std::sort(lruList.begin(), lruList.end());
+    for (auto &e: lruList) {
+        if (size<=pMemoryBudget) break;
+        IAFDMSlice &s = pList[e.second];
+        size -= s.memorySize();
+        s.evict();
+    }
+}
+
+
+/**
+ * Return the number of bytes used by all slices in memory.
+ */
+size_t IAFDMSliceList::residentSize()
+{
+    size_t size = 0;
+    for (auto &s: pList)
+        size += s.second.memorySize();
+    return size;
+}
+
+
 
 IAFDMSlice::IAFDMSlice()
 {
@@ -930,6 +1231,46 @@ void IAFDMSlice::purge()
     delete pSkirtToolpath; pSkirtToolpath = nullptr;
     delete pSupportToolpath; pSupportToolpath = nullptr;
     delete pCoreBitmap; pCoreBitmap = nullptr;
+    pEvicted = false;
+}
+
+
+/**
+ * Remove the slice from memory, but remember that it must be sliced again.
+ */
+void IAFDMSlice::evict()
+{
+    purge();
+    pEvicted = true;
+}
+
+
+/**
+ * Free the core bitmap when no neighbouring layer needs it anymore.
+ *
+ * The toolpaths stay in memory. If the core is needed again, it is
+ * recreated by IAFDMPrinter::acquireCorePattern().
+ */
+void IAFDMSlice::releaseCoreBitmap()
+{
+    delete pCoreBitmap;
+    pCoreBitmap = nullptr;
+}
+
+
+/**
+ * Return the number of bytes used by the toolpaths and the core bitmap.
+ */
+size_t IAFDMSlice::memorySize()
+{
+    size_t size = 0;
+    if (pShellToolpath) size += pShellToolpath->memorySize();
+    if (pLidToolpath) size += pLidToolpath->memorySize();
+    if (pInfillToolpath) size += pInfillToolpath->memorySize();
+    if (pSkirtToolpath) size += pSkirtToolpath->memorySize();
+    if (pSupportToolpath) size += pSupportToolpath->memorySize();
+    if (pCoreBitmap) size += pCoreBitmap->memorySize();
+    return size;
 }
 
 
@@ -11,12 +11,23 @@
 #include "printer/IAPrinter.h"
 
 #include <mutex>
+#include <stdint.h>
 
 
 class IAFDMPrinter;
 class IAFDMSlice;
+class IAGcodeStream;
+class IAMachineToolpath;
 
 
+/**
+ * A cache of slices, indexed by layer number.
+ *
+ * The cache keeps track of when each slice was used last. If the slices use
+ * more memory than the budget allows, trim() evicts the least recently used
+ * slices. Evicted slices are marked, so they can be sliced again when they
+ * are needed.
+ */
 class IAFDMSliceList
 {
 public:
@@ -25,10 +36,18 @@ public:
     /** \todo implement asynchrnous calculation of slices. */
     // if ( m.find("f") == m.end() )
     // lock this list and individual slices
-    IAFDMSlice &operator[](int i) { return pList[i]; }
+    IAFDMSlice &operator[](int i);
     void purge();
+    void trim(int keepLo, int keepHi);
+    size_t residentSize();
+    /** Set the number of bytes that trim() tries to stay under. */
+    void setMemoryBudget(size_t bytes) { pMemoryBudget = bytes; }
 private:
     std::map<int, IAFDMSlice> pList;
+    /// incremented every time a slice is accessed
+    uint64_t pUseCounter = 0;
+    /// number of bytes that all slices together should not exceed
+    size_t pMemoryBudget = (size_t)1024*1024*1024;
 };
 
 
@@ -42,6 +61,9 @@ public:
     IAFDMSlice();
     ~IAFDMSlice();
     void purge();
+    void evict();
+    void releaseCoreBitmap();
+    size_t memorySize();
     void lock() { pMutex.lock(); }
     void unlock() { pMutex.unlock(); }
 
@@ -55,6 +77,10 @@ public:
     IAToolpathList *pSupportToolpath = nullptr;
     /// Store the bitmap for the slice without the shell
     IAFramebuffer *pCoreBitmap = nullptr;
+    /// value of the use counter of the slice list when this slice was used last
+    uint64_t pLastUse = 0;
+    /// set if this slice was removed from memory and must be sliced again
+    bool pEvicted = false;
 };
 
 
@@ -93,6 +119,15 @@ public:
     virtual void writeProperties(Fl_Preferences &p) override;
 
     IAIntProperty numExtruders { "numExtruders", 2 };
+    IAIntProperty hasArcSupport { "hasArcSupport", 0 }; // firmware understands G2/G3
+    IAIntProperty gcodeEncoding { "gcodeEncoding", 0 }; // IAGcodeEncoder::Format
+    IAIntProperty outputSync { "outputSync", 0 }; // IAOutputSink::SyncPolicy
+    IAVectorProperty maxAcceleration { "maxAcceleration", { 1250.0, 1250.0, 200.0 } }; // mm/s^2
+    IAFloatProperty extruderAcceleration { "extruderAcceleration", 5000.0 }; // mm/s^2
+    IAVectorProperty maxFeedrate { "maxFeedrate", { 200.0, 200.0, 12.0 } }; // mm/s
+    IAFloatProperty junctionDeviation { "junctionDeviation", 0.013 }; // mm, 0=use maxJerk
+    IAVectorProperty maxJerk { "maxJerk", { 8.0, 8.0, 0.4 } }; // mm/s
+    IAIntProperty sliceCacheSize { "sliceCacheSize", 1024 }; // MB of slices kept in memory
     // ex 0 type
     // ex 0 nozzle diameter
     // ex 0 feeds
@@ -109,9 +144,13 @@ public:
     IAIntProperty numLids { "numLids", 2 };
     IAIntProperty lidType { "lidType", 0 }; // 0=zigzag, 1=concentric
     IAFloatProperty infillDensity { "infillDensity", 20.0 }; // %
+    IAIntProperty infillPattern { "infillPattern", 0 }; // see IAInfillGenerator::Pattern
+    IAIntProperty sliceResolution { "sliceResolution", 0 }; // 0=bitmap, 1=coverage 2048, 2=coverage 1024
+    IAFloatProperty simplifyTolerance { "simplifyTolerance", 0.02 }; // mm, 0=keep all points
     // skirt, brim, raft, ooze shield/side wall (vertical, waterfall, contoured, #shells, max. angle); bottom layer speed factor, temperature, prime pillar
     IAIntProperty hasSkirt { "hasSkirt",  1 }; // prime line around perimeter
     IAFloatProperty minimumLayerTime { "minimumLayerTime", 15.0 };
+    IAFloatProperty minimumPrintSpeed { "minimumPrintSpeed", 10.0 }; // mm/s, slowest speed for minimumLayerTime
     IAExtruderProperty modelExtruder { "modelExtruder", 0 };
     // support
     IAPresetProperty supportPreset { presetClass, "supportPreset", "none" };
@@ -132,7 +171,8 @@ public:
     void acquireCorePattern(int i);
 
     void sliceLayer(int i);
-    void sliceAll();
+    bool sliceAll(IAGcodeStream *stream=nullptr);
+    IAToolpathList *createLayerToolpath(int i);
 
     void addToolpathForSkirt(IAToolpathList *tp, int i);
     void addToolpathForSupport(IAToolpathList *tp, int i);
@@ -140,13 +180,22 @@ public:
     void addToolpathForLid(IAToolpathList *tp, int i, IAFramebuffer &fb);
     void addToolpathForInfill(IAToolpathList *tp, int i, IAFramebuffer &fb);
 
-    void saveToolpath(const char *filename = nullptr);
+    bool saveToolpath(const char *filename = nullptr);
+    bool importGCode(const char *filename);
 
     double filamentDiameter() { return 1.75; }
+
+    /** Outlines traced with marching squares may deviate this much, in mm. */
+    double traceTolerance() { return 0.25 * nozzleDiameter(); }
+
+    /** Arcs in GCode may deviate this much from the toolpath, in mm. */
+    double arcTolerance() { return 0.1 * nozzleDiameter(); }
     
 private:
 
     IAFDMSliceList pSliceList;
+    /// toolpaths read from a GCode file, drawn instead of the slices
+    IAMachineToolpath *pImportedToolpath = nullptr;
 };
 
 
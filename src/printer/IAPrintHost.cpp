@@ -0,0 +1,749 @@
+//
+//  IAPrintHost.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAPrintHost.h"
+
+#include "Iota.h"
+#include "toolpath/IAGcodeEncoder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#ifndef _WIN32
+# include <poll.h>
+# include <termios.h>
+# include <unistd.h>
+#endif
+
+
+/** Give the firmware this many seconds to boot if it does not say "start". */
+static const double kBootTime = 2.5;
+
+/** Give up if the printer does not send anything for this many seconds. */
+static const double kTimeout = 60.0;
+
+/** The virtual printer needs this many seconds to execute a command. */
+static const double kCommandTime = 0.0005;
+
+
+/**
+ * Return a time stamp in seconds.
+ */
+static double now()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+/**
+ * Calculate the checksum of a line, as defined by the RepRap firmware.
+ */
+static unsigned int checksum(const char *text, size_t size)
+{
+    unsigned int cs = 0;
+    for (size_t i=0; i<size; i++)
+        cs ^= (unsigned char)text[i];
+    return cs & 0xff;
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Create a print host that is not connected yet.
+ */
+IAPrintHost::IAPrintHost()
+{
+}
+
+
+/**
+ * Send all remaining commands and close the connection.
+ */
+IAPrintHost::~IAPrintHost()
+{
+    if (isOpen())
+        close();
+}
+
+
+/**
+ * Connect to a printer.
+ *
+ * Opening the port resets most printers, so the host waits until the
+ * firmware reports that it started, or for a few seconds at most, before it
+ * sends the first command.
+ *
+ * \param device name of the serial port, optionally followed by "@" and the
+ *        baud rate, for example "/dev/ttyACM0@250000"; "loopback" connects
+ *        to an IAVirtualSerialPrinter
+ * \param window number of commands that may wait for an "ok"
+ * \param meatPack send all lines after the first one in MeatPack encoding
+ *
+ * \return false if the port could not be opened; the error is set in
+ *        Iota.Error
+ */
+bool IAPrintHost::open(const char *device, int window, bool meatPack)
+{
+    if (isOpen())
+        close();
+#ifdef _WIN32
+    /** \todo Implement serial ports for MSWindows. */
+    Iota.Error.set("Print host", IAError::CantOpenFile_STR_BSD, device);
+    return false;
+#else
+    std::string name = device;
+    int baud = 115200;
+    size_t at = name.rfind('@');
+    if (at!=std::string::npos) {
+        baud = atoi(name.c_str()+at+1);
+        name.resize(at);
+    }
+    if (name=="loopback") {
+        pLoopback = new IAVirtualSerialPrinter();
+        if (!pLoopback->open()) {
+            Iota.Error.set("Print host", IAError::CantOpenFile_STR_BSD, "loopback");
+            delete pLoopback;
+            pLoopback = nullptr;
+            return false;
+        }
+        name = pLoopback->deviceName();
+    }
+    if (!openDevice(name.c_str(), baud) || pipe(pWakeFd)!=0) {
+        Iota.Error.set("Print host", IAError::CantOpenFile_STR_BSD, name.c_str());
+        if (pFd!=-1) ::close(pFd);
+        pFd = -1;
+        delete pLoopback;
+        pLoopback = nullptr;
+        return false;
+    }
+    fcntl(pWakeFd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pWakeFd[1], F_SETFL, O_NONBLOCK);
+
+    pPartialLine.clear();
+    pPendingList.clear();
+    pHistory.clear();
+    pHistoryFirst = 0;
+    pNextLine = 0;
+    pSendLine = 0;
+    pInFlight = 0;
+    pWindow = (window<1) ? 1 : window;
+    pIgnoreResends = 0;
+    pLastResend = -1;
+    pResendCount = 0;
+    pPacking = false;
+    pStarted = false;
+    pClosing = false;
+    pError.clear();
+
+    // start counting lines at 0; this line is sent before MeatPack is on
+    pMeatPack = false;
+    queueLine("M110 N0", 7);
+    pMeatPack = meatPack;
+    pThread = std::thread(&IAPrintHost::ioLoop, this);
+    return true;
+#endif
+}
+
+
+/**
+ * Open a serial port and set it to raw mode.
+ */
+bool IAPrintHost::openDevice(const char *device, int baud)
+{
+#ifdef _WIN32
+    return false;
+#else
+    int fd = ::open(device, O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (fd==-1)
+        return false;
+    struct termios tio;
+    if (tcgetattr(fd, &tio)==0) {
+        speed_t speed = B115200;
+        switch (baud) {
+            case 9600: speed = B9600; break;
+            case 19200: speed = B19200; break;
+            case 38400: speed = B38400; break;
+            case 57600: speed = B57600; break;
+            case 115200: speed = B115200; break;
+            case 230400: speed = B230400; break;
+#ifdef B250000
+            case 250000: speed = B250000; break;
+#endif
+#ifdef B500000
+            case 500000: speed = B500000; break;
+#endif
+#ifdef B1000000
+            case 1000000: speed = B1000000; break;
+#endif
+            default:
+                printf("Baud rate %d not supported, using 115200\n", baud);
+                break;
+        }
+        cfmakeraw(&tio);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~CRTSCTS;
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIOFLUSH);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    pFd = fd;
+    return true;
+#endif
+}
+
+
+/**
+ * Queue GCode for sending.
+ *
+ * The text may end in the middle of a line, which is then completed by the
+ * next call. If too many lines are waiting, this call blocks until the
+ * printer caught up.
+ *
+ * \param text GCode, usually many lines
+ * \param size number of bytes in text
+ */
+void IAPrintHost::write(const char *text, size_t size)
+{
+    std::unique_lock<std::mutex> lock(pMutex);
+    const char *end = text+size;
+    while (text<end) {
+        if (!pError.empty())
+            return; // the I/O thread has stopped
+        const char *nl = (const char*)memchr(text, '\n', end-text);
+        if (!nl) {
+            pPartialLine.append(text, end-text);
+            break;
+        }
+        if (pPartialLine.empty()) {
+            queueLine(text, nl-text);
+        } else {
+            pPartialLine.append(text, nl-text);
+            queueLine(pPartialLine.data(), pPartialLine.size());
+            pPartialLine.clear();
+        }
+        text = nl+1;
+        if (pPendingList.size()>=kMaxPending) {
+            wakeUp();
+            pWakeCaller.wait(lock, [this]{
+                return pPendingList.size()<kMaxPending/2 || !pError.empty();
+            });
+        }
+    }
+    wakeUp();
+}
+
+
+/**
+ * Remove the comment and whitespace from a line and queue it.
+ */
+void IAPrintHost::queueLine(const char *text, size_t size)
+{
+    if (pMeatPack) {
+        std::string line(text, size);
+        IAMeatPackEncoder::stripLine(line);
+        if (!line.empty())
+            pPendingList.push_back(line);
+        return;
+    }
+    const char *end = text+size;
+    const char *c = (const char*)memchr(text, ';', size);
+    if (c) end = c;
+    while (text<end && (*text==' ' || *text=='\t')) text++;
+    while (end>text && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\r')) end--;
+    if (text<end)
+        pPendingList.push_back(std::string(text, end-text));
+}
+
+
+/**
+ * Make the I/O thread look for new lines.
+ */
+void IAPrintHost::wakeUp()
+{
+#ifndef _WIN32
+    char c = 0;
+    if (::write(pWakeFd[1], &c, 1)<0) {
+        // the pipe is full, so the thread will wake up anyway
+    }
+#endif
+}
+
+
+/**
+ * Send all queued commands, wait for the printer to acknowledge them, and
+ * close the port.
+ *
+ * \return false if the connection was lost or the printer reported an
+ *        error; the error is set in Iota.Error
+ */
+bool IAPrintHost::close()
+{
+    if (!isOpen())
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        if (!pPartialLine.empty()) {
+            queueLine(pPartialLine.data(), pPartialLine.size());
+            pPartialLine.clear();
+        }
+        pClosing = true;
+        wakeUp();
+    }
+    pThread.join();
+#ifndef _WIN32
+    ::close(pFd);
+    ::close(pWakeFd[0]);
+    ::close(pWakeFd[1]);
+#endif
+    pFd = -1;
+    pWakeFd[0] = pWakeFd[1] = -1;
+    if (pLoopback) {
+        pLoopback->close();
+        delete pLoopback;
+        pLoopback = nullptr;
+    }
+    printf("Sent %ld lines to the printer, %d were sent again\n", pNextLine, pResendCount);
+    if (!pError.empty()) {
+        Iota.Error.set("Print host", IAError::PrinterCommunication_STR, pError.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Send commands and read the replies of the printer until all commands
+ * were acknowledged after close(), or until an error occurs.
+ */
+void IAPrintHost::ioLoop()
+{
+#ifndef _WIN32
+    std::string reply;
+    double startTime = now(), lastReply = now();
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(pMutex);
+            if (!pStarted && now()-startTime>kBootTime)
+                pStarted = true;
+            if (pStarted) {
+                while (pInFlight<pWindow && sendLine()) { }
+            }
+            if (pInFlight==0)
+                lastReply = now();
+            else if (now()-lastReply>kTimeout)
+                fail("The printer does not respond.");
+            if (!pError.empty())
+                break;
+            if (pClosing && pPendingList.empty() && pSendLine==pNextLine && pInFlight==0) {
+                if (pPacking)
+                    setPacking(false);
+                break;
+            }
+        }
+
+        struct pollfd fds[2] = { { pFd, POLLIN, 0 }, { pWakeFd[0], POLLIN, 0 } };
+        int n = poll(fds, 2, 100);
+        if (n<0 && errno!=EINTR) {
+            std::lock_guard<std::mutex> lock(pMutex);
+            fail(strerror(errno));
+            break;
+        }
+        if (n<=0)
+            continue;
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (::read(pWakeFd[0], buf, sizeof(buf))>0) { }
+        }
+        if (fds[0].revents & (POLLIN|POLLHUP|POLLERR)) {
+            char buf[256];
+            ssize_t got = ::read(pFd, buf, sizeof(buf));
+            std::lock_guard<std::mutex> lock(pMutex);
+            if (got<=0) {
+                fail(got<0 ? strerror(errno) : "The printer was disconnected.");
+                break;
+            }
+            lastReply = now();
+            for (ssize_t i=0; i<got; i++) {
+                char c = buf[i];
+                if (c=='\n') {
+                    handleResponse(reply);
+                    reply.clear();
+                } else if (c!='\r') {
+                    reply.push_back(c);
+                }
+            }
+        }
+    }
+#endif
+    std::lock_guard<std::mutex> lock(pMutex);
+    pWakeCaller.notify_all();
+}
+
+
+/**
+ * Send the next line, or send a line again if the firmware asked for it.
+ *
+ * Must be called with pMutex locked.
+ *
+ * \return false if there was nothing to send
+ */
+bool IAPrintHost::sendLine()
+{
+    std::string line;
+    if (pSendLine<pNextLine) {
+        if (pSendLine<pHistoryFirst) {
+            fail("The printer asked for a line that is no longer available.");
+            return false;
+        }
+        line = pHistory[pSendLine-pHistoryFirst];
+    } else {
+        if (pPendingList.empty())
+            return false;
+        char head[32];
+        snprintf(head, sizeof(head), pMeatPack ? "N%ld" : "N%ld ", pNextLine);
+        line = head + pPendingList.front();
+        pPendingList.pop_front();
+        char tail[16];
+        snprintf(tail, sizeof(tail), "*%u\n", checksum(line.data(), line.size()));
+        line += tail;
+        pHistory.push_back(line);
+        pNextLine++;
+        if (pHistory.size()>kHistorySize) {
+            pHistory.pop_front();
+            pHistoryFirst++;
+        }
+        if (pPendingList.size()<kMaxPending/2)
+            pWakeCaller.notify_all();
+    }
+    if (pPacking) {
+        std::vector<uint8_t> packed;
+        IAMeatPackEncoder::packText(line, packed);
+        if (!sendData(packed.data(), packed.size()))
+            return false;
+    } else {
+        if (!sendData(line.data(), line.size()))
+            return false;
+    }
+    pSendLine++;
+    pInFlight++;
+    if (pMeatPack && !pPacking)
+        return setPacking(true);
+    return true;
+}
+
+
+/**
+ * Write bytes to the port.
+ *
+ * Must be called with pMutex locked.
+ *
+ * \return false if the port failed
+ */
+bool IAPrintHost::sendData(const void *data, size_t size)
+{
+#ifndef _WIN32
+    const char *p = (const char*)data;
+    size_t left = size;
+    while (left>0) {
+        ssize_t n = ::write(pFd, p, left);
+        if (n<0) {
+            if (errno==EINTR) continue;
+            fail(strerror(errno));
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+#endif
+    return true;
+}
+
+
+/**
+ * Switch MeatPack and the "no spaces" mode in the firmware on or off.
+ *
+ * Must be called with pMutex locked.
+ *
+ * \return false if the port failed
+ */
+bool IAPrintHost::setPacking(bool packing)
+{
+    uint8_t k = IAMeatPackEncoder::kSignalByte;
+    uint8_t cmd[6] = {
+        k, k, packing ? IAMeatPackEncoder::kCmdEnablePacking : IAMeatPackEncoder::kCmdDisablePacking,
+        k, k, packing ? IAMeatPackEncoder::kCmdEnableNoSpaces : IAMeatPackEncoder::kCmdDisableNoSpaces
+    };
+    pPacking = packing;
+    return sendData(cmd, sizeof(cmd));
+}
+
+
+/**
+ * Interpret a line that the firmware sent.
+ *
+ * Must be called with pMutex locked.
+ */
+void IAPrintHost::handleResponse(const std::string &line)
+{
+    const char *s = line.c_str();
+    if (strncmp(s, "ok", 2)==0) {
+        pStarted = true;
+        if (pInFlight>0)
+            pInFlight--;
+    } else if (strncasecmp(s, "resend:", 7)==0 || strncmp(s, "rs ", 3)==0) {
+        const char *d = s+2;
+        while (*d && (*d<'0' || *d>'9')) d++;
+        long n = atol(d);
+        if (n==pLastResend && pIgnoreResends>0) {
+            pIgnoreResends--;
+            return;
+        }
+        if (n<pHistoryFirst || n>pSendLine) {
+            fail(line.c_str());
+            return;
+        }
+        // every line after this one will be rejected with the same request
+        pIgnoreResends = std::max(0L, pSendLine-n-1);
+        pLastResend = n;
+        pSendLine = n;
+        pResendCount++;
+    } else if (strncmp(s, "start", 5)==0) {
+        if (pStarted && pNextLine>1)
+            fail("The printer was reset.");
+        pStarted = true;
+    } else if (strncmp(s, "!!", 2)==0 || strstr(s, "halted") || strstr(s, "Kill")) {
+        fail(line.c_str());
+    } else if (strncmp(s, "wait", 4)==0) {
+        // Repetier firmware sends this when its queue ran empty
+        pInFlight = 0;
+    }
+    // everything else is a temperature report, a busy message, or an echo
+}
+
+
+/**
+ * Remember the first error and stop all communication.
+ *
+ * Must be called with pMutex locked.
+ */
+void IAPrintHost::fail(const char *message)
+{
+    if (pError.empty())
+        pError = message;
+    pWakeCaller.notify_all();
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Create a virtual printer that is not running yet.
+ */
+IAVirtualSerialPrinter::IAVirtualSerialPrinter()
+{
+}
+
+
+/**
+ * Stop the printer.
+ */
+IAVirtualSerialPrinter::~IAVirtualSerialPrinter()
+{
+    close();
+}
+
+
+/**
+ * Create a pseudo terminal and start the firmware simulation.
+ *
+ * \return false if no terminal could be created
+ */
+bool IAVirtualSerialPrinter::open()
+{
+#ifdef _WIN32
+    return false;
+#else
+    close();
+    pFd = posix_openpt(O_RDWR|O_NOCTTY);
+    if (pFd==-1)
+        return false;
+    if (grantpt(pFd)!=0 || unlockpt(pFd)!=0 || !ptsname(pFd)) {
+        ::close(pFd);
+        pFd = -1;
+        return false;
+    }
+    pDeviceName = ptsname(pFd);
+    // set raw mode before anything is sent, or the terminal would echo
+    pSlaveFd = ::open(pDeviceName.c_str(), O_RDWR|O_NOCTTY);
+    if (pSlaveFd!=-1) {
+        struct termios tio;
+        if (tcgetattr(pSlaveFd, &tio)==0) {
+            cfmakeraw(&tio);
+            tcsetattr(pSlaveFd, TCSANOW, &tio);
+        }
+    }
+    pLastLine = 0;
+    pCommandCount = 0;
+    pLineCount = 0;
+    pQueue.clear();
+    pQuit = false;
+    pThread = std::thread(&IAVirtualSerialPrinter::firmwareLoop, this);
+    return true;
+#endif
+}
+
+
+/**
+ * Stop the simulation and remove the terminal.
+ */
+void IAVirtualSerialPrinter::close()
+{
+#ifndef _WIN32
+    if (pFd==-1)
+        return;
+    pQuit = true;
+    pThread.join();
+    ::close(pFd);
+    if (pSlaveFd!=-1)
+        ::close(pSlaveFd);
+    pFd = pSlaveFd = -1;
+#endif
+}
+
+
+/**
+ * Read commands and answer them like the firmware would.
+ */
+void IAVirtualSerialPrinter::firmwareLoop()
+{
+#ifndef _WIN32
+    reply("start\n");
+    std::string line, text;
+    IAMeatPackDecoder decoder;
+    while (!pQuit) {
+        struct pollfd fds = { pFd, POLLIN, 0 };
+        if (poll(&fds, 1, 20)<=0)
+            continue;
+        char buf[256];
+        ssize_t got = ::read(pFd, buf, sizeof(buf));
+        if (got<=0)
+            continue;
+        // MeatPack is unpacked first, plain text passes unchanged
+        text.clear();
+        for (ssize_t i=0; i<got; i++)
+            decoder.decode((uint8_t)buf[i], text);
+        for (char c: text) {
+            if (c=='\n') {
+                handleLine(line);
+                line.clear();
+            } else if (c!='\r') {
+                line.push_back(c);
+            }
+        }
+    }
+#endif
+}
+
+
+/**
+ * Check the line number and checksum of a command and queue it.
+ */
+void IAVirtualSerialPrinter::handleLine(const std::string &line)
+{
+    if (line.empty())
+        return;
+    pLineCount++;
+    const char *s = line.c_str();
+    if (*s=='N') {
+        long n = atol(s+1);
+        size_t star = line.rfind('*');
+        if (star==std::string::npos) {
+            requestResend("No Checksum with line number");
+            return;
+        }
+        bool damaged = (pErrorInterval>0 && pLineCount%pErrorInterval==0);
+        if (damaged || checksum(s, star)!=(unsigned int)atoi(s+star+1)) {
+            requestResend("checksum mismatch");
+            return;
+        }
+        const char *cmd = s+1;
+        while (*cmd>='0' && *cmd<='9') cmd++;
+        while (*cmd==' ') cmd++;
+        if (strncmp(cmd, "M110", 4)==0) {
+            const char *np = strchr(cmd+4, 'N');
+            pLastLine = np ? atol(np+1) : n;
+            reply("ok\n");
+            return;
+        }
+        if (n!=pLastLine+1) {
+            requestResend("Line Number is not Last Line Number+1");
+            return;
+        }
+        pLastLine = n;
+    }
+
+    // wait until there is room in the command queue
+    double t = now();
+    while (!pQueue.empty() && pQueue.front()<=t)
+        pQueue.pop_front();
+    if ((int)pQueue.size()>=kQueueSize) {
+        double wait = pQueue.front()-t;
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        pQueue.pop_front();
+    }
+    double start = pQueue.empty() ? t : pQueue.back();
+    pQueue.push_back(start+kCommandTime);
+    pCommandCount++;
+    reply("ok\n");
+}
+
+
+/**
+ * Reject a line and ask for the next expected line again.
+ */
+void IAVirtualSerialPrinter::requestResend(const char *error)
+{
+    reply("Error:%s, Last Line: %ld\nResend: %ld\nok\n", error, pLastLine, pLastLine+1);
+}
+
+
+/**
+ * Send text to the print host.
+ */
+void IAVirtualSerialPrinter::reply(const char *format, ...)
+{
+#ifndef _WIN32
+    char buf[256];
+    va_list va;
+    va_start(va, format);
+    int n = vsnprintf(buf, sizeof(buf), format, va);
+    va_end(va);
+    if (n>0 && ::write(pFd, buf, std::min(n, (int)sizeof(buf)-1))<0) {
+        // the host disconnected
+    }
+#endif
+}
+
+
@@ -0,0 +1,173 @@
+//
+//  IAPrintHost.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_PRINT_HOST_H
+#define IA_PRINT_HOST_H
+
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+class IAVirtualSerialPrinter;
+
+
+/**
+ * Stream GCode directly to a printer over a serial port.
+ *
+ * Every command is sent with a line number and a checksum, the way Marlin,
+ * Repetier, and most other firmware expect it. Instead of waiting for the
+ * "ok" of every command, the host keeps a window of commands in flight and
+ * counts the "ok"s that come back, so the command queue of the firmware
+ * never runs empty, even for many short segments.
+ *
+ * When the firmware asks for a line again, the host sends all lines from
+ * that one on a second time. The firmware answers every line that it
+ * discards with another resend request, so the host ignores as many of
+ * those as it had lines in flight.
+ *
+ * Comments and empty lines are never sent. A background thread talks to
+ * the port, and write() only waits if too many commands are queued.
+ *
+ * If MeatPack is enabled, the host switches the firmware to MeatPack after
+ * the first command, and packs all numbered lines including their checksum.
+ * The checksum is calculated over the line without spaces, which is what
+ * the firmware gets after unpacking.
+ */
+class IAPrintHost
+{
+public:
+    IAPrintHost();
+    ~IAPrintHost();
+
+    bool open(const char *device, int window=kDefaultWindow, bool meatPack=false);
+    void write(const char *text, size_t size);
+    bool close();
+
+    /** Return true if a device is open. */
+    bool isOpen() { return pFd!=-1; }
+
+    /** Number of lines that the firmware asked for again. */
+    int resendCount() { return pResendCount; }
+
+    /// number of commands in flight if the caller does not say otherwise
+    static const int kDefaultWindow = 4;
+
+private:
+    void queueLine(const char *text, size_t size);
+    bool openDevice(const char *device, int baud);
+    void ioLoop();
+    void wakeUp();
+    bool sendLine();
+    bool sendData(const void *data, size_t size);
+    bool setPacking(bool packing);
+    void handleResponse(const std::string &line);
+    void fail(const char *message);
+
+    /// number of lines kept for resending
+    static const size_t kHistorySize = 1024;
+    /// write() waits if this many lines are waiting to be sent
+    static const size_t kMaxPending = 4096;
+
+    int pFd = -1;
+    /// pipe that wakes the I/O thread when lines were queued
+    int pWakeFd[2] = { -1, -1 };
+    std::thread pThread;
+    std::mutex pMutex;
+    /// wake the caller when there is room in the queue or all lines are done
+    std::condition_variable pWakeCaller;
+    /// text that write() received after the last newline
+    std::string pPartialLine;
+    /// commands that were not numbered and sent yet
+    std::deque<std::string> pPendingList;
+    /// numbered lines with checksum, in case the firmware asks again
+    std::deque<std::string> pHistory;
+    /// line number of the first entry in the history
+    long pHistoryFirst = 0;
+    /// number for the next new line
+    long pNextLine = 0;
+    /// number of the next line to send; smaller than pNextLine after a resend request
+    long pSendLine = 0;
+    /// commands that were sent, but not acknowledged by the firmware
+    int pInFlight = 0;
+    int pWindow = kDefaultWindow;
+    /// resend requests that are expected for lines that were discarded
+    long pIgnoreResends = 0;
+    long pLastResend = -1;
+    int pResendCount = 0;
+    /// remove spaces and pack lines with MeatPack after the first command
+    bool pMeatPack = false;
+    /// the firmware was switched to MeatPack
+    bool pPacking = false;
+    /// the firmware sent "start" or its first "ok"
+    bool pStarted = false;
+    bool pClosing = false;
+    /// description of the first error, empty if all went well
+    std::string pError;
+    /// used for "loopback" instead of a real device
+    IAVirtualSerialPrinter *pLoopback = nullptr;
+};
+
+
+/**
+ * A printer simulation on a pseudo terminal for testing the print host.
+ *
+ * The simulation checks line numbers and checksums like Marlin, and asks
+ * for a resend if they are wrong. It can also damage lines on purpose to
+ * test recovery. Commands are not executed, but they fill a command queue
+ * that empties at a fixed rate, so the "ok" is delayed when the queue is
+ * full, just like on a real printer.
+ */
+class IAVirtualSerialPrinter
+{
+public:
+    IAVirtualSerialPrinter();
+    ~IAVirtualSerialPrinter();
+
+    bool open();
+    void close();
+
+    /** The name of the device that the print host must open. */
+    const char *deviceName() { return pDeviceName.c_str(); }
+
+    /** Damage every nth line that arrives, or none if 0. */
+    void setErrorInterval(int n) { pErrorInterval = n; }
+
+    /** Number of commands that were accepted. */
+    long commandCount() { return pCommandCount; }
+
+    /// number of commands in the firmware queue
+    static const int kQueueSize = 4;
+
+private:
+    void firmwareLoop();
+    void handleLine(const std::string &line);
+    void requestResend(const char *error);
+    void reply(const char *format, ...);
+
+    int pFd = -1;
+    /// the other end of the terminal, kept open so it stays in raw mode
+    int pSlaveFd = -1;
+    std::string pDeviceName;
+    std::thread pThread;
+    std::atomic<bool> pQuit { false };
+    long pLastLine = 0;
+    long pCommandCount = 0;
+    long pLineCount = 0;
+    int pErrorInterval = 0;
+    /// time at which the commands in the queue will be done
+    std::deque<double> pQueue;
+};
+
+
+#endif /* IA_PRINT_HOST_H */
+
+
@@ -15,6 +15,7 @@
 #include "IAPrinterSLS.h"
 #include "view/IAGUIMain.h"
 #include "toolpath/IAToolpath.h"
+#include "opengl/IAFramebufferPool.h"
 
 #include <math.h>
 
@@ -126,7 +127,12 @@ void IAPrinter::initializeSceneSettings()
 void IAPrinter::purgeSlicesAndCaches()
 {
     gSlice.clear();
-    gSceneView->redraw();
+    // pooled framebuffers may hold OpenGL objects of the scene view
+    if (gSceneView && gSceneView->shown())
+        gSceneView->make_current();
+    IAFramebufferPool::purge();
+    if (gSceneView)
+        gSceneView->redraw();
 }
 
 
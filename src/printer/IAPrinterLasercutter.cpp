@@ -11,13 +11,20 @@
 #include "view/IAGUIMain.h"
 #include "view/IAProgressDialog.h"
 #include "toolpath/IAToolpath.h"
+#include "toolpath/IADxfWriter.h"
 #include "opengl/IAFramebuffer.h"
+#include "app/IAThreadPool.h"
 
 
 #include <FL/Fl_Native_File_Chooser.H>
 #include <FL/Fl_Input_Choice.H>
 #include <FL/Fl_Choice.H>
+#include <FL/Fl_Preferences.H>
 #include <FL/filename.H>
+#include <FL/fl_utf8.h>
+
+#include <algorithm>
+#include <errno.h>
 
 
 IAPrinterLasercutter::IAPrinterLasercutter()
@@ -30,7 +37,7 @@ IAPrinterLasercutter::IAPrinterLasercutter()
 IAPrinterLasercutter::IAPrinterLasercutter(IAPrinterLasercutter const& src)
 :   super(src)
 {
-    // nothing to copy
+    dxfLayout.set( src.dxfLayout() );
 }
 
 
@@ -60,10 +67,9 @@ void IAPrinterLasercutter::userSliceSave()
     if (pFirstWrite) {
         userSliceSaveAs();
     } else {
-        /** \bug if not yet sliced, do it */
-        //sliceAll();
-        /** \bug save to disk */
-        saveToolpaths();
+        Iota.Error.clear();
+        if (!saveToolpaths())
+            Iota.Error.showDialog();
     }
 }
 
@@ -74,7 +80,7 @@ void IAPrinterLasercutter::userSliceSave()
  */
 void IAPrinterLasercutter::userSliceSaveAs()
 {
-    if (queryOutputFilename("Save toolpath as GCode", "*.gcode", ".gcode")) {
+    if (queryOutputFilename("Save slices as DXF", "*.dxf", ".dxf")) {
         pFirstWrite = false;
         userSliceSave();
     }
@@ -92,95 +98,216 @@ void IAPrinterLasercutter::userSliceGenerateAll()
 
 
 /**
- * Create and cache all slices.
+ * Clear all cached slice outlines.
+ */
+void IAPrinterLasercutter::purgeSlicesAndCaches()
+{
+    pContourList.clear();
+    super::purgeSlicesAndCaches();
+}
+
+
+/**
+ * Draw the cached outlines of the slices from lo to hi.
+ */
+void IAPrinterLasercutter::drawPreview(double lo, double hi)
+{
+    for (int i=lo; i<=hi; i++) {
+        if (i<0 || i>=(int)pContourList.size()) continue;
+        if (pContourList[i]) pContourList[i]->draw();
+    }
+}
+
+
+/**
+ * Create and cache the outlines of all slices.
+ *
+ * The outlines are traced from a bitmap of every slice. Slicing stays in
+ * the main thread, but writing the cached outlines is done in parallel.
  */
 void IAPrinterLasercutter::sliceAll()
 {
-    double hgt = Iota.pMesh->pMax.z() - Iota.pMesh->pMin.z();
-    // initial height determines stickiness to bed
+    pContourList.clear();
+    if (!Iota.pMesh) return;
 
-    double zMin = layerHeight() * 0.7;
+    double hgt = Iota.pMesh->pMax.z() - Iota.pMesh->pMin.z();
     double zLayerHeight = layerHeight();
-    double zMax = hgt;
 
     // show a dialog to give the user a feedback for the Build choice
-    IAProgressDialog::show("Genrating slices",
+    IAProgressDialog::show("Generating slices",
                            "Slicing layer %d of %d at %.3fmm (%d%%)");
     Fl::wait(0.1);
 
-    int i = 0, n = (int)((zMax-zMin)/zLayerHeight);
-    for (double z=zMin; z<zMax; z+=zLayerHeight) {
+    int i, n = (int)(hgt/zLayerHeight);
+    pContourList.reserve(n);
+    for (i=0; i<n; i++) {
+        // cut every sheet in the middle of its height
+        double z = (i+0.5)*zLayerHeight;
         if (IAProgressDialog::update(i*100/n, i, n, z, i*100/n)) break;
-#if 0 // we do not cache these types of slices yet
-        gSlice.setNewZ(z);
-        gSlice.clear();
-        gSlice.generateRim(Iota.pMesh);
-        gSlice.tesselateLidFromRim();
-        gSlice.drawFlat(false, 1, 1, 1);
-#endif
-        i++;
+        IAFramebuffer sliceMap(this, IAFramebuffer::BITMAP);
+        IAMeshSlice slc(this);
+        slc.setNewZ(z);
+        slc.generateRim(Iota.pMesh);
+        slc.tesselateAndDrawLid(&sliceMap);
+        pContourList.push_back(sliceMap.toolpathFromLasso(z));
     }
     IAProgressDialog::hide();
-    gSceneView->redraw();
+    if (gSceneView) gSceneView->redraw();
 }
 
 
 /**
- * Virtual, implement the slicer for the given machine here.
+ * Write the cached slice outlines as DXF files.
+ *
+ * Depending on dxfLayout, every slice is written into its own file, adding
+ * the slice number to the filename, or all slices go into a single file,
+ * each on its own DXF layer. Every outline is written as a single POLYLINE
+ * entity.
+ *
+ * Slices are formatted and written in parallel, a batch at a time, so that
+ * the progress dialog is updated and can cancel in between.
+ *
+ * \param filename write to this file, or to the most recent upload filename
+ *
+ * \return false if a file could not be written, or if the user cancelled;
+ *         errors are set in Iota.Error
  */
-void IAPrinterLasercutter::saveToolpaths(const char *filename)
+bool IAPrinterLasercutter::saveToolpaths(const char *filename)
 {
-    assert(0);
-#if 0
     if (!filename)
-        filename = outputPath();
-    char fn[FL_PATH_MAX];
-    strcpy(fn, filename);
-    char *a = (char*)fl_filename_ext(fn);
-    const char *b = fl_filename_ext(filename);
-    if ( a && b ) {
-        sprintf(a, "_%%04d%s", b);
+        filename = recentUpload();
+    if (!filename)
+        return false;
+    if (pContourList.empty())
+        sliceAll();
+    int n = (int)pContourList.size();
+    if (n==0)
+        return false;
+
+    IAProgressDialog::show("Saving slices",
+                           "Writing slice %d of %d (%d%%)");
+
+    bool ok = true;
+    int batchSize = 4*(gThreadPool.numThreads()+1);
+    if (dxfLayout()==1) {
+        IADxfWriter w;
+        if (!w.open(filename, n)) {
+            Iota.Error.set("Saving slices", IAError::CantOpenFile_STR_BSD, filename);
+            IAProgressDialog::hide();
+            return false;
+        }
+        // format a batch of slices in parallel, then append them in order
+        std::vector<IADxfWriter> layerList(batchSize);
+        for (int first=0; first<n; first+=batchSize) {
+            if (IAProgressDialog::update(first*100/n, first, n, first*100/n)) {
+                ok = false;
+                break;
+            }
+            int count = std::min(batchSize, n-first);
+            gThreadPool.parallelFor(0, count, 1, [this, &layerList, first](int begin, int end) {
+                for (int i=begin; i<end; i++) {
+                    if (!pContourList[first+i]) continue;
+                    layerList[i].setLayer(first+i);
+                    pContourList[first+i]->saveDXF(layerList[i]);
+                }
+            });
+            for (int i=0; i<count; i++)
+                w.append(layerList[i]);
+        }
+        if (!w.close())
+            ok = false;
+        if (!ok)
+            fl_unlink(filename);
     } else {
-        strcat(fn, "_%04d");
+        char fn[FL_PATH_MAX];
+        strcpy(fn, filename);
+        char *a = (char*)fl_filename_ext(fn);
+        const char *b = fl_filename_ext(filename);
+        if ( a && b && *b ) {
+            sprintf(a, "_%%04d%s", b);
+        } else {
+            strcat(fn, "_%04d.dxf");
+        }
+        // Iota.Error is not thread safe, so workers only remember the errno
+        // of every slice, and the error is reported here
+        std::vector<int> errList(n, 0);
+        bool cancelled = false;
+        for (int first=0; first<n; first+=batchSize) {
+            if (IAProgressDialog::update(first*100/n, first, n, first*100/n)) {
+                cancelled = true;
+                break;
+            }
+            int last = std::min(first+batchSize, n);
+            gThreadPool.parallelFor(first, last, 1, [this, &fn, &errList](int begin, int end) {
+                for (int i=begin; i<end; i++) {
+                    char dxfFilename[FL_PATH_MAX+16];
+                    snprintf(dxfFilename, sizeof(dxfFilename), fn, i);
+                    IADxfWriter w;
+                    if (!w.open(dxfFilename)) {
+                        errList[i] = errno ? errno : EIO;
+                        continue;
+                    }
+                    if (pContourList[i])
+                        pContourList[i]->saveDXF(w);
+                    if (!w.close(false))
+                        errList[i] = errno ? errno : EIO;
+                }
+            });
+        }
+        auto err = std::find_if(errList.begin(), errList.end(), [](int e){ return e!=0; });
+        if (err!=errList.end()) {
+            char dxfFilename[FL_PATH_MAX+16];
+            snprintf(dxfFilename, sizeof(dxfFilename), fn, (int)(err-errList.begin()));
+            errno = *err;
+            Iota.Error.set("Saving slices", IAError::CantWriteFile_STR_BSD, dxfFilename);
+            ok = false;
+        }
+        if (cancelled)
+            ok = false;
     }
 
-    pMachineToolpath.clear();
-    
-    double hgt = Iota.pMesh->pMax.z() - Iota.pMesh->pMin.z();
-    // initial height determines stickiness to bed
+    IAProgressDialog::hide();
+    return ok;
+}
 
-    double zMin = 0.5 * layerHeight();
-    double zLayerHeight = layerHeight();
-    double zMax = hgt;
 
-    IAProgressDialog::show("Saving slices",
-                           "Writing layer %d of %d at %.3fmm (%d%%)");
-    int i = 0, n = (int)((zMax-zMin)/zLayerHeight);
-    for (double z=zMin; z<zMax; z+=zLayerHeight) {
-        if (IAProgressDialog::update(i*100/n, i, n, z, i*100/n)) break;
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
 
-        gSlice.setNewZ(z);
-        gSlice.clear();
-        gSlice.generateRim(Iota.pMesh);
-        gSlice.tesselateLidFromRim();
-        gSlice.drawFlat(false, 1, 1, 1);
 
-        uint8_t *rgb = gSlice.pColorbuffer->getRawImageRGB();
-        IAToolpathList *tp = new IAToolpathList(z);
-        gSlice.pFramebuffer->traceOutline(tp, z);
-//        tp->pToolpathList.push_back(new IAToolpathExtruder(1));
+void IAPrinterLasercutter::createPropertiesControls()
+{
+    IATreeItemController *s;
+
+    super::createPropertiesControls();
+
+    static Fl_Menu_Item dxfLayoutMenu[] = {
+        { "one file per slice", 0, nullptr, (void*)0, 0, 0, 0, 11 },
+        { "one file, slices on layers", 0, nullptr, (void*)1, 0, 0, 0, 11 },
+        { nullptr } };
+    s = new IAChoiceController("dxfLayout", "DXF files:", dxfLayout,
+                               []{}, dxfLayoutMenu );
+    s->tooltip("Write every slice into its own numbered file, or all slices "
+               "into a single file with one DXF layer per slice.");
+    pPropertiesControllerList.push_back(s);
+}
 
-        char dxfFilename[2048];
-        sprintf(dxfFilename, fn, i);
-        tp->saveDXF(dxfFilename);
 
-        delete tp;
-        free(rgb);
-        i++;
-    }
-    IAProgressDialog::hide();
-    gSceneView->redraw();
-#endif
+void IAPrinterLasercutter::readProperties(Fl_Preferences &printer)
+{
+    super::readProperties(printer);
+    Fl_Preferences properties(printer, "properties");
+    dxfLayout.read(properties);
+}
+
+
+void IAPrinterLasercutter::writeProperties(Fl_Preferences &printer)
+{
+    super::writeProperties(printer);
+    Fl_Preferences properties(printer, "properties");
+    dxfLayout.write(properties);
 }
 
 
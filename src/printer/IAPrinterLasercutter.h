@@ -9,6 +9,8 @@
 
 #include "printer/IAPrinter.h"
 
+#include <vector>
+
 class Fl_Widget;
 class Fl_Choice;
 class Fl_Input_Choice;
@@ -37,9 +39,25 @@ public:
     virtual void userSliceSaveAs() override;
     virtual void userSliceGenerateAll() override;
 
+    virtual void purgeSlicesAndCaches() override;
+    virtual void drawPreview(double lo, double hi) override;
+
     // ----
     void sliceAll();
-    void saveToolpaths(const char *filename = nullptr);
+    bool saveToolpaths(const char *filename = nullptr);
+
+    // ---- controllers
+    virtual void createPropertiesControls() override;
+
+    // ---- properties
+    virtual void readProperties(Fl_Preferences &p) override;
+    virtual void writeProperties(Fl_Preferences &p) override;
+
+    IAIntProperty dxfLayout { "dxfLayout", 0 }; // 0: file per slice, 1: one file, slices on layers
+
+private:
+    /// outline of every slice, indexed by slice number
+    std::vector<IAToolpathListSP> pContourList;
 };
 
 
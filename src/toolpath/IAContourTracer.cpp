@@ -0,0 +1,353 @@
+//
+//  IAContourTracer.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAContourTracer.h"
+
+#include "Iota.h"
+#include "opengl/IAFramebuffer.h"
+#include "printer/IAPrinter.h"
+#include "potrace/bitmap.h"
+
+#include <math.h>
+#include <unordered_map>
+#include <vector>
+
+
+/** Coverage values at or above this are inside of the outline. */
+static const int kInside = 128;
+
+/** The outline is where the coverage crosses this value. */
+static const double kIsoValue = 127.5;
+
+/** Ignore specks in bitmaps that are smaller than this, same as potrace. */
+static const double kMinBitmapArea = 20.0;
+
+
+/**
+ * Prepare tracing a framebuffer.
+ *
+ * \param fb a framebuffer of any type; OpenGL buffers are read into memory
+ */
+IAContourTracer::IAContourTracer(IAFramebuffer *fb)
+:   pWidth( fb->width() ),
+    pHeight( fb->height() )
+{
+    if (fb->pCoverage) {
+        pCoverage = fb->pCoverage;
+    } else if (fb->pBitmap) {
+        pBitmap = fb->pBitmap;
+        pMinArea = kMinBitmapArea;
+    } else {
+        pRGB = fb->getRawImageRGB();
+        pMinArea = kMinBitmapArea;
+    }
+}
+
+
+/**
+ * Release the image data that we read from OpenGL.
+ */
+IAContourTracer::~IAContourTracer()
+{
+    if (pRGB)
+        ::free((void*)pRGB);
+}
+
+
+/**
+ * Return the coverage of a pixel; pixels outside of the buffer are empty.
+ */
+int IAContourTracer::value(int x, int y)
+{
+    if (x<0 || y<0 || x>=pWidth || y>=pHeight)
+        return 0;
+    if (pCoverage)
+        return pCoverage[y*pWidth+x];
+    if (pBitmap)
+        return BM_UGET(pBitmap, x, y) ? 255 : 0;
+    return pRGB[(y*pWidth+x)*3]>128 ? 255 : 0;
+}
+
+
+/**
+ * Check if the bitmap cells from cx to cx+BM_WORDBITS-2 have no crossings.
+ *
+ * This is true if the bitmap words in the row above and below are both
+ * all clear or both all set, so we can skip a whole word at once.
+ *
+ * \param cx the first cell, must be the first pixel in a bitmap word
+ * \param cy the row of cells
+ */
+bool IAContourTracer::isUniform(int cx, int cy)
+{
+    if (!pBitmap || cx<0 || (cx & (BM_WORDBITS-1)) || cx+BM_WORDBITS>pWidth)
+        return false;
+    potrace_word a = (cy>=0) ? *bm_index(pBitmap, cx, cy) : 0;
+    potrace_word b = (cy+1<pHeight) ? *bm_index(pBitmap, cx, cy+1) : 0;
+    return a==b && (a==0 || a==BM_ALLBITS);
+}
+
+
+/**
+ * Remove points from a closed loop using the Douglas-Peucker algorithm.
+ *
+ * \param loop x and y coordinates of the points in the loop
+ * \param tolerance all removed points are closer than this to the new outline
+ */
+void IAContourTracer::simplify(std::vector<double> &loop, double tolerance)
+{
+    size_t n = loop.size()/2;
+    if (n<4) return;
+
+    // start with the first point and the point farthest away from it
+    size_t far = 0;
+    double farDist = -1.0;
+    for (size_t i=1; i<n; i++) {
+        double dx = loop[2*i]-loop[0], dy = loop[2*i+1]-loop[1];
+        double d = dx*dx + dy*dy;
+        if (d>farDist) { farDist = d; far = i; }
+    }
+
+    std::vector<bool> keep(n, false);
+    keep[0] = keep[far] = true;
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.push_back(std::make_pair(0, far));
+    stack.push_back(std::make_pair(far, n)); // index n wraps around to 0
+    while (!stack.empty()) {
+        size_t first = stack.back().first, last = stack.back().second;
+        stack.pop_back();
+        if (last-first<2) continue;
+        double x0 = loop[2*first], y0 = loop[2*first+1];
+        double x1 = loop[2*(last%n)], y1 = loop[2*(last%n)+1];
+        double dx = x1-x0, dy = y1-y0;
+        double len = sqrt(dx*dx + dy*dy);
+        size_t maxIndex = first;
+        double maxDist = -1.0;
+        for (size_t i=first+1; i<last; i++) {
+            double px = loop[2*i]-x0, py = loop[2*i+1]-y0;
+            double d = (len>0.0) ? fabs(px*dy - py*dx)/len : sqrt(px*px + py*py);
+            if (d>maxDist) { maxDist = d; maxIndex = i; }
+        }
+        if (maxDist>tolerance) {
+            keep[maxIndex] = true;
+            stack.push_back(std::make_pair(first, maxIndex));
+            stack.push_back(std::make_pair(maxIndex, last));
+        }
+    }
+
+    size_t j = 0;
+    for (size_t i=0; i<n; i++) {
+        if (keep[i]) {
+            loop[2*j] = loop[2*i];
+            loop[2*j+1] = loop[2*i+1];
+            j++;
+        }
+    }
+    loop.resize(2*j);
+}
+
+
+/**
+ * Trace all outlines and add them as loops to a toolpath list.
+ *
+ * \param toolpathList add outlines to this list
+ * \param z the z position of all loops
+ * \param tolerance remove points that are closer than this to the outline,
+ *        in millimeters
+ *
+ * \return the number of loops that were added
+ */
+int IAContourTracer::trace(IAToolpathList *toolpathList, double z, double tolerance)
+{
+    if (!pCoverage && !pBitmap && !pRGB) return 0;
+
+    /*
+     * Every cell of marching squares has four pixel centers as its corners.
+     * Every edge of a cell with one corner inside and one outside has a
+     * crossing. Walking the cell counter-clockwise, we leave the inside at
+     * one crossing and enter it at another. A segment of the outline runs
+     * from the leaving crossing to the entering one. The neighbouring cell
+     * shares that edge and walks it in the opposite direction, so its segment
+     * starts where ours ends.
+     */
+    struct Segment {
+        long long pNext;
+        double pX, pY;
+    };
+    std::unordered_map<long long, Segment> segmentMap;
+
+    const long long stride = pWidth + 2;
+    // unique index of the horizontal edge to the right of corner x, y
+    auto hEdge = [stride](int x, int y) { return 2*((long long)(y+1)*stride + (x+1)); };
+    // unique index of the vertical edge above corner x, y
+    auto vEdge = [stride](int x, int y) { return 2*((long long)(y+1)*stride + (x+1)) + 1; };
+
+    for (int cy=-1; cy<pHeight; cy++) {
+        for (int cx=-1; cx<pWidth; cx++) {
+            if (isUniform(cx, cy)) {
+                cx += BM_WORDBITS-2;
+                continue;
+            }
+            // the corners in counter-clockwise order
+            int px[4] = { cx, cx+1, cx+1, cx };
+            int py[4] = { cy, cy, cy+1, cy+1 };
+            int v[4], nInside = 0;
+            for (int k=0; k<4; k++) {
+                v[k] = value(px[k], py[k]);
+                if (v[k]>=kInside) nInside++;
+            }
+            if (nInside==0 || nInside==4) continue;
+
+            long long edge[4] = { hEdge(cx, cy), vEdge(cx+1, cy), hEdge(cx, cy+1), vEdge(cx, cy) };
+            long long crossEdge[4];
+            bool crossLeaves[4];
+            double crossX[4], crossY[4];
+            int n = 0;
+            for (int k=0; k<4; k++) {
+                int a = k, b = (k+1)&3;
+                bool inA = (v[a]>=kInside), inB = (v[b]>=kInside);
+                if (inA==inB) continue;
+                double t = (kIsoValue - v[a]) / (double)(v[b] - v[a]);
+                crossEdge[n] = edge[k];
+                crossLeaves[n] = inA;
+                crossX[n] = px[a] + 0.5 + t*(px[b]-px[a]);
+                crossY[n] = py[a] + 0.5 + t*(py[b]-py[a]);
+                n++;
+            }
+
+            // In a saddle cell, the center decides if the two inside
+            // corners are connected.
+            bool connected = true;
+            if (n==4) {
+                double center = (v[0]+v[1]+v[2]+v[3]) * 0.25;
+                connected = (center>=kIsoValue);
+            }
+
+            for (int k=0; k<n; k++) {
+                if (!crossLeaves[k]) continue;
+                int j = connected ? (k+1)%n : (k+n-1)%n;
+                segmentMap[crossEdge[k]] = { crossEdge[j], crossX[k], crossY[k] };
+            }
+        }
+    }
+
+    IAVector3d &printbed = Iota.pCurrentPrinter->pPrintVolume;
+    double xScl = printbed.x()/pWidth;
+    double yScl = printbed.y()/pHeight;
+    double pixelTolerance = tolerance/xScl;
+
+    std::vector<Contour> contourList;
+    std::vector<double> loop;
+    while (!segmentMap.empty()) {
+        // follow the segments until we are back at the start
+        loop.clear();
+        auto it = segmentMap.begin();
+        long long start = it->first;
+        long long next = start;
+        for (;;) {
+            auto s = segmentMap.find(next);
+            if (s==segmentMap.end()) break;
+            loop.push_back(s->second.pX);
+            loop.push_back(s->second.pY);
+            next = s->second.pNext;
+            segmentMap.erase(s);
+            if (next==start) break;
+        }
+
+        size_t nPoints = loop.size()/2;
+        if (nPoints<3) continue;
+        double area = 0.0;
+        for (size_t i=0; i<nPoints; i++) {
+            size_t j = (i+1)%nPoints;
+            area += loop[2*i]*loop[2*j+1] - loop[2*j]*loop[2*i+1];
+        }
+        area *= 0.5;
+        if (fabs(area)<pMinArea) continue;
+        contourList.push_back(Contour());
+        contourList.back().pPoints.swap(loop);
+        contourList.back().pArea = area;
+    }
+
+    // Outlines run counter-clockwise and have a positive area. Every
+    // outline starts an island. Holes belong to the smallest outline
+    // that contains them.
+    int firstIsland = toolpathList->numIslands();
+    int nIslands = 0;
+    for (auto &c: contourList) {
+        if (c.pArea>0.0)
+            c.pIsland = nIslands++;
+    }
+    for (auto &hole: contourList) {
+        if (hole.pArea>0.0) continue;
+        double x = hole.pPoints[0], y = hole.pPoints[1];
+        double bestArea = 0.0;
+        for (auto &c: contourList) {
+            if (c.pArea<=0.0) continue;
+            if (bestArea>0.0 && c.pArea>=bestArea) continue;
+            if (!contains(c.pPoints, x, y)) continue;
+            bestArea = c.pArea;
+            hole.pIsland = c.pIsland;
+        }
+    }
+
+    // write every island, followed by its holes
+    std::vector<std::vector<Contour*>> islandList(nIslands);
+    std::vector<Contour*> orphanList;
+    for (auto &c: contourList) {
+        if (c.pIsland<0)
+            orphanList.push_back(&c);
+        else if (c.pArea>0.0)
+            islandList[c.pIsland].insert(islandList[c.pIsland].begin(), &c);
+        else
+            islandList[c.pIsland].push_back(&c);
+    }
+    islandList.push_back(orphanList);
+
+    int nLoops = 0;
+    for (auto &island: islandList) {
+        for (auto c: island) {
+            std::vector<double> &pts = c->pPoints;
+            simplify(pts, pixelTolerance);
+            size_t nPoints = pts.size()/2;
+            IAToolpathLoop *toolpathLoop = new IAToolpathLoop(z);
+            toolpathLoop->startPath(pts[0]*xScl, pts[1]*yScl);
+            for (size_t i=1; i<nPoints; i++)
+                toolpathLoop->continuePath(pts[2*i]*xScl, pts[2*i+1]*yScl);
+            toolpathLoop->closePath();
+            if (c->pIsland>=0)
+                toolpathLoop->pIsland = firstIsland + c->pIsland;
+            toolpathLoop->pIsHole = (c->pArea<0.0);
+            toolpathList->add(toolpathLoop, 0, 0, 0);
+            nLoops++;
+        }
+    }
+    return nLoops;
+}
+
+
+/**
+ * Check if a point is inside a closed loop, using the even-odd rule.
+ *
+ * \param loop x and y coordinates of the points in the loop
+ * \param x, y the point to test
+ */
+bool IAContourTracer::contains(const std::vector<double> &loop, double x, double y)
+{
+    bool inside = false;
+    size_t n = loop.size()/2;
+    for (size_t i=0, j=n-1; i<n; j=i++) {
+        double xi = loop[2*i], yi = loop[2*i+1];
+        double xj = loop[2*j], yj = loop[2*j+1];
+        if ( (yi>y) != (yj>y) ) {
+            if (x < xi + (y-yi)*(xj-xi)/(yj-yi))
+                inside = !inside;
+        }
+    }
+    return inside;
+}
+
+
@@ -0,0 +1,77 @@
+//
+//  IAContourTracer.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_CONTOUR_TRACER_H
+#define IA_CONTOUR_TRACER_H
+
+
+#include "toolpath/IAToolpath.h"
+#include "potrace/potracelib.h"
+
+#include <stdint.h>
+#include <vector>
+
+
+class IAFramebuffer;
+
+
+/**
+ * Trace the outlines in a framebuffer using marching squares.
+ *
+ * The tracer runs marching squares across the pixel centers and finds the
+ * line where the coverage crosses 50%. In COVERAGE buffers, the position of
+ * the crossing is interpolated between two pixels, so the outline is
+ * accurate to a fraction of a pixel. In BITMAP and RGBA buffers, the outline
+ * follows the pixel boundaries with the corners cut off.
+ *
+ * Unlike potrace, the tracer does not fit curves. Instead, the outlines are
+ * simplified with the Douglas-Peucker algorithm, which removes all points
+ * that are closer than a given tolerance to the simplified outline. This is
+ * much faster and good enough for support structures, lids, and skirts.
+ *
+ * All outlines are closed loops. Outer outlines run counter-clockwise, holes
+ * run clockwise. Every outer outline starts a new island, and its holes are
+ * added right after it with the same island number.
+ */
+class IAContourTracer
+{
+public:
+    IAContourTracer(IAFramebuffer *fb);
+    ~IAContourTracer();
+    int trace(IAToolpathList *toolpathList, double z, double tolerance=0.0);
+
+private:
+    /**
+     * A closed outline in pixel coordinates.
+     */
+    class Contour {
+    public:
+        std::vector<double> pPoints;
+        double pArea = 0.0;
+        int pIsland = -1;
+    };
+
+    int value(int x, int y);
+    bool isUniform(int cx, int cy);
+    static void simplify(std::vector<double> &loop, double tolerance);
+    static bool contains(const std::vector<double> &loop, double x, double y);
+
+    /// coverage data of the buffer, or nullptr
+    uint8_t *pCoverage = nullptr;
+    /// bitmap of the buffer, or nullptr
+    potrace_bitmap_t *pBitmap = nullptr;
+    /// RGB data read from an OpenGL buffer, or nullptr
+    uint8_t *pRGB = nullptr;
+    /// size of the buffer in pixels
+    int pWidth = 0, pHeight = 0;
+    /// ignore loops that enclose less than this many square pixels
+    double pMinArea = 1.0;
+};
+
+
+#endif /* IA_CONTOUR_TRACER_H */
+
+
@@ -10,7 +10,10 @@
 #include "Iota.h"
 #include "data/binaryData.h"
 
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
 
 
 /**
@@ -26,7 +29,7 @@ IADxfWriter::IADxfWriter()
  */
 IADxfWriter::~IADxfWriter()
 {
-    if (pFile!=nullptr) close();
+    if (pSink.isOpen()) close();
 }
 
 
@@ -34,20 +37,20 @@ IADxfWriter::~IADxfWriter()
  * Create a minimal DXF file for writing.
  *
  * \param filename path and name for the file we want to create.
+ * \param numLayers add this many layers, named by layerName(), to the layer
+ *        table, so that every slice can be written to its own layer
  *
- * \return true, if the file was created, false, if there was any kind of error.
- *
- * \todo add user friendly error handling.
+ * \return true, if the file was created, false, if there was any kind of
+ *         error; errno is set
  */
-bool IADxfWriter::open(const char *filename)
+bool IADxfWriter::open(const char *filename, int numLayers)
 {
-    pFile = fopen(filename, "wb");
-    if (!pFile) {
-        // set error
-        printf("Can't open file %s\n", filename);
+    if (!pSink.open(filename)) {
+        // errno is set, the caller reports the error
         return false;
     }
-    fputs( // Header
+    pBuffer.clear();
+    pBuffer.append( // Header
           "999\r\n"
           "DXF created from Iota\r\n"
           "0\r\n"
@@ -57,7 +60,7 @@ bool IADxfWriter::open(const char *filename)
           "9\r\n"
           "$ACADVER\r\n"
           "1\r\n"
-          "AC1006\r\n"
+          "AC1009\r\n"
           "9\r\n"
           "$INSBASE\r\n"
           "10\r\n"
@@ -79,8 +82,8 @@ bool IADxfWriter::open(const char *filename)
           "20\r\n"
           "1000.0\r\n"
           "0\r\n"
-          "ENDSEC\r\n", pFile);
-    fputs(
+          "ENDSEC\r\n");
+    pBuffer.append(
           "0\r\n"
           "SECTION\r\n"
           "2\r\n"
@@ -110,29 +113,28 @@ bool IADxfWriter::open(const char *filename)
           "0\r\n"
           "TABLE\r\n"
           "2\r\n"
-          "LAYER\r\n"
-          "70\r\n"
-          "6\r\n"
-          "0\r\n"
-          "LAYER\r\n"
-          "2\r\n"
-          "1\r\n"
-          "70\r\n"
-          "64\r\n"
-          "62\r\n"
-          "7\r\n"
-          "6\r\n"
-          "CONTINUOUS\r\n"
-          "0\r\n"
-          "LAYER\r\n"
-          "2\r\n"
-          "2\r\n"
-          "70\r\n"
-          "64\r\n"
-          "62\r\n"
-          "7\r\n"
-          "6\r\n"
-          "CONTINUOUS\r\n"
+          "LAYER\r\n");
+    sendGroup(70, std::max(6, numLayers+2));
+    sendGroup(0, "LAYER");
+    sendGroup(2, "1");
+    sendGroup(70, 64);
+    sendGroup(62, 7);
+    sendGroup(6, "CONTINUOUS");
+    sendGroup(0, "LAYER");
+    sendGroup(2, "2");
+    sendGroup(70, 64);
+    sendGroup(62, 7);
+    sendGroup(6, "CONTINUOUS");
+    for (int i=0; i<numLayers; i++) {
+        char name[16];
+        layerName(name, i);
+        sendGroup(0, "LAYER");
+        sendGroup(2, name);
+        sendGroup(70, 64);
+        sendGroup(62, 7);
+        sendGroup(6, "CONTINUOUS");
+    }
+    pBuffer.append(
           "0\r\n"
           "ENDTAB\r\n"
           "0\r\n"
@@ -144,19 +146,19 @@ bool IADxfWriter::open(const char *filename)
           "0\r\n"
           "ENDTAB\r\n"
           "0\r\n"
-          "ENDSEC\r\n", pFile);
-    fputs(
+          "ENDSEC\r\n");
+    pBuffer.append(
           "0\r\n"
           "SECTION\r\n"
           "2\r\n"
           "BLOCKS\r\n"
           "0\r\n"
-          "ENDSEC\r\n", pFile);
-    fputs(
+          "ENDSEC\r\n");
+    pBuffer.append(
           "0\r\n"
           "SECTION\r\n"
           "2\r\n"
-          "ENTITIES\r\n", pFile);
+          "ENTITIES\r\n");
     return true;
 }
 
@@ -168,28 +170,169 @@ bool IADxfWriter::open(const char *filename)
  */
 void IADxfWriter::cmdLine(IAVector3d &a, IAVector3d &b)
 {
-    fprintf(pFile,
-            "0\r\n"
-            "LINE\r\n"
-            "8\r\n"
-            "2\r\n"
-            "62\r\n"
-            "4\r\n"
-            "10\r\n"
-            "%f\r\n"
-            "20\r\n"
-            "%f\r\n"
-            "30\r\n"
-            "%f\r\n"
-            "11\r\n"
-            "%f\r\n"
-            "21\r\n"
-            "%f\r\n"
-            "31\r\n"
-            "%f\r\n",
-            a.x(), a.y(), 0.0,
-            b.x(), b.y(), 0.0
-            );
+    sendGroup(0, "LINE");
+    sendGroup(8, pLayer);
+    sendGroup(62, 4);
+    sendGroup(10, a.x());
+    sendGroup(20, a.y());
+    sendGroup(30, 0.0);
+    sendGroup(11, b.x());
+    sendGroup(21, b.y());
+    sendGroup(31, 0.0);
+}
+
+
+/**
+ * Start a polyline.
+ *
+ * A single POLYLINE entity with its vertices is much smaller than a LINE
+ * entity for every segment, and laser software can cut it in one go.
+ * Vertices follow by calling cmdVertex(), and cmdEndPolyline() finishes
+ * the entity.
+ *
+ * \param closed if set, the last vertex is connected to the first one; the
+ *        first vertex must not be repeated at the end
+ */
+void IADxfWriter::cmdBeginPolyline(bool closed)
+{
+    sendGroup(0, "POLYLINE");
+    sendGroup(8, pLayer);
+    sendGroup(62, 4);
+    sendGroup(66, 1);
+    sendGroup(10, 0.0);
+    sendGroup(20, 0.0);
+    sendGroup(30, 0.0);
+    sendGroup(70, closed ? 1 : 0);
+}
+
+
+/**
+ * Add a vertex to the polyline started by cmdBeginPolyline().
+ */
+void IADxfWriter::cmdVertex(double x, double y)
+{
+    sendGroup(0, "VERTEX");
+    sendGroup(8, pLayer);
+    sendGroup(10, x);
+    sendGroup(20, y);
+    sendGroup(30, 0.0);
+}
+
+
+/**
+ * Finish the polyline started by cmdBeginPolyline().
+ */
+void IADxfWriter::cmdEndPolyline()
+{
+    sendGroup(0, "SEQEND");
+    sendGroup(8, pLayer);
+}
+
+
+/**
+ * Place all following entities on a numbered layer.
+ */
+void IADxfWriter::setLayer(int layer)
+{
+    layerName(pLayer, layer);
+}
+
+
+/**
+ * Create the name of a numbered layer.
+ *
+ * \param buf room for at least 16 characters
+ * \param layer layer index
+ */
+void IADxfWriter::layerName(char *buf, int layer)
+{
+    snprintf(buf, 16, "SLICE%04d", layer);
+}
+
+
+/**
+ * Move all entities from a writer that was not opened into this file.
+ */
+void IADxfWriter::append(IADxfWriter &entities)
+{
+    if (pBuffer.empty())
+        pBuffer.swap(entities.pBuffer);
+    else
+        pBuffer.append(entities.pBuffer);
+    entities.pBuffer.clear();
+    flush();
+}
+
+
+/**
+ * Write a group code and a text value.
+ */
+void IADxfWriter::sendGroup(int code, const char *value)
+{
+    char buf[16];
+    int n = snprintf(buf, sizeof(buf), "%d\r\n", code);
+    pBuffer.append(buf, n);
+    pBuffer.append(value);
+    pBuffer.append("\r\n", 2);
+    if (pBuffer.size()>kFlushSize)
+        flush();
+}
+
+
+/**
+ * Write a group code and an integer value.
+ */
+void IADxfWriter::sendGroup(int code, int value)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", value);
+    sendGroup(code, buf);
+}
+
+
+/**
+ * Write a group code and a coordinate.
+ *
+ * This is the same as printf("%f"), but much faster, because the number is
+ * formatted as an integer.
+ */
+void IADxfWriter::sendGroup(int code, double value)
+{
+    char buf[32], *d = buf;
+    double a = fabs(value)*1e6 + 0.5;
+    if (!(a<9e15)) {
+        // NaN, infinite, or too large for the integer formatter
+        snprintf(buf, sizeof(buf), "%f", value);
+    } else {
+        uint64_t n = (uint64_t)a;
+        if (value<0.0 && n!=0) *d++ = '-';
+        char digits[24];
+        int len = 0;
+        do {
+            digits[len++] = (char)('0' + n%10);
+            n /= 10;
+        } while (n || len<=6);
+        for (int i=len-1; i>=0; i--) {
+            *d++ = digits[i];
+            if (i==6) *d++ = '.';
+        }
+        *d = 0;
+    }
+    sendGroup(code, buf);
+}
+
+
+/**
+ * Hand the buffered text to the output sink.
+ *
+ * Writers that were not opened keep all text in memory.
+ */
+void IADxfWriter::flush()
+{
+    if (!pSink.isOpen() || pBuffer.empty())
+        return;
+    pSink.write(pBuffer.data(), pBuffer.size());
+    pBuffer.clear();
 }
 
 
@@ -197,19 +340,22 @@ void IADxfWriter::cmdLine(IAVector3d &a, IAVector3d &b)
  * Close the DXF file.
  *
  * Safe to call if no file was opened, or opening a file failed.
+ *
+ * \param reportError see IAOutputSink::close()
+ *
+ * \return false if the file could not be written completely
  */
-void IADxfWriter::close()
+bool IADxfWriter::close(bool reportError)
 {
-    if (pFile!=nullptr) {
-        fputs(
-              "0\r\n"
-              "ENDSEC\r\n"
-              "0\r\n"
-              "EOF\r\n", pFile);
-
-        fclose(pFile);
-        pFile = nullptr;
-    }
+    if (!pSink.isOpen())
+        return false;
+    pBuffer.append(
+          "0\r\n"
+          "ENDSEC\r\n"
+          "0\r\n"
+          "EOF\r\n");
+    flush();
+    return pSink.close(reportError);
 }
 
 
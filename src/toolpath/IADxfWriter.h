@@ -9,13 +9,20 @@
 
 
 #include "geometry/IAVector3d.h"
+#include "app/IAOutputSink.h"
 
+#include <string>
 #include <vector>
 #include <map>
 
 
 /**
  * Helps the toolpath classes to write DXF files.
+ *
+ * Entities are formatted into a memory buffer, which is handed to the
+ * output sink in large blocks. A writer that was never opened just keeps
+ * the entities in memory, so layers can be formatted in parallel and then
+ * appended to a file that is open in another writer.
  */
 class IADxfWriter
 {
@@ -23,13 +30,34 @@ public:
     IADxfWriter();
     ~IADxfWriter();
 
-    bool open(const char *filename);
-    void close();
+    bool open(const char *filename, int numLayers=0);
+    bool close(bool reportError=true);
+
+    void setLayer(int layer);
+    void append(IADxfWriter &entities);
 
     void cmdLine(IAVector3d &a, IAVector3d &b);
+    void cmdBeginPolyline(bool closed);
+    void cmdVertex(double x, double y);
+    void cmdEndPolyline();
+
+    static void layerName(char *buf, int layer);
 
 private:
-    FILE *pFile = nullptr;
+    void sendGroup(int code, const char *value);
+    void sendGroup(int code, int value);
+    void sendGroup(int code, double value);
+    void flush();
+
+    /// the buffer is handed to the sink when it grows beyond this size
+    static const size_t kFlushSize = 256*1024;
+
+    /// writes the file in a background thread
+    IAOutputSink pSink;
+    /// formatted text that was not written yet
+    std::string pBuffer;
+    /// entities are placed on this DXF layer
+    char pLayer[16] = "2";
     //int pHandle = 0x3C;
 };
 
@@ -0,0 +1,707 @@
+//
+//  IAGcodeEncoder.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAGcodeEncoder.h"
+
+#include "Iota.h"
+#include "app/IAOutputSink.h"
+
+#include <FL/fl_utf8.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+
+/** Magic bytes at the start of a block encoded file. */
+static const char kBlockMagic[4] = { 'I', 'A', 'G', 'C' };
+
+/** Matches must be at least this long. */
+static const size_t kMinMatch = 4;
+
+/** The last bytes of a block are always literals. */
+static const size_t kLastLiterals = 5;
+
+/** No match may start in the last bytes of a block. */
+static const size_t kMatchLimit = 12;
+
+/** Size of the match finder hash table in bits. */
+static const int kHashBits = 14;
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Create an encoder for one of the output formats.
+ *
+ * \param format PLAIN, MEATPACK, or BLOCKS; unknown formats are written plain
+ * \param sink the encoded data is written to this sink
+ *
+ * \return a new encoder; the caller must delete it
+ */
+IAGcodeEncoder *IAGcodeEncoder::create(int format, IAOutputSink &sink)
+{
+    switch (format) {
+        case MEATPACK: return new IAMeatPackEncoder(sink);
+        case BLOCKS: return new IABlockEncoder(sink);
+        default: return new IAPlainEncoder(sink);
+    }
+}
+
+
+/**
+ * Create an encoder that writes to an open sink.
+ */
+IAGcodeEncoder::IAGcodeEncoder(IAOutputSink &sink)
+:   pSink( sink )
+{
+}
+
+
+/**
+ * Release all resources.
+ */
+IAGcodeEncoder::~IAGcodeEncoder()
+{
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Copy the text to the sink.
+ */
+void IAPlainEncoder::write(const char *text, size_t size)
+{
+    pSink.write(text, size);
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Create a MeatPack encoder and switch the firmware into packing mode.
+ */
+IAMeatPackEncoder::IAMeatPackEncoder(IAOutputSink &sink)
+:   IAGcodeEncoder(sink)
+{
+    sendCommand(kCmdEnablePacking);
+    sendCommand(kCmdEnableNoSpaces);
+}
+
+
+/**
+ * Return the four bit code of a character.
+ *
+ * We always use the "no spaces" variant, where 'E' replaces the space.
+ *
+ * \return the code, or -1 if the character can not be packed
+ */
+int IAMeatPackEncoder::packedNibble(char c)
+{
+    if (c>='0' && c<='9') return c-'0';
+    switch (c) {
+        case '.': return 10;
+        case 'E': return 11;
+        case '\n': return 12;
+        case 'G': return 13;
+        case 'X': return 14;
+    }
+    return -1;
+}
+
+
+/**
+ * Return the character for a four bit code.
+ */
+char IAMeatPackEncoder::unpackedChar(int nibble)
+{
+    static const char kChars[] = "0123456789.E\nGX";
+    return (nibble>=0 && nibble<15) ? kChars[nibble] : 0;
+}
+
+
+/**
+ * Send a command to the MeatPack decoder in the firmware.
+ */
+void IAMeatPackEncoder::sendCommand(uint8_t cmd)
+{
+    uint8_t buf[3] = { kSignalByte, kSignalByte, cmd };
+    pSink.write(buf, 3);
+}
+
+
+/**
+ * Collect text into lines and pack every complete line.
+ */
+void IAMeatPackEncoder::write(const char *text, size_t size)
+{
+    const char *end = text+size;
+    while (text<end) {
+        const char *nl = (const char*)memchr(text, '\n', end-text);
+        if (!nl) {
+            pLine.append(text, end-text);
+            return;
+        }
+        pLine.append(text, nl-text);
+        packLine();
+        text = nl+1;
+    }
+}
+
+
+/**
+ * Pack the last line, and switch the firmware back to plain text.
+ */
+void IAMeatPackEncoder::finish()
+{
+    if (!pLine.empty())
+        packLine();
+    sendCommand(kCmdDisablePacking);
+    sendCommand(kCmdDisableNoSpaces);
+}
+
+
+/**
+ * Remove comments and spaces from the current line and write it packed.
+ */
+void IAMeatPackEncoder::packLine()
+{
+    stripLine(pLine);
+    if (pLine.empty())
+        return;
+    pLine.push_back('\n');
+    pPacked.clear();
+    packText(pLine, pPacked);
+    pSink.write(pPacked.data(), pPacked.size());
+    pLine.clear();
+}
+
+
+/**
+ * Remove the comment and all unneeded spaces from a line of GCode.
+ *
+ * Commands that take a file name or a message keep their spaces. In "no
+ * spaces" mode, a space can not be packed, so it is sent as a full byte.
+ *
+ * \param line a single line without the line break; empty on return if
+ *        there was no command in it
+ */
+void IAMeatPackEncoder::stripLine(std::string &line)
+{
+    std::string &s = line;
+    size_t comment = s.find(';');
+    if (comment!=std::string::npos)
+        s.erase(comment);
+    size_t first = s.find_first_not_of(" \t\r");
+    if (first==std::string::npos) {
+        s.clear();
+        return;
+    }
+    s.erase(0, first);
+    s.erase(s.find_last_not_of(" \t\r")+1);
+    bool keepSpaces = (s.compare(0, 4, "M117")==0 || s.compare(0, 4, "M118")==0
+                       || s.compare(0, 3, "M23")==0 || s.compare(0, 3, "M28")==0
+                       || s.compare(0, 3, "M30")==0 || s.compare(0, 3, "M32")==0);
+    if (!keepSpaces) {
+        size_t j = 0;
+        for (size_t i=0; i<s.size(); i++)
+            if (s[i]!=' ' && s[i]!='\t') s[j++] = s[i];
+        s.resize(j);
+    }
+}
+
+
+/**
+ * Pack a line of GCode.
+ *
+ * \param text a single line, ending in a line break
+ * \param packed the packed bytes are appended here
+ */
+void IAMeatPackEncoder::packText(const std::string &text, std::vector<uint8_t> &packed)
+{
+    const std::string &s = text;
+    // if the line has an odd length, the line break ends up in the first
+    // nibble of the last byte, and the decoder ignores the second nibble
+    for (size_t i=0; i<s.size(); i+=2) {
+        char c1 = s[i];
+        char c2 = (i+1<s.size()) ? s[i+1] : '\n';
+        int n1 = packedNibble(c1), n2 = packedNibble(c2);
+        uint8_t b = (uint8_t)( (n1<0 ? kFullChar : n1) | ((n2<0 ? kFullChar : n2)<<4) );
+        packed.push_back(b);
+        if (n1<0) packed.push_back((uint8_t)c1);
+        if (n2<0) packed.push_back((uint8_t)c2);
+    }
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Decode the next byte of a MeatPack stream.
+ *
+ * \param c the next byte
+ * \param text decoded characters are appended here
+ *
+ * \return false if the stream contains an unknown command
+ */
+bool IAMeatPackDecoder::decode(uint8_t c, std::string &text)
+{
+    if (pSignals==2) {
+        switch (c) {
+            case IAMeatPackEncoder::kCmdEnablePacking: pPacking = true; break;
+            case IAMeatPackEncoder::kCmdDisablePacking: pPacking = false; break;
+            case IAMeatPackEncoder::kCmdEnableNoSpaces: pNoSpaces = true; break;
+            case IAMeatPackEncoder::kCmdDisableNoSpaces: pNoSpaces = false; break;
+            default: return false;
+        }
+        pSignals = 0;
+        return true;
+    }
+    if (c==IAMeatPackEncoder::kSignalByte && pFullChars==0) {
+        pSignals++;
+        return true;
+    }
+    if (pSignals) {
+        // a single signal byte is a byte with two full characters
+        unpack(IAMeatPackEncoder::kSignalByte, text);
+        pSignals = 0;
+    }
+    unpack(c, text);
+    return true;
+}
+
+
+/**
+ * Unpack a byte that is not part of a command.
+ */
+void IAMeatPackDecoder::unpack(uint8_t c, std::string &text)
+{
+    if (!pPacking) {
+        text.push_back((char)c);
+    } else if (pFullChars==0) {
+        int n1 = c & 0x0F, n2 = c>>4;
+        char c1 = IAMeatPackEncoder::unpackedChar(n1);
+        char c2 = IAMeatPackEncoder::unpackedChar(n2);
+        if (!pNoSpaces) {
+            if (c1=='E') c1 = ' ';
+            if (c2=='E') c2 = ' ';
+        }
+        if (n1==IAMeatPackEncoder::kFullChar) {
+            pFullChars++;
+            if (n2==IAMeatPackEncoder::kFullChar) pFullChars++;
+            else pSecond = c2;
+        } else {
+            text.push_back(c1);
+            if (c1!='\n') {
+                if (n2==IAMeatPackEncoder::kFullChar) pFullChars++;
+                else text.push_back(c2);
+            }
+        }
+    } else {
+        text.push_back((char)c);
+        if (pSecond) {
+            text.push_back(pSecond);
+            pSecond = 0;
+        }
+        pFullChars--;
+    }
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Create a block encoder and write the file header.
+ */
+IABlockEncoder::IABlockEncoder(IAOutputSink &sink)
+:   IAGcodeEncoder(sink)
+{
+    uint8_t header[8] = { 0, 0, 0, 0, kVersion, 0, 0, 0 };
+    memcpy(header, kBlockMagic, 4);
+    pSink.write(header, 8);
+    pBlock.reserve(kBlockSize);
+}
+
+
+/**
+ * Collect text and write every block that is full.
+ */
+void IABlockEncoder::write(const char *text, size_t size)
+{
+    while (size>0) {
+        size_t n = std::min(size, kBlockSize-pBlock.size());
+        pBlock.insert(pBlock.end(), (const uint8_t*)text, (const uint8_t*)text+n);
+        text += n;
+        size -= n;
+        if (pBlock.size()==kBlockSize)
+            writeBlock();
+    }
+}
+
+
+/**
+ * Write the last block and the end marker.
+ */
+void IABlockEncoder::finish()
+{
+    if (!pBlock.empty())
+        writeBlock();
+    writeHeader(0, 0, pTotalCrc);
+}
+
+
+/**
+ * Write a block header with three little endian numbers.
+ */
+void IABlockEncoder::writeHeader(uint32_t size, uint32_t packedSize, uint32_t crc)
+{
+    uint8_t buf[12];
+    uint32_t v[3] = { size, packedSize, crc };
+    for (int i=0; i<3; i++) {
+        buf[4*i+0] = (uint8_t)(v[i]);
+        buf[4*i+1] = (uint8_t)(v[i]>>8);
+        buf[4*i+2] = (uint8_t)(v[i]>>16);
+        buf[4*i+3] = (uint8_t)(v[i]>>24);
+    }
+    pSink.write(buf, 12);
+}
+
+
+/**
+ * Compress the current block and write it.
+ *
+ * If compression does not make the block smaller, it is stored as it is.
+ */
+void IABlockEncoder::writeBlock()
+{
+    size_t size = pBlock.size();
+    uint32_t crc = crc32(0, pBlock.data(), size);
+    pTotalCrc = crc32(pTotalCrc, pBlock.data(), size);
+    pPacked.resize(size);
+    size_t packedSize = compress(pBlock.data(), size, pPacked.data(), size-1);
+    if (packedSize==0) {
+        writeHeader((uint32_t)size, (uint32_t)size, crc);
+        pSink.write(pBlock.data(), size);
+    } else {
+        writeHeader((uint32_t)size, (uint32_t)packedSize, crc);
+        pSink.write(pPacked.data(), packedSize);
+    }
+    pBlock.clear();
+}
+
+
+/**
+ * Calculate the CRC-32 of some data, as used by zip and png.
+ *
+ * \param crc the CRC of the data before, or 0
+ * \param data, size the data to add to the checksum
+ */
+uint32_t IABlockEncoder::crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static const std::vector<uint32_t> table = []{
+        std::vector<uint32_t> t(256);
+        for (uint32_t i=0; i<256; i++) {
+            uint32_t c = i;
+            for (int k=0; k<8; k++)
+                c = (c&1) ? (0xEDB88320u ^ (c>>1)) : (c>>1);
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i=0; i<size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc>>8);
+    return ~crc;
+}
+
+
+/**
+ * Compress a block with a fast LZ77 coder.
+ *
+ * The data is a list of sequences. Every sequence starts with a token byte;
+ * the high nibble is the number of literals, the low nibble is the match
+ * length minus four. A nibble of 15 is followed by more length bytes, until
+ * a byte is less than 255. Then come the literals, and a two byte little
+ * endian offset back to the match. The last sequence has only literals.
+ * GCode repeats the same letters and short digit sequences over and over,
+ * so even this simple coder shrinks it to about half its size.
+ *
+ * \param src, size the text to compress
+ * \param dst, room destination buffer and its size
+ *
+ * \return the compressed size, or 0 if the data did not fit
+ */
+size_t IABlockEncoder::compress(const uint8_t *src, size_t size, uint8_t *dst, size_t room)
+{
+    std::vector<int32_t> table(1<<kHashBits, -1);
+    size_t op = 0;
+    bool overflow = false;
+
+    auto put = [&](uint8_t b) {
+        if (op<room) dst[op++] = b; else overflow = true;
+    };
+    auto putLength = [&](size_t n) {
+        for ( ; n>=255; n-=255) put(255);
+        put((uint8_t)n);
+    };
+    auto putSequence = [&](size_t anchor, size_t literals, size_t offset, size_t match) {
+        size_t m = match ? match-kMinMatch : 0;
+        put((uint8_t)( (std::min(literals, (size_t)15)<<4) | std::min(m, (size_t)15) ));
+        if (literals>=15) putLength(literals-15);
+        if (op+literals>room) { overflow = true; return; }
+        memcpy(dst+op, src+anchor, literals);
+        op += literals;
+        if (match) {
+            put((uint8_t)offset);
+            put((uint8_t)(offset>>8));
+            if (m>=15) putLength(m-15);
+        }
+    };
+    auto read32 = [&](size_t i) -> uint32_t {
+        uint32_t v; memcpy(&v, src+i, 4); return v;
+    };
+
+    size_t anchor = 0, ip = 0;
+    if (size>kMatchLimit) {
+        size_t limit = size-kMatchLimit;
+        while (ip<limit && !overflow) {
+            uint32_t seq = read32(ip);
+            uint32_t h = (seq*2654435761u)>>(32-kHashBits);
+            int32_t ref = table[h];
+            table[h] = (int32_t)ip;
+            if (ref>=0 && ip-ref<=0xFFFF && read32(ref)==seq) {
+                size_t len = kMinMatch;
+                size_t matchEnd = size-kLastLiterals;
+                while (ip+len<matchEnd && src[ref+len]==src[ip+len]) len++;
+                putSequence(anchor, ip-anchor, ip-ref, len);
+                ip += len;
+                anchor = ip;
+            } else {
+                ip++;
+            }
+        }
+    }
+    putSequence(anchor, size-anchor, 0, 0);
+    return overflow ? 0 : op;
+}
+
+
+/**
+ * Expand a block that was compressed with compress().
+ *
+ * \return false if the data is corrupt or does not expand to dstSize bytes
+ */
+bool IABlockEncoder::decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstSize)
+{
+    size_t ip = 0, op = 0;
+    auto getLength = [&](size_t &n) -> bool {
+        for (;;) {
+            if (ip>=size) return false;
+            uint8_t b = src[ip++];
+            n += b;
+            if (b<255) return true;
+        }
+    };
+    while (ip<size) {
+        uint8_t token = src[ip++];
+        size_t literals = token>>4;
+        if (literals==15 && !getLength(literals)) return false;
+        if (ip+literals>size || op+literals>dstSize) return false;
+        memcpy(dst+op, src+ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip==size) break; // the last sequence has no match
+        if (ip+2>size) return false;
+        size_t offset = src[ip] | (src[ip+1]<<8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match==15 && !getLength(match)) return false;
+        match += kMinMatch;
+        if (offset==0 || offset>op || op+match>dstSize) return false;
+        // the match may overlap the bytes that it creates
+        for (size_t i=0; i<match; i++, op++)
+            dst[op] = dst[op-offset];
+    }
+    return op==dstSize;
+}
+
+
+#ifdef __APPLE__
+#pragma mark -
+#endif
+// =============================================================================
+
+
+/**
+ * Find out how some GCode data was encoded.
+ *
+ * \return one of the IAGcodeEncoder formats
+ */
+int IAGcodeDecoder::detectFormat(const uint8_t *data, size_t size)
+{
+    if (size>=8 && memcmp(data, kBlockMagic, 4)==0)
+        return IAGcodeEncoder::BLOCKS;
+    if (size>=3 && data[0]==IAMeatPackEncoder::kSignalByte
+        && data[1]==IAMeatPackEncoder::kSignalByte)
+        return IAGcodeEncoder::MEATPACK;
+    return IAGcodeEncoder::PLAIN;
+}
+
+
+/**
+ * Decode GCode in any of the known encodings into plain text.
+ *
+ * \param data, size the encoded data
+ * \param[out] text the decoded GCode
+ *
+ * \return false, if the data was corrupt; text may be incomplete
+ */
+bool IAGcodeDecoder::decode(const uint8_t *data, size_t size, std::string &text)
+{
+    text.clear();
+    switch (detectFormat(data, size)) {
+        case IAGcodeEncoder::MEATPACK:
+            return decodeMeatPack(data, size, text);
+        case IAGcodeEncoder::BLOCKS:
+            return decodeBlocks(data, size, text);
+        default:
+            text.assign((const char*)data, size);
+            return true;
+    }
+}
+
+
+/**
+ * Decode MeatPack data the same way the printer firmware does.
+ */
+bool IAGcodeDecoder::decodeMeatPack(const uint8_t *data, size_t size, std::string &text)
+{
+    IAMeatPackDecoder decoder;
+    for (size_t i=0; i<size; i++) {
+        if (!decoder.decode(data[i], text))
+            return false;
+    }
+    return decoder.isComplete();
+}
+
+
+/**
+ * Decode a block container and verify all checksums.
+ */
+bool IAGcodeDecoder::decodeBlocks(const uint8_t *data, size_t size, std::string &text)
+{
+    if (data[4]!=IABlockEncoder::kVersion) {
+        Iota.Error.set("Decode GCode", IAError::FileContentCorrupt_STR, "unknown version");
+        return false;
+    }
+    auto read32 = [&](size_t i) -> uint32_t {
+        return data[i] | (data[i+1]<<8) | (data[i+2]<<16) | ((uint32_t)data[i+3]<<24);
+    };
+    std::vector<uint8_t> block;
+    uint32_t totalCrc = 0;
+    size_t ip = 8;
+    int index = 0;
+    char msg[80];
+    for (;;) {
+        if (ip+12>size) {
+            Iota.Error.set("Decode GCode", IAError::FileContentCorrupt_STR, "file is truncated");
+            return false;
+        }
+        uint32_t rawSize = read32(ip), packedSize = read32(ip+4), crc = read32(ip+8);
+        ip += 12;
+        if (rawSize==0) {
+            if (crc!=totalCrc) {
+                Iota.Error.set("Decode GCode", IAError::FileContentCorrupt_STR, "file checksum mismatch");
+                return false;
+            }
+            return true;
+        }
+        if (rawSize>IABlockEncoder::kBlockSize || packedSize>rawSize || ip+packedSize>size) {
+            snprintf(msg, sizeof(msg), "block %d has an invalid size", index);
+            Iota.Error.set("Decode GCode", IAError::FileContentCorrupt_STR, msg);
+            return false;
+        }
+        block.resize(rawSize);
+        if (packedSize==rawSize) {
+            memcpy(block.data(), data+ip, rawSize);
+        } else if (!IABlockEncoder::decompress(data+ip, packedSize, block.data(), rawSize)) {
+            snprintf(msg, sizeof(msg), "block %d can't be decompressed", index);
+            Iota.Error.set("Decode GCode", IAError::FileContentCorrupt_STR, msg);
+            return false;
+        }
+        if (IABlockEncoder::crc32(0, block.data(), rawSize)!=crc) {
+            snprintf(msg, sizeof(msg), "block %d checksum mismatch", index);
+            Iota.Error.set("Decode GCode", IAError::FileContentCorrupt_STR, msg);
+            return false;
+        }
+        totalCrc = IABlockEncoder::crc32(totalCrc, block.data(), rawSize);
+        text.append((const char*)block.data(), rawSize);
+        ip += packedSize;
+        index++;
+    }
+}
+
+
+/**
+ * Decode an encoded GCode file into a plain text file.
+ *
+ * \param srcFilename the encoded file
+ * \param dstFilename the plain text file that will be created
+ *
+ * \return false if the source could not be read or decoded, or the
+ *         destination could not be written; the error is set in Iota.Error
+ */
+bool IAGcodeDecoder::decodeFile(const char *srcFilename, const char *dstFilename)
+{
+    FILE *f = fl_fopen(srcFilename, "rb");
+    if (!f) {
+        Iota.Error.set("Decode GCode", IAError::CantOpenFile_STR_BSD, srcFilename);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[64*1024];
+    for (;;) {
+        size_t n = fread(buf, 1, sizeof(buf), f);
+        if (n==0) break;
+        data.insert(data.end(), buf, buf+n);
+    }
+    fclose(f);
+
+    std::string text;
+    bool ok = decode(data.data(), data.size(), text);
+
+    IAOutputSink sink;
+    if (!sink.open(dstFilename))
+        return false;
+    sink.write(text.data(), text.size());
+    if (!sink.close())
+        return false;
+    return ok;
+}
+
+
@@ -0,0 +1,182 @@
+//
+//  IAGcodeEncoder.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_GCODE_ENCODER_H
+#define IA_GCODE_ENCODER_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+class IAOutputSink;
+
+
+/**
+ * Encode the GCode text on its way from the writer to the output file.
+ *
+ * The plain encoder copies the text as it is. The MeatPack encoder packs the
+ * most common GCode characters into four bits each, which is understood by
+ * Marlin and Prusa firmware and nearly halves the bytes sent over a serial
+ * line. The block encoder compresses the text in blocks of 64kB and adds a
+ * CRC-32 checksum to every block, so a file can be verified before it is
+ * sent to a printer.
+ *
+ * All encodings can be decoded again with IAGcodeDecoder.
+ */
+class IAGcodeEncoder
+{
+public:
+    /** Output encodings, as stored in the printer properties. */
+    enum Format { PLAIN = 0, MEATPACK, BLOCKS };
+
+    static IAGcodeEncoder *create(int format, IAOutputSink &sink);
+    IAGcodeEncoder(IAOutputSink &sink);
+    virtual ~IAGcodeEncoder();
+    /** Encode some text. The text does not have to end at a line break. */
+    virtual void write(const char *text, size_t size) = 0;
+    /** Encode all remaining text and write the trailer. */
+    virtual void finish() { }
+
+protected:
+    /// receives the encoded data
+    IAOutputSink &pSink;
+};
+
+
+/**
+ * Write GCode as it is.
+ */
+class IAPlainEncoder : public IAGcodeEncoder
+{
+public:
+    IAPlainEncoder(IAOutputSink &sink) : IAGcodeEncoder(sink) { }
+    virtual void write(const char *text, size_t size) override;
+};
+
+
+/**
+ * Write GCode in MeatPack encoding.
+ *
+ * Comments and unneeded spaces are removed. The remaining characters are
+ * packed two per byte if they are digits, '.', 'E', 'G', 'X', or a line
+ * break. Any other character is marked in its nibble and follows as a full
+ * byte. Every line starts at a byte boundary.
+ */
+class IAMeatPackEncoder : public IAGcodeEncoder
+{
+public:
+    IAMeatPackEncoder(IAOutputSink &sink);
+    virtual void write(const char *text, size_t size) override;
+    virtual void finish() override;
+
+    /** The byte that introduces a MeatPack command when sent twice. */
+    static const uint8_t kSignalByte = 0xFF;
+    static const uint8_t kCmdEnablePacking = 0xFB;
+    static const uint8_t kCmdDisablePacking = 0xFA;
+    static const uint8_t kCmdEnableNoSpaces = 0xF7;
+    static const uint8_t kCmdDisableNoSpaces = 0xF6;
+    /** This nibble marks a character that follows as a full byte. */
+    static const uint8_t kFullChar = 0x0F;
+
+    static int packedNibble(char c);
+    static char unpackedChar(int nibble);
+    static void stripLine(std::string &line);
+    static void packText(const std::string &text, std::vector<uint8_t> &packed);
+
+private:
+    void sendCommand(uint8_t cmd);
+    void packLine();
+
+    /// the line that is currently assembled
+    std::string pLine;
+    /// the packed line
+    std::vector<uint8_t> pPacked;
+};
+
+
+/**
+ * Unpack a MeatPack data stream byte by byte, like the printer firmware.
+ */
+class IAMeatPackDecoder
+{
+public:
+    bool decode(uint8_t c, std::string &text);
+    /** Return true if no command or full character is pending. */
+    bool isComplete() { return pFullChars==0 && pSignals==0; }
+
+private:
+    void unpack(uint8_t c, std::string &text);
+
+    bool pPacking = false;
+    bool pNoSpaces = false;
+    /// number of signal bytes in a row
+    int pSignals = 0;
+    /// number of full characters that follow
+    int pFullChars = 0;
+    /// packed character that follows the next full character
+    char pSecond = 0;
+};
+
+
+/**
+ * Write GCode as compressed blocks with checksums.
+ *
+ * The file starts with the four characters "IAGC" and a version byte. Every
+ * block has a header of three 32 bit little endian numbers: the size of the
+ * text, the size of the data that follows, and the CRC-32 of the text. If
+ * the data has the same size as the text, it was stored uncompressed.
+ * A block with a text size of 0 ends the file; its checksum covers the
+ * entire text.
+ */
+class IABlockEncoder : public IAGcodeEncoder
+{
+public:
+    IABlockEncoder(IAOutputSink &sink);
+    virtual void write(const char *text, size_t size) override;
+    virtual void finish() override;
+
+    static const size_t kBlockSize = 64*1024;
+    static const uint8_t kVersion = 1;
+
+    static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size);
+    static size_t compress(const uint8_t *src, size_t size, uint8_t *dst, size_t room);
+    static bool decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dstSize);
+
+private:
+    void writeBlock();
+    void writeHeader(uint32_t size, uint32_t packedSize, uint32_t crc);
+
+    /// collects text until a block is full
+    std::vector<uint8_t> pBlock;
+    /// compressed data of the current block
+    std::vector<uint8_t> pPacked;
+    /// CRC-32 of all text so far
+    uint32_t pTotalCrc = 0;
+};
+
+
+/**
+ * Decode GCode that was written by any of the encoders.
+ */
+class IAGcodeDecoder
+{
+public:
+    static int detectFormat(const uint8_t *data, size_t size);
+    static bool decode(const uint8_t *data, size_t size, std::string &text);
+    static bool decodeFile(const char *srcFilename, const char *dstFilename);
+
+private:
+    static bool decodeMeatPack(const uint8_t *data, size_t size, std::string &text);
+    static bool decodeBlocks(const uint8_t *data, size_t size, std::string &text);
+};
+
+
+#endif /* IA_GCODE_ENCODER_H */
+
+
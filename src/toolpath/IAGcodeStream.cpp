@@ -0,0 +1,192 @@
+//
+//  IAGcodeStream.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAGcodeStream.h"
+
+#include "toolpath/IAToolpath.h"
+#include "printer/IAFDMPrinter.h"
+
+#include <FL/fl_utf8.h>
+
+#include <string.h>
+
+
+/**
+ * Create a stream that writes GCode for a printer.
+ *
+ * \param printer the printer with all settings for the GCode writer
+ * \param window number of layers that may wait for the writer before
+ *        push() blocks
+ */
+IAGcodeStream::IAGcodeStream(IAFDMPrinter *printer, size_t window)
+:   pPrinter( printer ),
+    pWriter( printer ),
+    pWindow( window ? window : 1 )
+{
+}
+
+
+/**
+ * Finish writing if the stream was not closed yet.
+ */
+IAGcodeStream::~IAGcodeStream()
+{
+    close();
+}
+
+
+/**
+ * Open the file, write the init sequence, and start the writer thread.
+ *
+ * \param filename destination file
+ * \param toolmap a bit for every tool that will be used; the tools are
+ *        heated in the init sequence
+ *
+ * \return false if the file could not be created
+ */
+bool IAGcodeStream::open(const char *filename, unsigned int toolmap)
+{
+    if (!pWriter.open(filename))
+        return false;
+    pWriter.resetTotalTime();
+    pWriter.sendInitSequence(toolmap);
+    pPosition = IAVector3d(0.0, 0.0, 0.0);
+    pScheduler.reset();
+    pFilename = filename;
+    pClosing = false;
+    pAborting = false;
+    pIsOpen = true;
+    pThread = std::thread(&IAGcodeStream::writerLoop, this);
+    return true;
+}
+
+
+/**
+ * Hand a finished layer to the writer.
+ *
+ * Layers must be pushed from bottom to top. If the window is full, this
+ * call waits until the writer has finished a layer.
+ *
+ * \param layer the toolpath of one layer; the stream takes ownership and
+ *        deletes the layer when it was written
+ */
+void IAGcodeStream::push(IAToolpathList *layer)
+{
+    if (!pIsOpen) {
+        delete layer;
+        return;
+    }
+    std::unique_lock<std::mutex> lock(pMutex);
+    pWakeSlicer.wait(lock, [this]{ return pQueue.size()<pWindow; });
+    pQueue.push_back(layer);
+    pWakeWriter.notify_one();
+}
+
+
+/**
+ * Write all remaining layers, the shutdown sequence, and close the file.
+ *
+ * \return false if the stream was not open, or if the GCode could not be
+ *         written completely; the error is set in Iota.Error
+ */
+bool IAGcodeStream::close()
+{
+    if (!pIsOpen)
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        pClosing = true;
+    }
+    pWakeWriter.notify_one();
+    pThread.join();
+    pWriter.sendShutdownSequence();
+    pWriter.cmdEstimatedTime();
+    pWriter.cmdToolChangeSummary();
+    bool ret = pWriter.close();
+    pIsOpen = false;
+    return ret;
+}
+
+
+/**
+ * Stop writing after slicing was cancelled.
+ *
+ * Layers that were not written yet are discarded. A file is deleted, so
+ * that no truncated GCode is left behind. A printer still receives the
+ * shutdown sequence, so that heaters and motors are turned off.
+ */
+void IAGcodeStream::abort()
+{
+    if (!pIsOpen)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(pMutex);
+        pAborting = true;
+        pClosing = true;
+    }
+    pWakeWriter.notify_one();
+    pThread.join();
+    for (auto layer: pQueue)
+        delete layer;
+    pQueue.clear();
+    if (strncmp(pFilename.c_str(), "serial:", 7)==0) {
+        pWriter.cmdComment("print cancelled");
+        pWriter.sendShutdownSequence();
+        pWriter.close();
+    } else {
+        pWriter.close();
+        fl_unlink(pFilename.c_str());
+    }
+    pIsOpen = false;
+}
+
+
+/**
+ * Write layers as they arrive until the stream is closed.
+ */
+void IAGcodeStream::writerLoop()
+{
+    for (;;) {
+        IAToolpathList *layer = nullptr, *next = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(pMutex);
+            pWakeWriter.wait(lock, [this]{
+                return pQueue.size()>1 || pQueue.size()>=pWindow || pClosing;
+            });
+            if (pQueue.empty() || pAborting)
+                return;
+            layer = pQueue.front();
+            pQueue.pop_front();
+            if (!pQueue.empty())
+                next = pQueue.front();
+        }
+        pWakeSlicer.notify_one();
+        // the slicer never touches a layer after pushing it
+        writeLayer(layer, next ? next->createToolmap() : 0);
+        delete layer;
+    }
+}
+
+
+/**
+ * Optimize, simplify, and write a single layer.
+ *
+ * The slice cache and the preview still use the toolpaths of the layer, so
+ * only the order of the list changes in this thread. New seams and the
+ * simplification are applied while the GCode is written.
+ *
+ * \param layer the layer to write
+ * \param nextToolmap the tools used by the next layer, or 0 at the top
+ */
+void IAGcodeStream::writeLayer(IAToolpathList *layer, unsigned int nextToolmap)
+{
+    layer->optimize(pPosition, pScheduler.schedule(layer->createToolmap(), nextToolmap));
+    layer->setSaveTolerance(pPrinter->simplifyTolerance());
+    layer->saveGCodeLayer(pWriter, pPrinter->minimumLayerTime());
+}
+
+
@@ -0,0 +1,82 @@
+//
+//  IAGcodeStream.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_GCODE_STREAM_H
+#define IA_GCODE_STREAM_H
+
+
+#include "toolpath/IAGcodeWriter.h"
+#include "toolpath/IAToolScheduler.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+
+
+class IAFDMPrinter;
+class IAToolpathList;
+
+
+/**
+ * Write GCode layer by layer while the following layers are still sliced.
+ *
+ * The slicer pushes every finished layer in order. A writer thread
+ * optimizes, simplifies, and writes the layers to the file. If the writer
+ * falls behind, push() waits until there is room, so only a small window of
+ * layers is held in memory at any time.
+ *
+ * Slicing needs the OpenGL context, so it stays in the main thread, and only
+ * writing moves to the other thread.
+ *
+ * The writer waits for the layer above before it writes a layer, so the
+ * tool scheduler knows which tools the next layer needs.
+ */
+class IAGcodeStream
+{
+public:
+    IAGcodeStream(IAFDMPrinter *printer, size_t window=kDefaultWindow);
+    ~IAGcodeStream();
+    bool open(const char *filename, unsigned int toolmap);
+    void push(IAToolpathList *layer);
+    bool close();
+    void abort();
+
+    /// number of layers that may wait for the writer
+    static const size_t kDefaultWindow = 8;
+
+private:
+    void writerLoop();
+    void writeLayer(IAToolpathList *layer, unsigned int nextToolmap);
+
+    IAFDMPrinter *pPrinter = nullptr;
+    IAGcodeWriter pWriter;
+    std::thread pThread;
+    std::mutex pMutex;
+    /// wake the writer when a layer was added or the stream is closed
+    std::condition_variable pWakeWriter;
+    /// wake the slicer when a layer was written
+    std::condition_variable pWakeSlicer;
+    /// layers that were sliced, but not written yet
+    std::deque<IAToolpathList*> pQueue;
+    size_t pWindow;
+    bool pIsOpen = false;
+    bool pClosing = false;
+    /// set if the remaining layers must be discarded
+    bool pAborting = false;
+    /// the destination file, or a "serial:" device
+    std::string pFilename;
+    /// position of the head after the last layer that was written
+    IAVector3d pPosition;
+    /// chooses the order of tools in every layer
+    IAToolScheduler pScheduler;
+};
+
+
+#endif /* IA_GCODE_STREAM_H */
+
+
@@ -9,11 +9,15 @@
 
 #include "Iota.h"
 #include "printer/IAFDMPrinter.h"
+#include "printer/IAPrintHost.h"
 
 #include <FL/gl.h>
 
 #include <math.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 
 
 #ifdef __APPLE__
@@ -36,14 +40,16 @@ IAGcodeWriter::IAGcodeWriter(IAFDMPrinter *printer)
  */
 IAGcodeWriter::~IAGcodeWriter()
 {
-    if (pFile!=nullptr) close();
+    if (pSink.isOpen() || pHost) close();
+    ::free((void*)pBuffer);
 }
 
 
 /**
  * Open a file for wrinting GCode commands.
  *
- * \param filename destination file
+ * \param filename destination file, or "serial:" followed by a device name
+ *        to stream the commands directly to a printer, see IAPrintHost::open()
  *
  * \return true, if we were able to create that file.
  *
@@ -51,36 +57,66 @@ IAGcodeWriter::~IAGcodeWriter()
  */
 bool IAGcodeWriter::open(const char *filename)
 {
-    pFile = fopen(filename, "wb");
-    if (!pFile) {
-        // set error
-        printf("Can't open file %s\n", filename);
-        return false;
+    if (strncmp(filename, "serial:", 7)==0) {
+        pHost = new IAPrintHost();
+        bool meatPack = (pPrinter->gcodeEncoding()==IAGcodeEncoder::MEATPACK);
+        if (!pHost->open(filename+7, IAPrintHost::kDefaultWindow, meatPack)) {
+            delete pHost;
+            pHost = nullptr;
+            return false;
+        }
+    } else {
+        if (!pSink.open(filename, (IAOutputSink::SyncPolicy)pPrinter->outputSync())) {
+            Iota.Error.set("Writing GCode", IAError::CantOpenFile_STR_BSD, filename);
+            return false;
+        }
+        pEncoder = IAGcodeEncoder::create(pPrinter->gcodeEncoding(), pSink);
     }
+    if (!pBuffer)
+        pBuffer = (char*)::malloc(kBufferSize);
+    pBufferUsed = 0;
     pPosition = { 0.0, 0.0, 0.0 };
     pT = -1;
     pE = 0.0;
     pF = 0.0;
+    pToolChangeCount = 0;
+    pPurgeLength = 0.0;
     pRapidFeedrate = 3000.0;
     pPrintFeedrate = 1000.0;
     pLayerHeight = 0.3;
     pLayerStartTime = 0.0;
-    pTotalTime = 0.0;
+    pLayerTimeList.clear();
+    pPlanner.setup(pPrinter);
+    pSpeedFactor = 1.0;
+    pSimulating = false;
     pEFactor = ((pPrinter->filamentDiameter()/2)*(pPrinter->filamentDiameter()/2)*M_PI)
              / (pPrinter->nozzleDiameter()*pPrinter->layerHeight());
+    pArcTolerance = pPrinter->hasArcSupport() ? pPrinter->arcTolerance() : 0.0;
     return true;
 }
 
 
 /**
  * Close the GCode writer.
+ *
+ * \return false if the file could not be written completely
  */
-void IAGcodeWriter::close()
+bool IAGcodeWriter::close()
 {
-    if (pFile!=nullptr) {
-        fclose(pFile);
-        pFile = nullptr;
+    if (pHost) {
+        flush();
+        bool ret = pHost->close();
+        delete pHost;
+        pHost = nullptr;
+        return ret;
     }
+    if (!pSink.isOpen())
+        return false;
+    flush();
+    pEncoder->finish();
+    delete pEncoder;
+    pEncoder = nullptr;
+    return pSink.close();
 }
 
 
@@ -105,27 +141,48 @@ void IAGcodeWriter::setPrintFeedrate(double feedrate)
 
 
 
+/**
+ * Start estimating the printing time from zero.
+ */
 void IAGcodeWriter::resetTotalTime()
 {
-    pTotalTime = 0.0;
+    pPlanner.reset();
+    pLayerStartTime = 0.0;
 }
 
 
+/**
+ * Return the estimated time for all commands so far.
+ *
+ * The planner must stop the head to know the exact time, so this should
+ * only be called between layers.
+ *
+ * \return time in seconds
+ */
 double IAGcodeWriter::getTotalTime()
 {
-    return pTotalTime;
+    pPlanner.flush();
+    return pPlanner.time();
 }
 
 
+/**
+ * Start estimating the time for a new layer.
+ */
 void IAGcodeWriter::resetLayerTime()
 {
-    pLayerStartTime = pTotalTime;
+    pLayerStartTime = getTotalTime();
 }
 
 
+/**
+ * Return the estimated time since resetLayerTime().
+ *
+ * \return time in seconds
+ */
 double IAGcodeWriter::getLayerTime()
 {
-    return pTotalTime - pLayerStartTime;
+    return getTotalTime() - pLayerStartTime;
 }
 
 
@@ -140,9 +197,10 @@ double IAGcodeWriter::getLayerTime()
  */
 void IAGcodeWriter::cmdHome()
 {
-    fprintf(pFile, "G28 ; home all axes\n");
+    sendFormat("G28 ; home all axes\n");
     pPosition = { 0.0, 0.0, 0.0 };
     // unknown time to execute
+    pPlanner.flush();
 }
 
 
@@ -160,15 +218,15 @@ void IAGcodeWriter::cmdRetract(double d)
 #if 0
     // repetier long retract and short retract
     if (d>1.0)
-        fprintf(pFile, "G10 S1\n");
+        sendFormat("G10 S1\n");
     else
-        fprintf(pFile, "G10\n");
+        sendFormat("G10\n");
 #elif 0
     w.cmdExtrudeRel(-d);
 #else
     // lowest common denominator
-    fprintf(pFile, "G10\n");
-    pTotalTime += 0.1; // assuming this time to execute
+    sendFormat("G10\n");
+    pPlanner.addDelay(0.1); // assuming this time to execute
 #endif
 }
 
@@ -189,15 +247,15 @@ void IAGcodeWriter::cmdUnretract(double d)
 #if 0
     // repetier long retract and short retract
     if (d>1.0)
-        fprintf(pFile, "G11 S1\n");
+        sendFormat("G11 S1\n");
     else
-        fprintf(pFile, "G11\n");
+        sendFormat("G11\n");
 #elif 0
     w.cmdExtrudeRel(d);
 #else
     // lowest common denominator
-    fprintf(pFile, "G11\n");
-    pTotalTime += 0.1; // assuming this time to execute
+    sendFormat("G11\n");
+    pPlanner.addDelay(0.1); // assuming this time to execute
 #endif
 }
 
@@ -212,7 +270,7 @@ void IAGcodeWriter::cmdUnretract(double d)
  */
 void IAGcodeWriter::cmdSelectExtruder(int n)
 {
-    fprintf(pFile, "T%d ; select extruder\n", n);
+    sendFormat("T%d ; select extruder\n", n);
 }
 
 
@@ -229,10 +287,10 @@ void IAGcodeWriter::cmdSelectExtruder(int n)
 void IAGcodeWriter::cmdExtrude(double distance, double feedrate)
 {
     if (feedrate<0.0) feedrate = pPrintFeedrate;
-    fprintf(pFile, "G1 E%.4f F%.4f\n", pE+distance, feedrate);
+    sendFormat("G1 E%.4f F%.4f\n", pE+distance, feedrate);
     pE += distance;  // mm
     pF = feedrate;   // mm/min
-    pTotalTime += distance / (feedrate/60.0);
+    pPlanner.addMove(pPosition, pPosition, distance, feedrate);
 }
 
 
@@ -250,9 +308,9 @@ void IAGcodeWriter::cmdExtrude(double distance, double feedrate)
 void IAGcodeWriter::cmdExtrudeRel(double distance, double feedrate)
 {
     if (feedrate<0.0) feedrate = pPrintFeedrate;
-    fprintf(pFile, "G1 E%.4f:%.4f:%.4f:%.4f F%.4f\n", distance/4.0, distance/4.0, distance/4.0, distance/4.0, feedrate);
+    sendFormat("G1 E%.4f:%.4f:%.4f:%.4f F%.4f\n", distance/4.0, distance/4.0, distance/4.0, distance/4.0, feedrate);
     pF = feedrate;
-    pTotalTime += distance / (feedrate/60.0);
+    pPlanner.addMove(pPosition, pPosition, distance, feedrate);
 }
 
 
@@ -275,11 +333,10 @@ void IAGcodeWriter::cmdRapidMove(double x, double y)
  */
 void IAGcodeWriter::cmdRapidMove(IAVector3d &v)
 {
+    pPlanner.addMove(pPosition, v, 0.0, pRapidFeedrate);
     sendRapidMoveTo(v);
     sendFeedrate(pRapidFeedrate);
     sendNewLine();
-    double distance = (v-position()).length();
-    pTotalTime += distance / (pRapidFeedrate/60.0);
 }
 
 
@@ -325,32 +382,39 @@ void IAGcodeWriter::cmdRetractMove(IAVector3d &v)
     if (2.0*retrDist>=totalDist) {
         double f = totalDist/(2.0*retrDist);
         // first move, retract while moving
-        sendMoveTo(start + direction*(f*retrDist));
+        IAVector3d p1 = start + direction*(f*retrDist);
+        pPlanner.addMove(pPosition, p1, f*-retraction, pRapidFeedrate);
+        sendMoveTo(p1);
         sendExtrusionAdd(f*-retraction);
         sendFeedrate(pRapidFeedrate);
         sendNewLine();
         // last, move and unretract
+        pPlanner.addMove(pPosition, v, f*retraction, pRapidFeedrate);
         sendMoveTo(v);
         sendExtrusionAdd(f*retraction);
         sendFeedrate(pRapidFeedrate);
         sendNewLine();
     } else {
         // first move, retract while moving
-        sendMoveTo(start + direction*retrDist);
+        IAVector3d p1 = start + direction*retrDist;
+        pPlanner.addMove(pPosition, p1, -retraction, pRapidFeedrate);
+        sendMoveTo(p1);
         sendExtrusionAdd(-retraction);
         sendFeedrate(pRapidFeedrate);
         sendNewLine();
         // now just move rapidly
-        sendMoveTo(start + direction*(totalDist-retrDist));
+        IAVector3d p2 = start + direction*(totalDist-retrDist);
+        pPlanner.addMove(pPosition, p2, 0.0, pRapidFeedrate);
+        sendMoveTo(p2);
         sendFeedrate(pRapidFeedrate);
         sendNewLine();
         // last, move and unretract
+        pPlanner.addMove(pPosition, v, retraction, pRapidFeedrate);
         sendMoveTo(v);
         sendExtrusionAdd(retraction);
         sendFeedrate(pRapidFeedrate);
         sendNewLine();
     }
-    pTotalTime += totalDist / (pRapidFeedrate/60.0);
 #endif
 //    cmdComment("Retract End");
 }
@@ -382,11 +446,44 @@ void IAGcodeWriter::cmdPrintMove(double x, double y)
 void IAGcodeWriter::cmdPrintMove(IAVector3d &v)
 {
     double distance = (v-pPosition).length();
+    double feedrate = pPrintFeedrate*pSpeedFactor;
+    pPlanner.addMove(pPosition, v, distance/pEFactor, feedrate, true);
     sendMoveTo(v);
     sendExtrusionAdd(distance/pEFactor);
-    sendFeedrate(pPrintFeedrate);
+    sendFeedrate(feedrate);
+    sendNewLine();
+}
+
+
+/**
+ * Move the printhead along an arc in the xy plane while extruding.
+ *
+ * This sends G2 or G3, which most firmwares execute much more smoothly
+ * than a long list of short G1 moves.
+ *
+ * \param v end of the arc in mm from origin
+ * \param center center of the arc; the current position and v must have
+ *        about the same distance from the center
+ * \param ccw true to move counter-clockwise
+ */
+void IAGcodeWriter::cmdPrintArc(IAVector3d &v, IAVector3d &center, bool ccw)
+{
+    double dx = pPosition.x()-center.x(), dy = pPosition.y()-center.y();
+    double radius = sqrt(dx*dx + dy*dy);
+    double a0 = atan2(dy, dx);
+    double a1 = atan2(v.y()-center.y(), v.x()-center.x());
+    double sweep = ccw ? a1-a0 : a0-a1;
+    if (sweep<0.0) sweep += 2.0*M_PI;
+    double distance = radius*sweep;
+    double feedrate = pPrintFeedrate*pSpeedFactor;
+    pPlanner.addArc(pPosition, v, center, ccw, distance/pEFactor, feedrate, true);
+    sendText(ccw ? "G3 " : "G2 ");
+    sendPosition(v);
+    sendNumber('I', -dx, 3);
+    sendNumber('J', -dy, 3);
+    sendExtrusionAdd(distance/pEFactor);
+    sendFeedrate(feedrate);
     sendNewLine();
-    pTotalTime += distance / (pPrintFeedrate/60.0);
 }
 
 
@@ -416,7 +513,7 @@ void IAGcodeWriter::cmdPrintMove(IAVector3d &v)
  */
 void IAGcodeWriter::cmdResetExtruder()
 {
-    fprintf(pFile, "G92 E0 ; reset extruder\n");
+    sendFormat("G92 E0 ; reset extruder\n");
     pE = 0.0;
 }
 
@@ -426,12 +523,12 @@ void IAGcodeWriter::cmdResetExtruder()
  */
 void IAGcodeWriter::cmdComment(const char *format, ...)
 {
-    fprintf(pFile, "; ");
+    sendText("; ");
     va_list va;
     va_start(va, format);
-    vfprintf(pFile, format, va);
+    sendFormatV(format, va);
     va_end(va);
-    fprintf(pFile, "\n");
+    sendText("\n");
 }
 
 
@@ -442,9 +539,159 @@ void IAGcodeWriter::cmdComment(const char *format, ...)
  */
 void IAGcodeWriter::cmdDwell(double seconds)
 {
-    fprintf(pFile, "G4 P%.f", seconds*1000);
+    sendFormat("G4 P%.f", seconds*1000);
     sendNewLine("wait");
-    pTotalTime += seconds;
+    pPlanner.addDelay(seconds);
+}
+
+
+/**
+ * Start a new layer.
+ *
+ * \param z height of the layer, only used in the comment
+ */
+void IAGcodeWriter::cmdBeginLayer(double z)
+{
+    cmdComment("");
+    cmdComment("==== layer at z=%.2f", z);
+    cmdComment("");
+    cmdResetExtruder();
+    resetLayerTime();
+    pLayerZ = z;
+}
+
+
+/**
+ * Finish a layer and wait if it printed too fast.
+ *
+ * If the layer took less than the minimum layer time, the head moves out of
+ * the way and waits, so the layer can cool down.
+ *
+ * \param minLayerTime minimum time for a layer in seconds
+ */
+void IAGcodeWriter::cmdEndLayer(double minLayerTime)
+{
+    double layerTime = getLayerTime();
+    printf("Layer at %.2f will print in %.2f seconds\n", pLayerZ, layerTime);
+    /** \todo tune this parameter */
+    if (layerTime>0.0 && layerTime<minLayerTime) {
+        IAVector3d prev = position();
+        IAVector3d pause = Iota.pMesh->pMin
+                         - IAVector3d(10.0, 10.0, 0.0)
+                         + Iota.pMesh->position(); /** \bug in world coordinates */
+        pause.setMax(IAVector3d(0.0, 0.0, 0.0));
+        pause.z( prev.z() );
+        cmdRetract();
+        cmdRapidMove(pause);
+        cmdDwell(minLayerTime-layerTime);
+        cmdRapidMove(prev);
+        cmdUnretract();
+        layerTime = getLayerTime();
+    }
+    cmdComment("estimated layer time: %.1f seconds", layerTime);
+    pLayerTimeList.push_back(layerTime);
+    if (pHost)
+        flush(); // keep the printer busy while the next layer is sliced
+}
+
+
+/**
+ * Slow down all printing moves.
+ *
+ * Rapid moves are not affected.
+ *
+ * \param factor 1.0 for the normal printing speed, less to print slower
+ */
+void IAGcodeWriter::setSpeedFactor(double factor)
+{
+    pSpeedFactor = factor;
+}
+
+
+/**
+ * Return the smallest speed factor that still prints at the minimum speed
+ * set in the printer properties.
+ */
+double IAGcodeWriter::minimumSpeedFactor()
+{
+    double f = pPrinter->minimumPrintSpeed()*60.0 / pPrintFeedrate;
+    return std::min(1.0, std::max(0.01, f));
+}
+
+
+/**
+ * Start measuring the time for a list of commands without writing them.
+ *
+ * All commands between this call and endSimulation() are planned, but not
+ * written to the file. The state of the writer is restored at the end.
+ */
+void IAGcodeWriter::beginSimulation()
+{
+    pSavedState.pPosition = pPosition;
+    pSavedState.pT = pT;
+    pSavedState.pE = pE;
+    pSavedState.pF = pF;
+    pSavedState.pToolCount = pToolCount;
+    pSavedState.pToolChangeCount = pToolChangeCount;
+    pSavedState.pPurgeLength = pPurgeLength;
+    pSavedState.pPlanner = pPlanner;
+    pPlanner.flush();
+    pSavedState.pStartTime = pPlanner.time();
+    pSavedState.pStartPrintTime = pPlanner.printTime();
+    pSimulating = true;
+}
+
+
+/**
+ * Stop the simulation and restore the writer to where it was before.
+ *
+ * \param[out] printTime if set, receives the part of the time that was
+ *        spent in printing moves, which scales with the speed factor
+ * \return the estimated time of all simulated commands in seconds
+ */
+double IAGcodeWriter::endSimulation(double *printTime)
+{
+    pPlanner.flush();
+    double t = pPlanner.time() - pSavedState.pStartTime;
+    if (printTime)
+        *printTime = pPlanner.printTime() - pSavedState.pStartPrintTime;
+    pPosition = pSavedState.pPosition;
+    pT = pSavedState.pT;
+    pE = pSavedState.pE;
+    pF = pSavedState.pF;
+    pToolCount = pSavedState.pToolCount;
+    pToolChangeCount = pSavedState.pToolChangeCount;
+    pPurgeLength = pSavedState.pPurgeLength;
+    pPlanner = pSavedState.pPlanner;
+    pSimulating = false;
+    return t;
+}
+
+
+/**
+ * Write the estimated printing time as a comment and to the console.
+ *
+ * Call this after the shutdown sequence.
+ */
+void IAGcodeWriter::cmdEstimatedTime()
+{
+    double t = getTotalTime();
+    int s = (int)(t+0.5);
+    cmdComment("estimated printing time: %d:%02d:%02d", s/3600, (s/60)%60, s%60);
+    printf("Total print time is %.2f minutes\n", t/60.0);
+}
+
+
+/**
+ * Write the number of tool changes and the purged filament as a comment and
+ * to the console.
+ *
+ * Call this after the shutdown sequence.
+ */
+void IAGcodeWriter::cmdToolChangeSummary()
+{
+    cmdComment("tool changes: %d, purged %.1f mm^3 of filament", pToolChangeCount, purgeVolume());
+    printf("%d tool changes, %.1f mm^3 of filament purged\n", pToolChangeCount, purgeVolume());
 }
 
 #ifdef __APPLE__
@@ -453,6 +700,135 @@ void IAGcodeWriter::cmdDwell(double seconds)
 // =============================================================================
 
 
+/**
+ * Hand all buffered text to the printer or the encoder.
+ */
+void IAGcodeWriter::flush()
+{
+    if (pBufferUsed)
+        sendUnbuffered(pBuffer, pBufferUsed);
+    pBufferUsed = 0;
+}
+
+
+/**
+ * Send text to the printer, or to the encoder, which writes it to the
+ * output sink, bypassing the buffer.
+ */
+void IAGcodeWriter::sendUnbuffered(const char *text, size_t size)
+{
+    if (pHost)
+        pHost->write(text, size);
+    else
+        pEncoder->write(text, size);
+}
+
+
+/**
+ * Make sure that the buffer has room for a number of bytes.
+ */
+void IAGcodeWriter::reserve(size_t n)
+{
+    if (pBufferUsed+n>kBufferSize)
+        flush();
+}
+
+
+/**
+ * Send some text without any formatting.
+ */
+void IAGcodeWriter::sendText(const char *text)
+{
+    if (pSimulating) return;
+    size_t n = strlen(text);
+    if (n>kBufferSize/2) {
+        flush();
+        sendUnbuffered(text, n);
+        return;
+    }
+    reserve(n);
+    memcpy(pBuffer+pBufferUsed, text, n);
+    pBufferUsed += n;
+}
+
+
+/**
+ * Send text in printf() formatting.
+ */
+void IAGcodeWriter::sendFormat(const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    sendFormatV(format, va);
+    va_end(va);
+}
+
+
+/**
+ * Send text in vprintf() formatting.
+ */
+void IAGcodeWriter::sendFormatV(const char *format, va_list va)
+{
+    if (pSimulating) return;
+    va_list va2;
+    va_copy(va2, va);
+    reserve(kMaxFormatSize);
+    size_t room = kBufferSize-pBufferUsed;
+    int n = vsnprintf(pBuffer+pBufferUsed, room, format, va);
+    if (n>=0 && (size_t)n<room) {
+        pBufferUsed += n;
+    } else if (n>=0) {
+        // the text did not fit, so write it directly
+        flush();
+        std::vector<char> text(n+1);
+        vsnprintf(text.data(), n+1, format, va2);
+        sendUnbuffered(text.data(), n);
+    }
+    va_end(va2);
+}
+
+
+/**
+ * Send a letter followed by a number with a fixed number of decimals, and
+ * a space.
+ *
+ * This is the same as printf("%c%.*f ", letter, decimals, v), but much
+ * faster, because the number is formatted as an integer.
+ *
+ * \param letter the GCode parameter name, for example 'X'
+ * \param v the value
+ * \param decimals number of digits after the decimal point, 0 to 6
+ */
+void IAGcodeWriter::sendNumber(char letter, double v, int decimals)
+{
+    if (pSimulating) return;
+    static const double scale[] = { 1.0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+    reserve(32);
+    char *d = pBuffer + pBufferUsed;
+    *d++ = letter;
+    double a = fabs(v)*scale[decimals] + 0.5;
+    if (!(a<9e15)) {
+        // NaN, infinite, or too large for the integer formatter
+        d += snprintf(d, 28, "%.*f", decimals, v);
+    } else {
+        uint64_t n = (uint64_t)a;
+        if (v<0.0 && n!=0) *d++ = '-';
+        char digits[24];
+        int len = 0;
+        do {
+            digits[len++] = (char)('0' + n%10);
+            n /= 10;
+        } while (n || len<=decimals);
+        for (int i=len-1; i>=0; i--) {
+            *d++ = digits[i];
+            if (i==decimals && decimals>0) *d++ = '.';
+        }
+    }
+    *d++ = ' ';
+    pBufferUsed = d - pBuffer;
+}
+
+
 /**
  * Send the end-of-line character.
  *
@@ -460,9 +836,11 @@ void IAGcodeWriter::cmdDwell(double seconds)
  */
 void IAGcodeWriter::sendNewLine(const char *comment)
 {
-    if (comment)
-        fprintf(pFile, " ; %s", comment);
-    fprintf(pFile, "\n");
+    if (comment) {
+        sendText(" ; ");
+        sendText(comment);
+    }
+    sendText("\n");
 }
 
 
@@ -471,7 +849,7 @@ void IAGcodeWriter::sendNewLine(const char *comment)
  */
 void IAGcodeWriter::sendMoveTo(const IAVector3d &v)
 {
-    fprintf(pFile, "G1 ");
+    sendText("G1 ");
     sendPosition(v);
 }
 
@@ -481,7 +859,7 @@ void IAGcodeWriter::sendMoveTo(const IAVector3d &v)
  */
 void IAGcodeWriter::sendRapidMoveTo(IAVector3d &v)
 {
-    fprintf(pFile, "G0 ");
+    sendText("G0 ");
     sendPosition(v);
 }
 
@@ -492,11 +870,11 @@ void IAGcodeWriter::sendRapidMoveTo(IAVector3d &v)
 void IAGcodeWriter::sendPosition(const IAVector3d &v)
 {
     if (v.x()!=pPosition.x())
-        fprintf(pFile, "X%.3f ", v.x());
+        sendNumber('X', v.x(), 3);
     if (v.y()!=pPosition.y())
-        fprintf(pFile, "Y%.3f ", v.y());
+        sendNumber('Y', v.y(), 3);
     if (v.z()!=pPosition.z())
-        fprintf(pFile, "Z%.3f ", v.z());
+        sendNumber('Z', v.z(), 3);
     pPosition = v;
 }
 
@@ -507,7 +885,7 @@ void IAGcodeWriter::sendPosition(const IAVector3d &v)
 void IAGcodeWriter::sendFeedrate(double f)
 {
     if (f!=pF) {
-        fprintf(pFile, "F%.1f ", f);
+        sendNumber('F', f, 1);
         pF = f;
     }
 }
@@ -524,7 +902,7 @@ void IAGcodeWriter::sendExtrusionAdd(double e)
 {
     double newE = pE + e;
     if (newE!=pE) {
-        fprintf(pFile, "E%.5f ", newE);
+        sendNumber('E', newE, 5);
         pE = newE;
     }
 }
@@ -542,7 +920,7 @@ void IAGcodeWriter::sendExtrusionAdd(double e)
 //    double g = (double((color>>8)&255))/255.0/4.0;
 //    double b = (double((color>>0)&255))/255.0/4.0;
 //    double k = 1.0 - r - g - b;
-//    fprintf(pFile, "E%.4f:%.4f:%.4f:%.4f ", r*e, g*e, b*e, k*e);
+//    sendFormat("E%.4f:%.4f:%.4f:%.4f ", r*e, g*e, b*e, k*e);
 //}
 
 
@@ -568,79 +946,79 @@ void IAGcodeWriter::sendInitSequence(unsigned int toolmap)
     pToolCount = ((v + (v >> 4) & 0xF0F0F0F) * 0x1010101) >> 24; // count
 #ifdef IA_QUAD
 #error
-    fprintf(pFile, "; generated by Iota Slicer\n");
+    sendFormat("; generated by Iota Slicer\n");
     cmdComment("");
     cmdComment("==== Macro Init");
-    fprintf(pFile, "G21 ; set units to millimeters\n");
-    fprintf(pFile, "G90 ; use absolute coordinates\n");
-    fprintf(pFile, "G28 ; home all axes\n");
-    fprintf(pFile, "G1 Z5 F5000 ; lift nozzle\n");
-    fprintf(pFile, "M140 S60 ; set bed temperature\n");
-    fprintf(pFile, "M563 P0 D0:1:2:3 H0 F0 ; set tool 0 as full color on quad\n");
-    fprintf(pFile, "T0\n");
+    sendFormat("G21 ; set units to millimeters\n");
+    sendFormat("G90 ; use absolute coordinates\n");
+    sendFormat("G28 ; home all axes\n");
+    sendFormat("G1 Z5 F5000 ; lift nozzle\n");
+    sendFormat("M140 S60 ; set bed temperature\n");
+    sendFormat("M563 P0 D0:1:2:3 H0 F0 ; set tool 0 as full color on quad\n");
+    sendFormat("T0\n");
     // Using relative distances for extrusion is a very bad idea, but we nned to know how the Quad board behave before we can fix this
-    fprintf(pFile, "M83 ; use relative distances for extrusion\n");
-    fprintf(pFile, "M104 S230 ; set extruder temperature\n");
-    fprintf(pFile, "M109 S230 ; set temperature and wait for it to be reached\n");
-    fprintf(pFile, "M190 S60 ; wait for bed temperature\n");
+    sendFormat("M83 ; use relative distances for extrusion\n");
+    sendFormat("M104 S230 ; set extruder temperature\n");
+    sendFormat("M109 S230 ; set temperature and wait for it to be reached\n");
+    sendFormat("M190 S60 ; wait for bed temperature\n");
     cmdResetExtruder();
-    fprintf(pFile, "G1 F800 E3:0:0:0 ; purge\n");
-    fprintf(pFile, "G1 F800 E0:3:0:0 ; purge\n");
-    fprintf(pFile, "G1 F800 E0:0:3:0 ; purge\n");
-    fprintf(pFile, "G1 F800 E0:0:0:3 ; purge\n");
-    fprintf(pFile, "M106 S255 P0 ; fan on\n");
-    fprintf(pFile, "M106 S255 P1 ; fan on\n");
-    fprintf(pFile, "M106 S255 P2 ; fan on\n");
-    fprintf(pFile, "G4 S0.1 ; dwell\n");
+    sendFormat("G1 F800 E3:0:0:0 ; purge\n");
+    sendFormat("G1 F800 E0:3:0:0 ; purge\n");
+    sendFormat("G1 F800 E0:0:3:0 ; purge\n");
+    sendFormat("G1 F800 E0:0:0:3 ; purge\n");
+    sendFormat("M106 S255 P0 ; fan on\n");
+    sendFormat("M106 S255 P1 ; fan on\n");
+    sendFormat("M106 S255 P2 ; fan on\n");
+    sendFormat("G4 S0.1 ; dwell\n");
     // C=523.251, D=587.330, E=659.255, F=698.456, G=783.991, A=880, B=987.767, C=1046.50
-    fprintf(pFile, "M300 S523.251 P100 ; beep\n");
-    fprintf(pFile, "M300 S587.330 P100 ; beep\n");
-    fprintf(pFile, "M300 S659.255 P100 ; beep\n");
-    fprintf(pFile, "M300 S698.456 P100 ; beep\n");
-    fprintf(pFile, "M300 S783.991 P100 ; beep\n");
+    sendFormat("M300 S523.251 P100 ; beep\n");
+    sendFormat("M300 S587.330 P100 ; beep\n");
+    sendFormat("M300 S659.255 P100 ; beep\n");
+    sendFormat("M300 S698.456 P100 ; beep\n");
+    sendFormat("M300 S783.991 P100 ; beep\n");
 #else
-    fprintf(pFile, "; generated by Iota Slicer\n");
+    sendFormat("; generated by Iota Slicer\n");
     cmdComment("");
     cmdComment("==== Macro Init");
-    fprintf(pFile, "G21 ; set units to millimeters\n");
-    fprintf(pFile, "G90 ; use absolute coordinates\n");
-    fprintf(pFile, "G28 ; home all axes\n");
-    fprintf(pFile, "G1 Z5 F5000 ; lift nozzle\n");
-    fprintf(pFile, "M140 S60 ; set bed temperature\n");
-    //    fprintf(pFile, "T1\n");
-    //    fprintf(pFile, "M82 ; use absolute distances for extrusion\n");
-    //    fprintf(pFile, "M104 S230 ; set extruder temperature\n");
+    sendFormat("G21 ; set units to millimeters\n");
+    sendFormat("G90 ; use absolute coordinates\n");
+    sendFormat("G28 ; home all axes\n");
+    sendFormat("G1 Z5 F5000 ; lift nozzle\n");
+    sendFormat("M140 S60 ; set bed temperature\n");
+    //    sendFormat("T1\n");
+    //    sendFormat("M82 ; use absolute distances for extrusion\n");
+    //    sendFormat("M104 S230 ; set extruder temperature\n");
     if (pToolmap&1) {
-        fprintf(pFile, "T0\n");
-        fprintf(pFile, "M82 ; use absolute distances for extrusion\n");
-        fprintf(pFile, "M104 S%d ; set extruder temperature\n", pExtruderStandbyTemp);
+        sendFormat("T0\n");
+        sendFormat("M82 ; use absolute distances for extrusion\n");
+        sendFormat("M104 S%d ; set extruder temperature\n", pExtruderStandbyTemp);
     }
     if (pToolmap&2) {
-        fprintf(pFile, "T1\n");
-        fprintf(pFile, "M82 ; use absolute distances for extrusion\n");
-        fprintf(pFile, "M104 S%d ; set extruder temperature\n", pExtruderStandbyTemp);
+        sendFormat("T1\n");
+        sendFormat("M82 ; use absolute distances for extrusion\n");
+        sendFormat("M104 S%d ; set extruder temperature\n", pExtruderStandbyTemp);
     }
     if (pToolmap&1) {
-        fprintf(pFile, "T0\n");
-        fprintf(pFile, "M109 S%d ; set temperature and wait for it to be reached\n", pExtruderStandbyTemp);
+        sendFormat("T0\n");
+        sendFormat("M109 S%d ; set temperature and wait for it to be reached\n", pExtruderStandbyTemp);
     }
     if (pToolmap&2) {
-        fprintf(pFile, "T1\n");
-        fprintf(pFile, "M109 S%d ; set temperature and wait for it to be reached\n", pExtruderStandbyTemp);
+        sendFormat("T1\n");
+        sendFormat("M109 S%d ; set temperature and wait for it to be reached\n", pExtruderStandbyTemp);
     }
-    fprintf(pFile, "M190 S60 ; wait for bed temperature\n");
+    sendFormat("M190 S60 ; wait for bed temperature\n");
     cmdResetExtruder();
     sendMoveTo(pPosition); sendExtrusionAdd(-1.0); sendFeedrate(1800.0); sendNewLine("retract extruder");
-    fprintf(pFile, "M106 S255 P0 ; fan on\n");
-    fprintf(pFile, "M106 S255 P1 ; fan on\n");
-    fprintf(pFile, "M106 S255 P2 ; fan on\n");
-    fprintf(pFile, "G4 S0.1 ; dwell\n");
+    sendFormat("M106 S255 P0 ; fan on\n");
+    sendFormat("M106 S255 P1 ; fan on\n");
+    sendFormat("M106 S255 P2 ; fan on\n");
+    sendFormat("G4 S0.1 ; dwell\n");
     // C=523.251, D=587.330, E=659.255, F=698.456, G=783.991, A=880, B=987.767, C=1046.50
-    fprintf(pFile, "M300 S523.251 P100 ; beep\n");
-    fprintf(pFile, "M300 S587.330 P100 ; beep\n");
-    fprintf(pFile, "M300 S659.255 P100 ; beep\n");
-    fprintf(pFile, "M300 S698.456 P100 ; beep\n");
-    fprintf(pFile, "M300 S783.991 P100 ; beep\n");
+    sendFormat("M300 S523.251 P100 ; beep\n");
+    sendFormat("M300 S587.330 P100 ; beep\n");
+    sendFormat("M300 S659.255 P100 ; beep\n");
+    sendFormat("M300 S698.456 P100 ; beep\n");
+    sendFormat("M300 S783.991 P100 ; beep\n");
 #if 0
     sendMoveTo(pPosition);
     sendExtrusionAdd(8);
@@ -669,28 +1047,28 @@ void IAGcodeWriter::sendShutdownSequence()
     cmdComment("");
     cmdComment("==== Macro Shutdown");
     cmdResetExtruder();
-    //    fprintf(pFile, "T1 M104 S0 ; set extruder temperature\n");
+    //    sendFormat("T1 M104 S0 ; set extruder temperature\n");
     if (pToolmap&1) {
-        fprintf(pFile, "T0\n");
-        fprintf(pFile, "M104 S0 ; set extruder temperature\n");
+        sendFormat("T0\n");
+        sendFormat("M104 S0 ; set extruder temperature\n");
     }
     if (pToolmap&2) {
-        fprintf(pFile, "T1\n");
-        fprintf(pFile, "M104 S0 ; set extruder temperature\n");
+        sendFormat("T1\n");
+        sendFormat("M104 S0 ; set extruder temperature\n");
     }
-    fprintf(pFile, "M140 S0 ; set bed temperature\n");
-    fprintf(pFile, "M106 S0 P0 ; fan off\n");
-    fprintf(pFile, "M106 S0 P1 ; fan off\n");
-    fprintf(pFile, "M106 S0 P2 ; fan off\n");
-    fprintf(pFile, "G28 X0 Y0  ; home X and Y axis\n");
-    fprintf(pFile, "M84 ; disable motors\n");
-
-    fprintf(pFile, "G4 S0.1 ; dwell\n");
-    fprintf(pFile, "M300 S783.991 P100 ; beep\n");
-    fprintf(pFile, "M300 S698.456 P100 ; beep\n");
-    fprintf(pFile, "M300 S659.255 P100 ; beep\n");
-    fprintf(pFile, "M300 S587.330 P100 ; beep\n");
-    fprintf(pFile, "M300 S523.251 P100 ; beep\n");
+    sendFormat("M140 S0 ; set bed temperature\n");
+    sendFormat("M106 S0 P0 ; fan off\n");
+    sendFormat("M106 S0 P1 ; fan off\n");
+    sendFormat("M106 S0 P2 ; fan off\n");
+    sendFormat("G28 X0 Y0  ; home X and Y axis\n");
+    sendFormat("M84 ; disable motors\n");
+
+    sendFormat("G4 S0.1 ; dwell\n");
+    sendFormat("M300 S783.991 P100 ; beep\n");
+    sendFormat("M300 S698.456 P100 ; beep\n");
+    sendFormat("M300 S659.255 P100 ; beep\n");
+    sendFormat("M300 S587.330 P100 ; beep\n");
+    sendFormat("M300 S523.251 P100 ; beep\n");
     cmdComment("");
 }
 
@@ -704,14 +1082,16 @@ void IAGcodeWriter::requestTool(int t)
         // missing in the build. Some of this may be reduced by retracting much
         // further, bu I assume, some kind of minimal waste tower
         // is unavaoidable.
+        if (pT!=-1 && t!=-1)
+            pToolChangeCount++;
         if (pT!=-1) {
-            fprintf(pFile, "T%d\n", pT);
-            fprintf(pFile, "M104 S%d ; standby temperature\n", pExtruderStandbyTemp);
+            sendFormat("T%d\n", pT);
+            sendFormat("M104 S%d ; standby temperature\n", pExtruderStandbyTemp);
             cmdExtrude(-4.0); // pull the filament 4mm in in the hopes it will stop oozing
         }
         if (t!=-1) {
             // -- select the new extruder
-            fprintf(pFile, "T%d\n", t);
+            sendFormat("T%d\n", t);
             // -- move out of the way of the model
             IAVector3d pause = Iota.pMesh->pMin
                 - IAVector3d(10.0, 10.0, 0.0)
@@ -720,11 +1100,13 @@ void IAGcodeWriter::requestTool(int t)
             pause.z( pPosition.z() );
             cmdRapidMove(pause);
             // -- wait for printing temperature
-            fprintf(pFile, "M109 S%d ; printing temperature and wait\n", pExtruderPrintTemp);
+            sendFormat("M109 S%d ; printing temperature and wait\n", pExtruderPrintTemp);
             // -- or purge, or print outline, or print waste tower, or ...
             cmdExtrude(4.0); // unretract the filament 4mm in in the hopes it will continue printing without gap
-            pTotalTime += abs(t-pT)/1.5; // we assume 1.5 deg C per seconds heating rate
+            if (pT!=-1) // we assume 1.5 deg C per seconds heating rate
+                pPlanner.addDelay((pExtruderPrintTemp-pExtruderStandbyTemp)/1.5);
             if (pToolCount && pPrinter->toolChangeStrategy()==3) { // prime tower
+                double e0 = pE;
                 /// \bug the prime tower must ALWAYS be built, or a few layers without a toolchange will disrupt the tower
                 double tw = 13.0, td = 13.0;
                 double dx = (tw + 1.0) * t;
@@ -741,6 +1123,7 @@ void IAGcodeWriter::requestTool(int t)
                 cmdPrintMove(pause.x()+dx+tw, pause.y()-td);
                 cmdPrintMove(pause.x()+dx, pause.y()-td);
                 cmdPrintMove(pause.x()+dx, pause.y());
+                pPurgeLength += pE - e0;
                 /// \todo generate a prime tower to ensure a steady flow of filament.
                 /// \todo what's with collisions? Printing outside of the bed? Manually positioning towers?
                 // we may also use an ooze shild or the infill for priming
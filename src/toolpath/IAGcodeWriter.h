@@ -10,13 +10,19 @@
 
 #include "geometry/IAVector3d.h"
 #include "app/IAMacros.h"
+#include "app/IAOutputSink.h"
+#include "toolpath/IAGcodeEncoder.h"
+#include "toolpath/IAMotionPlanner.h"
 
 #include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <vector>
 #include <map>
 
 
 class IAFDMPrinter;
+class IAPrintHost;
 
 
 /**
@@ -29,7 +35,7 @@ public:
     ~IAGcodeWriter();
 
     bool open(const char *filename);
-    void close();
+    bool close();
 
 //    /** \todo save and update pEFactor */
 //    void setFilamentDiameter(double d);
@@ -44,11 +50,17 @@ public:
     double getTotalTime();
     void resetLayerTime();
     double getLayerTime();
+    /** Estimated time of every layer that was finished so far, in seconds. */
+    const std::vector<double> &layerTimeList() { return pLayerTimeList; }
 
     /** Position of the extruder head.
      \return the position of the current extruder's tip. */
     IAVector3d &position() { return pPosition; }
 
+    /** Toolpaths may be written as arcs if they deviate less than this, in
+     mm. Arcs are not used if this is 0. */
+    double arcTolerance() { return pArcTolerance; }
+
     void sendInitSequence(unsigned int toolmap);
     void sendShutdownSequence();
 
@@ -64,9 +76,24 @@ public:
     void cmdRetractMove(IAVector3d &v);
     void cmdPrintMove(double x, double y);
     void cmdPrintMove(IAVector3d &v);
+    void cmdPrintArc(IAVector3d &v, IAVector3d &center, bool ccw);
     void cmdRetract(double d=1.0);
     void cmdUnretract(double d=1.0);
     void cmdDwell(double seconds);
+    void cmdBeginLayer(double z);
+    void cmdEndLayer(double minLayerTime);
+    void cmdEstimatedTime();
+    void cmdToolChangeSummary();
+
+    /** Number of tool changes so far, not counting the first tool. */
+    int toolChangeCount() { return pToolChangeCount; }
+    /** Filament in mm^3 that was extruded to purge tools so far. */
+    double purgeVolume() { return pPurgeLength*(1.75/2)*(1.75/2)*M_PI; }
+
+    void setSpeedFactor(double factor);
+    double minimumSpeedFactor();
+    void beginSimulation();
+    double endSimulation(double *printTime=nullptr);
 
 private:
     DEPRECATED("This call does not work yet!")
@@ -84,9 +111,30 @@ private:
     void sendExtrusionAdd(double e);
     void sendExtrusionRel(uint32_t color, double e);
     void sendNewLine(const char *comment=nullptr);
+    void sendText(const char *text);
+    void sendFormat(const char *format, ...);
+    void sendFormatV(const char *format, va_list va);
+    void sendNumber(char letter, double v, int decimals);
+    void reserve(size_t n);
+    void flush();
+    void sendUnbuffered(const char *text, size_t size);
+
+    /// size of the output buffer; text is handed to the sink in blocks of this size
+    static const size_t kBufferSize = 1024*1024;
+    /// a formatted text of this size will always fit into the buffer
+    static const size_t kMaxFormatSize = 1024;
 
     IAFDMPrinter *pPrinter = nullptr;
-    FILE *pFile = nullptr;
+    /// writes the file in a background thread
+    IAOutputSink pSink;
+    /// streams directly to a printer instead of writing a file
+    IAPrintHost *pHost = nullptr;
+    /// plain text, MeatPack, or compressed blocks
+    IAGcodeEncoder *pEncoder = nullptr;
+    /// collects text until it is handed to the sink
+    char *pBuffer = nullptr;
+    /// number of bytes in the buffer
+    size_t pBufferUsed = 0;
     IAVector3d pPosition;
     int pT = 0;
     double pE = 0.0;
@@ -94,8 +142,11 @@ private:
     double pRapidFeedrate = 3000.0;
     double pPrintFeedrate = 1000.0; // 1400.0
     double pLayerHeight = 0.3;
+    double pArcTolerance = 0.0;
     unsigned int pToolmap = 0; // fill this list with bit for every tool used in the process
     int pToolCount = 0; // number of tools used
+    int pToolChangeCount = 0; // number of changes from one tool to another
+    double pPurgeLength = 0.0; // mm of filament extruded while changing tools
 
     int pExtruderStandbyTemp = 205;
     int pExtruderPrintTemp = 230;
@@ -124,8 +175,27 @@ private:
 
     double pEFactor = ((1.75/2)*(1.75/2)*M_PI) / (0.4*0.3); // ~20.0
 
+    /// estimates the printing time like the printer firmware would
+    IAMotionPlanner pPlanner;
+    /// print moves run at this fraction of the print feedrate
+    double pSpeedFactor = 1.0;
+    /// if set, commands are planned, but not written
+    bool pSimulating = false;
+    /// the state of the writer before a simulation
+    struct {
+        IAVector3d pPosition;
+        int pT = 0;
+        double pE = 0.0, pF = 0.0;
+        int pToolCount = 0;
+        int pToolChangeCount = 0;
+        double pPurgeLength = 0.0;
+        IAMotionPlanner pPlanner;
+        double pStartTime = 0.0;
+        double pStartPrintTime = 0.0;
+    } pSavedState;
     double pLayerStartTime = 0.0;
-    double pTotalTime = 0.0;
+    double pLayerZ = 0.0;
+    std::vector<double> pLayerTimeList;
 };
 
 
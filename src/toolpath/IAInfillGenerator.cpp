@@ -0,0 +1,432 @@
+//
+//  IAInfillGenerator.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAInfillGenerator.h"
+
+#include "Iota.h"
+#include "opengl/IAFramebuffer.h"
+#include "potrace/bitmap.h"
+#include "printer/IAPrinter.h"
+
+#include <math.h>
+
+
+/**
+ * Create an infill generator for the given region.
+ *
+ * \param region a framebuffer of type BITMAP; every pixel that is set will
+ *        be filled.
+ */
+IAInfillGenerator::IAInfillGenerator(IAFramebuffer *region)
+:   pRegion( region )
+{
+    IAVector3d &printbed = Iota.pCurrentPrinter->pPrintVolume;
+    pXScl = printbed.x()/region->width();
+    pYScl = printbed.y()/region->height();
+    // walk polylines at half a pixel, so that we never jump across a pixel
+    pStep = 0.5 * ((pXScl<pYScl) ? pXScl : pYScl);
+}
+
+
+/**
+ * Release all resources.
+ */
+IAInfillGenerator::~IAInfillGenerator()
+{
+    delete pLine;
+}
+
+
+/**
+ * Create a toolpath that fills the region with a pattern.
+ *
+ * \param pattern the type of infill
+ * \param layer the layer index, used by patterns that alternate between layers
+ * \param z height of the toolpath
+ * \param spacing average distance between extrusions in world coordinates,
+ *        the infill density is the extrusion width divided by the spacing.
+ *
+ * \return nullptr, if the region is empty
+ * \return a new smart_pointer to a list of toolpath lines
+ */
+IAToolpathListSP IAInfillGenerator::generate(Pattern pattern, int layer, double z,
+                                             double spacing)
+{
+    if ((!pRegion->pBitmap && !pRegion->pCoverage) || !findBoundingBox())
+        return nullptr;
+    if (spacing<4*pStep)
+        spacing = 4*pStep;
+
+    pZ = z;
+    pList = std::make_shared<IAToolpathList>(z);
+
+    switch (pattern) {
+        case RECTILINEAR:
+            // alternating diagonals, just like the original bitmap infill
+            addLines((layer&1) ? 45.0 : -45.0, spacing);
+            break;
+        case GRID:
+            addLines(45.0, 2.0*spacing);
+            addLines(-45.0, 2.0*spacing);
+            break;
+        case TRIANGLES:
+            addLines(0.0, 3.0*spacing);
+            addLines(60.0, 3.0*spacing);
+            addLines(120.0, 3.0*spacing);
+            break;
+        case HONEYCOMB:
+            // a honeycomb with side length a uses 4a of filament per cell of
+            // 2.6a^2 because the vertical walls are printed twice
+            addHoneycomb(1.54*spacing, layer);
+            break;
+        case GYROID:
+            // two curves per period; the curves are about 20% longer than
+            // a straight line
+            addGyroid(2.4*spacing, z);
+            break;
+    }
+    endPiece();
+
+    IAToolpathListSP list = pList;
+    pList = nullptr;
+    if (list->isEmpty())
+        return nullptr;
+    return list;
+}
+
+
+/**
+ * Find the area in the bitmap that contains pixels.
+ *
+ * \return false, if the bitmap is empty
+ */
+bool IAInfillGenerator::findBoundingBox()
+{
+    if (pRegion->pCoverage) {
+        int w = pRegion->width(), h = pRegion->height();
+        int xMin = w, xMax = -1, yMin = h, yMax = -1;
+        for (int y=0; y<h; y++) {
+            uint8_t *p = pRegion->pCoverage + y*w;
+            for (int x=0; x<w; x++) {
+                if (p[x]>=128) {
+                    if (x<xMin) xMin = x;
+                    if (x>xMax) xMax = x;
+                    if (y<yMin) yMin = y;
+                    yMax = y;
+                }
+            }
+        }
+        if (xMax==-1)
+            return false;
+        pXMin = xMin*pXScl;
+        pXMax = (xMax+1)*pXScl;
+        pYMin = yMin*pYScl;
+        pYMax = (yMax+1)*pYScl;
+        return true;
+    }
+
+    potrace_bitmap_t *bm = pRegion->pBitmap;
+    int dy = bm->dy;
+    int xMin = dy, xMax = -1, yMin = bm->h, yMax = -1;
+    for (int y=0; y<bm->h; y++) {
+        potrace_word *p = bm_scanline(bm, y);
+        for (int i=0; i<dy; i++) {
+            if (p[i]) {
+                if (i<xMin) xMin = i;
+                if (i>xMax) xMax = i;
+                if (y<yMin) yMin = y;
+                yMax = y;
+            }
+        }
+    }
+    if (xMax==-1)
+        return false;
+    pXMin = xMin*BM_WORDBITS*pXScl;
+    pXMax = (xMax+1)*BM_WORDBITS*pXScl;
+    pYMin = yMin*pYScl;
+    pYMax = (yMax+1)*pYScl;
+    return true;
+}
+
+
+/**
+ * Check if a point in world coordinates is inside the region.
+ */
+bool IAInfillGenerator::isInside(double x, double y)
+{
+    int px = (int)floor(x/pXScl);
+    int py = (int)floor(y/pYScl);
+    if (pRegion->pCoverage) {
+        if (px<0 || py<0 || px>=pRegion->width() || py>=pRegion->height())
+            return false;
+        return pRegion->pCoverage[py*pRegion->width()+px]>=128;
+    }
+    return BM_GET(pRegion->pBitmap, px, py);
+}
+
+
+/**
+ * Check if a line in world coordinates is entirely inside the region.
+ */
+bool IAInfillGenerator::isInside(const IAVector3d &a, const IAVector3d &b)
+{
+    IAVector3d d = b - a;
+    int n = (int)ceil(d.length()/pStep);
+    for (int i=0; i<=n; i++) {
+        IAVector3d p = (n==0) ? a : a + d*((double)i/n);
+        if (!isInside(p.x(), p.y()))
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Find the border of the region between two points.
+ *
+ * \param in a point inside the region
+ * \param out a point outside of the region, less than a pixel away from in
+ *
+ * \return a point on the last pixel inside the region, closest to out
+ */
+IAVector3d IAInfillGenerator::findEdge(IAVector3d in, IAVector3d out)
+{
+    for (int i=0; i<6; i++) {
+        IAVector3d m = (in + out) * 0.5;
+        if (isInside(m.x(), m.y()))
+            in = m;
+        else
+            out = m;
+    }
+    return in;
+}
+
+
+/**
+ * Add a set of parallel lines across the region.
+ *
+ * Lines are anchored at the origin of the world, so that patterns stack
+ * nicely from layer to layer. Every other line is reversed to generate
+ * zig-zags.
+ *
+ * \param angle direction of the lines in degrees
+ * \param spacing distance between lines
+ */
+void IAInfillGenerator::addLines(double angle, double spacing)
+{
+    double a = angle/180.0*M_PI;
+    IAVector3d d(cos(a), sin(a), 0.0);
+    IAVector3d n(-sin(a), cos(a), 0.0);
+
+    // find the range of the bounding box in line and normal direction
+    double dMin = 1e9, dMax = -1e9, nMin = 1e9, nMax = -1e9;
+    IAVector3d corner[4] = {
+        { pXMin, pYMin, 0.0 }, { pXMax, pYMin, 0.0 },
+        { pXMin, pYMax, 0.0 }, { pXMax, pYMax, 0.0 }
+    };
+    for (auto &c: corner) {
+        double dd = c.dot(d), nn = c.dot(n);
+        if (dd<dMin) dMin = dd;
+        if (dd>dMax) dMax = dd;
+        if (nn<nMin) nMin = nn;
+        if (nn>nMax) nMax = nn;
+    }
+
+    pMaxConnector = 3.0*spacing;
+    int k0 = (int)floor(nMin/spacing), k1 = (int)ceil(nMax/spacing);
+    Polyline line(2);
+    for (int k=k0; k<=k1; k++) {
+        IAVector3d o = n * (k*spacing);
+        line[0] = o + d*dMin;
+        line[1] = o + d*dMax;
+        clip(line, k&1);
+    }
+    endPiece();
+}
+
+
+/**
+ * Add a honeycomb pattern across the region.
+ *
+ * The honeycomb is built from vertical strips that are half a hexagon wide.
+ * Every strip zig-zags between its left and right border, so that two
+ * neighbouring strips touch at the vertical walls of the hexagons.
+ *
+ * \param side length of one side of the hexagon
+ * \param layer the layer index, alternates the direction of travel
+ */
+void IAInfillGenerator::addHoneycomb(double side, int layer)
+{
+    double w = side*sqrt(3.0); // width of the hexagon between its vertical walls
+    double hw = 0.5*w, rowHgt = 1.5*side;
+    int s0 = (int)floor(pXMin/hw)-1, s1 = (int)ceil(pXMax/hw)+1;
+    int r0 = (int)floor(pYMin/rowHgt)-1, r1 = (int)ceil(pYMax/rowHgt)+1;
+
+    pMaxConnector = 2.0*side;
+    Polyline strip;
+    for (int s=s0; s<=s1; s++) {
+        double xl = s*hw, xr = (s+1)*hw;
+        // walls in even rows are at odd multiples of w/2
+        double xOdd = (s&1) ? xl : xr;
+        double xInt = (s&1) ? xr : xl;
+        strip.clear();
+        for (int r=r0; r<=r1; r++) {
+            double x = (r&1) ? xInt : xOdd;
+            strip.push_back(IAVector3d(x, r*rowHgt - 0.5*side, 0.0));
+            strip.push_back(IAVector3d(x, r*rowHgt + 0.5*side, 0.0));
+        }
+        clip(strip, (s+layer)&1);
+    }
+    endPiece();
+}
+
+
+/**
+ * Add a gyroid pattern across the region.
+ *
+ * The curves are the intersection of the gyroid surface
+ * sin(x)cos(y) + sin(y)cos(z) + sin(z)cos(x) = 0 with the current layer. The
+ * equation is solved for y (or x, depending on z), which gives two branches
+ * per period.
+ *
+ * \param period length of one period of the gyroid
+ * \param z the current layer height
+ */
+void IAInfillGenerator::addGyroid(double period, double z)
+{
+    double k = 2.0*M_PI/period;
+    double sz = sin(z*k), cz = cos(z*k);
+    // solve for y if the curves run along x, otherwise solve for x
+    bool alongX = (fabs(cz)>=fabs(sz));
+    double uMin = alongX ? pXMin : pYMin, uMax = alongX ? pXMax : pYMax;
+    double vMin = alongX ? pYMin : pXMin, vMax = alongX ? pYMax : pXMax;
+    double du = period/16.0;
+    int nu = (int)ceil((uMax-uMin)/du)+1;
+    int m0 = (int)floor(vMin/period)-1, m1 = (int)ceil(vMax/period)+1;
+
+    pMaxConnector = period;
+    Polyline curve;
+    int n = 0;
+    for (int m=m0; m<=m1; m++) {
+        for (int branch=-1; branch<=1; branch+=2) {
+            curve.clear();
+            for (int i=0; i<=nu; i++) {
+                double u = uMin + i*du;
+                double su = sin(u*k), cu = cos(u*k);
+                // A cos(v) + B sin(v) = C
+                double A, B, C;
+                if (alongX) {
+                    A = su; B = cz; C = -sz*cu;
+                } else {
+                    A = sz; B = cu; C = -su*cz;
+                }
+                double R = sqrt(A*A+B*B);
+                double c = C/R;
+                if (c>1.0) c = 1.0;
+                if (c<-1.0) c = -1.0;
+                double v = (atan2(B, A) + branch*acos(c))/k + m*period;
+                if (alongX)
+                    curve.push_back(IAVector3d(u, v, 0.0));
+                else
+                    curve.push_back(IAVector3d(v, u, 0.0));
+            }
+            clip(curve, (n++)&1);
+        }
+    }
+    endPiece();
+}
+
+
+/**
+ * Clip a polyline against the region and add all pieces inside.
+ *
+ * \param src a polyline in world coordinates
+ * \param reverse walk the polyline from the last point to the first
+ */
+void IAInfillGenerator::clip(const Polyline &src, bool reverse)
+{
+    int n = (int)src.size();
+    if (n<2) return;
+
+    Polyline piece;
+    IAVector3d prev = reverse ? src[n-1] : src[0];
+    bool inside = isInside(prev.x(), prev.y());
+    if (inside) piece.push_back(prev);
+
+    for (int j=1; j<n; j++) {
+        const IAVector3d &a = reverse ? src[n-j] : src[j-1];
+        const IAVector3d &b = reverse ? src[n-j-1] : src[j];
+        IAVector3d d = b - a;
+        int ns = (int)ceil(d.length()/pStep);
+        for (int i=1; i<=ns; i++) {
+            IAVector3d p = (i==ns) ? b : a + d*((double)i/ns);
+            bool ins = isInside(p.x(), p.y());
+            if (ins!=inside) {
+                if (ins) {
+                    piece.clear();
+                    piece.push_back(findEdge(p, prev));
+                } else {
+                    piece.push_back(findEdge(prev, p));
+                    addPiece(piece);
+                    piece.clear();
+                }
+                inside = ins;
+            }
+            prev = p;
+        }
+        if (inside)
+            piece.push_back(b);
+    }
+    if (inside)
+        addPiece(piece);
+}
+
+
+/**
+ * Add a piece of a polyline to the toolpath.
+ *
+ * If the piece starts close to the end of the current toolpath line, and the
+ * connection is inside the region, the piece is appended, creating a zig-zag.
+ * Otherwise, a new toolpath line is started.
+ */
+void IAInfillGenerator::addPiece(const Polyline &piece)
+{
+    if (piece.size()<2) return;
+    // drop specks that are shorter than two pixels
+    double len = 0.0;
+    for (size_t i=1; i<piece.size(); i++)
+        len += (piece[i]-piece[i-1]).length();
+    if (len<4*pStep) return;
+
+    IAVector3d first(piece[0].x(), piece[0].y(), pZ);
+    if (   pLine
+        && (first-pLine->tPrev).length()<=pMaxConnector
+        && isInside(pLine->tPrev, first))
+    {
+        // connect to the previous piece
+    } else {
+        endPiece();
+        pLine = new IAToolpathLine(pZ);
+        pLine->startPath(first.x(), first.y());
+    }
+    for (auto &p: piece)
+        pLine->continuePath(p.x(), p.y());
+}
+
+
+/**
+ * Add the current toolpath line to the list of results.
+ */
+void IAInfillGenerator::endPiece()
+{
+    if (pLine) {
+        pList->add(pLine, 0, 0, 0);
+        pLine = nullptr;
+    }
+}
+
+
@@ -0,0 +1,90 @@
+//
+//  IAInfillGenerator.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_INFILL_GENERATOR_H
+#define IA_INFILL_GENERATOR_H
+
+
+#include "toolpath/IAToolpath.h"
+#include "geometry/IAVector3d.h"
+
+#include <vector>
+
+
+class IAFramebuffer;
+
+
+/**
+ * Generate infill toolpaths by clipping parametric patterns against a region.
+ *
+ * The region is the core bitmap of a slice, either a BITMAP or a COVERAGE
+ * framebuffer. Instead of drawing stripes into
+ * the bitmap and tracing the result, every pattern is described as a set of
+ * polylines in world coordinates. The polylines are clipped against the
+ * region by walking them at pixel resolution, and the resulting pieces are
+ * connected into zig-zags wherever the connection stays inside the region.
+ *
+ * The output consists of IAToolpathLine objects, so no tracing is needed at
+ * all for the infill.
+ */
+class IAInfillGenerator
+{
+public:
+    /**
+     * These are the supported infill patterns.
+     */
+    typedef enum {
+        RECTILINEAR = 0,
+        GRID,
+        TRIANGLES,
+        HONEYCOMB,
+        GYROID
+    } Pattern;
+
+    IAInfillGenerator(IAFramebuffer *region);
+    ~IAInfillGenerator();
+
+    IAToolpathListSP generate(Pattern pattern, int layer, double z,
+                              double spacing);
+
+private:
+    typedef std::vector<IAVector3d> Polyline;
+
+    bool findBoundingBox();
+    bool isInside(double x, double y);
+    bool isInside(const IAVector3d &a, const IAVector3d &b);
+    IAVector3d findEdge(IAVector3d in, IAVector3d out);
+
+    void addLines(double angle, double spacing);
+    void addHoneycomb(double side, int layer);
+    void addGyroid(double period, double z);
+
+    void clip(const Polyline &src, bool reverse);
+    void addPiece(const Polyline &piece);
+    void endPiece();
+
+    /// the region that will be filled
+    IAFramebuffer *pRegion = nullptr;
+    /// size of a pixel in world coordinates
+    double pXScl = 1.0, pYScl = 1.0;
+    /// step width when walking a polyline
+    double pStep = 1.0;
+    /// bounding box of the region in world coordinates
+    double pXMin = 0.0, pYMin = 0.0, pXMax = 0.0, pYMax = 0.0;
+    /// maximum length of a zig-zag connector in the current pattern
+    double pMaxConnector = 0.0;
+    /// z position of all generated toolpaths
+    double pZ = 0.0;
+    /// the toolpath line that is currently growing
+    IAToolpathLine *pLine = nullptr;
+    /// all finished toolpaths
+    IAToolpathListSP pList = nullptr;
+};
+
+
+#endif /* IA_INFILL_GENERATOR_H */
+
+
@@ -0,0 +1,284 @@
+//
+//  IAMotionPlanner.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAMotionPlanner.h"
+
+#include "printer/IAFDMPrinter.h"
+
+#include <math.h>
+#include <algorithm>
+
+
+/**
+ * Create a planner with the limits of a typical desktop printer.
+ */
+IAMotionPlanner::IAMotionPlanner()
+{
+}
+
+
+/**
+ * Read acceleration, speed, and junction limits from the printer properties.
+ */
+void IAMotionPlanner::setup(IAFDMPrinter *printer)
+{
+    const IAVector3d &accel = printer->maxAcceleration();
+    const IAVector3d &speed = printer->maxFeedrate();
+    const IAVector3d &jerk = printer->maxJerk();
+    pMaxAccel[0] = accel.x(); pMaxAccel[1] = accel.y(); pMaxAccel[2] = accel.z();
+    pMaxSpeed[0] = speed.x(); pMaxSpeed[1] = speed.y(); pMaxSpeed[2] = speed.z();
+    pMaxJerk[0] = jerk.x(); pMaxJerk[1] = jerk.y(); pMaxJerk[2] = jerk.z();
+    pMaxAccel[3] = printer->extruderAcceleration();
+    pJunctionDeviation = printer->junctionDeviation();
+    reset();
+}
+
+
+/**
+ * Start a new estimate with the printer at rest.
+ */
+void IAMotionPlanner::reset()
+{
+    pQueue.clear();
+    for (int i=0; i<4; i++) pPrevUnit[i] = 0.0;
+    pPrevNominal = 0.0;
+    pTime = 0.0;
+    pPrintTime = 0.0;
+}
+
+
+/**
+ * Add a linear move.
+ *
+ * \param from, to start and end of the move in mm
+ * \param e length of filament in mm, negative when retracting
+ * \param feedrate requested speed in mm/min
+ * \param print true if this move prints, see printTime()
+ */
+void IAMotionPlanner::addMove(const IAVector3d &from, const IAVector3d &to, double e, double feedrate,
+                              bool print)
+{
+    double d[4] = { to.x()-from.x(), to.y()-from.y(), to.z()-from.z(), e };
+    double length = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    if (length<1e-9) length = fabs(e); // extruder only move
+    if (length<1e-9) return;
+
+    Block b;
+    b.pLength = length;
+    b.pNominal = feedrate/60.0;
+    b.pAccel = 1e9;
+    b.pPrint = print;
+    for (int i=0; i<4; i++) {
+        b.pUnitIn[i] = b.pUnitOut[i] = d[i]/length;
+        double u = fabs(d[i]/length);
+        if (u>1e-9) {
+            b.pNominal = std::min(b.pNominal, pMaxSpeed[i]/u);
+            b.pAccel = std::min(b.pAccel, pMaxAccel[i]/u);
+        }
+    }
+    addBlock(b);
+}
+
+
+/**
+ * Add an arc in the xy plane.
+ *
+ * The firmware splits arcs into many short segments with very small angles
+ * between them, so the whole arc is planned as a single move. The head must
+ * be able to run at full speed in x and in y.
+ *
+ * \param from, to start and end of the arc in mm
+ * \param center center of the arc
+ * \param ccw true if the arc runs counter-clockwise
+ * \param e length of filament in mm
+ * \param feedrate requested speed in mm/min
+ * \param print true if this move prints, see printTime()
+ */
+void IAMotionPlanner::addArc(const IAVector3d &from, const IAVector3d &to,
+                             const IAVector3d &center, bool ccw, double e, double feedrate,
+                             bool print)
+{
+    double rx0 = from.x()-center.x(), ry0 = from.y()-center.y();
+    double rx1 = to.x()-center.x(), ry1 = to.y()-center.y();
+    double radius = sqrt(rx0*rx0 + ry0*ry0);
+    if (radius<1e-9) return;
+    double a0 = atan2(ry0, rx0), a1 = atan2(ry1, rx1);
+    double sweep = ccw ? a1-a0 : a0-a1;
+    if (sweep<0.0) sweep += 2.0*M_PI;
+    double length = radius*sweep;
+    if (length<1e-9) return;
+
+    Block b;
+    b.pLength = length;
+    b.pPrint = print;
+    double s = ccw ? 1.0 : -1.0;
+    b.pUnitIn[0] = -s*ry0/radius; b.pUnitIn[1] = s*rx0/radius;
+    b.pUnitOut[0] = -s*ry1/radius; b.pUnitOut[1] = s*rx1/radius;
+    b.pUnitIn[3] = b.pUnitOut[3] = e/length;
+    b.pNominal = std::min(feedrate/60.0, std::min(pMaxSpeed[0], pMaxSpeed[1]));
+    b.pAccel = std::min(pMaxAccel[0], pMaxAccel[1]);
+    double u = fabs(e/length);
+    if (u>1e-9) {
+        b.pNominal = std::min(b.pNominal, pMaxSpeed[3]/u);
+        b.pAccel = std::min(b.pAccel, pMaxAccel[3]/u);
+    }
+    addBlock(b);
+}
+
+
+/**
+ * Stop the printer and wait.
+ *
+ * \param seconds time for the command, for example a dwell or a firmware
+ *        retraction
+ */
+void IAMotionPlanner::addDelay(double seconds)
+{
+    flush();
+    pTime += seconds;
+}
+
+
+/**
+ * Execute all queued moves and come to a full stop.
+ */
+void IAMotionPlanner::flush()
+{
+    plan(0.0);
+    while (!pQueue.empty())
+        retire(0.0);
+    pPrevNominal = 0.0;
+}
+
+
+/**
+ * Queue a move and execute the oldest move if the queue is full.
+ */
+void IAMotionPlanner::addBlock(Block &b)
+{
+    b.pMaxEntry = junctionSpeed(pPrevUnit, pPrevNominal, b);
+    b.pEntry = b.pMaxEntry;
+    for (int i=0; i<4; i++) pPrevUnit[i] = b.pUnitOut[i];
+    pPrevNominal = b.pNominal;
+    pQueue.push_back(b);
+    if (pQueue.size()>kLookAhead) {
+        plan(0.0);
+        retire(0.0);
+    }
+}
+
+
+/**
+ * Find the fastest speed at which the head can pass from one move into the
+ * next.
+ *
+ * \param prev direction at the end of the previous move
+ * \param prevNominal speed of the previous move, 0 if the printer is at rest
+ * \param b the next move
+ */
+double IAMotionPlanner::junctionSpeed(const double *prev, double prevNominal, const Block &b)
+{
+    if (prevNominal<=0.0)
+        return 0.0;
+    const double *next = b.pUnitIn;
+    double v = std::min(prevNominal, b.pNominal);
+
+    if (pJunctionDeviation>0.0) {
+        // the head follows a circle that deviates this much from the corner
+        double lp = sqrt(prev[0]*prev[0] + prev[1]*prev[1] + prev[2]*prev[2]);
+        double ln = sqrt(next[0]*next[0] + next[1]*next[1] + next[2]*next[2]);
+        if (lp<1e-9 || ln<1e-9)
+            return 0.0; // extruder only moves stop the head
+        double cosTheta = -(prev[0]*next[0] + prev[1]*next[1] + prev[2]*next[2]) / (lp*ln);
+        if (cosTheta>0.999999)
+            return 0.0; // full reversal
+        if (cosTheta>-0.999999) {
+            double sinHalf = sqrt(0.5*(1.0-cosTheta));
+            double vj = sqrt(b.pAccel*pJunctionDeviation*sinHalf/(1.0-sinHalf));
+            v = std::min(v, vj);
+        }
+    } else {
+        // every axis may change its speed by no more than its jerk
+        for (int i=0; i<4; i++) {
+            double du = fabs(prev[i]-next[i]);
+            if (du>1e-9)
+                v = std::min(v, pMaxJerk[i]/du);
+        }
+    }
+    return v;
+}
+
+
+/**
+ * Calculate the entry speeds of all queued moves.
+ *
+ * The backward pass makes sure that every move can still slow down to the
+ * next move, and that the last move can slow down to exitSpeed. The forward
+ * pass makes sure that every move can reach the next entry speed. The entry
+ * speed of the first move is fixed, because the printer is already
+ * executing it.
+ */
+void IAMotionPlanner::plan(double exitSpeed)
+{
+    size_t n = pQueue.size();
+    if (n==0) return;
+    double next = exitSpeed;
+    for (size_t i=n-1; i>0; i--) {
+        Block &b = pQueue[i];
+        b.pEntry = std::min(b.pMaxEntry, sqrt(next*next + 2.0*b.pAccel*b.pLength));
+        next = b.pEntry;
+    }
+    for (size_t i=0; i+1<n; i++) {
+        Block &b = pQueue[i];
+        double maxExit = sqrt(b.pEntry*b.pEntry + 2.0*b.pAccel*b.pLength);
+        Block &c = pQueue[i+1];
+        c.pEntry = std::min(c.pEntry, maxExit);
+    }
+}
+
+
+/**
+ * Execute the oldest queued move.
+ *
+ * \param exitSpeed speed at the end of the move if it is the only one
+ */
+void IAMotionPlanner::retire(double exitSpeed)
+{
+    if (pQueue.empty()) return;
+    double exit = (pQueue.size()>1) ? pQueue[1].pEntry : exitSpeed;
+    double t = blockTime(pQueue.front(), exit);
+    pTime += t;
+    if (pQueue.front().pPrint)
+        pPrintTime += t;
+    pQueue.pop_front();
+}
+
+
+/**
+ * Return the time for a trapezoidal speed profile.
+ *
+ * If the move is too short to reach its nominal speed, the profile becomes
+ * a triangle.
+ */
+double IAMotionPlanner::blockTime(const Block &b, double exitSpeed)
+{
+    double v0 = b.pEntry, v1 = exitSpeed, vc = b.pNominal, a = b.pAccel, len = b.pLength;
+    if (vc<=0.0) return 0.0;
+    if (a<=0.0) return len/vc;
+    double accelDist = (vc*vc - v0*v0) / (2.0*a);
+    double decelDist = (vc*vc - v1*v1) / (2.0*a);
+    if (accelDist+decelDist<=len)
+        return (vc-v0)/a + (vc-v1)/a + (len-accelDist-decelDist)/vc;
+    double vp = sqrt((2.0*a*len + v0*v0 + v1*v1) / 2.0);
+    if (vp<std::max(v0, v1)) {
+        // can't happen if the plan is consistent, assume constant change
+        return (v0+v1>0.0) ? 2.0*len/(v0+v1) : 0.0;
+    }
+    return (vp-v0)/a + (vp-v1)/a;
+}
+
+
@@ -0,0 +1,98 @@
+//
+//  IAMotionPlanner.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_MOTION_PLANNER_H
+#define IA_MOTION_PLANNER_H
+
+
+#include "geometry/IAVector3d.h"
+
+#include <stddef.h>
+#include <deque>
+
+
+class IAFDMPrinter;
+
+
+/**
+ * Estimate the time that a printer needs to execute a list of moves.
+ *
+ * The planner simulates the trapezoidal motion planner of common printer
+ * firmware. Every move accelerates from its entry speed to its nominal
+ * speed, cruises, and decelerates to the entry speed of the next move.
+ * Acceleration and maximum speed are limited per axis. The speed at the
+ * junction between two moves is limited by the junction deviation, or, if
+ * that is 0, by the classic per axis jerk.
+ *
+ * Like the firmware, the planner only looks a limited number of moves
+ * ahead, and must always be able to stop at the end of the last known move.
+ * Dwells, firmware retraction, and homing empty the planner.
+ */
+class IAMotionPlanner
+{
+public:
+    IAMotionPlanner();
+    void setup(IAFDMPrinter *printer);
+    void reset();
+    void addMove(const IAVector3d &from, const IAVector3d &to, double e, double feedrate,
+                 bool print=false);
+    void addArc(const IAVector3d &from, const IAVector3d &to, const IAVector3d &center,
+                bool ccw, double e, double feedrate, bool print=false);
+    void addDelay(double seconds);
+    void flush();
+
+    /** Time in seconds for all moves that left the planner. */
+    double time() { return pTime; }
+    /** Time in seconds for all printing moves that left the planner. */
+    double printTime() { return pPrintTime; }
+
+    /** Number of moves that the firmware plans ahead. */
+    static const size_t kLookAhead = 16;
+
+private:
+    /**
+     * A single move in the planner queue.
+     */
+    class Block {
+    public:
+        double pLength = 0.0;       ///< mm in xyz, or in e for extruder moves
+        double pNominal = 0.0;      ///< cruise speed in mm/s
+        double pAccel = 0.0;        ///< acceleration in mm/s^2
+        double pMaxEntry = 0.0;     ///< fastest possible speed at the start
+        double pEntry = 0.0;        ///< planned speed at the start
+        double pUnitIn[4] = { };    ///< direction at the start, xyze
+        double pUnitOut[4] = { };   ///< direction at the end, xyze
+        bool pPrint = false;        ///< true for printing moves
+    };
+
+    void addBlock(Block &b);
+    double junctionSpeed(const double *prev, double prevNominal, const Block &b);
+    void plan(double exitSpeed);
+    void retire(double exitSpeed);
+    static double blockTime(const Block &b, double exitSpeed);
+
+    /// moves that were added, but not executed yet
+    std::deque<Block> pQueue;
+    /// direction and speed at the end of the last move
+    double pPrevUnit[4] = { };
+    double pPrevNominal = 0.0;
+    /// time of all retired moves
+    double pTime = 0.0;
+    /// time of all retired printing moves
+    double pPrintTime = 0.0;
+
+    /// limits per axis, xyze
+    double pMaxAccel[4] = { 1250.0, 1250.0, 200.0, 5000.0 };
+    double pMaxSpeed[4] = { 200.0, 200.0, 12.0, 120.0 };
+    double pMaxJerk[4] = { 8.0, 8.0, 0.4, 2.5 };
+    /// junction deviation in mm, use pMaxJerk if 0
+    double pJunctionDeviation = 0.013;
+};
+
+
+#endif /* IA_MOTION_PLANNER_H */
+
+
@@ -0,0 +1,72 @@
+//
+//  IAToolScheduler.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IAToolScheduler.h"
+
+#include <algorithm>
+
+
+/**
+ * Create a scheduler for a new print.
+ */
+IAToolScheduler::IAToolScheduler()
+{
+}
+
+
+/**
+ * Start a new print with no tool selected.
+ */
+void IAToolScheduler::reset()
+{
+    pLastTool = -1;
+}
+
+
+/**
+ * Find the order of tools for the next layer.
+ *
+ * Layers must be scheduled from bottom to top.
+ *
+ * \param toolmap a bit for every tool used in this layer
+ * \param nextToolmap a bit for every tool used in the following layer, or 0
+ *        if that is not known
+ *
+ * \return the tools in the order in which they should print
+ */
+std::vector<int> IAToolScheduler::schedule(unsigned int toolmap, unsigned int nextToolmap)
+{
+    std::vector<int> order;
+    for (int t=0; t<32; t++) {
+        if (toolmap & (1u<<t))
+            order.push_back(t);
+    }
+    if (order.empty())
+        return order;
+
+    // keep printing with the tool that is already hot
+    auto first = std::find(order.begin(), order.end(), pLastTool);
+    bool keepFirst = (first!=order.end());
+    if (keepFirst)
+        std::rotate(order.begin(), first, first+1);
+
+    // finish with a tool that the next layer can start with
+    size_t firstFree = keepFirst ? 1 : 0;
+    if (order.size()>firstFree+1) {
+        for (size_t i=order.size(); i>firstFree; i--) {
+            if (nextToolmap & (1u<<order[i-1])) {
+                std::rotate(order.begin()+i-1, order.begin()+i, order.end());
+                break;
+            }
+        }
+    }
+
+    pLastTool = order.back();
+    return order;
+}
+
+
@@ -0,0 +1,45 @@
+//
+//  IAToolScheduler.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_TOOL_SCHEDULER_H
+#define IA_TOOL_SCHEDULER_H
+
+
+#include <vector>
+
+
+/**
+ * Decide in which order the tools print a layer.
+ *
+ * Every tool change parks the old extruder, heats the new one, and purges
+ * it, which takes much longer than printing a few toolpaths. The toolpaths
+ * of different tools in the same layer don't depend on each other, so every
+ * tool prints all of its toolpaths in one go, and the scheduler only
+ * chooses the order of the tools.
+ *
+ * A layer starts with the tool that finished the previous layer, so the
+ * change at the layer boundary goes away. It ends with a tool that is
+ * also used in the next layer, so that the next layer can start with it.
+ * With two tools, every layer then needs a single change instead of two.
+ */
+class IAToolScheduler
+{
+public:
+    IAToolScheduler();
+    void reset();
+    std::vector<int> schedule(unsigned int toolmap, unsigned int nextToolmap=0);
+
+    /** The last tool of the last scheduled layer, or -1. */
+    int lastTool() { return pLastTool; }
+
+private:
+    int pLastTool = -1;
+};
+
+
+#endif /* IA_TOOL_SCHEDULER_H */
+
+
@@ -9,6 +9,7 @@
 
 
 #include "IAToolpath.h"
+#include "IATravelOptimizer.h"
 
 #include "Iota.h"
 #include "opengl/IAFramebuffer.h"
@@ -20,6 +21,19 @@
 #include <algorithm>
 
 
+/** Replace at least this many segments with an arc. */
+static const size_t kMinArcSegments = 3;
+
+/** Replace at most this many segments with a single arc. */
+static const size_t kMaxArcSegments = 128;
+
+/** Larger arcs are written as lines, in mm. */
+static const double kMaxArcRadius = 500.0;
+
+/** Arcs must not sweep more than this, so start and end are never close. */
+static const double kMaxArcSweep = 1.5*M_PI;
+
+
 bool isBlack(uint8_t *rgb, IAVector3d v)
 {
     IAVector3d s = v * (kFramebufferSize / 214.0);
@@ -208,14 +222,6 @@ void IAMachineToolpath::drawLayer(double z)
 }
 
 
-void IAMachineToolpath::optimize()
-{
-    for (auto &p: pToolpathListMap) {
-        p.second->optimize();
-    }
-}
-
-
 /**
  * Return a layer at the give z height, or nullptr if none found.
  */
@@ -293,32 +299,12 @@ bool IAMachineToolpath::saveGCode(const char *filename /*, printer */)
         unsigned int toolmap = createToolmap();
         w.sendInitSequence(toolmap);
         for (auto &p: pToolpathListMap) {
-            w.cmdComment("");
-            w.cmdComment("==== layer at z=%.2f", p.first / 1000.0);
-            w.cmdComment("");
-            w.cmdResetExtruder();
-            w.resetLayerTime();
             // send all motion commands
-            p.second->saveGCode(w);
-            double layerTime = w.getLayerTime();
-            printf("Layer at %.2f will print in %.2f seconds\n", p.first / 1000.0, layerTime);
-            /** \todo tune this parameter */
-            if (layerTime>0.0 && layerTime<minLayerTime) {
-                IAVector3d prev = w.position();
-                IAVector3d pause = Iota.pMesh->pMin
-                                 - IAVector3d(10.0, 10.0, 0.0)
-                                 + Iota.pMesh->position(); /** \bug in world coordinates */
-                pause.setMax(IAVector3d(0.0, 0.0, 0.0));
-                pause.z( prev.z() );
-                w.cmdRetract();
-                w.cmdRapidMove(pause);
-                w.cmdDwell(minLayerTime-layerTime);
-                w.cmdRapidMove(prev);
-                w.cmdUnretract();
-            }
+            p.second->saveGCodeLayer(w, minLayerTime);
         }
         w.sendShutdownSequence();
-        printf("Total print time is %.2f minutes\n", w.getTotalTime()/60.0);
+        w.cmdEstimatedTime();
+        w.cmdToolChangeSummary();
         w.close();
         ret = true;
     }
@@ -336,6 +322,7 @@ bool IAMachineToolpath::saveGCode(const char *filename /*, printer */)
  * Manage a list of toolpath types.
  */
 IAToolpathList::IAToolpathList(double z)
+:   pZ( z )
 {
 }
 
@@ -354,9 +341,8 @@ IAToolpathList::~IAToolpathList()
  */
 void IAToolpathList::purge()
 {
-    for (auto &tt: pToolpathList)
-        delete tt;
     pToolpathList.clear();
+    pSeamList.clear();
 }
 
 
@@ -376,6 +362,66 @@ bool IAToolpathList::isEmpty()
 }
 
 
+/**
+ * Return the number of bytes used by this list and its toolpaths.
+ *
+ * Toolpaths that are shared with other lists are counted in every list.
+ */
+size_t IAToolpathList::memorySize()
+{
+    size_t size = sizeof(IAToolpathList) + pToolpathList.capacity()*sizeof(IAToolpathTypeSP);
+    for (auto &tt: pToolpathList) {
+        size += sizeof(IAToolpath);
+        size += tt->pVertexList.capacity()*sizeof(IAToolpath::Vertex);
+        size += tt->pColorList.capacity()*sizeof(tt->pColorList[0]);
+    }
+    return size;
+}
+
+
+/**
+ * Return the number of islands in this list.
+ *
+ * Island numbers are assigned when tracing. They are unique within the
+ * loops of one trace.
+ *
+ * \return one more than the highest island number, or 0 if no loop in the
+ *         list belongs to an island
+ */
+int IAToolpathList::numIslands()
+{
+    int n = 0;
+    for (auto &tt: pToolpathList)
+        if (tt->pIsland>=n)
+            n = tt->pIsland + 1;
+    return n;
+}
+
+
+/**
+ * Create a new list for every island, containing its outline and its holes.
+ *
+ * Islands can be processed independently, for example to generate shells in
+ * parallel, or to print one island completely before moving to the next.
+ * Toolpaths that do not belong to an island are not copied.
+ *
+ * \return a list of toolpath lists, indexed by island number; islands that
+ *         were removed, for example for being too small, are nullptr
+ */
+std::vector<IAToolpathListSP> IAToolpathList::splitIslands()
+{
+    std::vector<IAToolpathListSP> islandList(numIslands());
+    for (auto &tt: pToolpathList) {
+        if (tt->pIsland<0) continue;
+        IAToolpathListSP &island = islandList[tt->pIsland];
+        if (!island)
+            island = std::make_shared<IAToolpathList>(pZ);
+        island->pToolpathList.push_back(tt);
+    }
+    return islandList;
+}
+
+
 /**
  * Add another toolpath type to the list.
  */
@@ -384,7 +430,7 @@ void IAToolpathList::add(IAToolpath *tt, int tool, int group, int priority)
     tt->pTool = tool;
     tt->pGroup = group;
     tt->pPriority = priority;
-    pToolpathList.push_back(tt);
+    pToolpathList.push_back(IAToolpathTypeSP(tt));
 }
 
 
@@ -401,7 +447,26 @@ void IAToolpathList::move(IAToolpathList *tl)
 
 
 /**
- * Add another toolpath list to the list.
+ * Move toolpaths from another list to this list and set their attributes.
+ *
+ * This is much cheaper than adding copies, if the other list is no longer
+ * needed.
+ */
+void IAToolpathList::move(IAToolpathList *tl, int tool, int group, int priority)
+{
+    for (auto &tt: tl->pToolpathList) {
+        tt->pTool = tool;
+        tt->pGroup = group;
+        tt->pPriority = priority;
+        pToolpathList.push_back(tt);
+    }
+    tl->pToolpathList.clear();
+}
+
+
+/**
+ * Add copies of the toolpaths in another list to the list and set their
+ * attributes.
  */
 void IAToolpathList::add(IAToolpathList *tl, int tool, int group, int priority)
 {
@@ -411,10 +476,15 @@ void IAToolpathList::add(IAToolpathList *tl, int tool, int group, int priority)
 }
 
 
+/**
+ * Add the toolpaths of another list to this list.
+ *
+ * The toolpaths are shared between both lists and are not copied.
+ */
 void IAToolpathList::add(IAToolpathList *tl)
 {
     for (auto &tt: tl->pToolpathList) {
-        add(tt->clone(), tt->pTool, tt->pGroup, tt->pPriority);
+        pToolpathList.push_back(tt);
     }
 }
 
@@ -473,9 +543,53 @@ unsigned int IAToolpathList::createToolmap()
 void IAToolpathList::saveGCode(IAGcodeWriter &w)
 {
     w.cmdComment("Send generated toolpath...");
-    for (auto &tt: pToolpathList) {
-        tt->saveGCode(w);
+    for (size_t i=0; i<pToolpathList.size(); i++) {
+        size_t seam = (i<pSeamList.size()) ? pSeamList[i] : 1;
+        pToolpathList[i]->saveGCode(w, seam, pSaveTolerance);
+    }
+}
+
+
+/**
+ * Save one layer of a GCode file and make sure it prints slow enough.
+ *
+ * If the layer would print faster than minLayerTime, all printing moves are
+ * slowed down, so the layer has time to cool without a pause. To find the
+ * speed factor, the layer is first simulated at full speed in a pre-pass
+ * that writes nothing. The pre-pass returns the time of the printing moves
+ * b, which scales with 1/factor, and the time of all other commands a,
+ * which does not. The factor is then b/(minLayerTime-a). If even the
+ * minimum speed is too fast, cmdEndLayer() adds the remaining time as a
+ * pause.
+ *
+ * \param w the GCode writer
+ * \param minLayerTime minimum time for a layer in seconds
+ */
+void IAToolpathList::saveGCodeLayer(IAGcodeWriter &w, double minLayerTime)
+{
+    w.cmdBeginLayer(pZ);
+    double factor = 1.0;
+    if (minLayerTime>0.0) {
+        double b = 0.0;
+        w.beginSimulation();
+        saveGCode(w);
+        double t = w.endSimulation(&b);
+        if (t>0.0 && t<minLayerTime && b>0.0) {
+            double a = t - b;
+            double minFactor = w.minimumSpeedFactor();
+            // acceleration makes slow moves a bit more efficient, so
+            // leave some headroom instead of pausing for a fraction
+            // of a second
+            factor = b / (minLayerTime - a) * 0.98;
+            factor = std::max(minFactor, std::min(1.0, factor));
+        }
     }
+    if (factor<1.0)
+        w.cmdComment("printing at %d%% speed for the minimum layer time", (int)(factor*100.0+0.5));
+    w.setSpeedFactor(factor);
+    saveGCode(w);
+    w.setSpeedFactor(1.0);
+    w.cmdEndLayer(minLayerTime);
 }
 
 
@@ -486,56 +600,51 @@ void IAToolpathList::saveDXF(const char *filename)
 {
     IADxfWriter w;
     if (w.open(filename)) {
-        for (auto &tt: pToolpathList) {
-            tt->saveDXF(w);
-        }
+        saveDXF(w);
         w.close();
     }
 }
 
 
-void IAToolpathList::optimize()
+/**
+ * Add all toolpaths to a DXF writer.
+ */
+void IAToolpathList::saveDXF(IADxfWriter &w)
 {
-    std::sort(pToolpathList.begin(), pToolpathList.end(), IAToolpath::comparePriorityAscending);
-    // -- optimize my travel distance: if Toolpaths are in the same group,
-    // with the same priority, and the same tool, sort them so that traveling
-    // between toolpaths is short
-    size_t i, j, n = pToolpathList.size();
-    if (n) for (i=0; i<n-1; i++) {
-        IAToolpath *ta = pToolpathList[i];
-        IAToolpath *tx = pToolpathList[i+1];
-        size_t x = i+1;
-        if (   ta->pGroup==tx->pGroup
-            && ta->pPriority==tx->pPriority
-            && ta->pTool==tx->pTool)
-        {
-            double dist = (ta->tFirst-tx->tFirst).length();
-            for (j=i+2; j<n; j++) {
-                IAToolpath *tb = pToolpathList[j];
-                if (   ta->pGroup==tb->pGroup
-                    && ta->pPriority==tb->pPriority
-                    && ta->pTool==tx->pTool )
-                {
-                    double dist2 = (ta->tFirst-tb->tFirst).length();
-                    if (dist2<dist) {
-                        dist = dist2;
-                        tx = tb;
-                        x = j;
-                    }
-                } else {
-                    break;
-                }
-            }
-            if (x!=i+1) {
-                IAToolpath *tmp = pToolpathList[x];
-                pToolpathList[x] = pToolpathList[i+1];
-                pToolpathList[i+1] = tmp;
-            }
-        }
+    for (auto &tt: pToolpathList) {
+        tt->saveDXF(w);
     }
 }
 
 
+/**
+ * Sort toolpaths by tool, group, and priority, and reduce the travel between
+ * them, starting at the origin.
+ */
+void IAToolpathList::optimize()
+{
+    IAVector3d position(0.0, 0.0, pZ);
+    optimize(position);
+}
+
+
+/**
+ * Sort toolpaths by tool, group, and priority, and reduce the travel between
+ * them.
+ *
+ * New seams are stored in pSeamList and only applied when writing GCode.
+ *
+ * \param position where the head is before this layer; on return, where the
+ *        head is after this layer
+ * \param toolOrder the order of tools from IAToolScheduler, or empty to
+ *        print the tools in ascending order
+ */
+void IAToolpathList::optimize(IAVector3d &position, const std::vector<int> &toolOrder)
+{
+    IATravelOptimizer(pToolpathList, pSeamList).optimize(position, toolOrder);
+}
+
+
 
 #ifdef __APPLE__
 #pragma mark -
@@ -579,8 +688,10 @@ IAToolpath *IAToolpath::clone(IAToolpath *t)
     t->pTool = pTool;
     t->pGroup = pGroup;
     t->pPriority = pPriority;
-    for (auto &e: pElementList)
-        t->pElementList.push_back(e->clone());
+    t->pIsland = pIsland;
+    t->pIsHole = pIsHole;
+    t->pVertexList = pVertexList;
+    t->pColorList = pColorList;
     return t;
 }
 
@@ -590,9 +701,9 @@ IAToolpath *IAToolpath::clone(IAToolpath *t)
  */
 void IAToolpath::purge()
 {
-    for (auto &el: pElementList)
-        delete el;
-    pElementList.clear();
+    pVertexList.clear();
+    pVertexList.shrink_to_fit();
+    pColorList.clear();
     tFirst = { 0.0, 0.0, pZ };
     tPrev = { 0.0, 0.0, pZ };
 }
@@ -631,229 +742,540 @@ void IAToolpath::draw()
         case  0: glColor3f(1.0, 1.0, 1.0); break;
         case  1: glColor3f(0.3, 0.3, 0.3); break;
     }
-    for (auto &e: pElementList) {
-        e->draw();
+#ifdef RENDER_HEX_TOOLPATH
+    size_t nextColor = 0;
+    uint32_t color = 0xFFFFFFFF;
+    for (size_t i=1; i<pVertexList.size(); i++) {
+        while (nextColor<pColorList.size() && pColorList[nextColor].first<=i)
+            color = pColorList[nextColor++].second;
+        if (pVertexList[i].pFlags & kRapid) continue;
+        if (color!=0xFFFFFFFF)
+            glColor3ub(color>>16, color>>8, color);
+        drawHexSegment(vertex(i-1), vertex(i));
+    }
+#else
+    // draw runs of rapid and extruding moves with as few state changes as possible
+    size_t n = pVertexList.size();
+    for (size_t i=1; i<n; ) {
+        bool rapid = (pVertexList[i].pFlags & kRapid);
+        if (rapid) {
+            glLineWidth(1.0);
+            glColor3f(1.0, 1.0, 0.0);
+        } else {
+            glLineWidth(2.0);
+            glColor3f(1.0, 0.0, 1.0);
+        }
+        glBegin(GL_LINE_STRIP);
+        glVertex3f(pVertexList[i-1].pX, pVertexList[i-1].pY, pZ);
+        for ( ; i<n && (bool)(pVertexList[i].pFlags & kRapid)==rapid; i++)
+            glVertex3f(pVertexList[i].pX, pVertexList[i].pY, pZ);
+        glEnd();
     }
+    glLineWidth(1.0);
+#endif
+}
+
+
+/**
+ * Draw an extrusion as a hexagonal bar.
+ *
+ * \todo make the extrusion hexagonal so we can represent the squashing
+ *       by the layer height. Also, use the current E factor to calculate the
+ *       expected width of the extrusion and draw that.
+ * \todo add lids or connecotrs to the next extrusion.
+ * \todo this should be cached
+ */
+void IAToolpath::drawHexSegment(const IAVector3d &pStart, const IAVector3d &pEnd)
+{
+    double r=0.2;
+    IAVector3d d = (pEnd - pStart).normalized();
+    IAVector3d n0 = { d.y(), -d.x(), 0.0 };
+    IAVector3d n1 = { 0.0, 0.0, 1.0 };
+    IAVector3d n2 = { -d.y(), d.x(), 0.0 };
+    IAVector3d n3 = { 0.0, 0.0, -1.0 };
+    IAVector3d p0, p1, p2, p3;
+
+    glBegin(GL_QUADS);
+    glNormal3dv(n0.dataPointer());
+    p0 = pStart + n0*r; glVertex3dv(p0.dataPointer());
+    glNormal3dv(n0.dataPointer());
+    p1 = pEnd + n0*r; glVertex3dv(p1.dataPointer());
+    glNormal3dv(n1.dataPointer());
+    p2 = pEnd + n1*r; glVertex3dv(p2.dataPointer());
+    glNormal3dv(n1.dataPointer());
+    p3 = pStart + n1*r; glVertex3dv(p3.dataPointer());
+    glEnd();
+
+    glBegin(GL_QUADS);
+    glNormal3dv(n1.dataPointer());
+    p0 = pStart + n1*r; glVertex3dv(p0.dataPointer());
+    glNormal3dv(n1.dataPointer());
+    p1 = pEnd + n1*r; glVertex3dv(p1.dataPointer());
+    glNormal3dv(n2.dataPointer());
+    p2 = pEnd + n2*r; glVertex3dv(p2.dataPointer());
+    glNormal3dv(n2.dataPointer());
+    p3 = pStart + n2*r; glVertex3dv(p3.dataPointer());
+    glEnd();
+
+    glBegin(GL_QUADS);
+    glNormal3dv(n2.dataPointer());
+    p0 = pStart + n2*r; glVertex3dv(p0.dataPointer());
+    glNormal3dv(n2.dataPointer());
+    p1 = pEnd + n2*r; glVertex3dv(p1.dataPointer());
+    glNormal3dv(n3.dataPointer());
+    p2 = pEnd + n3*r; glVertex3dv(p2.dataPointer());
+    glNormal3dv(n3.dataPointer());
+    p3 = pStart + n3*r; glVertex3dv(p3.dataPointer());
+    glEnd();
+
+    glBegin(GL_QUADS);
+    glNormal3dv(n3.dataPointer());
+    p0 = pStart + n3*r; glVertex3dv(p0.dataPointer());
+    glNormal3dv(n3.dataPointer());
+    p1 = pEnd + n3*r; glVertex3dv(p1.dataPointer());
+    glNormal3dv(n0.dataPointer());
+    p2 = pEnd + n0*r; glVertex3dv(p2.dataPointer());
+    glNormal3dv(n0.dataPointer());
+    p3 = pStart + n0*r; glVertex3dv(p3.dataPointer());
+    glEnd();
 }
 
 
+/**
+ * Draw all extruding moves as lines of the given width.
+ *
+ * \todo draw connection between lines.
+ * \todo this should draw a cap depending on the previous line.
+ * \todo this is the brute force approach which could be made so much
+ *       faster. This approach just draws an octagon, extende by a line.
+ */
 void IAToolpath::drawFlat(double w)
 {
-    /**
-     \todo draw connection between lines.
-     */
-    for (auto &e: pElementList) {
-        e->drawFlat(w);
+    for (size_t i=1; i<pVertexList.size(); i++) {
+        if (pVertexList[i].pFlags & kRapid) continue;
+        IAVector3d pStart = vertex(i-1), pEnd = vertex(i);
+        IAVector3d d = pEnd - pStart;
+        IAVector3d u = d.normalized();
+        double xo = u.x() * w * 0.5, x7 = xo * 0.7;
+        double yo = u.y() * w * 0.5, y7 = yo * 0.7;;
+        glBegin(GL_POLYGON);
+        glVertex3d(pStart.x()-xo, pStart.y()-yo, pStart.z());
+        glVertex3d(pStart.x()-x7-y7, pStart.y()-y7+x7, pStart.z());
+        glVertex3d(pStart.x()-yo, pStart.y()+xo, pStart.z());
+        glVertex3d(pEnd.x()-yo, pEnd.y()+xo, pEnd.z());
+        glVertex3d(pEnd.x()+x7-y7, pEnd.y()+y7+x7, pEnd.z());
+        glVertex3d(pEnd.x()+xo, pEnd.y()+yo, pEnd.z());
+        glVertex3d(pEnd.x()+x7+y7, pEnd.y()+y7-x7, pEnd.z());
+        glVertex3d(pEnd.x()+yo, pEnd.y()-xo, pEnd.z());
+        glVertex3d(pStart.x()+yo, pStart.y()-xo, pStart.z());
+        glVertex3d(pStart.x()-x7+y7, pStart.y()-y7-x7, pStart.z());
+        glEnd();
     }
 }
 
 
+/**
+ * Draw all extruding moves as lines of the given width into a bitmap.
+ *
+ * \todo see drawFlat()
+ */
 void IAToolpath::drawFlatToBitmap(IAFramebuffer *fb, double w, int color)
 {
-    /**
-     \todo draw connection between lines.
-     */
-    for (auto &e: pElementList) {
-        e->drawFlatToBitmap(fb, w, color);
+    for (size_t i=1; i<pVertexList.size(); i++) {
+        if (pVertexList[i].pFlags & kRapid) continue;
+        IAVector3d pStart = vertex(i-1), pEnd = vertex(i);
+        IAVector3d d = pEnd - pStart;
+        IAVector3d u = d.normalized();
+        double xo = u.x() * w * 0.5, x7 = xo * 0.7;
+        double yo = u.y() * w * 0.5, y7 = yo * 0.7;;
+        fb->beginComplexPolygon();
+        fb->addPoint(pStart.x()-xo, pStart.y()-yo);
+        fb->addPoint(pStart.x()-x7-y7, pStart.y()-y7+x7);
+        fb->addPoint(pStart.x()-yo, pStart.y()+xo);
+        fb->addPoint(pEnd.x()-yo, pEnd.y()+xo);
+        fb->addPoint(pEnd.x()+x7-y7, pEnd.y()+y7+x7);
+        fb->addPoint(pEnd.x()+xo, pEnd.y()+yo);
+        fb->addPoint(pEnd.x()+x7+y7, pEnd.y()+y7-x7);
+        fb->addPoint(pEnd.x()+yo, pEnd.y()-xo);
+        fb->addPoint(pStart.x()+yo, pStart.y()-xo);
+        fb->addPoint(pStart.x()-x7+y7, pStart.y()-y7-x7);
+        fb->endComplexPolygon(color);
     }
 }
 
 
 /**
- * Start a new path.
+ * Add a point to the path.
  */
-void IAToolpath::startPath(double x, double y)
+void IAToolpath::addVertex(const IAVector3d &v, bool rapid)
 {
-    IAVector3d next(x, y, pZ);
-    tFirst = next;
-    pElementList.push_back(new IAToolpathMotion(tPrev, next, true));
-    tPrev = next;
+    Vertex vtx;
+    vtx.pX = (float)v.x();
+    vtx.pY = (float)v.y();
+    vtx.pFlags = rapid ? kRapid : 0;
+    pVertexList.push_back(vtx);
 }
 
 
 /**
- * Add a motion segment to the path.
+ * Check if this path is a single closed loop.
+ *
+ * A closed loop has a rapid move to its first point, is printed without
+ * any further rapid moves, and ends where it started. It has no color
+ * changes.
+ *
+ * \return true if the seam of the loop can be moved with moveSeam()
  */
-void IAToolpath::continuePath(double x, double y)
+bool IAToolpath::isClosedLoop()
 {
-    IAVector3d next(x, y, pZ);
-    if (!(tPrev==next))
-        pElementList.push_back(new IAToolpathMotion(tPrev, next));
-    tPrev = next;
+    size_t n = pVertexList.size();
+    if (n<4 || !pColorList.empty())
+        return false;
+    if (!(pVertexList[1].pFlags & kRapid))
+        return false;
+    for (size_t i=2; i<n; i++)
+        if (pVertexList[i].pFlags & kRapid)
+            return false;
+    return pVertexList[1].pX==pVertexList[n-1].pX
+        && pVertexList[1].pY==pVertexList[n-1].pY;
 }
 
 
 /**
- * Create a loop by moving back to the very first vector.
+ * Start printing a closed loop at a different vertex.
+ *
+ * The shape of the loop does not change.
+ *
+ * \param seam index of the new first point, must be in the ring of the
+ *        loop, from 1 to the number of vertices minus 2
+ *
+ * \see isClosedLoop()
  */
-void IAToolpath::closePath()
+void IAToolpath::moveSeam(size_t seam)
 {
-    if (!(tPrev==tFirst))
-        pElementList.push_back(new IAToolpathMotion(tPrev, tFirst));
+    size_t n = pVertexList.size();
+    if (seam<=1 || seam>=n-1)
+        return;
+    rotateLoop(pVertexList, seam);
+    tFirst = tPrev = vertex(1);
 }
 
 
 /**
- * Create a bitmap of all tools/extruders used in this toolpath.
+ * Rotate the vertices of a closed loop, so that it starts at the seam.
+ *
+ * \param vl the vertices of a closed loop
+ * \param seam index of the new first point, from 2 to the number of
+ *        vertices minus 2
  */
-unsigned int IAToolpath::createToolmap()
+void IAToolpath::rotateLoop(std::vector<Vertex> &vl, size_t seam)
 {
-    if (pTool==-1) return 1;
-    return 1<<pTool;
+    size_t n = vl.size();
+    std::vector<Vertex> dst;
+    dst.reserve(n);
+    dst.push_back(vl[0]);
+    for (size_t i=seam; i<n-1; i++)
+        dst.push_back(vl[i]);
+    for (size_t i=1; i<=seam; i++)
+        dst.push_back(vl[i]);
+    for (size_t i=1; i<n; i++)
+        dst[i].pFlags &= ~kRapid;
+    dst[1].pFlags |= kRapid;
+    vl.swap(dst);
 }
 
 
 /**
- * Save the toolpath as a GCode file.
+ * Remove points that are closer than a tolerance to the simplified path.
+ *
+ * Every run of printing moves between two rapid moves is simplified with
+ * the Douglas-Peucker algorithm. The start and end of every run are kept, so
+ * rapid moves and seams do not change. Collinear points are always removed.
+ *
+ * Distances are measured to the segment, not to the infinite line, so a
+ * path that turns around and runs back on itself keeps its turning point.
+ *
+ * \param tolerance maximum deviation from the original path, in mm
  */
-void IAToolpath::saveGCode(IAGcodeWriter &w)
+void IAToolpath::simplify(double tolerance)
 {
-    w.requestTool(pTool);
-    for (auto &e: pElementList) {
-        e->saveGCode(w);
-    }
+    size_t n = pVertexList.size();
+    if (n<3) return;
+    std::vector<size_t> newIndex;
+    simplifyRuns(pVertexList, tolerance, &newIndex);
+    // move color changes to the new indices
+    for (auto &c: pColorList)
+        c.first = newIndex[std::min(c.first, n)];
 }
 
 
 /**
- * Save the toolpath as a DXF file.
+ * Remove points from a list of vertices, as described in simplify().
+ *
+ * \param vl the list of vertices, compacted in place
+ * \param tolerance maximum deviation from the original path, in mm
+ * \param[out] newIndex if set, the new index of every original vertex, plus
+ *        the new size at the end
  */
-void IAToolpath::saveDXF(IADxfWriter &w)
+void IAToolpath::simplifyRuns(std::vector<Vertex> &vl, double tolerance,
+                              std::vector<size_t> *newIndex)
 {
-    for (auto &e: pElementList) {
-        e->saveDXF(w);
+    size_t n = vl.size();
+    if (n<3) return;
+
+    std::vector<bool> keep(n, false);
+    std::vector<std::pair<size_t, size_t>> stack;
+    size_t first = 0;
+    while (first<n) {
+        // a run starts at a vertex and continues through all printing moves
+        size_t last = first+1;
+        while (last<n && !(vl[last].pFlags & kRapid))
+            last++;
+        last--;
+        keep[first] = keep[last] = true;
+        stack.push_back(std::make_pair(first, last));
+        while (!stack.empty()) {
+            size_t a = stack.back().first, b = stack.back().second;
+            stack.pop_back();
+            if (b-a<2) continue;
+            double x0 = vl[a].pX, y0 = vl[a].pY;
+            double dx = vl[b].pX-x0, dy = vl[b].pY-y0;
+            double len2 = dx*dx + dy*dy;
+            size_t maxIndex = a;
+            double maxDist = -1.0;
+            for (size_t i=a+1; i<b; i++) {
+                double px = vl[i].pX-x0, py = vl[i].pY-y0;
+                double t = (len2>0.0) ? (px*dx + py*dy)/len2 : 0.0;
+                if (t<0.0) t = 0.0; else if (t>1.0) t = 1.0;
+                double ex = px-t*dx, ey = py-t*dy;
+                double d = ex*ex + ey*ey;
+                if (d>maxDist) { maxDist = d; maxIndex = i; }
+            }
+            if (maxDist>tolerance*tolerance) {
+                keep[maxIndex] = true;
+                stack.push_back(std::make_pair(a, maxIndex));
+                stack.push_back(std::make_pair(maxIndex, b));
+            }
+        }
+        first = last+1;
     }
-}
 
-
-#ifdef __APPLE__
-#pragma mark -
-#endif
-// =============================================================================
+    // compact the list
+    if (newIndex) newIndex->resize(n+1);
+    size_t j = 0;
+    for (size_t i=0; i<n; i++) {
+        if (newIndex) (*newIndex)[i] = j;
+        if (keep[i])
+            vl[j++] = vl[i];
+    }
+    if (newIndex) (*newIndex)[n] = j;
+    vl.resize(j);
+}
 
 
-IAToolpathLoop::IAToolpathLoop(double z)
-:   IAToolpath( z )
+/**
+ * Start a new path.
+ */
+void IAToolpath::startPath(double x, double y)
 {
+    IAVector3d next(x, y, pZ);
+    tFirst = next;
+    // the very first rapid move starts wherever the previous path ended
+    if (pVertexList.empty())
+        addVertex(tPrev, true);
+    addVertex(next, true);
+    tPrev = next;
 }
 
 
-IAToolpathLoop::~IAToolpathLoop()
+/**
+ * Add a motion segment to the path.
+ */
+void IAToolpath::continuePath(double x, double y)
 {
+    IAVector3d next(x, y, pZ);
+    if (!(tPrev==next))
+        addVertex(next, false);
+    tPrev = next;
 }
 
 
-IAToolpath *IAToolpathLoop::clone(IAToolpath *t)
+/**
+ * Create a loop by moving back to the very first vector.
+ */
+void IAToolpath::closePath()
 {
-    if (!t)
-        t = new IAToolpathLoop(pZ);
-    return super::clone(t);
+    if (!(tPrev==tFirst))
+        addVertex(tFirst, false);
+    tPrev = tFirst;
 }
 
 
-#ifdef __APPLE__
-#pragma mark -
-#endif
-// =============================================================================
+/**
+ * Draw all following segments in a different color.
+ *
+ * \param color 0xRRGGBB, or 0xFFFFFFFF to use the color of the tool
+ */
+void IAToolpath::setColor(uint32_t color)
+{
+    pColorList.push_back(std::make_pair(pVertexList.size(), color));
+}
 
 
 /**
- * Create any sort of toolpath element.
+ * Create a bitmap of all tools/extruders used in this toolpath.
  */
-IAToolpathElement::IAToolpathElement()
+unsigned int IAToolpath::createToolmap()
 {
+    if (pTool==-1) return 1;
+    return 1<<pTool;
 }
 
 
 /**
- * Destroy an element.
+ * Check if a run of printing moves can be replaced by a single arc.
+ *
+ * The arc runs through the first, middle, and last vertex. All other vertices
+ * and the middle of all segments must be within the tolerance of the arc,
+ * and the path must turn the same way at every vertex.
+ *
+ * \param first, last indices of the first and last vertex of the run
+ * \param tolerance maximum deviation from the toolpath, in mm
+ * \param[out] center center of the arc
+ * \param[out] ccw true if the arc runs counter-clockwise
+ *
+ * \return true if the arc fits
  */
-IAToolpathElement::~IAToolpathElement()
+bool IAToolpath::fitArc(const std::vector<Vertex> &vl, size_t first, size_t last,
+                        double tolerance, IAVector3d &center, bool &ccw)
 {
+    const Vertex &a = vl[first];
+    const Vertex &m = vl[(first+last)/2];
+    const Vertex &b = vl[last];
+    double ax = a.pX, ay = a.pY, mx = m.pX, my = m.pY, bx = b.pX, by = b.pY;
+    double d = 2.0 * (ax*(my-by) + mx*(by-ay) + bx*(ay-my));
+    if (fabs(d)<1e-9) return false; // collinear
+    double a2 = ax*ax+ay*ay, m2 = mx*mx+my*my, b2 = bx*bx+by*by;
+    double cx = (a2*(my-by) + m2*(by-ay) + b2*(ay-my)) / d;
+    double cy = (a2*(bx-mx) + m2*(ax-bx) + b2*(mx-ax)) / d;
+    double r = sqrt((ax-cx)*(ax-cx) + (ay-cy)*(ay-cy));
+    if (r>kMaxArcRadius) return false;
+    ccw = (d>0.0);
+
+    double sweep = 0.0;
+    for (size_t i=first; i<last; i++) {
+        double px = vl[i].pX-cx, py = vl[i].pY-cy;
+        double qx = vl[i+1].pX-cx, qy = vl[i+1].pY-cy;
+        if (fabs(sqrt(qx*qx + qy*qy)-r)>tolerance) return false;
+        double cross = px*qy - py*qx, dot = px*qx + py*qy;
+        double angle = atan2(cross, dot);
+        if ( (angle>0.0) != ccw ) return false;
+        sweep += fabs(angle);
+        // the arc bulges out between two vertices
+        double lx = qx-px, ly = qy-py;
+        double h2 = r*r - 0.25*(lx*lx + ly*ly);
+        if (h2<0.0 || r-sqrt(h2)>tolerance) return false;
+    }
+    if (sweep>kMaxArcSweep) return false;
+    center.set(cx, cy, pZ);
+    return true;
 }
 
 
-IAToolpathElement *IAToolpathElement::clone()
+/**
+ * Save the toolpath as a GCode file.
+ *
+ * If the writer allows it, runs of short moves that follow a circle are
+ * written as arcs.
+ *
+ * Toolpaths are shared with the slice cache and the preview, so a new seam
+ * and simplification are applied to a temporary copy of the vertices, and
+ * the toolpath itself does not change.
+ *
+ * \param w the GCode writer
+ * \param seam start a closed loop at this vertex, see moveSeam()
+ * \param tolerance simplify the toolpath by this many mm, see simplify()
+ */
+void IAToolpath::saveGCode(IAGcodeWriter &w, size_t seam, double tolerance)
 {
-    return new IAToolpathElement();
+    size_t n = pVertexList.size();
+    bool rotate = (seam>1 && seam<n-1);
+    if (!rotate && (tolerance<=0.0 || n<3)) {
+        writeGCode(w, pVertexList);
+        return;
+    }
+    std::vector<Vertex> vl(pVertexList);
+    if (rotate)
+        rotateLoop(vl, seam);
+    if (tolerance>0.0)
+        simplifyRuns(vl, tolerance);
+    writeGCode(w, vl);
 }
 
 
 /**
- * Draw any element.
+ * Write a list of vertices at the z position of this toolpath.
  */
-void IAToolpathElement::draw()
+void IAToolpath::writeGCode(IAGcodeWriter &w, const std::vector<Vertex> &vl)
 {
-    // nothing to here
+    w.requestTool(pTool);
+    double arcTolerance = w.arcTolerance();
+    size_t n = vl.size();
+    for (size_t i=1; i<n; i++) {
+        IAVector3d pEnd(vl[i].pX, vl[i].pY, pZ);
+        if (vl[i].pFlags & kRapid) {
+            w.cmdRetractMove(pEnd);
+            continue;
+        }
+        IAVector3d pStart(vl[i-1].pX, vl[i-1].pY, pZ);
+        if (w.position()!=pStart)
+            w.cmdRetractMove(pStart);
+        if (arcTolerance>0.0) {
+            // grow the arc as long as the following vertices fit
+            size_t last = i-1;
+            IAVector3d center, c;
+            bool ccw = false, dir;
+            for (size_t j=i; j<n && j-(i-1)<=kMaxArcSegments; j++) {
+                if (vl[j].pFlags & kRapid) break;
+                if (j-(i-1)<kMinArcSegments) continue;
+                if (!fitArc(vl, i-1, j, arcTolerance, c, dir)) break;
+                last = j; center = c; ccw = dir;
+            }
+            if (last>i-1) {
+                IAVector3d pArcEnd(vl[last].pX, vl[last].pY, pZ);
+                w.cmdPrintArc(pArcEnd, center, ccw);
+                i = last;
+                continue;
+            }
+        }
+        w.cmdPrintMove(pEnd);
+    }
 }
 
 
-//#ifdef __APPLE__
-//#pragma mark -
-//#endif
-//// =============================================================================
-//
-//
-//
-///**
-// * Create any sort of toolpath element.
-// */
-//IAToolpathExtruder::IAToolpathExtruder(int tool)
-//:   pTool( tool )
-//{
-//}
-//
-//
-///**
-// * Destroy an element.
-// */
-//IAToolpathExtruder::~IAToolpathExtruder()
-//{
-//}
-//
-//
-//IAToolpathElement *IAToolpathExtruder::clone()
-//{
-//    IAToolpathExtruder *tpe = new IAToolpathExtruder(pTool);
-//    return tpe;
-//}
-//
-//
-///**
-// * Save the toolpath element as a GCode file.
-// */
-//void IAToolpathExtruder::saveGCode(IAGcodeWriter &w)
-//{
-//    assert(0); // this must be implemented again
-//#if 0
-//    w.cmdComment("");
-//    w.cmdComment("---- Change to extruder %d", pTool);
-//    // deactivate the other extruder
-//    int otherTool = 1-pTool;
-//    w.cmdSelectExtruder(otherTool);
-//    w.cmdResetExtruder();
-//    w.cmdExtrude(-4.0);
-//
-//    // activate the new extruder
-//    w.cmdSelectExtruder(pTool);
-//    w.cmdResetExtruder();
-//    w.cmdExtrude(4.0);
-//    int x = pTool ? 100 : 48;
-//    int pw = 20;
-//    w.cmdRapidMove(x, 10.0);
-//    int i;
-//    for (i=0; i<4; i++) {
-//        w.cmdPrintMove(x+pw, 10.0+i);
-//        w.cmdPrintMove(x+pw, 10.0+i+0.5);
-//        w.cmdMove(x, 10.0+i+0.5);
-//        w.cmdMove(x, 10.0+i+1.0);
-//    }
-//    w.cmdSelectExtruder(pTool); // redundant
-//    w.cmdResetExtruder();
-//    w.cmdComment("Extruder %d ready", pTool);
-//    w.cmdComment("");
-//#endif
-//}
+/**
+ * Save the toolpath as a DXF file.
+ */
+void IAToolpath::saveDXF(IADxfWriter &w)
+{
+    // every run of connected segments becomes one polyline
+    size_t n = pVertexList.size();
+    size_t i = 1;
+    while (i<n) {
+        if (pVertexList[i].pFlags & kRapid) { i++; continue; }
+        size_t first = i-1, last = i;
+        while (last+1<n && !(pVertexList[last+1].pFlags & kRapid))
+            last++;
+        auto &a = pVertexList[first], &b = pVertexList[last];
+        bool closed = (last-first>1 && a.pX==b.pX && a.pY==b.pY);
+        if (closed) last--;
+        w.cmdBeginPolyline(closed);
+        for (size_t j=first; j<=last; j++)
+            w.cmdVertex(pVertexList[j].pX, pVertexList[j].pY);
+        w.cmdEndPolyline();
+        i = (closed ? last+2 : last+1);
+    }
+}
 
 
 #ifdef __APPLE__
@@ -862,219 +1284,47 @@ void IAToolpathElement::draw()
 // =============================================================================
 
 
-/**
- * Create a toolpath for a head motion to a new position.
- */
-IAToolpathMotion::IAToolpathMotion(IAVector3d &a, IAVector3d &b, bool rapid)
-:   IAToolpathElement(),
-    pStart( a ),
-    pEnd( b ),
-    pIsRapid( rapid )
+IAToolpathLoop::IAToolpathLoop(double z)
+:   IAToolpath( z )
 {
 }
 
 
-IAToolpathElement *IAToolpathMotion::clone()
+IAToolpathLoop::~IAToolpathLoop()
 {
-    IAToolpathMotion *mtn = new IAToolpathMotion(pStart, pEnd, pIsRapid);
-    mtn->pColor = pColor;
-    return mtn;
 }
 
 
-/**
- * Draw the toolpath motion into the scene viewer.
- *
- * \todo make the extrusion hexagonal so we can represent the squashing
- *       by the layer height. Also, use the current E factor to calculate the
- *       expected width of the extrusion and draw that.
- * \todo add lids or connecotrs to the next extrusion.
- * \todo this should be cached
- */
-void IAToolpathMotion::draw()
+IAToolpath *IAToolpathLoop::clone(IAToolpath *t)
 {
-#ifdef RENDER_HEX_TOOLPATH
-    if (pIsRapid) {
-//        glDisable(GL_LIGHTING);
-//        glColor3f(1.0, 1.0, 0.0);
-//        glEnable(GL_LIGHTING);
-    } else {
-        double r=0.2;
-        IAVector3d d = (pEnd - pStart).normalized();
-        IAVector3d n0 = { d.y(), -d.x(), 0.0 };
-        IAVector3d n1 = { 0.0, 0.0, 1.0 };
-        IAVector3d n2 = { -d.y(), d.x(), 0.0 };
-        IAVector3d n3 = { 0.0, 0.0, -1.0 };
-        IAVector3d p0, p1, p2, p3;
-
-        if (pColor!=0xFFFFFFFF)
-            glColor3ub(pColor>>16, pColor>>8, pColor);
-
-        glBegin(GL_QUADS);
-        glNormal3dv(n0.dataPointer());
-        p0 = pStart + n0*r; glVertex3dv(p0.dataPointer());
-        glNormal3dv(n0.dataPointer());
-        p1 = pEnd + n0*r; glVertex3dv(p1.dataPointer());
-        glNormal3dv(n1.dataPointer());
-        p2 = pEnd + n1*r; glVertex3dv(p2.dataPointer());
-        glNormal3dv(n1.dataPointer());
-        p3 = pStart + n1*r; glVertex3dv(p3.dataPointer());
-        glEnd();
-
-        glBegin(GL_QUADS);
-        glNormal3dv(n1.dataPointer());
-        p0 = pStart + n1*r; glVertex3dv(p0.dataPointer());
-        glNormal3dv(n1.dataPointer());
-        p1 = pEnd + n1*r; glVertex3dv(p1.dataPointer());
-        glNormal3dv(n2.dataPointer());
-        p2 = pEnd + n2*r; glVertex3dv(p2.dataPointer());
-        glNormal3dv(n2.dataPointer());
-        p3 = pStart + n2*r; glVertex3dv(p3.dataPointer());
-        glEnd();
-
-        glBegin(GL_QUADS);
-        glNormal3dv(n2.dataPointer());
-        p0 = pStart + n2*r; glVertex3dv(p0.dataPointer());
-        glNormal3dv(n2.dataPointer());
-        p1 = pEnd + n2*r; glVertex3dv(p1.dataPointer());
-        glNormal3dv(n3.dataPointer());
-        p2 = pEnd + n3*r; glVertex3dv(p2.dataPointer());
-        glNormal3dv(n3.dataPointer());
-        p3 = pStart + n3*r; glVertex3dv(p3.dataPointer());
-        glEnd();
-
-        glBegin(GL_QUADS);
-        glNormal3dv(n3.dataPointer());
-        p0 = pStart + n3*r; glVertex3dv(p0.dataPointer());
-        glNormal3dv(n3.dataPointer());
-        p1 = pEnd + n3*r; glVertex3dv(p1.dataPointer());
-        glNormal3dv(n0.dataPointer());
-        p2 = pEnd + n0*r; glVertex3dv(p2.dataPointer());
-        glNormal3dv(n0.dataPointer());
-        p3 = pStart + n0*r; glVertex3dv(p3.dataPointer());
-        glEnd();
-
-    }
-#else
-    if (pIsRapid) {
-        glLineWidth(1.0);
-        glColor3f(1.0, 1.0, 0.0);
-    } else {
-        glLineWidth(2.0);
-        glColor3f(1.0, 0.0, 1.0);
-    }
-    glBegin(GL_LINES);
-    glVertex3dv(pStart.dataPointer());
-    glVertex3dv(pEnd.dataPointer());
-    glEnd();
-    glLineWidth(1.0);
-#endif
+    if (!t)
+        t = new IAToolpathLoop(pZ);
+    return super::clone(t);
 }
 
 
-/**
- * Draw the toolpath motion into the scene viewer.
- */
-void IAToolpathMotion::drawFlat(double w)
-{
-    if (!pIsRapid) {
-#if 1
-        /**
-         \todo this should draw a cap depending on the previous line.
-         \todo this is the brute force approach which could be made so much
-         faster. This approach just draws an octagon, extende by a line.
-         */
-        IAVector3d d = pEnd - pStart;
-        IAVector3d u = d.normalized();
-        double xo = u.x() * w * 0.5, x7 = xo * 0.7;
-        double yo = u.y() * w * 0.5, y7 = yo * 0.7;;
-        glBegin(GL_POLYGON);
-        glVertex3d(pStart.x()-xo, pStart.y()-yo, pStart.z());
-        glVertex3d(pStart.x()-x7-y7, pStart.y()-y7+x7, pStart.z());
-        glVertex3d(pStart.x()-yo, pStart.y()+xo, pStart.z());
-        glVertex3d(pEnd.x()-yo, pEnd.y()+xo, pEnd.z());
-        glVertex3d(pEnd.x()+x7-y7, pEnd.y()+y7+x7, pEnd.z());
-        glVertex3d(pEnd.x()+xo, pEnd.y()+yo, pEnd.z());
-        glVertex3d(pEnd.x()+x7+y7, pEnd.y()+y7-x7, pEnd.z());
-        glVertex3d(pEnd.x()+yo, pEnd.y()-xo, pEnd.z());
-        glVertex3d(pStart.x()+yo, pStart.y()-xo, pStart.z());
-        glVertex3d(pStart.x()-x7+y7, pStart.y()-y7-x7, pStart.z());
-        glEnd();
-#else
-        /** \bug line width! */
-        glBegin(GL_LINES);
-        glVertex3dv(pStart.dataPointer());
-        glVertex3dv(pEnd.dataPointer());
-        glEnd();
+#ifdef __APPLE__
+#pragma mark -
 #endif
-    }
-}
+// =============================================================================
 
 
-/**
- * Draw the toolpath motion into the scene viewer.
- */
-void IAToolpathMotion::drawFlatToBitmap(IAFramebuffer *fb, double w, int color)
-{
-    if (!pIsRapid) {
-        /**
-         \todo this should draw a cap depending on the previous line.
-         \todo this is the brute force approach which could be made so much
-         faster. This approach just draws an octagon, extende by a line.
-         */
-        IAVector3d d = pEnd - pStart;
-        IAVector3d u = d.normalized();
-        double xo = u.x() * w * 0.5, x7 = xo * 0.7;
-        double yo = u.y() * w * 0.5, y7 = yo * 0.7;;
-        fb->beginComplexPolygon();
-        fb->addPoint(pStart.x()-xo, pStart.y()-yo);
-        fb->addPoint(pStart.x()-x7-y7, pStart.y()-y7+x7);
-        fb->addPoint(pStart.x()-yo, pStart.y()+xo);
-        fb->addPoint(pEnd.x()-yo, pEnd.y()+xo);
-        fb->addPoint(pEnd.x()+x7-y7, pEnd.y()+y7+x7);
-        fb->addPoint(pEnd.x()+xo, pEnd.y()+yo);
-        fb->addPoint(pEnd.x()+x7+y7, pEnd.y()+y7-x7);
-        fb->addPoint(pEnd.x()+yo, pEnd.y()-xo);
-        fb->addPoint(pStart.x()+yo, pStart.y()-xo);
-        fb->addPoint(pStart.x()-x7+y7, pStart.y()-y7-x7);
-        fb->endComplexPolygon(color);
-    }
+IAToolpathLine::IAToolpathLine(double z)
+:   IAToolpath( z )
+{
 }
 
 
-/**
- * Save the toolpath element as a GCode file.
- */
-void IAToolpathMotion::saveGCode(IAGcodeWriter &w)
-{
-    if (pIsRapid) {
-        w.cmdRetractMove(pEnd);
-//        bool retract = ((pEnd-pStart).length() > 5.0);
-//        if (retract) w.cmdRetract();
-//        w.cmdRapidMove(pEnd);
-//        if (retract) w.cmdUnretract();
-    } else {
-        if (w.position()!=pStart) {
-            w.cmdRetractMove(pStart);
-//            bool retract = ((w.position()-pStart).length() > 5.0);
-//            if (retract) w.cmdRetract();
-//            w.cmdRapidMove(pStart);
-//            if (retract) w.cmdUnretract();
-        }
-        w.cmdPrintMove(pEnd);
-    }
+IAToolpathLine::~IAToolpathLine()
+{
 }
 
 
-/**
- * Save the toolpath element as line in a DXF file.
- */
-void IAToolpathMotion::saveDXF(IADxfWriter &g)
+IAToolpath *IAToolpathLine::clone(IAToolpath *t)
 {
-    if (!pIsRapid) {
-        g.cmdLine(pStart, pEnd);
-    }
+    if (!t)
+        t = new IAToolpathLine(pZ);
+    return super::clone(t);
 }
 
 
-
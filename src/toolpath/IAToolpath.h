@@ -12,6 +12,7 @@
 #include "IADxfWriter.h"
 #include "geometry/IAVector3d.h"
 
+#include <stdint.h>
 #include <vector>
 #include <map>
 #include <memory>
@@ -19,16 +20,14 @@
 
 class IAToolpathList;
 class IAToolpath;
-class IAToolpathElement;
 class IAFramebuffer;
 class IAFDMPrinter;
 
 
 typedef std::map<int, IAToolpathList*> IAToolpathListMap;
-typedef std::vector<IAToolpath*> IAToolpathTypeList;
-typedef std::vector<IAToolpathElement*> IAToolpathElementList;
 typedef std::shared_ptr<IAToolpathList> IAToolpathListSP;
 typedef std::shared_ptr<IAToolpath> IAToolpathTypeSP;
+typedef std::vector<IAToolpathTypeSP> IAToolpathTypeList;
 
 
 /**
@@ -58,7 +57,6 @@ public:
     IAToolpathList *createLayer(double);
     void deleteLayer(double);
     int roundLayerNumber(double);
-    void optimize();
 
     bool saveGCode(const char *filename);
 
@@ -74,6 +72,10 @@ private:
  Add the class IAToolpathList and use IAToolpath as a superclass for
  IAToolpathLoop and IAToolpathLine. IAToolpathList can then sort and optimize
  its Loops and Lines by priority and grouping.
+
+ Toolpaths are held by shared pointers, so that several lists can share the
+ same toolpath without copying it. A toolpath must not change its shape after
+ it was added to more than one list.
  */
 
 class IAToolpathList
@@ -88,13 +90,20 @@ public:
     void drawFlatToBitmap(IAFramebuffer*, double w, int color=0);
 
     void move(IAToolpathList *tl);
+    void move(IAToolpathList *tl, int tool, int group, int priority);
     void add(IAToolpathList *tl);
     void add(IAToolpathList *tl, int tool, int group, int priority);
     void add(IAToolpath *tt, int tool, int group, int priority);
 
     bool isEmpty();
+    size_t memorySize();
+    int numIslands();
+    std::vector<IAToolpathListSP> splitIslands();
 
     void optimize();
+    void optimize(IAVector3d &position, const std::vector<int> &toolOrder = { });
+    /** Simplify the toolpaths by this many mm when writing GCode, or 0. */
+    void setSaveTolerance(double tolerance) { pSaveTolerance = tolerance; }
 
     unsigned int createToolmap();
 
@@ -102,19 +111,48 @@ public:
 //    void colorizeSoft(uint8_t *rgb, IAToolpath *dst);
 
     void saveGCode(IAGcodeWriter &g);
+    void saveGCodeLayer(IAGcodeWriter &g, double minLayerTime);
     void saveDXF(const char *filename);
+    void saveDXF(IADxfWriter &w);
 
     IAToolpathTypeList pToolpathList;
+    /// first vertex of every toolpath when writing GCode, set by optimize();
+    /// toolpaths are shared with the slice cache, so they are not modified
+    std::vector<size_t> pSeamList;
+    /// simplify toolpaths by this tolerance when writing GCode
+    double pSaveTolerance = 0.0;
 
     double pZ;
 };
 
 
+/**
+ * A toolpath is a sequence of points that the tool head moves through.
+ *
+ * Points are stored as a compact array of 2D floats, and all points share
+ * the z position of the toolpath. The head moves to every point either
+ * extruding, or in a rapid move. This takes a small fraction of the memory
+ * of individual motion objects, and drawing and saving run over the array
+ * without virtual calls.
+ */
 class IAToolpath
 {
 protected:
     IAToolpath(double z);
 public:
+    /**
+     * A point in the path. The head moves from the previous point to this
+     * point. The first point in the path is only a starting position.
+     */
+    class Vertex {
+    public:
+        float pX, pY;
+        uint32_t pFlags;
+    };
+
+    /// Vertex flag: this point is reached in a rapid move without extruding
+    static const uint32_t kRapid = 1;
+
     static bool comparePriorityAscending(const IAToolpath *a, const IAToolpath *b);
 
     virtual ~IAToolpath();
@@ -126,28 +164,53 @@ public:
     void drawFlat(double w);
     void drawFlatToBitmap(IAFramebuffer*, double w, int color=0);
 
-    bool isEmpty() { return pElementList.empty(); }
+    bool isEmpty() { return pVertexList.empty(); }
+    bool isClosedLoop();
+    void moveSeam(size_t seam);
+    void simplify(double tolerance);
 
     void startPath(double x, double y);
     void continuePath(double x, double y);
     void closePath(void);
+    void setColor(uint32_t color);
+
+    /** Return point i as a vector at the z position of this path. */
+    IAVector3d vertex(size_t i) {
+        return IAVector3d(pVertexList[i].pX, pVertexList[i].pY, pZ);
+    }
 
 //    void colorize(uint8_t *rgb, IAToolpath *black, IAToolpath *white);
 //    void colorizeSoft(uint8_t *rgb, IAToolpath *dst);
     
     unsigned int createToolmap();
 
-    void saveGCode(IAGcodeWriter &g);
+    void saveGCode(IAGcodeWriter &g, size_t seam=1, double tolerance=0.0);
     void saveDXF(IADxfWriter &w);
 
-    IAToolpathElementList pElementList;
-    // list of elements
+    /// all points in this path
+    std::vector<Vertex> pVertexList;
+    /// the vertex index at which a new drawing color starts, and the color
+    std::vector<std::pair<size_t, uint32_t>> pColorList;
 
     IAVector3d tFirst, tPrev;
     double pZ = 0.0;
     int pTool = -1;
     int pGroup = 0;
     int pPriority = 0;
+    /// outlines and their holes share an island number; -1 if unknown
+    int pIsland = -1;
+    /// true if this loop is a hole inside its island
+    bool pIsHole = false;
+
+protected:
+    void addVertex(const IAVector3d &v, bool rapid);
+    static void drawHexSegment(const IAVector3d &a, const IAVector3d &b);
+    void writeGCode(IAGcodeWriter &w, const std::vector<Vertex> &vl);
+    bool fitArc(const std::vector<Vertex> &vl, size_t first, size_t last,
+                double tolerance, IAVector3d &center, bool &ccw);
+    static void rotateLoop(std::vector<Vertex> &vl, size_t seam);
+    static void simplifyRuns(std::vector<Vertex> &vl, double tolerance,
+                             std::vector<size_t> *newIndex=nullptr);
 };
 
 
@@ -172,63 +235,8 @@ public:
 
 
 
-/**
- * Base class for any element inside the tool path.
- */
-class IAToolpathElement
-{
-public:
-    IAToolpathElement();
-    virtual ~IAToolpathElement();
-    virtual void draw();
-    virtual void drawFlat(double w) { }
-    virtual void drawFlatToBitmap(IAFramebuffer*, double w, int color=0) { }
-    virtual void saveGCode(IAGcodeWriter &g) { }
-    virtual void saveDXF(IADxfWriter &g) { }
-    virtual IAToolpathElement *clone();
-};
-
-
-/**
- * Element changes to another extruder.
- */
-//class IAToolpathExtruder : public IAToolpathElement
-//{
-//public:
-//    IAToolpathExtruder(int i);
-//    virtual ~IAToolpathExtruder() override;
-//    virtual void draw() override { }
-//    virtual void drawFlat(double w) override { }
-//    virtual void saveGCode(IAGcodeWriter &g) override;
-//    virtual IAToolpathElement *clone() override;
-//
-//    int pTool = 0;
-//};
-
-
-/**
- * Toolpath element for extruder motion.
- */
-class IAToolpathMotion : public IAToolpathElement
-{
-public:
-    IAToolpathMotion(IAVector3d &a, IAVector3d &b, bool rapid=false);
-    virtual void draw() override;
-    virtual void drawFlat(double w) override;
-    virtual void drawFlatToBitmap(IAFramebuffer*, double w, int color=0) override;
-    virtual void saveGCode(IAGcodeWriter &g) override;
-    virtual void saveDXF(IADxfWriter &g) override;
-    virtual IAToolpathElement *clone() override;
-    void setColor(uint32_t c) { pColor = c; }
-
-    IAVector3d pStart, pEnd;
-    uint32_t pColor = 0xFFFFFFFF;
-    bool pIsRapid = false;
-};
-
-
 /*
- further elements could be
+ further vertex flags could mark
   - tool change
   - tool cleaning
   - machine setup, bed heating, extruder heating, etc.
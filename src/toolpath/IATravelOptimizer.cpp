@@ -0,0 +1,325 @@
+//
+//  IATravelOptimizer.cpp
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+
+#include "IATravelOptimizer.h"
+
+#include <math.h>
+#include <algorithm>
+
+
+/** Refine the order by comparing every toolpath to this many followers. */
+static const int k2OptWindow = 32;
+
+/** Stop refining after this many passes. */
+static const int k2OptMaxPasses = 4;
+
+/** Never create more than this many grid cells in either direction. */
+static const int kMaxGridSize = 512;
+
+
+/**
+ * Prepare the optimizer for a list of toolpaths.
+ *
+ * \param list the toolpaths of a layer; the list will be reordered
+ * \param seamList receives the index of the first vertex of every toolpath
+ *        in the new order, see IAToolpath::saveGCode()
+ */
+IATravelOptimizer::IATravelOptimizer(IAToolpathTypeList &list, std::vector<size_t> &seamList)
+:   pList( list ),
+    pSeamList( seamList )
+{
+}
+
+
+/**
+ * Sort the list by tool, group, and priority, and reduce the travel within
+ * every run of toolpaths with the same attributes.
+ *
+ * Loops may get a new seam, which changes only their starting point, not
+ * their shape. The toolpaths themselves are not modified.
+ *
+ * \param position the position of the head before the first toolpath; on
+ *        return, the position after the last toolpath
+ * \param toolOrder print the tools in this order; tools that are not in the
+ *        list follow in ascending order
+ */
+void IATravelOptimizer::optimize(IAVector3d &position, const std::vector<int> &toolOrder)
+{
+    if (toolOrder.empty()) {
+        std::stable_sort(pList.begin(), pList.end(),
+                         [](const IAToolpathTypeSP &a, const IAToolpathTypeSP &b) {
+                             return IAToolpath::comparePriorityAscending(a.get(), b.get());
+                         });
+    } else {
+        auto rank = [&toolOrder](int tool) -> int {
+            if (tool<0) tool = 0; // see IAToolpath::createToolmap()
+            auto it = std::find(toolOrder.begin(), toolOrder.end(), tool);
+            if (it!=toolOrder.end())
+                return (int)(it-toolOrder.begin());
+            return (int)toolOrder.size() + tool;
+        };
+        std::stable_sort(pList.begin(), pList.end(),
+                         [&rank](const IAToolpathTypeSP &a, const IAToolpathTypeSP &b) {
+                             int ra = rank(a->pTool), rb = rank(b->pTool);
+                             if (ra!=rb)
+                                 return ra<rb;
+                             return IAToolpath::comparePriorityAscending(a.get(), b.get());
+                         });
+    }
+    size_t first = 0, n = pList.size();
+    pSeamList.assign(n, 1);
+    while (first<n) {
+        IAToolpath *a = pList[first].get();
+        size_t last = first+1;
+        while (last<n) {
+            IAToolpath *b = pList[last].get();
+            if (a->pTool!=b->pTool || a->pGroup!=b->pGroup || a->pPriority!=b->pPriority)
+                break;
+            last++;
+        }
+        optimizeRun(first, last, position);
+        first = last;
+    }
+}
+
+
+/**
+ * Reorder a run of toolpaths with the same tool, group, and priority.
+ */
+void IATravelOptimizer::optimizeRun(size_t first, size_t last, IAVector3d &position)
+{
+    size_t n = last-first;
+    pPathList.clear();
+    pPathList.resize(n);
+    pNumLeft = 0;
+    bool allLoops = true;
+    for (size_t i=0; i<n; i++) {
+        Path &p = pPathList[i];
+        p.pToolpath = pList[first+i].get();
+        p.pIsLoop = p.pToolpath->isClosedLoop();
+        if (p.pToolpath->pVertexList.size()<2) {
+            p.pUsed = true; // nothing to print, keep it at the end
+        } else {
+            pNumLeft++;
+            if (!p.pIsLoop) allLoops = false;
+        }
+    }
+    if (pNumLeft==0) return;
+
+    buildGrid();
+
+    // always go to the nearest possible entry next
+    std::vector<int> order;
+    order.reserve(n);
+    double x = position.x(), y = position.y();
+    double x0 = x, y0 = y;
+    while (pNumLeft>0) {
+        int vertex = 1;
+        int i = findNearest(x, y, vertex);
+        if (i<0) break;
+        Path &p = pPathList[i];
+        p.pUsed = true;
+        p.pEntry = vertex;
+        pNumLeft--;
+        order.push_back(i);
+        IAToolpath::Vertex &v = p.pToolpath->pVertexList[vertex];
+        p.pX = v.pX; p.pY = v.pY;
+        if (p.pIsLoop) {
+            x = v.pX; y = v.pY;
+        } else {
+            IAToolpath::Vertex &e = p.pToolpath->pVertexList.back();
+            x = e.pX; y = e.pY;
+        }
+    }
+
+    // loops start and end at the same point, so we can reverse any part
+    // of the order
+    if (allLoops && order.size()>2)
+        refine(order, x0, y0);
+
+    // write the new order and the seams back
+    std::vector<IAToolpathTypeSP> run(pList.begin()+first, pList.begin()+last);
+    size_t j = first;
+    for (int i: order) {
+        Path &p = pPathList[i];
+        if (p.pIsLoop)
+            pSeamList[j] = (size_t)p.pEntry;
+        pList[j++] = run[i];
+    }
+    for (size_t i=0; i<n; i++) {
+        if (pPathList[i].pToolpath->pVertexList.size()<2)
+            pList[j++] = run[i];
+    }
+
+    // empty toolpaths are sorted to the end, so the head stops at the end
+    // of the last toolpath that is actually printed
+    if (!order.empty()) {
+        Path &p = pPathList[order.back()];
+        auto &vl = p.pToolpath->pVertexList;
+        IAToolpath::Vertex &e = p.pIsLoop ? vl[p.pEntry] : vl.back();
+        position.set(e.pX, e.pY, position.z());
+    }
+}
+
+
+/**
+ * Return the index of the grid cell that contains a point.
+ */
+int IATravelOptimizer::cellIndex(double x, double y)
+{
+    int cx = (int)floor((x-pGridX)/pCellSize);
+    int cy = (int)floor((y-pGridY)/pCellSize);
+    cx = std::max(0, std::min(pGridW-1, cx));
+    cy = std::max(0, std::min(pGridH-1, cy));
+    return cy*pGridW + cx;
+}
+
+
+/**
+ * Sort all entry points of the current run into a grid.
+ *
+ * Every vertex of a loop is an entry, open lines can only be entered at
+ * their start.
+ */
+void IATravelOptimizer::buildGrid()
+{
+    double xMin = 1e30, yMin = 1e30, xMax = -1e30, yMax = -1e30;
+    size_t nEntries = 0;
+    for (auto &p: pPathList) {
+        if (p.pUsed) continue;
+        auto &vl = p.pToolpath->pVertexList;
+        size_t last = p.pIsLoop ? vl.size()-1 : 2;
+        for (size_t i=1; i<last; i++) {
+            xMin = std::min(xMin, (double)vl[i].pX); xMax = std::max(xMax, (double)vl[i].pX);
+            yMin = std::min(yMin, (double)vl[i].pY); yMax = std::max(yMax, (double)vl[i].pY);
+            nEntries++;
+        }
+    }
+
+    // aim for a few entries per cell
+    double w = std::max(xMax-xMin, 1e-3), h = std::max(yMax-yMin, 1e-3);
+    pCellSize = std::max(sqrt(w*h/(double)nEntries)*2.0, 1e-3);
+    pCellSize = std::max(pCellSize, std::max(w, h)/kMaxGridSize);
+    pGridX = xMin; pGridY = yMin;
+    pGridW = std::min(kMaxGridSize, (int)(w/pCellSize)+1);
+    pGridH = std::min(kMaxGridSize, (int)(h/pCellSize)+1);
+    pGrid.clear();
+    pGrid.resize(pGridW*pGridH);
+
+    for (size_t j=0; j<pPathList.size(); j++) {
+        Path &p = pPathList[j];
+        if (p.pUsed) continue;
+        auto &vl = p.pToolpath->pVertexList;
+        size_t last = p.pIsLoop ? vl.size()-1 : 2;
+        for (size_t i=1; i<last; i++) {
+            Entry e = { vl[i].pX, vl[i].pY, (int)j, (int)i };
+            pGrid[cellIndex(e.pX, e.pY)].push_back(e);
+        }
+    }
+}
+
+
+/**
+ * Find the nearest entry of a toolpath that was not used yet.
+ *
+ * The search looks at rings of cells around the point, until no cell in the
+ * next ring can be closer than the best entry so far. Entries of used
+ * toolpaths are removed from the grid as they are found.
+ *
+ * \param x, y find the entry closest to this point
+ * \param[out] vertex the index of the entry vertex in the toolpath
+ *
+ * \return the index of the toolpath in the run, or -1 if all are used
+ */
+int IATravelOptimizer::findNearest(double x, double y, int &vertex)
+{
+    int c = cellIndex(x, y);
+    int cx = c % pGridW, cy = c / pGridW;
+    // distance from the point to the border of its own cell
+    double fx = x - pGridX - cx*pCellSize, fy = y - pGridY - cy*pCellSize;
+    double border = std::min(std::min(fx, pCellSize-fx), std::min(fy, pCellSize-fy));
+    if (border<0.0) border = 0.0;
+
+    int best = -1;
+    double bestDist = 1e30;
+    int maxRing = std::max(pGridW, pGridH);
+    for (int r=0; r<=maxRing; r++) {
+        for (int gy=cy-r; gy<=cy+r; gy++) {
+            if (gy<0 || gy>=pGridH) continue;
+            bool edgeRow = (gy==cy-r || gy==cy+r);
+            for (int gx=cx-r; gx<=cx+r; gx += (edgeRow ? 1 : 2*r)) {
+                if (gx>=0 && gx<pGridW) {
+                    std::vector<Entry> &cell = pGrid[gy*pGridW+gx];
+                    for (size_t k=0; k<cell.size(); ) {
+                        Entry &e = cell[k];
+                        if (pPathList[e.pPath].pUsed) {
+                            cell[k] = cell.back();
+                            cell.pop_back();
+                            continue;
+                        }
+                        double dx = e.pX-x, dy = e.pY-y;
+                        double d = dx*dx + dy*dy;
+                        if (d<bestDist) {
+                            bestDist = d;
+                            best = e.pPath;
+                            vertex = e.pVertex;
+                        }
+                        k++;
+                    }
+                }
+                if (r==0) break;
+            }
+        }
+        // everything outside of ring r is farther away than this
+        double reach = border + r*pCellSize;
+        if (best>=0 && bestDist<=reach*reach)
+            break;
+    }
+    return best;
+}
+
+
+/**
+ * Improve the order of a run of loops with a bounded 2-opt pass.
+ *
+ * \param order indices into pPathList in the order they will be printed
+ * \param x, y the position of the head before the first loop
+ */
+void IATravelOptimizer::refine(std::vector<int> &order, double x, double y)
+{
+    int n = (int)order.size();
+    auto dist = [&](int a, int b) -> double {
+        // index -1 is the start position
+        double ax = (a<0) ? x : pPathList[order[a]].pX;
+        double ay = (a<0) ? y : pPathList[order[a]].pY;
+        double bx = pPathList[order[b]].pX, by = pPathList[order[b]].pY;
+        return sqrt((ax-bx)*(ax-bx) + (ay-by)*(ay-by));
+    };
+
+    for (int pass=0; pass<k2OptMaxPasses; pass++) {
+        bool improved = false;
+        for (int i=-1; i<n-2; i++) {
+            int jMax = std::min(n-1, i+k2OptWindow);
+            for (int j=i+2; j<=jMax; j++) {
+                // reverse the loops from i+1 to j
+                double before = dist(i, i+1);
+                double after = dist(i, j);
+                if (j<n-1) {
+                    before += dist(j, j+1);
+                    after += dist(i+1, j+1);
+                }
+                if (after < before - 1e-6) {
+                    std::reverse(order.begin()+i+1, order.begin()+j+1);
+                    improved = true;
+                }
+            }
+        }
+        if (!improved) break;
+    }
+}
+
+
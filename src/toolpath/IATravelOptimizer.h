@@ -0,0 +1,88 @@
+//
+//  IATravelOptimizer.h
+//
+//  Copyright (c) 2013-2018 Matthias Melcher. All rights reserved.
+//
+
+#ifndef IA_TRAVEL_OPTIMIZER_H
+#define IA_TRAVEL_OPTIMIZER_H
+
+
+#include "toolpath/IAToolpath.h"
+#include "geometry/IAVector3d.h"
+
+#include <vector>
+
+
+/**
+ * Reorder the toolpaths of a layer to reduce travel between them.
+ *
+ * The optimizer works on runs of toolpaths that share the same tool, group,
+ * and priority, so the order of shells, infill, and support stays intact.
+ * Tools print in ascending order, or in the order given by IAToolScheduler.
+ *
+ * Within a run, it picks the nearest toolpath over and over again. Closed
+ * loops can be entered at any vertex, so the nearest vertex becomes the new
+ * seam. Seams are returned in a separate list, so toolpaths that are shared
+ * with the slice cache do not change. Open lines are entered at their start. Nearest neighbours are found
+ * in a uniform grid, so this stays fast for thousands of toolpaths.
+ *
+ * If a run contains only loops, the greedy order is then refined with a
+ * 2-opt pass that reverses subsequences of the order when that shortens the
+ * travel. The pass only looks at a limited window of neighbours and stops
+ * after a few iterations.
+ */
+class IATravelOptimizer
+{
+public:
+    IATravelOptimizer(IAToolpathTypeList &list, std::vector<size_t> &seamList);
+    void optimize(IAVector3d &position, const std::vector<int> &toolOrder = { });
+
+private:
+    /**
+     * A vertex where the head can start printing a toolpath.
+     */
+    class Entry {
+    public:
+        float pX, pY;
+        int pPath;
+        int pVertex;
+    };
+
+    /**
+     * Information about a toolpath in the current run.
+     */
+    class Path {
+    public:
+        IAToolpath *pToolpath = nullptr;
+        bool pIsLoop = false;
+        bool pUsed = false;
+        int pEntry = 1;
+        double pX = 0.0, pY = 0.0;
+    };
+
+    void optimizeRun(size_t first, size_t last, IAVector3d &position);
+    void buildGrid();
+    int findNearest(double x, double y, int &vertex);
+    void refine(std::vector<int> &order, double x, double y);
+    int cellIndex(double x, double y);
+
+    /// the list that we reorder
+    IAToolpathTypeList &pList;
+    /// the first vertex of every toolpath in pList
+    std::vector<size_t> &pSeamList;
+    /// the toolpaths of the current run
+    std::vector<Path> pPathList;
+    /// all possible entries, sorted into grid cells
+    std::vector<std::vector<Entry>> pGrid;
+    /// grid size and position
+    int pGridW = 0, pGridH = 0;
+    double pGridX = 0.0, pGridY = 0.0, pCellSize = 1.0;
+    /// number of toolpaths in the run that were not used yet
+    int pNumLeft = 0;
+};
+
+
+#endif /* IA_TRAVEL_OPTIMIZER_H */
+
+
@@ -55,6 +55,7 @@ void IAProgressDialog::createProgressDialog()
  *      need to retain or manage.
  */
 void IAProgressDialog::show(const char *title, const char *text) {
+    if (!wMainWindow) return; // running headless
     if (!wDialog) {
         createProgressDialog();
     }
@@ -105,6 +106,8 @@ bool IAProgressDialog::update(double percent, ...)
 {
     char buf[2048];
 
+    if (!wDialog) return pCanceled;
+
     va_list va;
     va_start(va, percent);
     vsnprintf(buf, 2047, pText, va);